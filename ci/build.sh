@@ -6,7 +6,14 @@ set -e
 
 source ci/lib.sh
 
-for tag_path in $(list_tags);
-do
-	docker build -t "${REPO_NAME}":"$(echo "${tag_path}" | cut -d: -f2)" -f "$(echo "${tag_path}" | cut -d: -f1)" .
-done
+BUILD_DIR=build
+
+suffix="$(tag_suffix)"
+
+if [ "x${suffix}" != "x" ];
+then
+	# stages shared by targets are built once, independent ones in parallel
+	python3 generate.py info graph
+	python3 generate.py bake --output-dir "${BUILD_DIR}"
+	REPO_NAME="${REPO_NAME}" TAG_SUFFIX="${suffix}" docker buildx bake -f "${BUILD_DIR}/docker-bake.json" --load
+fi
@@ -2,23 +2,20 @@
 # author: Arkadiusz Dzięgiel <arkadiusz.dziegiel@glorpen.pl>
 #
 
-function list_tags(){
+function tag_suffix(){
 	if [ "${TRAVIS_BRANCH}" == "master" ];
 	then
-		suffix="latest";
+		echo "latest";
 	else
-		suffix="${TRAVIS_TAG/v}";
-	fi
-	
-	if [ "x${suffix}" != "x" ];
-	then
-		find ./ -maxdepth 1 -name '*.dockerfile' -printf '%f\n' | sort -fdr | while read n;
-		do
-			echo "${n}" | sed -e "s/.dockerfile/-${suffix}/" -e "s/^/${n}:/"
-		done
+		echo "${TRAVIS_TAG/v}";
 	fi
 }
 
 function list_tags_only(){
-	list_tags | cut -d: -f2
+	suffix="$(tag_suffix)"
+
+	if [ "x${suffix}" != "x" ];
+	then
+		python3 generate.py info targets | sort -fdr | sed -e "s/$/-${suffix}/"
+	fi
 }
@@ -13,6 +13,8 @@ from jinja2.ext import Extension
 import datetime
 import semver
 import collections
+import hashlib
+import json
 
 re_line = re.compile("(\s*\n\s*)+")
 def filter_oneline(value):
@@ -30,6 +32,53 @@ class EmbedExtension(Extension):
 
 install_dir = "/opt/puppetizer"
 
+re_stage = re.compile(r"^FROM\s+(\S+)(?:\s+as\s+(\S+))?\s*$", re.I | re.M)
+re_copy_from = re.compile(r"--from=(\S+)")
+
+class Stage(object):
+    """Single stage of rendered dockerfile, addressed by its content and content of stages it is built from."""
+
+    def __init__(self, name, parent, body):
+        super(Stage, self).__init__()
+        self.name = name
+        self.parent = parent
+        self.body = body
+        self.deps = re_copy_from.findall(body)
+        self.key = None
+
+    def refs(self, keys):
+        """Names of stages built from, as named build contexts."""
+        return ["stage-%s" % keys[n] for n in [self.parent] + self.deps if n in keys]
+
+    def render(self, keys):
+        def ref(name):
+            return "stage-%s" % keys[name] if name in keys else name
+        body = re_copy_from.sub(lambda m: "--from=%s" % ref(m.group(1)), self.body)
+        return "# syntax=docker/dockerfile:1.4\nFROM %s%s" % (ref(self.parent), body)
+
+def split_stages(dockerfile):
+    """
+    Splits rendered dockerfile into stages and keys them, same toolchain built
+    for different targets ends up with same key. Stages can refer only to ones before them.
+    """
+    matches = list(re_stage.finditer(dockerfile))
+    stages = []
+    keys = {}
+    for i, m in enumerate(matches):
+        end = matches[i + 1].start() if i + 1 < len(matches) else len(dockerfile)
+        stage = Stage(m.group(2), m.group(1), dockerfile[m.end():end])
+
+        h = hashlib.sha256()
+        for n in [stage.parent] + stage.deps:
+            h.update((keys.get(n) or "image:%s" % n).encode("utf-8") + b"\0")
+        h.update(re_copy_from.sub("--from=", stage.body).encode("utf-8"))
+        stage.key = h.hexdigest()[:16]
+
+        if stage.name:
+            keys[stage.name] = stage.key
+        stages.append(stage)
+    return stages, keys
+
 class Config(object):
     
     _pkg_keys = ('puppet', 'facter', 'ruby', 'leatherman', 'cpp-hocon', 'boost', 'yaml-cpp')
@@ -113,6 +162,8 @@ class Config(object):
             "system_version": s["system-version"],
             "system_packages": s["system-packages"],
             "source_image": s["source-image"],
+            # compiler cache is shared by all targets of same system
+            "ccache_id": "ccache-%s" % info["target"],
             "version": self.version
         }
         return ret
@@ -146,6 +197,9 @@ class Renderer(object):
         tpl = self.env.get_template("%s.dockerfile.jinja2" % cfg["system"])
         return self.re_empty_lines.sub("\n", tpl.render(cfg))
 
+    def stages(self, name):
+        return split_stages(self.render(name))
+
     def load_config(self, config_path):
         self.config = Config((self._root_dir / config_path).as_posix())
 
@@ -157,6 +211,58 @@ def cli_info(r, ns):
         sys.stdout.write("\n".join(r.config.targets.keys())+"\n")
     elif ns.mode == "version":
         sys.stdout.write(str(r.config.version)+"\n")
+    elif ns.mode == "graph":
+        seen = set()
+        for name in r.config.targets.keys():
+            stages, keys = r.stages(name)
+            sys.stdout.write("%s\n" % name)
+            for stage in stages:
+                sys.stdout.write("  %s %-16s %s%s\n" % (
+                    stage.key, stage.name or "(image)", " ".join([stage.parent] + stage.deps),
+                    " (shared)" if stage.key in seen else ""
+                ))
+                seen.add(stage.key)
+
+def bake_target_name(name):
+    return re.sub("[^a-zA-Z0-9_-]", "_", name)
+
+def cli_bake(r, ns):
+    """
+    Writes each distinct stage as own dockerfile and buildx bake file building them,
+    stages are shared between targets by named contexts so each is built once.
+    """
+    out = pathlib.Path(ns.output_dir)
+    out.mkdir(parents=True, exist_ok=True)
+
+    bake = {
+        "variable": {
+            "REPO_NAME": {"default": "glorpen/puppetizer-base"},
+            "TAG_SUFFIX": {"default": "latest"}
+        },
+        "group": {"default": {"targets": []}},
+        "target": collections.OrderedDict()
+    }
+
+    for name in r.config.targets.keys():
+        stages, keys = r.stages(name)
+        for stage in stages:
+            final = stage is stages[-1]
+            target = bake_target_name(name) if final else "stage-%s" % stage.key
+            if target in bake["target"]:
+                continue
+
+            dockerfile = out / ("%s.dockerfile" % target)
+            dockerfile.write_text(stage.render(keys))
+            bake["target"][target] = {
+                "context": ".",
+                "dockerfile": dockerfile.as_posix(),
+                "contexts": dict((ref, "target:%s" % ref) for ref in stage.refs(keys))
+            }
+            if final:
+                bake["target"][target]["tags"] = ["${REPO_NAME}:%s-${TAG_SUFFIX}" % name]
+                bake["group"]["default"]["targets"].append(target)
+
+    (out / "docker-bake.json").write_text(json.dumps(bake, indent=2) + "\n")
 
 if __name__ == "__main__":
     p = argparse.ArgumentParser()
@@ -168,7 +274,11 @@ if __name__ == "__main__":
 
     p_info = subparsers.add_parser("info")
     p_info.set_defaults(f=cli_info)
-    p_info.add_argument("mode", choices=('targets','version'))
+    p_info.add_argument("mode", choices=('targets','version','graph'))
+
+    p_bake = subparsers.add_parser("bake")
+    p_bake.set_defaults(f=cli_bake)
+    p_bake.add_argument('--output-dir', default='build')
     
     ns = p.parse_args()
     
@@ -0,0 +1,26 @@
+#ifndef _BENCH_BENCH_H
+#define _BENCH_BENCH_H
+
+#include "../src/common.h"
+
+#include <stdio.h>
+
+/*
+ * Each result is printed as single JSON object per line:
+ *   {"bench":NAME, PARAMS..., "ops":N, "elapsed_ns":N, "ops_per_sec":N,
+ *    "p50_ns":N, "p90_ns":N, "p99_ns":N, "max_ns":N}
+ * Percentiles are present only for benchmarks timing single operations.
+ */
+
+uint64_t bench_now_ns();
+void bench_report(const char *name, const char *params, uint64_t ops, uint64_t elapsed_ns, uint64_t *samples, size_t samples_count);
+
+void bench_control();
+void bench_reap();
+void bench_boot();
+
+// internals of init exercised by benchmarks
+bool init_reap_children();
+struct service* service_add(const char *name);
+
+#endif
@@ -0,0 +1,130 @@
+#include "../src/common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+#include "../src/event.h"
+#include "../src/service.h"
+
+static char start_path[64], stop_path[64];
+
+static void bench_write_script(const char *path, const char *content)
+{
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL) {
+        perror("Could not write benchmark script");
+        exit(1);
+    }
+    fputs(content, f);
+    fclose(f);
+    chmod(path, 0755);
+}
+
+/**
+ * Reaps exited services and stop scripts, as init loop does.
+ */
+static void bench_reap_services()
+{
+    struct service *svc;
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        svc = service_find_by_pid(pid);
+        if (svc != NULL) {
+            service_set_down(svc);
+        }
+    }
+}
+
+static void bench_wait_events()
+{
+    struct epoll_event events[64];
+    int count, i;
+
+    count = event_wait(events, 64, 100);
+    for (i=0; i<count; i++) {
+        if (EVENT_TYPE(events[i]) == EVENT_SERVICE_NOTIFY) {
+            service_handle_notify(service_get(EVENT_ID(events[i])));
+        }
+    }
+    bench_reap_services();
+}
+
+/**
+ * Services form binary tree of dependencies and notify readiness,
+ * boot is measured until all are UP and halt until all are DOWN again.
+ */
+static void bench_boot_services(uint16_t count)
+{
+    struct service **svcs = calloc(count, sizeof(struct service*));
+    uint64_t start;
+    uint16_t i;
+    char name[32], params[32];
+
+    for (i=0; i<count; i++) {
+        snprintf(name, sizeof(name), "bench-boot-%u-%u", count, i);
+        svcs[i] = service_add(name);
+        free(svcs[i]->start_path);
+        free(svcs[i]->stop_path);
+        svcs[i]->start_path = strdup(start_path);
+        svcs[i]->stop_path = strdup(stop_path);
+        svcs[i]->opts.ready = SERVICE_READY_NOTIFY;
+        if (i > 0) {
+            svcs[i]->deps = malloc(sizeof(struct service*));
+            svcs[i]->deps[0] = svcs[(i - 1) / 2];
+            svcs[i]->deps_count = 1;
+        }
+    }
+    snprintf(params, sizeof(params), "\"services\":%u", count);
+
+    // leaves first, so most services wait for dependencies
+    start = bench_now_ns();
+    for (i=count; i>0; i--) {
+        service_start(svcs[i - 1]);
+    }
+    while (service_count_by_state(STATE_UP, false) < count) {
+        bench_wait_events();
+    }
+    bench_report("boot", params, count, bench_now_ns() - start, NULL, 0);
+
+    start = bench_now_ns();
+    service_stop_all();
+    while (service_count_by_state(STATE_DOWN, true) > 0) {
+        bench_wait_events();
+        service_stop_all();
+    }
+    bench_report("halt", params, count, bench_now_ns() - start, NULL, 0);
+
+    free(svcs);
+}
+
+void bench_boot()
+{
+    static const uint16_t services[] = { 10, 100, 500, 0 };
+    char dir[] = "/tmp/puppetizer-bench-XXXXXX";
+    uint8_t i;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("Could not create benchmark directory");
+        exit(1);
+    }
+    snprintf(start_path, sizeof(start_path), "%s/start", dir);
+    snprintf(stop_path, sizeof(stop_path), "%s/stop", dir);
+    bench_write_script(start_path, "#!/bin/sh\necho READY=1 >&$PUPPETIZER_NOTIFY_FD\nexec sleep 1000\n");
+    bench_write_script(stop_path, "#!/bin/sh\nkill $1\n");
+
+    for (i=0; services[i]; i++) {
+        bench_boot_services(services[i]);
+    }
+
+    unlink(start_path);
+    unlink(stop_path);
+    rmdir(dir);
+}
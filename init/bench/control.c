@@ -0,0 +1,202 @@
+#include "../src/common.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bench.h"
+
+#include "../src/control.h"
+#include "../src/event.h"
+#include "../src/service.h"
+
+#define BENCH_CONTROL_REQUESTS 20000
+#define BENCH_CONTROL_PIPELINE 256
+#define BENCH_CONTROL_UPDATES 2000
+#define BENCH_CONTROL_SERVICE "bench-control"
+
+struct bench_client {
+    // server side is registered in control, client side is blocking
+    int server_fd, client_fd;
+};
+
+static uint32_t handled;
+
+static status_t bench_handle_packet(void *packet, uint16_t len, int fd)
+{
+    struct service *svc;
+    char *name;
+
+    control_decode_request_service_state(packet, &name);
+    svc = service_find_by_name(name);
+    handled++;
+    return control_write_service_state(svc ? CMD_RESPONSE_OK : CMD_RESPONSE_FAILED, svc ? svc->state : 0, PACKET_REQUEST_ID(packet), fd);
+}
+
+/**
+ * Handles whatever is ready, as init loop does for clients.
+ */
+static void bench_serve(int timeout)
+{
+    struct epoll_event events[64];
+    int count, i;
+
+    count = event_wait(events, 64, timeout);
+    for (i=0; i<count; i++) {
+        if (EVENT_TYPE(events[i]) != EVENT_CLIENT) continue;
+        if (events[i].events & EPOLLOUT) {
+            control_client_flush(EVENT_ID(events[i]));
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            control_client_read(EVENT_ID(events[i]), bench_handle_packet);
+        }
+    }
+    control_dispatch_flush();
+    control_client_reap();
+}
+
+static struct bench_client *bench_connect(uint16_t count)
+{
+    struct bench_client *clients = calloc(count, sizeof(struct bench_client));
+    int fds[2];
+    uint16_t i;
+
+    for (i=0; i<count; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1 || control_client_add(fds[0]) != S_OK) {
+            perror("Could not connect benchmark client");
+            exit(1);
+        }
+        clients[i].server_fd = fds[0];
+        clients[i].client_fd = fds[1];
+    }
+    return clients;
+}
+
+static void bench_disconnect(struct bench_client *clients, uint16_t count)
+{
+    uint16_t i;
+
+    for (i=0; i<count; i++) {
+        control_client_close(clients[i].server_fd);
+        close(clients[i].client_fd);
+    }
+    control_client_reap();
+    free(clients);
+}
+
+/**
+ * Sequential request and response, each client waits for its answer.
+ */
+static void bench_control_latency(uint16_t clients_count)
+{
+    struct bench_client *clients = bench_connect(clients_count);
+    uint8_t data[control_max_data_length];
+    uint64_t *samples = malloc(sizeof(uint64_t) * BENCH_CONTROL_REQUESTS);
+    uint64_t start, begin;
+    uint32_t i;
+    struct bench_client *c;
+    char params[64];
+
+    begin = bench_now_ns();
+    for (i=0; i<BENCH_CONTROL_REQUESTS; i++) {
+        c = &clients[i % clients_count];
+        start = bench_now_ns();
+        control_request_service_state(BENCH_CONTROL_SERVICE, i, c->client_fd);
+        bench_serve(-1);
+        control_read_packet(c->client_fd, data);
+        samples[i] = bench_now_ns() - start;
+    }
+
+    snprintf(params, sizeof(params), "\"clients\":%u", clients_count);
+    bench_report("control_latency", params, BENCH_CONTROL_REQUESTS, bench_now_ns() - begin, samples, BENCH_CONTROL_REQUESTS);
+    free(samples);
+    bench_disconnect(clients, clients_count);
+}
+
+/**
+ * All clients send batch of requests at once, init answers them in as few iterations as it can.
+ */
+static void bench_control_throughput(uint16_t clients_count)
+{
+    struct bench_client *clients = bench_connect(clients_count);
+    uint8_t data[control_max_data_length];
+    uint32_t i, total = (uint32_t)clients_count * BENCH_CONTROL_PIPELINE;
+    uint64_t start;
+    uint16_t j;
+    char params[64];
+
+    handled = 0;
+    start = bench_now_ns();
+    for (i=0; i<BENCH_CONTROL_PIPELINE; i++) {
+        for (j=0; j<clients_count; j++) {
+            control_request_service_state(BENCH_CONTROL_SERVICE, i, clients[j].client_fd);
+        }
+    }
+    while (handled < total) {
+        bench_serve(-1);
+    }
+    for (j=0; j<clients_count; j++) {
+        for (i=0; i<BENCH_CONTROL_PIPELINE; i++) {
+            control_read_packet(clients[j].client_fd, data);
+        }
+    }
+
+    snprintf(params, sizeof(params), "\"clients\":%u,\"pipeline\":%u", clients_count, BENCH_CONTROL_PIPELINE);
+    bench_report("control_throughput", params, total, bench_now_ns() - start, NULL, 0);
+    bench_disconnect(clients, clients_count);
+}
+
+/**
+ * State change of one service fanned out to all subscribers, until each of them has read it.
+ */
+static void bench_control_subscribers(uint16_t subscribers_count, struct service *svc)
+{
+    struct bench_client *clients = bench_connect(subscribers_count);
+    uint8_t data[control_max_data_length];
+    uint64_t *samples = malloc(sizeof(uint64_t) * BENCH_CONTROL_UPDATES);
+    uint64_t start, begin;
+    uint32_t i;
+    uint16_t j;
+    char params[64];
+
+    for (j=0; j<subscribers_count; j++) {
+        control_subscribe_client(clients[j].server_fd, svc, 1);
+        control_read_packet(clients[j].client_fd, data);
+    }
+
+    begin = bench_now_ns();
+    for (i=0; i<BENCH_CONTROL_UPDATES; i++) {
+        start = bench_now_ns();
+        svc->state = svc->state == STATE_DOWN ? STATE_PENDING_UP : STATE_DOWN;
+        control_dispatch_service_state_change(svc);
+        control_dispatch_flush();
+        for (j=0; j<subscribers_count; j++) {
+            control_read_packet(clients[j].client_fd, data);
+        }
+        samples[i] = bench_now_ns() - start;
+    }
+    svc->state = STATE_DOWN;
+
+    snprintf(params, sizeof(params), "\"subscribers\":%u", subscribers_count);
+    bench_report("control_fanout", params, BENCH_CONTROL_UPDATES, bench_now_ns() - begin, samples, BENCH_CONTROL_UPDATES);
+    free(samples);
+    bench_disconnect(clients, subscribers_count);
+}
+
+void bench_control()
+{
+    static const uint16_t clients[] = { 1, 16, 128, 0 };
+    static const uint16_t subscribers[] = { 1, 32, 256, 0 };
+    struct service *svc = service_add(BENCH_CONTROL_SERVICE);
+    uint8_t i;
+
+    for (i=0; clients[i]; i++) {
+        bench_control_latency(clients[i]);
+    }
+    for (i=0; clients[i]; i++) {
+        bench_control_throughput(clients[i]);
+    }
+    for (i=0; subscribers[i]; i++) {
+        bench_control_subscribers(subscribers[i], svc);
+    }
+}
@@ -0,0 +1,99 @@
+#include "../src/common.h"
+
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+#include "../src/event.h"
+#include "../src/log.h"
+
+static const struct {
+    const char *name;
+    void (*run)();
+} benchmarks[] = {
+    { "control", bench_control },
+    { "reap", bench_reap },
+    { "boot", bench_boot },
+    { NULL, NULL }
+};
+
+uint64_t bench_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t bench_percentile(const uint64_t *sorted, size_t count, uint8_t pct)
+{
+    return sorted[(count - 1) * pct / 100];
+}
+
+void bench_report(const char *name, const char *params, uint64_t ops, uint64_t elapsed_ns, uint64_t *samples, size_t samples_count)
+{
+    printf("{\"bench\":\"%s\"", name);
+    if (params != NULL && params[0] != 0) {
+        printf(",%s", params);
+    }
+    printf(",\"ops\":%llu,\"elapsed_ns\":%llu,\"ops_per_sec\":%.1f",
+        (unsigned long long)ops, (unsigned long long)elapsed_ns,
+        elapsed_ns ? ops * 1e9 / elapsed_ns : 0.0);
+
+    if (samples_count > 0) {
+        qsort(samples, samples_count, sizeof(uint64_t), bench_compare);
+        printf(",\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu",
+            (unsigned long long)bench_percentile(samples, samples_count, 50),
+            (unsigned long long)bench_percentile(samples, samples_count, 90),
+            (unsigned long long)bench_percentile(samples, samples_count, 99),
+            (unsigned long long)samples[samples_count - 1]);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+/**
+ * Runs all benchmarks, or only ones named in arguments.
+ */
+int main(int argc, char **argv)
+{
+    sigset_t mask;
+    uint8_t i;
+    int j;
+    bool selected;
+
+    log_name = "bench";
+    log_level = LOG_NONE;
+
+    // children are reaped through signalfd, as init does
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    if (event_setup() != S_OK) {
+        fprintf(stderr, "Could not setup polling\n");
+        return 1;
+    }
+
+    // first line identifies run, so results can be collected over time
+    printf("{\"suite\":\"init\",\"time\":%lld}\n", (long long)time(NULL));
+    for (i=0; benchmarks[i].name != NULL; i++) {
+        selected = argc < 2;
+        for (j=1; j<argc && !selected; j++) {
+            selected = strcmp(argv[j], benchmarks[i].name) == 0;
+        }
+        if (selected) {
+            benchmarks[i].run();
+        }
+    }
+    return 0;
+}
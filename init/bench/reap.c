@@ -0,0 +1,84 @@
+#include "../src/common.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+/**
+ * Children wait on pipe and exit all at once when it is closed,
+ * so init gets burst of SIGCHLD as when process group is killed.
+ */
+static void bench_reap_burst(int signal_fd, uint32_t count)
+{
+    struct signalfd_siginfo info;
+    struct pollfd pfd = { signal_fd, POLLIN, 0 };
+    siginfo_t child;
+    uint64_t start;
+    uint32_t i;
+    int release[2];
+    pid_t pid;
+    char params[32];
+    char c;
+
+    if (pipe(release) == -1) {
+        perror("Could not create pipe");
+        exit(1);
+    }
+    for (i=0; i<count; i++) {
+        pid = fork();
+        if (pid == 0) {
+            close(release[1]);
+            while (read(release[0], &c, 1) == -1 && errno == EINTR);
+            _exit(0);
+        }
+        if (pid == -1) {
+            // process limit reached, measure what was started
+            count = i;
+            break;
+        }
+    }
+    close(release[0]);
+
+    start = bench_now_ns();
+    close(release[1]);
+    for (;;) {
+        if (poll(&pfd, 1, 100) == 1) {
+            while (read(signal_fd, &info, sizeof(info)) == sizeof(info));
+        }
+        while (init_reap_children());
+
+        child.si_pid = 0;
+        if (waitid(P_ALL, 0, &child, WEXITED | WNOHANG | WNOWAIT) == -1 && errno == ECHILD) {
+            break;
+        }
+    }
+
+    snprintf(params, sizeof(params), "\"children\":%u", count);
+    bench_report("reap", params, count, bench_now_ns() - start, NULL, 0);
+}
+
+void bench_reap()
+{
+    static const uint32_t children[] = { 100, 1000, 5000, 0 };
+    sigset_t mask;
+    int signal_fd;
+    uint8_t i;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("Could not create signalfd");
+        exit(1);
+    }
+
+    for (i=0; children[i]; i++) {
+        bench_reap_burst(signal_fd, children[i]);
+    }
+    close(signal_fd);
+}
@@ -0,0 +1,583 @@
+#include "common.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "puppetizer.h"
+#include "control.h"
+#include "service.h"
+
+#define PUPPETIZER_PACKET_MAX 0xffff
+// type and request id
+#define PUPPETIZER_HEADER_SIZE 3
+#define PUPPETIZER_DATA(P) ((P)->packet + PUPPETIZER_HEADER_SIZE)
+
+struct puppetizer_pending {
+    uint16_t id;
+    uint8_t state;
+};
+
+struct puppetizer {
+    int fd;
+    uint16_t last_id;
+    // state changes sent without waiting, replies are checked as they arrive
+    struct puppetizer_pending *pending;
+    uint16_t pending_count;
+    uint32_t pending_size;
+    bool pending_failed;
+    // service which did not reach requested state
+    char failed[256];
+    // last read packet, service states are iterated in place
+    uint8_t packet[PUPPETIZER_PACKET_MAX];
+    uint16_t len;
+    uint8_t *entries;
+    uint16_t entries_left;
+};
+
+struct puppetizer *puppetizer_open(const char *path)
+{
+    struct sockaddr_un addr;
+    struct puppetizer *p;
+    int fd, err;
+
+    if (path == NULL) {
+        path = PUPPETIZER_CONTROL_SOCKET;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || (p = puppetizer_open_fd(fd)) == NULL) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    return p;
+}
+
+/**
+ * Wraps already connected socket, it is closed with client.
+ */
+struct puppetizer *puppetizer_open_fd(int fd)
+{
+    struct puppetizer *p = calloc(1, sizeof(struct puppetizer));
+
+    if (p != NULL) {
+        p->fd = fd;
+    }
+    return p;
+}
+
+void puppetizer_close(struct puppetizer *p)
+{
+    if (p == NULL) {
+        return;
+    }
+    close(p->fd);
+    free(p->pending);
+    free(p);
+}
+
+static uint16_t puppetizer_next_id(struct puppetizer *p)
+{
+    p->last_id = (p->last_id % 0xffff) + 1;
+    return p->last_id;
+}
+
+static int puppetizer_send(struct puppetizer *p, uint8_t type, uint16_t id, const void *data, size_t len)
+{
+    uint16_t payload_size;
+    size_t sent = 0;
+    ssize_t n;
+
+    if (len > PUPPETIZER_PACKET_MAX - PUPPETIZER_HEADER_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    payload_size = len + PUPPETIZER_HEADER_SIZE;
+
+    uint8_t buff[sizeof(uint16_t) + payload_size];
+    memcpy(buff, &payload_size, sizeof(uint16_t));
+    buff[2] = type;
+    memcpy(buff + 3, &id, sizeof(uint16_t));
+    if (len) {
+        memcpy(buff + 5, data, len);
+    }
+
+    while (sent < sizeof(buff)) {
+        n = send(p->fd, buff + sent, sizeof(buff) - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+static int puppetizer_recv(struct puppetizer *p, void *data, size_t len)
+{
+    size_t received = 0;
+    ssize_t n;
+
+    while (received < len) {
+        n = recv(p->fd, (uint8_t*)data + received, len - received, 0);
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+static int puppetizer_read(struct puppetizer *p, uint8_t *type, uint16_t *id)
+{
+    if (puppetizer_recv(p, &p->len, sizeof(uint16_t)) == -1) {
+        return -1;
+    }
+    if (p->len < PUPPETIZER_HEADER_SIZE) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (puppetizer_recv(p, p->packet, p->len) == -1) {
+        return -1;
+    }
+    *type = p->packet[0];
+    memcpy(id, p->packet + 1, sizeof(uint16_t));
+    return 0;
+}
+
+/**
+ * Decodes service states from last packet, init answers
+ * with bare command response to requests it could not parse.
+ */
+static int puppetizer_decode_states(struct puppetizer *p, uint8_t type, uint8_t *response)
+{
+    p->entries_left = 0;
+    if (type == PACKET_COMMAND_RESPONSE && p->len > PUPPETIZER_HEADER_SIZE) {
+        *response = PUPPETIZER_DATA(p)[0];
+        return 0;
+    }
+    if (type != PACKET_SERVICE_STATES || p->len < PUPPETIZER_HEADER_SIZE + 3) {
+        errno = EPROTO;
+        return -1;
+    }
+    *response = PUPPETIZER_DATA(p)[0];
+    memcpy(&p->entries_left, PUPPETIZER_DATA(p) + 1, sizeof(uint16_t));
+    p->entries = PUPPETIZER_DATA(p) + 3;
+    return 0;
+}
+
+/**
+ * Returns 0 with next entry of last service states reply and 1 when
+ * there are no more. Name is valid until next call on this client.
+ */
+int puppetizer_next_service_state(struct puppetizer *p, const char **name, uint8_t *state)
+{
+    uint8_t *end = p->packet + p->len, *name_end;
+
+    if (p->entries_left == 0) {
+        return 1;
+    }
+    if (p->entries + 1 >= end || (name_end = memchr(p->entries + 1, 0, end - p->entries - 1)) == NULL) {
+        p->entries_left = 0;
+        errno = EPROTO;
+        return -1;
+    }
+    *state = p->entries[0];
+    *name = (const char*)p->entries + 1;
+    p->entries = name_end + 1;
+    p->entries_left--;
+    return 0;
+}
+
+static void puppetizer_set_failed(struct puppetizer *p, const char *name)
+{
+    strncpy(p->failed, name, sizeof(p->failed) - 1);
+    p->failed[sizeof(p->failed) - 1] = 0;
+}
+
+// first service in last reply which is not in target state
+static void puppetizer_find_failed(struct puppetizer *p, uint8_t target)
+{
+    const char *name;
+    uint8_t state;
+
+    p->failed[0] = 0;
+    while (puppetizer_next_service_state(p, &name, &state) == 0) {
+        if (state != target) {
+            puppetizer_set_failed(p, name);
+            return;
+        }
+    }
+}
+
+/**
+ * Checks packet against state changes sent without waiting,
+ * anything else is a late subscription update and is dropped.
+ */
+static int puppetizer_handle_pending(struct puppetizer *p, uint8_t type, uint16_t id)
+{
+    uint8_t response;
+    uint16_t i;
+
+    for (i=0; i<p->pending_count && p->pending[i].id != id; i++);
+    if (i == p->pending_count) {
+        return 0;
+    }
+    if (puppetizer_decode_states(p, type, &response) == -1) {
+        return -1;
+    }
+    if (response != CMD_RESPONSE_OK && !p->pending_failed) {
+        p->pending_failed = true;
+        puppetizer_find_failed(p, p->pending[i].state);
+    }
+    p->pending[i] = p->pending[--p->pending_count];
+    return 0;
+}
+
+static int puppetizer_reply(struct puppetizer *p, uint16_t id, uint8_t *type)
+{
+    uint16_t packet_id;
+
+    while (true) {
+        if (puppetizer_read(p, type, &packet_id) == -1) {
+            return -1;
+        }
+        if (packet_id == id) {
+            return 0;
+        }
+        if (puppetizer_handle_pending(p, *type, packet_id) == -1) {
+            return -1;
+        }
+    }
+}
+
+static int puppetizer_add_pending(struct puppetizer *p, uint16_t id, uint8_t state)
+{
+    struct puppetizer_pending *resized;
+    uint32_t size;
+
+    if (p->pending_count == p->pending_size) {
+        size = p->pending_size ? p->pending_size * 2 : 16;
+        resized = realloc(p->pending, sizeof(struct puppetizer_pending) * size);
+        if (resized == NULL) {
+            return -1;
+        }
+        p->pending = resized;
+        p->pending_size = size;
+    }
+    p->pending[p->pending_count].id = id;
+    p->pending[p->pending_count].state = state;
+    p->pending_count++;
+    return 0;
+}
+
+/**
+ * Writes name count and NUL terminated names after prefix bytes,
+ * returned buffer has to be freed.
+ */
+static uint8_t *puppetizer_encode_names(const char **names, uint16_t count, size_t prefix, size_t *len)
+{
+    uint8_t *buff, *p;
+    size_t name_len;
+    uint16_t i;
+
+    *len = prefix + sizeof(uint16_t);
+    for (i=0; i<count; i++) {
+        *len += strlen(names[i]) + 1;
+    }
+    if (*len > PUPPETIZER_PACKET_MAX - PUPPETIZER_HEADER_SIZE) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    buff = malloc(*len);
+    if (buff == NULL) {
+        return NULL;
+    }
+    p = buff + prefix;
+    memcpy(p, &count, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    for (i=0; i<count; i++) {
+        name_len = strlen(names[i]) + 1;
+        memcpy(p, names[i], name_len);
+        p += name_len;
+    }
+    return buff;
+}
+
+static int puppetizer_send_names(struct puppetizer *p, uint8_t type, uint16_t id, const char **names, uint16_t count, const uint8_t *prefix, size_t prefix_len)
+{
+    uint8_t *buff;
+    size_t len;
+    int ret;
+
+    buff = puppetizer_encode_names(names, count, prefix_len, &len);
+    if (buff == NULL) {
+        return -1;
+    }
+    if (prefix_len) {
+        memcpy(buff, prefix, prefix_len);
+    }
+    ret = puppetizer_send(p, type, id, buff, len);
+    free(buff);
+    return ret;
+}
+
+/**
+ * Queries states of given services, or of all when count is 0.
+ * Results are read with puppetizer_next_service_state,
+ * unknown services have state 0.
+ */
+int puppetizer_service_states(struct puppetizer *p, const char **names, uint16_t count)
+{
+    uint16_t id = puppetizer_next_id(p);
+    uint8_t type, response;
+
+    if (puppetizer_send_names(p, PACKET_REQUEST_SERVICE_STATES, id, names, count, NULL, 0) == -1
+        || puppetizer_reply(p, id, &type) == -1
+        || puppetizer_decode_states(p, type, &response) == -1) {
+        return -1;
+    }
+    return response == CMD_RESPONSE_OK ? 0 : 1;
+}
+
+// service went the other way, eg. was not ready in time
+static bool puppetizer_moved_away(uint8_t target, uint8_t state)
+{
+    return (target == STATE_UP) != (state == STATE_UP || state == STATE_PENDING_UP);
+}
+
+/**
+ * Drops updates sent before init handled unsubscribe.
+ */
+static int puppetizer_unsubscribe(struct puppetizer *p, uint16_t id)
+{
+    uint16_t packet_id;
+    uint8_t type;
+
+    if (puppetizer_send(p, PACKET_UNSUBSCRIBE, id, NULL, 0) == -1) {
+        return -1;
+    }
+    while (true) {
+        if (puppetizer_read(p, &type, &packet_id) == -1) {
+            return -1;
+        }
+        if (packet_id == id) {
+            if (type == PACKET_COMMAND_RESPONSE) return 0;
+            continue;
+        }
+        if (puppetizer_handle_pending(p, type, packet_id) == -1) {
+            return -1;
+        }
+    }
+}
+
+static int puppetizer_wait_for(struct puppetizer *p, uint16_t id, const char **names, uint16_t count, uint8_t target)
+{
+    bool *reached = calloc(count, sizeof(bool));
+    uint16_t left = count, i;
+    uint8_t type, response, state;
+    const char *name;
+    int ret = 0;
+
+    if (reached == NULL) {
+        return -1;
+    }
+    while (left > 0 && ret == 0) {
+        if (puppetizer_reply(p, id, &type) == -1 || puppetizer_decode_states(p, type, &response) == -1) {
+            ret = -1;
+            break;
+        }
+        if (response != CMD_RESPONSE_OK) {
+            puppetizer_set_failed(p, names[0]);
+            ret = 1;
+            break;
+        }
+        while (ret == 0 && puppetizer_next_service_state(p, &name, &state) == 0) {
+            for (i=0; i<count; i++) {
+                if (reached[i] || strcmp(names[i], name) != 0) continue;
+                if (puppetizer_moved_away(target, state)) {
+                    puppetizer_set_failed(p, name);
+                    ret = 1;
+                    break;
+                }
+                if (state == target) {
+                    reached[i] = true;
+                    left--;
+                }
+            }
+        }
+    }
+    free(reached);
+    return ret;
+}
+
+/**
+ * Sets state of given services, optionally waiting until they reach it.
+ * Without waiting reply is checked later by puppetizer_check_pending,
+ * so request costs no round trip. Failed service is given by puppetizer_failed.
+ */
+int puppetizer_set_service_states(struct puppetizer *p, const char **names, uint16_t count, uint8_t state, int wait)
+{
+    uint16_t command = puppetizer_next_id(p), subscription;
+    uint8_t type, response;
+    int ret;
+
+    p->failed[0] = 0;
+    if (count == 0) {
+        return 0;
+    }
+    if (puppetizer_send_names(p, PACKET_SET_SERVICE_STATES, command, names, count, &state, sizeof(state)) == -1) {
+        return -1;
+    }
+    if (!wait) {
+        return puppetizer_add_pending(p, command, state);
+    }
+
+    // sent after command, so first update already shows requested change
+    subscription = puppetizer_next_id(p);
+    if (puppetizer_send_names(p, PACKET_SUBSCRIBE_SERVICE_STATES, subscription, names, count, NULL, 0) == -1
+        || puppetizer_reply(p, command, &type) == -1
+        || puppetizer_decode_states(p, type, &response) == -1) {
+        return -1;
+    }
+    if (response != CMD_RESPONSE_OK) {
+        puppetizer_find_failed(p, state);
+        if (p->failed[0] == 0) {
+            puppetizer_set_failed(p, names[0]);
+        }
+        ret = 1;
+    } else {
+        ret = puppetizer_wait_for(p, subscription, names, count, state);
+    }
+    if (ret != -1 && puppetizer_unsubscribe(p, subscription) == -1) {
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * Returns 1 when any state change sent without waiting was rejected.
+ */
+int puppetizer_check_pending(struct puppetizer *p)
+{
+    uint16_t id;
+    uint8_t type;
+
+    while (p->pending_count > 0) {
+        if (puppetizer_read(p, &type, &id) == -1 || puppetizer_handle_pending(p, type, id) == -1) {
+            return -1;
+        }
+    }
+    if (p->pending_failed) {
+        p->pending_failed = false;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Name of service which failed last state change, empty when unknown.
+ */
+const char *puppetizer_failed(struct puppetizer *p)
+{
+    return p->failed;
+}
+
+int puppetizer_init_state(struct puppetizer *p, uint8_t *state)
+{
+    uint16_t id = puppetizer_next_id(p);
+    uint8_t type;
+
+    if (puppetizer_send(p, PACKET_REQUEST_INIT_STATE, id, NULL, 0) == -1 || puppetizer_reply(p, id, &type) == -1) {
+        return -1;
+    }
+    if (type != PACKET_INIT_STATE || p->len < PUPPETIZER_HEADER_SIZE + 1) {
+        errno = EPROTO;
+        return -1;
+    }
+    *state = PUPPETIZER_DATA(p)[0];
+    return 0;
+}
+
+/**
+ * Cached health state, age of oldest result in seconds
+ * and name of first failed check (or empty string).
+ */
+int puppetizer_health(struct puppetizer *p, uint8_t *state, uint32_t *age, const char **failed)
+{
+    uint16_t id = puppetizer_next_id(p);
+    uint8_t type;
+
+    if (puppetizer_send(p, PACKET_REQUEST_HEALTH, id, NULL, 0) == -1 || puppetizer_reply(p, id, &type) == -1) {
+        return -1;
+    }
+    if (type != PACKET_HEALTH || p->len < PUPPETIZER_HEADER_SIZE + 6 || p->packet[p->len - 1] != 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    *state = PUPPETIZER_DATA(p)[0];
+    memcpy(age, PUPPETIZER_DATA(p) + 1, sizeof(uint32_t));
+    *failed = (const char*)PUPPETIZER_DATA(p) + 5;
+    return 0;
+}
+
+/**
+ * Adds phases which just finished to apply track, durations are in microseconds.
+ */
+int puppetizer_report_trace(struct puppetizer *p, const char **names, const uint32_t *durations, uint16_t count)
+{
+    uint16_t id = puppetizer_next_id(p), i;
+    size_t len = sizeof(uint16_t), name_len;
+    uint8_t *buff, *b, type;
+    int ret;
+
+    for (i=0; i<count; i++) {
+        len += sizeof(uint32_t) + strlen(names[i]) + 1;
+    }
+    if (len > PUPPETIZER_PACKET_MAX - PUPPETIZER_HEADER_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    b = buff = malloc(len);
+    if (buff == NULL) {
+        return -1;
+    }
+    memcpy(b, &count, sizeof(uint16_t));
+    b += sizeof(uint16_t);
+    for (i=0; i<count; i++) {
+        name_len = strlen(names[i]) + 1;
+        memcpy(b, &durations[i], sizeof(uint32_t));
+        memcpy(b + sizeof(uint32_t), names[i], name_len);
+        b += sizeof(uint32_t) + name_len;
+    }
+    ret = puppetizer_send(p, PACKET_REPORT_TRACE, id, buff, len);
+    free(buff);
+
+    if (ret == -1 || puppetizer_reply(p, id, &type) == -1) {
+        return -1;
+    }
+    if (type != PACKET_COMMAND_RESPONSE || p->len < PUPPETIZER_HEADER_SIZE + 1) {
+        errno = EPROTO;
+        return -1;
+    }
+    return PUPPETIZER_DATA(p)[0] == CMD_RESPONSE_OK ? 0 : 1;
+}
@@ -0,0 +1,33 @@
+#ifndef _PUPPETIZER_H
+#define _PUPPETIZER_H
+
+#include <stdint.h>
+
+/*
+ * Client of init control socket for callers which would otherwise run
+ * `init` in client mode and parse its text output.
+ *
+ * Functions return 0 on success, 1 when init refused the request and -1
+ * on socket or protocol error with errno set. States are protocol values,
+ * see STATE_* in service.h, INIT_STATE_* in init.h and HEALTH_* in health.h.
+ * Connection is blocking and not thread safe.
+ */
+
+struct puppetizer;
+
+struct puppetizer *puppetizer_open(const char *path);
+struct puppetizer *puppetizer_open_fd(int fd);
+void puppetizer_close(struct puppetizer *p);
+
+int puppetizer_service_states(struct puppetizer *p, const char **names, uint16_t count);
+int puppetizer_next_service_state(struct puppetizer *p, const char **name, uint8_t *state);
+
+int puppetizer_set_service_states(struct puppetizer *p, const char **names, uint16_t count, uint8_t state, int wait);
+int puppetizer_check_pending(struct puppetizer *p);
+const char *puppetizer_failed(struct puppetizer *p);
+
+int puppetizer_init_state(struct puppetizer *p, uint8_t *state);
+int puppetizer_health(struct puppetizer *p, uint8_t *state, uint32_t *age, const char **failed);
+int puppetizer_report_trace(struct puppetizer *p, const char **names, const uint32_t *durations, uint16_t count);
+
+#endif
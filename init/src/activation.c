@@ -0,0 +1,199 @@
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "activation.h"
+#include "log.h"
+
+#define LOG_MODULE "activation"
+
+static int activation_open_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("Socket path %s is too long", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // left by previous run
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Parses numeric host and port, names are rejected as init does not
+ * wait for resolver and static binary has no NSS.
+ */
+static socklen_t activation_parse_inet(char *address, struct sockaddr_storage *addr)
+{
+    struct sockaddr_in *in = (struct sockaddr_in*)addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6*)addr;
+    char *host = NULL, *port = address, *sep, *end;
+    unsigned long value;
+
+    if (address[0] == '[') {
+        sep = strchr(address, ']');
+        if (sep == NULL || sep[1] != ':') return 0;
+        *sep = 0;
+        host = address + 1;
+        port = sep + 2;
+    } else if ((sep = strrchr(address, ':')) != NULL) {
+        *sep = 0;
+        host = address;
+        port = sep + 1;
+    }
+
+    if (!isdigit((unsigned char)port[0])) return 0;
+    errno = 0;
+    value = strtoul(port, &end, 10);
+    if (*end != 0 || errno != 0 || value > 65535) return 0;
+
+    memset(addr, 0, sizeof(*addr));
+    if (host == NULL || host[0] == 0) {
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = htonl(INADDR_ANY);
+        in->sin_port = htons(value);
+        return sizeof(*in);
+    }
+    if (inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(value);
+        return sizeof(*in);
+    }
+    if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(value);
+        return sizeof(*in6);
+    }
+    return 0;
+}
+
+static int activation_open_inet(char *address, int type)
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int fd, one = 1;
+
+    len = activation_parse_inet(address, &addr);
+    if (len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = socket(addr.ss_family, type | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr*)&addr, len) == -1 || (type == SOCK_STREAM && listen(fd, SOMAXCONN) == -1)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Creates bound socket for address, returns -1 on failure.
+ * Sockets are blocking, as service would get them.
+ */
+int activation_open(const char *address)
+{
+    char buff[256];
+    int fd;
+
+    if (strlen(address) >= sizeof(buff)) {
+        return -1;
+    }
+    strcpy(buff, address);
+    errno = 0;
+
+    if (strncmp(buff, "unix:", 5) == 0) {
+        fd = activation_open_unix(buff + 5);
+    } else if (strncmp(buff, "tcp:", 4) == 0) {
+        fd = activation_open_inet(buff + 4, SOCK_STREAM);
+    } else if (strncmp(buff, "udp:", 4) == 0) {
+        fd = activation_open_inet(buff + 4, SOCK_DGRAM);
+    } else {
+        log_error("Unknown socket type in %s", address);
+        return -1;
+    }
+
+    if (fd == -1 && errno != 0) {
+        log_errno_error("Could not listen on %s", address);
+    }
+    return fd;
+}
+
+/**
+ * Opens sockets listed in file, missing file is not an error.
+ * Already opened sockets are closed on failure.
+ */
+status_t activation_load(const char *path, int **fds, uint8_t *count)
+{
+    char line[256], *address, *end;
+    status_t status = S_OK;
+    FILE *f;
+    int fd;
+
+    *fds = NULL;
+    *count = 0;
+
+    f = fopen(path, "re");
+    if (f == NULL) {
+        if (errno == ENOENT) {
+            return S_OK;
+        }
+        log_errno_warning("Could not read %s", path);
+        return S_ACTIVATION_ERROR;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        for (address = line; isspace((unsigned char)*address); address++);
+        for (end = address + strlen(address); end > address && isspace((unsigned char)end[-1]); end--);
+        *end = 0;
+        if (address[0] == 0 || address[0] == '#') continue;
+
+        if (*count == ACTIVATION_MAX_SOCKETS) {
+            log_error("Too many sockets in %s", path);
+            status = S_ACTIVATION_ERROR;
+            break;
+        }
+        fd = activation_open(address);
+        if (fd == -1) {
+            status = S_ACTIVATION_ERROR;
+            break;
+        }
+        *fds = realloc(*fds, sizeof(int) * (*count + 1));
+        (*fds)[(*count)++] = fd;
+    }
+    fclose(f);
+
+    if (status != S_OK) {
+        while (*count > 0) close((*fds)[--(*count)]);
+        free(*fds);
+        *fds = NULL;
+    }
+    return status;
+}
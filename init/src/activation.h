@@ -0,0 +1,18 @@
+#ifndef _ACTIVATION_H
+#define _ACTIVATION_H
+
+#include <sys/types.h>
+#include "status.h"
+
+// sockets passed to service, see sd_listen_fds(3)
+#define ACTIVATION_MAX_SOCKETS 16
+
+/*
+ * <name>.socket lists one address per line, lines starting with # are ignored:
+ *   tcp:PORT, tcp:HOST:PORT, tcp:[HOST]:PORT, udp:... and unix:PATH
+ */
+
+int activation_open(const char *address);
+status_t activation_load(const char *path, int **fds, uint8_t *count);
+
+#endif
@@ -0,0 +1,265 @@
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cgroup.h"
+#include "log.h"
+
+#define LOG_MODULE "cgroup"
+
+// cgroup init was started in, parent of init and service cgroups
+__static int base_fd = -1;
+
+static bool cgroup_write(int dir, const char *file, const char *value)
+{
+    ssize_t len = strlen(value), n;
+    int fd = openat(dir, file, O_WRONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return false;
+    }
+    n = write(fd, value, len);
+    close(fd);
+    return n == len;
+}
+
+static ssize_t cgroup_read(int dir, const char *file, char *buff, size_t size)
+{
+    int fd = openat(dir, file, O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if (fd == -1) {
+        return -1;
+    }
+    n = read(fd, buff, size - 1);
+    close(fd);
+    if (n >= 0) {
+        buff[n] = 0;
+    }
+    return n;
+}
+
+/**
+ * Opens cgroup v2 directory of init, taken from "0::" entry of /proc/self/cgroup.
+ * Without cgroup namespace the path is not visible and mount root is used.
+ * After re-exec init is already in its own cgroup, parent is returned then.
+ */
+static int cgroup_open_self()
+{
+    char line[512], path[768];
+    size_t len, suffix = strlen("/" CGROUP_INIT_NAME);
+    int fd = -1;
+    FILE *f;
+
+    f = fopen("/proc/self/cgroup", "re");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (strncmp(line, "0::", 3) != 0) continue;
+            len = strlen(line);
+            if (len > 0 && line[len - 1] == '\n') line[--len] = 0;
+            if (len > suffix && strcmp(line + len - suffix, "/" CGROUP_INIT_NAME) == 0) {
+                line[len - suffix] = 0;
+            }
+            snprintf(path, sizeof(path), PUPPETIZER_CGROUP_ROOT "%s", line + 3);
+            fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            break;
+        }
+        fclose(f);
+    }
+    if (fd == -1) {
+        fd = open(PUPPETIZER_CGROUP_ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    return fd;
+}
+
+static void cgroup_enable_controllers()
+{
+    static const char *wanted[] = { "cpu", "io", "memory", NULL };
+    char available[256], enable[16], *p;
+    size_t len;
+    uint8_t i;
+
+    if (cgroup_read(base_fd, "cgroup.controllers", available, sizeof(available)) < 0) {
+        return;
+    }
+    for (i = 0; wanted[i] != NULL; i++) {
+        len = strlen(wanted[i]);
+        for (p = strstr(available, wanted[i]); p != NULL; p = strstr(p + len, wanted[i])) {
+            if ((p == available || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\n' || p[len] == 0)) break;
+        }
+        if (p == NULL) {
+            log_debug("Controller %s is not delegated", wanted[i]);
+            continue;
+        }
+        snprintf(enable, sizeof(enable), "+%s", wanted[i]);
+        if (!cgroup_write(base_fd, "cgroup.subtree_control", enable)) {
+            log_errno_warning("Could not enable %s controller", wanted[i]);
+        }
+    }
+}
+
+/**
+ * Moves init to its own leaf cgroup and enables controllers for services,
+ * fails when cgroup v2 is not mounted or not writable.
+ */
+status_t cgroup_setup()
+{
+    int init_fd;
+    bool moved;
+
+    base_fd = cgroup_open_self();
+    if (base_fd == -1) {
+        return S_CGROUP_UNAVAILABLE;
+    }
+    if (faccessat(base_fd, "cgroup.controllers", F_OK, 0) == -1 || faccessat(base_fd, "cgroup.subtree_control", W_OK, 0) == -1) {
+        close(base_fd);
+        base_fd = -1;
+        return S_CGROUP_UNAVAILABLE;
+    }
+
+    if (mkdirat(base_fd, CGROUP_INIT_NAME, 0755) == -1 && errno != EEXIST) {
+        log_errno_warning("Could not create cgroup for init");
+        close(base_fd);
+        base_fd = -1;
+        return S_CGROUP_UNAVAILABLE;
+    }
+    init_fd = openat(base_fd, CGROUP_INIT_NAME, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    moved = init_fd != -1 && cgroup_write(init_fd, "cgroup.procs", "0");
+    if (init_fd != -1) {
+        close(init_fd);
+    }
+    if (!moved) {
+        log_errno_warning("Could not move init to its cgroup");
+        close(base_fd);
+        base_fd = -1;
+        return S_CGROUP_UNAVAILABLE;
+    }
+
+    cgroup_enable_controllers();
+    return S_OK;
+}
+
+bool cgroup_enabled()
+{
+    return base_fd != -1;
+}
+
+/**
+ * Creates or reuses cgroup of service, returns its directory fd or -1.
+ */
+int cgroup_create(const char *name)
+{
+    char dir[256];
+    int fd;
+
+    snprintf(dir, sizeof(dir), "%s" CGROUP_SERVICE_SUFFIX, name);
+    if (mkdirat(base_fd, dir, 0755) == -1 && errno != EEXIST) {
+        log_errno_warning("Could not create cgroup for service %s", name);
+        return -1;
+    }
+    fd = openat(base_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        log_errno_warning("Could not open cgroup of service %s", name);
+    }
+    return fd;
+}
+
+static void cgroup_set(int fd, const char *name, const char *file, uint64_t value, const char *unset)
+{
+    char buff[32];
+
+    if (value > 0) {
+        snprintf(buff, sizeof(buff), "%llu", (unsigned long long)value);
+        if (!cgroup_write(fd, file, buff)) {
+            log_errno_warning("Could not set %s of service %s", file, name);
+        }
+    } else {
+        // previous start could have set it, controller can also be missing
+        cgroup_write(fd, file, unset);
+    }
+}
+
+/**
+ * Writes limits on each start, so values removed from options are reset.
+ */
+void cgroup_set_limits(int fd, const char *name, const struct cgroup_limits *limits)
+{
+    cgroup_set(fd, name, "memory.max", limits->memory_max, "max");
+    cgroup_set(fd, name, "cpu.weight", limits->cpu_weight, "100");
+    cgroup_set(fd, name, "io.weight", limits->io_weight, "default 100");
+}
+
+/**
+ * Opens cgroup.procs which child writes to before exec.
+ */
+int cgroup_open_procs(int fd)
+{
+    return openat(fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+}
+
+/**
+ * Signals every process in cgroup, including ones that left process group.
+ * SIGKILL uses cgroup.kill so processes forking meanwhile are not missed.
+ */
+bool cgroup_signal(int fd, int sig)
+{
+    int procs_fd;
+    bool found = false;
+    FILE *f;
+    int pid;
+
+    if (sig == SIGKILL && cgroup_write(fd, "cgroup.kill", "1")) {
+        return true;
+    }
+
+    procs_fd = openat(fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+    if (procs_fd == -1 || (f = fdopen(procs_fd, "r")) == NULL) {
+        if (procs_fd != -1) close(procs_fd);
+        return false;
+    }
+    while (fscanf(f, "%d", &pid) == 1) {
+        if (kill(pid, sig) == 0) found = true;
+    }
+    fclose(f);
+    return found;
+}
+
+/**
+ * CPU time of whole cgroup from usage_usec of cpu.stat.
+ */
+bool cgroup_cpu_usage(int fd, uint64_t *cpu_ms)
+{
+    char buff[512], *p;
+    unsigned long long usec;
+
+    if (cgroup_read(fd, "cpu.stat", buff, sizeof(buff)) <= 0) {
+        return false;
+    }
+    p = strstr(buff, "usage_usec ");
+    if (p == NULL || sscanf(p + 11, "%llu", &usec) != 1) {
+        return false;
+    }
+    *cpu_ms = usec / 1000;
+    return true;
+}
+
+/**
+ * Memory charged to cgroup, available only with memory controller.
+ */
+bool cgroup_memory_usage(int fd, uint64_t *bytes)
+{
+    char buff[32];
+    unsigned long long value;
+
+    if (cgroup_read(fd, "memory.current", buff, sizeof(buff)) <= 0 || sscanf(buff, "%llu", &value) != 1) {
+        return false;
+    }
+    *bytes = value;
+    return true;
+}
@@ -0,0 +1,32 @@
+#ifndef _CGROUP_H
+#define _CGROUP_H
+
+#include <sys/types.h>
+#include "status.h"
+
+// init moves itself here, processes can not live in cgroup with enabled controllers
+#define CGROUP_INIT_NAME "init.scope"
+// services get sibling <name>.service cgroups
+#define CGROUP_SERVICE_SUFFIX ".service"
+
+/**
+ * Resource controls written to service cgroup, 0 keeps kernel default.
+ */
+struct cgroup_limits {
+    // bytes for memory.max
+    uint64_t memory_max;
+    // 1-10000 for cpu.weight and io.weight
+    uint32_t cpu_weight;
+    uint32_t io_weight;
+};
+
+status_t cgroup_setup();
+bool cgroup_enabled();
+int cgroup_create(const char *name);
+void cgroup_set_limits(int fd, const char *name, const struct cgroup_limits *limits);
+int cgroup_open_procs(int fd);
+bool cgroup_signal(int fd, int sig);
+bool cgroup_cpu_usage(int fd, uint64_t *cpu_ms);
+bool cgroup_memory_usage(int fd, uint64_t *bytes);
+
+#endif
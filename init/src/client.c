@@ -2,6 +2,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <argp.h>
 
 #include "client.h"
@@ -9,50 +10,163 @@
 #include "log.h"
 #include "service.h"
 #include "init.h"
+#include "health.h"
+#include "trace.h"
 
 #define LOG_MODULE "client"
 
 #define ASSERT(X) if(X != S_OK) { log_error("failed"); exit(1); }
 
 int fd_control;
+static control_request_id_t client_last_id = 0;
 
-static control_response_t client_send_message(const char *name, service_state_t state)
+static control_request_id_t client_next_id()
+{
+    return ++client_last_id;
+}
+
+/**
+ * Reads packets until reply to given request arrives.
+ */
+static void client_read_reply(control_request_id_t id, void *data)
+{
+    for (;;) {
+        ASSERT(control_read_packet(fd_control, data));
+        if (PACKET_REQUEST_ID(data) == id) {
+            return;
+        }
+        log_debug("Skipping reply to request %d", PACKET_REQUEST_ID(data));
+    }
+}
+
+static const char *client_state_name(service_state_t state)
+{
+    switch (state) {
+        case STATE_UP: return "UP";
+        case STATE_PENDING_UP: return "PENDING UP";
+        case STATE_DOWN: return "DOWN";
+        case STATE_PENDING_DOWN: return "PENDING DOWN";
+        default: return "UNKNOWN";
+    }
+}
+
+static const char *client_init_state_name(uint8_t state)
+{
+    switch (state) {
+        case INIT_STATE_BOOTING: return "booting";
+        case INIT_STATE_RUNNING: return "running";
+        case INIT_STATE_HALTING: return "halting";
+        default: return "unknown";
+    }
+}
+
+static control_response_t client_send_message(const char **names, uint16_t count, service_state_t state)
 {
     control_response_t response = 100;
     uint8_t data[control_max_data_length];
+    control_request_id_t id = client_next_id();
 
-    ASSERT(control_set_service_state(name, state, fd_control));
-    ASSERT(control_read_packet(fd_control, data));
-    control_decode_response(data, &response);
+    ASSERT(control_set_service_states(names, count, state, id, fd_control));
+    client_read_reply(id, data);
+
+    if (PACKET_TYPE(data) == PACKET_COMMAND_RESPONSE) {
+        control_decode_response(data, &response);
+    } else {
+        uint8_t *entries;
+        uint16_t entries_count;
+        control_decode_service_states(data, &response, &entries_count, &entries);
+    }
 
     return response;
 }
 
-static bool client_set_service_state_and_wait(const char *name, service_state_t target_state)
+static void client_wait_failed(const char *name, control_response_t response)
+{
+    if (response == CMD_RESPONSE_OK) {
+        printf("failed\n");
+    } else {
+        printf("failed with response %d\n", response);
+    }
+    if (name) {
+        log_error("Service %s did not reach requested state", name);
+    }
+    exit(1);
+}
+
+/**
+ * Sends batch command and waits for all services over single connection,
+ * all services are watched with one subscription.
+ */
+static bool client_set_service_state_and_wait(const char **names, uint16_t count, service_state_t target_state)
 {
     uint8_t data[control_max_data_length];
     control_response_t response;
+    control_request_id_t id, command_id, subscribe_id;
     service_state_t state;
-    
-    ASSERT(control_set_service_state(name, target_state, fd_control));
-    ASSERT(control_subscribe_service_state(name, fd_control));
+    uint16_t i, j, entries_count, pending = count;
+    uint8_t *entries;
+    char *name;
+    bool reached[count];
 
-    for (;;) {
+    command_id = client_next_id();
+    subscribe_id = client_next_id();
+
+    ASSERT(control_set_service_states(names, count, target_state, command_id, fd_control));
+    ASSERT(control_subscribe_service_states(names, count, subscribe_id, fd_control));
+    for (i=0;i<count;i++) {
+        reached[i] = false;
+    }
+
+    while (pending) {
         ASSERT(control_read_packet(fd_control, data));
-        control_decode_service_state(data, &response, &state);
+        id = PACKET_REQUEST_ID(data);
 
         log_debug("client loop");
 
-        if (response == CMD_RESPONSE_OK) {
+        if (id == command_id) {
+            if (PACKET_TYPE(data) == PACKET_COMMAND_RESPONSE) {
+                control_decode_response(data, &response);
+            } else {
+                control_decode_service_states(data, &response, &entries_count, &entries);
+            }
+            if (response != CMD_RESPONSE_OK) {
+                client_wait_failed(NULL, response);
+            }
+            continue;
+        }
+
+        if (id != subscribe_id || PACKET_TYPE(data) != PACKET_SERVICE_STATES) {
+            log_debug("Skipping packet %d for request %d", PACKET_TYPE(data), id);
+            continue;
+        }
+
+        control_decode_service_states(data, &response, &entries_count, &entries);
+        if (response != CMD_RESPONSE_OK) {
+            client_wait_failed(NULL, response);
+        }
+
+        for (j=0;j<entries_count;j++) {
+            control_next_service_state(&entries, &state, &name);
+            for (i=0;i<count && strcmp(names[i], name) != 0;i++);
+            if (i == count) {
+                continue;
+            }
             if (state == target_state) {
-                printf("OK\n");
-                exit(0);
+                if (!reached[i]) {
+                    reached[i] = true;
+                    pending--;
+                }
+                continue;
+            }
+            // service went the other way, eg. was not ready in time
+            if ((target_state == STATE_UP) != (state == STATE_UP || state == STATE_PENDING_UP)) {
+                client_wait_failed(names[i], response);
             }
-        } else {
-            printf("failed with response %d\n", response);
-            exit(1);
         }
     }
+
+    printf("OK\n");
+    exit(0);
 }
 
 static void print_response(control_response_t response)
@@ -77,51 +191,285 @@ void cmd_init_status()
     uint8_t state;
     uint8_t data[control_max_data_length];
 
-    ASSERT(control_request_init_state(fd_control));
-    ASSERT(control_read_packet(fd_control, data));
+    control_request_id_t id = client_next_id();
+
+    ASSERT(control_request_init_state(id, fd_control));
+    client_read_reply(id, data);
     control_decode_init_state(data, &state);
 
+    printf("%s\n", client_init_state_name(state));
+
+    exit(0);
+}
+
+/**
+ * Prints cached health, exits with 0 only when all checks pass.
+ */
+void cmd_health()
+{
+    uint8_t state;
+    uint32_t age;
+    char *failed;
+    uint8_t data[control_max_data_length];
+
+    control_request_id_t id = client_next_id();
+
+    ASSERT(control_request_health(id, fd_control));
+    client_read_reply(id, data);
+    control_decode_health(data, &state, &age, &failed);
+
     switch (state) {
-        case INIT_STATE_BOOTING:
-            printf("booting\n"); break;
-        case INIT_STATE_RUNNING:
-            printf("running\n"); break;
-        case INIT_STATE_HALTING:
-            printf("halting\n"); break;
+        case HEALTH_OK:
+            printf("healthy (%ds ago)\n", age);
+            exit(0);
+        case HEALTH_FAILED:
+            printf("unhealthy: %s (%ds ago)\n", failed, age);
+            break;
         default:
-            printf("unknown\n"); break;
+            printf("unknown\n");
+            break;
     }
 
-    exit(0);
+    exit(1);
 }
 
 void cmd_service_state(const char *svc_name)
 {
     service_state_t state;
     control_response_t response;
+    control_request_id_t id = client_next_id();
 
     uint8_t data[control_max_data_length];
-    ASSERT(control_request_service_state(svc_name, fd_control));
-    ASSERT(control_read_packet(fd_control, data));
+    ASSERT(control_request_service_state(svc_name, id, fd_control));
+    client_read_reply(id, data);
 
     control_decode_service_state(data, &response, &state);
 
     if (response != CMD_RESPONSE_OK) {
         printf("ERROR\n");
     } else {
-        switch (state) {
-            case STATE_UP: printf("UP\n"); break;
-            case STATE_PENDING_UP: printf("PENDING UP\n"); break;
-            case STATE_DOWN: printf("DOWN\n"); break;
-            case STATE_PENDING_DOWN: printf("PENDING DOWN\n"); break;
-            default: 
-                log_warning("Unknown state: %d", state);
-                printf("UNKNOWN\n");
+        if (state < STATE_PENDING_UP || state > STATE_PENDING_DOWN) {
+            log_warning("Unknown state: %d", state);
+        }
+        printf("%s\n", client_state_name(state));
+    }
+}
+
+/**
+ * Prints state of each listed service or all services when none given.
+ */
+void cmd_service_states(const char **names, uint16_t count)
+{
+    service_state_t state;
+    control_response_t response;
+    control_request_id_t id = client_next_id();
+    uint8_t *entries;
+    char *name;
+    uint16_t i;
+
+    uint8_t data[control_max_data_length];
+    ASSERT(control_request_service_states(names, count, id, fd_control));
+    client_read_reply(id, data);
+
+    if (PACKET_TYPE(data) != PACKET_SERVICE_STATES) {
+        printf("ERROR\n");
+        exit(1);
+    }
+
+    control_decode_service_states(data, &response, &count, &entries);
+    for (i=0;i<count;i++) {
+        control_next_service_state(&entries, &state, &name);
+        printf("%s %s\n", name, state?client_state_name(state):"ERROR");
+    }
+
+    exit(response == CMD_RESPONSE_OK ? 0 : 1);
+}
+
+/**
+ * Prints last captured output of each service.
+ */
+void cmd_service_logs(const char **names, uint16_t count)
+{
+    control_response_t response;
+    control_request_id_t id;
+    uint8_t *tail;
+    uint16_t i, len;
+    int rc = 0;
+
+    uint8_t data[control_max_data_length];
+    for (i=0;i<count;i++) {
+        id = client_next_id();
+        ASSERT(control_request_service_output(names[i], id, fd_control));
+        client_read_reply(id, data);
+        control_decode_service_output(data, &response, &len, &tail);
+
+        if (response != CMD_RESPONSE_OK) {
+            log_error("Unknown service %s", names[i]);
+            rc = 1;
+            continue;
+        }
+        fwrite(tail, 1, len, stdout);
+    }
+
+    exit(rc);
+}
+
+/**
+ * Prints service metrics in Prometheus text format.
+ */
+void cmd_metrics()
+{
+    control_response_t response;
+    control_request_id_t id = client_next_id();
+    struct service_metrics *metrics;
+    uint64_t log_dropped;
+    uint8_t *entries;
+    uint16_t i, count;
+
+    uint8_t data[control_max_data_length];
+    ASSERT(control_request_metrics(id, fd_control));
+    client_read_reply(id, data);
+    if (PACKET_TYPE(data) != PACKET_METRICS) {
+        log_error("Metrics are not available");
+        exit(1);
+    }
+    control_decode_metrics(data, &response, &count, &log_dropped, &entries);
+
+    metrics = calloc(count ? count : 1, sizeof(struct service_metrics));
+    for (i=0;i<count;i++) {
+        control_next_metrics(&entries, &metrics[i]);
+    }
+    metrics_write_prometheus(stdout, metrics, count, log_dropped);
+    free(metrics);
+
+    exit(response == CMD_RESPONSE_OK ? 0 : 1);
+}
+
+/**
+ * Prints events recorded by init in Chrome trace format,
+ * names of service tracks are taken from service list which is in id order.
+ */
+void cmd_trace()
+{
+    control_response_t response;
+    control_request_id_t id = client_next_id();
+    struct trace_event *events = NULL;
+    service_state_t state;
+    uint64_t since = 0;
+    uint32_t events_count = 0;
+    uint8_t *entries;
+    uint16_t i, count, names_count;
+    const char **names;
+    char *name;
+
+    uint8_t data[control_max_data_length];
+    ASSERT(control_request_service_states(NULL, 0, id, fd_control));
+    client_read_reply(id, data);
+    control_decode_service_states(data, &response, &names_count, &entries);
+    names = calloc(names_count ? names_count : 1, sizeof(char*));
+    for (i=0;i<names_count;i++) {
+        control_next_service_state(&entries, &state, &name);
+        names[i] = strdup(name);
+    }
+
+    do {
+        id = client_next_id();
+        ASSERT(control_request_trace(since, id, fd_control));
+        client_read_reply(id, data);
+        if (PACKET_TYPE(data) != PACKET_TRACE) {
+            log_error("Trace is not available");
+            exit(1);
+        }
+        control_decode_trace(data, &response, &count, &since, &entries);
+        events = realloc(events, sizeof(struct trace_event) * (events_count + count + 1));
+        for (i=0;i<count;i++) {
+            control_next_trace(&entries, &events[events_count++]);
+        }
+    } while (count > 0);
+
+    trace_write_chrome(stdout, events, events_count, names, names_count);
+    exit(0);
+}
+
+/**
+ * Sends phases of finished work as NAME=SECONDS pairs, e.g. timings of puppet run.
+ */
+void cmd_trace_report(const char **phases, uint16_t phases_count)
+{
+    control_response_t response;
+    control_request_id_t id = client_next_id();
+    const char *names[phases_count];
+    uint32_t durations[phases_count];
+    char *sep, *end;
+    double seconds;
+    uint16_t i;
+
+    for (i=0;i<phases_count;i++) {
+        sep = strchr(phases[i], '=');
+        if (sep == NULL || sep == phases[i]) {
+            log_error("Bad phase %s, expected NAME=SECONDS", phases[i]);
+            exit(1);
+        }
+        seconds = strtod(sep + 1, &end);
+        if (end == sep + 1 || *end != 0 || seconds < 0 || seconds > UINT32_MAX / 1000000.0) {
+            log_error("Bad duration of phase %s", phases[i]);
+            exit(1);
+        }
+        names[i] = strndup(phases[i], sep - phases[i]);
+        durations[i] = seconds * 1000000;
+    }
+
+    uint8_t data[control_max_data_length];
+    ASSERT(control_report_trace(names, durations, phases_count, id, fd_control));
+    client_read_reply(id, data);
+    control_decode_response(data, &response);
+
+    exit(response == CMD_RESPONSE_OK ? 0 : 1);
+}
+
+/**
+ * Streams init and service state changes until init closes connection.
+ */
+void cmd_events()
+{
+    service_state_t state;
+    control_response_t response;
+    control_request_id_t init_id = client_next_id(), services_id = client_next_id();
+    uint8_t *entries;
+    uint8_t init_state;
+    uint16_t i, count;
+    char *name;
+
+    uint8_t data[control_max_data_length];
+    ASSERT(control_subscribe_init_state(init_id, fd_control));
+    ASSERT(control_subscribe_all_services(services_id, fd_control));
+
+    for (;;) {
+        if (control_read_packet(fd_control, data) != S_OK) {
+            exit(0);
+        }
+
+        switch (PACKET_TYPE(data)) {
+            case PACKET_INIT_STATE:
+                control_decode_init_state(data, &init_state);
+                printf("init %s\n", client_init_state_name(init_state));
+                break;
+            case PACKET_SERVICE_STATES:
+                control_decode_service_states(data, &response, &count, &entries);
+                for (i=0;i<count;i++) {
+                    control_next_service_state(&entries, &state, &name);
+                    printf("%s %s\n", name, client_state_name(state));
+                }
+                break;
+            default:
+                printf("failed\n");
+                exit(1);
         }
+        fflush(stdout);
     }
 }
 
-int client_main(const char *svc_name, uint8_t cmd, bool wait)
+int client_main(const char **svc_names, uint16_t svc_count, uint8_t cmd, bool wait)
 {
     status_t status;
 
@@ -134,25 +482,57 @@ int client_main(const char *svc_name, uint8_t cmd, bool wait)
     switch (cmd) {
         case CMD_SERVICE_STOP:
             if (wait) {
-                client_set_service_state_and_wait(svc_name, STATE_DOWN);
+                client_set_service_state_and_wait(svc_names, svc_count, STATE_DOWN);
             } else {
-                print_response(client_send_message(svc_name, STATE_DOWN));
+                print_response(client_send_message(svc_names, svc_count, STATE_DOWN));
             };
             break;
         case CMD_SERVICE_START:
             if (wait) {
-                client_set_service_state_and_wait(svc_name, STATE_UP);
+                client_set_service_state_and_wait(svc_names, svc_count, STATE_UP);
             } else {
-                print_response(client_send_message(svc_name, STATE_UP));
+                print_response(client_send_message(svc_names, svc_count, STATE_UP));
             }
             break;
         case CMD_SERVICE_STATUS:
-            cmd_service_state(svc_name);
+            if (svc_count == 1) {
+                cmd_service_state(svc_names[0]);
+            } else {
+                cmd_service_states(svc_names, svc_count);
+            }
+            break;
+
+        case CMD_SERVICE_LIST:
+            cmd_service_states(NULL, 0);
+            break;
+
+        case CMD_SERVICE_EVENTS:
+            cmd_events();
+            break;
+
+        case CMD_SERVICE_LOGS:
+            cmd_service_logs(svc_names, svc_count);
             break;
         
         case CMD_INIT_STATUS:
             cmd_init_status();
             break;
+
+        case CMD_HEALTH:
+            cmd_health();
+            break;
+
+        case CMD_METRICS:
+            cmd_metrics();
+            break;
+
+        case CMD_TRACE:
+            cmd_trace();
+            break;
+
+        case CMD_TRACE_REPORT:
+            cmd_trace_report(svc_names, svc_count);
+            break;
     }
     exit(5);
 }
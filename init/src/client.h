@@ -9,7 +9,13 @@
 #define CMD_SERVICE_STATUS 3
 #define CMD_SERVICE_EVENTS 4
 #define CMD_INIT_STATUS 5
+#define CMD_HEALTH 6
+#define CMD_SERVICE_LIST 7
+#define CMD_SERVICE_LOGS 8
+#define CMD_METRICS 9
+#define CMD_TRACE 10
+#define CMD_TRACE_REPORT 11
 
-int client_main(const char *svc_name, uint8_t cmd, bool wait);
+int client_main(const char **svc_names, uint16_t svc_count, uint8_t cmd, bool wait);
 
 #endif
@@ -0,0 +1,94 @@
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "conf.h"
+#include "log.h"
+
+#define LOG_MODULE "conf"
+
+static char* conf_trim(char *s)
+{
+    char *end;
+
+    while (isspace((unsigned char)*s)) s++;
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) end--;
+    *end = 0;
+
+    return s;
+}
+
+/**
+ * Reads "key = value" lines, empty lines and ones starting with # are skipped.
+ * Missing file is not an error.
+ */
+status_t conf_parse_file(const char *path, conf_handler_t handler, void *ctx)
+{
+    char line[512];
+    char *key, *value, *sep;
+    uint16_t lineno = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        if (errno == ENOENT) {
+            return S_OK;
+        }
+        log_errno_warning("Could not read %s", path);
+        return S_CONF_ERROR;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        key = conf_trim(line);
+        if (key[0] == 0 || key[0] == '#') {
+            continue;
+        }
+
+        sep = strchr(key, '=');
+        if (sep == NULL) {
+            log_warning("Ignoring malformed line %d in %s", lineno, path);
+            continue;
+        }
+        *sep = 0;
+        value = conf_trim(sep + 1);
+        key = conf_trim(key);
+
+        if (!handler(ctx, key, value)) {
+            log_warning("Ignoring invalid option %s in %s", key, path);
+        }
+    }
+    fclose(f);
+
+    return S_OK;
+}
+
+bool conf_parse_uint(const char *value, uint32_t *out)
+{
+    char *end;
+    unsigned long v;
+
+    errno = 0;
+    v = strtoul(value, &end, 10);
+    if (errno != 0 || end == value || *end != 0 || v > UINT32_MAX) {
+        return false;
+    }
+    *out = v;
+    return true;
+}
+
+bool conf_parse_bool(const char *value, bool *out)
+{
+    if (strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "1") == 0) {
+        *out = true;
+    } else if (strcmp(value, "false") == 0 || strcmp(value, "no") == 0 || strcmp(value, "0") == 0) {
+        *out = false;
+    } else {
+        return false;
+    }
+    return true;
+}
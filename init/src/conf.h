@@ -0,0 +1,15 @@
+#ifndef _CONF_H
+#define _CONF_H
+
+#include "status.h"
+
+/**
+ * Called for each option, should return false for unknown or invalid ones.
+ */
+typedef bool (*conf_handler_t)(void *ctx, const char *key, const char *value);
+
+status_t conf_parse_file(const char *path, conf_handler_t handler, void *ctx);
+bool conf_parse_uint(const char *value, uint32_t *out);
+bool conf_parse_bool(const char *value, bool *out);
+
+#endif
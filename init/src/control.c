@@ -1,27 +1,83 @@
 #include "common.h"
 
 #include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
 #include "control.h"
+#include "event.h"
 #include "log.h"
+#include "facts.h"
 
 #define LOG_MODULE "control"
 
-typedef uint8_t control_header_length_t;
-const uint8_t control_max_data_length = (uint64_t)(1<<(sizeof(control_header_length_t)*8))-1;
+typedef uint16_t control_header_length_t;
+const uint16_t control_max_data_length = (uint64_t)(1<<(sizeof(control_header_length_t)*8))-1;
 
-struct init_client_t {
-    int client_fd;
-    struct service *svc;
+/**
+ * Server side connection, reads and writes never block init.
+ * Output is queued in ring buffer, client not reading it
+ * is disconnected once CONTROL_CLIENT_WRITE_MAX is reached.
+ */
+struct control_client {
+    int fd;
+    bool dead;
+    uint8_t *rbuf;
+    uint32_t rlen, rcap;
+    uint8_t *wbuf;
+    uint32_t whead, wlen, wcap;
+};
+
+#define CONTROL_CLIENT_READ_SIZE 4096
+#define CONTROL_CLIENT_WRITE_MIN 4096
+#define CONTROL_CLIENT_WRITE_MAX (256 * 1024)
+
+// indexed by fd
+static struct control_client **clients = NULL;
+static int clients_size = 0;
+static bool clients_dead = false;
+
+struct control_subscriber {
+    int fd;
+    control_request_id_t id;
+    // updates carry service name, for subscriptions to multiple services
+    bool named;
+};
+
+/**
+ * Growable subscriber list, order is not kept on removal.
+ */
+struct control_subscribers {
+    struct control_subscriber *items;
+    uint32_t count, size;
+};
+
+struct control_watch {
+    struct control_subscribers subscribers;
+    bool dirty;
 };
 
-#define MAX_SUBSCRIBED_CLIENTS 10
-static struct init_client_t subscribed_clients[MAX_SUBSCRIBED_CLIENTS];
+// indexed by service id
+static struct control_watch *watches = NULL;
+static uint16_t watches_size = 0;
+
+static struct control_subscribers all_subscribers;
+static struct control_subscribers init_subscribers;
 
-#define PACKET_FIRST_DATA(X) (((uint8_t*)X)+sizeof(control_type_t))
+// services changed since last flush, sent once per loop iteration
+static uint16_t *dirty_ids = NULL;
+static uint16_t dirty_count = 0, dirty_size = 0;
+static bool init_dirty = false;
+static uint8_t init_state;
+
+#define PACKET_HEADER_SIZE (sizeof(control_type_t) + sizeof(control_request_id_t))
+#define PACKET_FIRST_DATA(X) (((uint8_t*)X)+PACKET_HEADER_SIZE)
 
 static size_t control_memcpy(void *dst, const void *src, size_t len)
 {
@@ -29,9 +85,9 @@ static size_t control_memcpy(void *dst, const void *src, size_t len)
     return len;
 }
 
-static status_t control_communicate(int fd,  ssize_t (*comm)(int, void*, size_t, int), control_header_length_t len, void *data)
+static status_t control_communicate(int fd,  ssize_t (*comm)(int, void*, size_t, int), size_t len, void *data)
 {
-    control_header_length_t handled = 0;
+    size_t handled = 0;
     status_t ret = S_OK;
     int res;
     // const char* method = comm == recv?"recv":"send";
@@ -58,6 +114,284 @@ static status_t control_communicate(int fd,  ssize_t (*comm)(int, void*, size_t,
     return ret;
 }
 
+static struct control_client *control_client_get(int fd)
+{
+    return fd >= 0 && fd < clients_size ? clients[fd] : NULL;
+}
+
+static void control_client_kill(struct control_client *client)
+{
+    if (!client->dead) {
+        client->dead = true;
+        clients_dead = true;
+    }
+}
+
+/**
+ * Sends as much of queued output as socket accepts.
+ */
+static status_t control_client_send(struct control_client *client)
+{
+    ssize_t res;
+    uint32_t chunk;
+
+    while (client->wlen) {
+        chunk = client->wcap - client->whead;
+        if (chunk > client->wlen) chunk = client->wlen;
+
+        res = send(client->fd, client->wbuf + client->whead, chunk, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (res == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            log_errno_debug("Failed to write to client %d", client->fd);
+            control_client_kill(client);
+            return S_SOCKET_ERROR;
+        }
+
+        client->whead = (client->whead + res) % client->wcap;
+        client->wlen -= res;
+    }
+
+    if (client->wlen == 0) {
+        client->whead = 0;
+    }
+
+    return S_OK;
+}
+
+static bool control_client_reserve(struct control_client *client, uint32_t len)
+{
+    uint32_t cap = client->wcap ? client->wcap : CONTROL_CLIENT_WRITE_MIN;
+    uint32_t first;
+    uint8_t *buf;
+
+    if (client->wlen + len > CONTROL_CLIENT_WRITE_MAX) {
+        return false;
+    }
+    if (client->wlen + len <= client->wcap) {
+        return true;
+    }
+
+    while (cap < client->wlen + len) cap *= 2;
+    if (cap > CONTROL_CLIENT_WRITE_MAX) cap = CONTROL_CLIENT_WRITE_MAX;
+
+    buf = malloc(cap);
+    if (buf == NULL) {
+        return false;
+    }
+
+    // unwrap ring into new buffer
+    if (client->wlen) {
+        first = client->wcap - client->whead;
+        if (first > client->wlen) first = client->wlen;
+        memcpy(buf, client->wbuf + client->whead, first);
+        memcpy(buf + first, client->wbuf, client->wlen - first);
+    }
+
+    free(client->wbuf);
+    client->wbuf = buf;
+    client->wcap = cap;
+    client->whead = 0;
+    return true;
+}
+
+static status_t control_client_write(struct control_client *client, const uint8_t *data, uint32_t len)
+{
+    bool was_idle = client->wlen == 0;
+    uint32_t tail, first;
+
+    if (client->dead) {
+        return S_SOCKET_ERROR;
+    }
+
+    if (!control_client_reserve(client, len)) {
+        log_warning("Client %d is not reading its messages, disconnecting", client->fd);
+        control_client_kill(client);
+        return S_SOCKET_ERROR;
+    }
+
+    tail = (client->whead + client->wlen) % client->wcap;
+    first = client->wcap - tail;
+    if (first > len) first = len;
+    memcpy(client->wbuf + tail, data, first);
+    memcpy(client->wbuf, data + first, len - first);
+    client->wlen += len;
+
+    if (control_client_send(client) != S_OK) {
+        return S_SOCKET_ERROR;
+    }
+
+    if (was_idle && client->wlen) {
+        event_set_writable(client->fd, EVENT_CLIENT, client->fd, true);
+    }
+    return S_OK;
+}
+
+/**
+ * Registers accepted connection, its socket is switched to non blocking mode.
+ */
+status_t control_client_add(int fd)
+{
+    struct control_client *client;
+    struct control_client **resized;
+    int size;
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1 || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        return S_SOCKET_ERROR;
+    }
+
+    if (fd >= clients_size) {
+        size = clients_size ? clients_size : 16;
+        while (size <= fd) size *= 2;
+        resized = realloc(clients, size * sizeof(struct control_client*));
+        if (resized == NULL) {
+            return S_SOCKET_ERROR;
+        }
+        memset(resized + clients_size, 0, (size - clients_size) * sizeof(struct control_client*));
+        clients = resized;
+        clients_size = size;
+    }
+
+    client = calloc(1, sizeof(struct control_client));
+    if (client == NULL) {
+        return S_SOCKET_ERROR;
+    }
+    client->fd = fd;
+
+    if (event_add(fd, EVENT_CLIENT, fd) != S_OK) {
+        free(client);
+        return S_EVENT_ERROR;
+    }
+
+    clients[fd] = client;
+    return S_OK;
+}
+
+/**
+ * Reads available data and passes each complete packet to handler.
+ * Returns S_SOCKET_EOF when client is gone, client is then closed on next reap.
+ */
+status_t control_client_read(int fd, control_packet_handler_t handler)
+{
+    struct control_client *client = control_client_get(fd);
+    control_header_length_t len;
+    uint32_t offset = 0, need;
+    ssize_t res;
+    uint8_t *buf;
+    status_t status = S_OK;
+
+    if (client == NULL || client->dead) {
+        return S_SOCKET_ERROR;
+    }
+
+    if (client->rcap - client->rlen < CONTROL_CLIENT_READ_SIZE) {
+        need = client->rlen + CONTROL_CLIENT_READ_SIZE;
+        buf = realloc(client->rbuf, need);
+        if (buf == NULL) {
+            control_client_kill(client);
+            return S_SOCKET_ERROR;
+        }
+        client->rbuf = buf;
+        client->rcap = need;
+    }
+
+    res = recv(fd, client->rbuf + client->rlen, client->rcap - client->rlen, MSG_DONTWAIT);
+    if (res == 0) {
+        control_client_kill(client);
+        return S_SOCKET_EOF;
+    }
+    if (res == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return S_OK;
+        }
+        log_errno_debug("Failed to read from client %d", fd);
+        control_client_kill(client);
+        return S_SOCKET_ERROR;
+    }
+    client->rlen += res;
+
+    while (!client->dead && client->rlen - offset >= sizeof(control_header_length_t)) {
+        memcpy(&len, client->rbuf + offset, sizeof(control_header_length_t));
+        if (len < PACKET_HEADER_SIZE) {
+            log_warning("Client %d sent malformed packet", fd);
+            control_client_kill(client);
+            return S_SOCKET_ERROR;
+        }
+        if (client->rlen - offset < sizeof(control_header_length_t) + len) {
+            break;
+        }
+
+        status = handler(client->rbuf + offset + sizeof(control_header_length_t), len, fd);
+        offset += sizeof(control_header_length_t) + len;
+        if (status != S_OK) {
+            control_client_kill(client);
+            break;
+        }
+    }
+
+    // keep partial packet for next read
+    if (offset) {
+        memmove(client->rbuf, client->rbuf + offset, client->rlen - offset);
+        client->rlen -= offset;
+    }
+
+    return status;
+}
+
+/**
+ * Continues sending queued output when socket is writable.
+ */
+status_t control_client_flush(int fd)
+{
+    struct control_client *client = control_client_get(fd);
+
+    if (client == NULL || client->dead) {
+        return S_SOCKET_ERROR;
+    }
+    if (control_client_send(client) != S_OK) {
+        return S_SOCKET_ERROR;
+    }
+    if (client->wlen == 0) {
+        event_set_writable(fd, EVENT_CLIENT, fd, false);
+    }
+    return S_OK;
+}
+
+/**
+ * Closes connections marked as dead, called after each event batch
+ * so pending events never reference reused fd.
+ */
+void control_client_reap()
+{
+    struct control_client *client;
+    int fd;
+
+    if (!clients_dead) return;
+    clients_dead = false;
+
+    for (fd = 0; fd < clients_size; fd++) {
+        client = clients[fd];
+        if (client == NULL || !client->dead) continue;
+
+        log_debug("Closing client %d", fd);
+        event_remove(fd);
+        control_unsubscribe_client(fd);
+        close(fd);
+        free(client->rbuf);
+        free(client->wbuf);
+        free(client);
+        clients[fd] = NULL;
+    }
+}
+
+void control_client_close(int fd)
+{
+    struct control_client *client = control_client_get(fd);
+    if (client != NULL) {
+        control_client_kill(client);
+    }
+}
+
 status_t control_read_packet(int fd, void *data)
 {
     control_header_length_t len;
@@ -75,18 +409,109 @@ status_t control_read_packet(int fd, void *data)
     return control_communicate(fd, recv, len, data);
 }
 
-static status_t control_write_packet(int fd, control_type_t type, control_header_length_t len, const void *data)
+control_request_id_t control_decode_request_id(void *packet)
+{
+    control_request_id_t id;
+    control_memcpy(&id, ((uint8_t*)packet)+sizeof(control_type_t), sizeof(control_request_id_t));
+    return id;
+}
+
+// position after NUL terminated string, NULL when it does not fit
+static const uint8_t *control_check_string(const uint8_t *p, const uint8_t *end)
+{
+    const uint8_t *nul = p < end ? memchr(p, 0, end - p) : NULL;
+    return nul ? nul + 1 : NULL;
+}
+
+static const uint8_t *control_check_names(const uint8_t *p, const uint8_t *end)
+{
+    uint16_t count;
+
+    if (end - p < (ptrdiff_t)sizeof(uint16_t)) {
+        return NULL;
+    }
+    p += control_memcpy(&count, p, sizeof(uint16_t));
+    while (count-- > 0 && p != NULL) {
+        p = control_check_string(p, end);
+    }
+    return p;
+}
+
+static bool control_check_trace_report(const uint8_t *p, const uint8_t *end)
+{
+    uint16_t count;
+
+    if (end - p < (ptrdiff_t)sizeof(uint16_t)) {
+        return false;
+    }
+    p += control_memcpy(&count, p, sizeof(uint16_t));
+    while (count-- > 0 && p != NULL) {
+        if (end - p < (ptrdiff_t)sizeof(uint32_t)) {
+            return false;
+        }
+        p = control_check_string(p + sizeof(uint32_t), end);
+    }
+    return p != NULL;
+}
+
+/**
+ * Checks that counts and names of packet sent by client fit in its length,
+ * so decoders can not read past it. Unknown packets are left to handler.
+ */
+bool control_packet_valid(void *packet, uint16_t len)
 {
-    uint8_t payload_size = len + sizeof(control_type_t);
-    uint16_t packet_size = sizeof(control_header_length_t) + payload_size;
+    const uint8_t *p = PACKET_FIRST_DATA(packet), *end = (uint8_t*)packet + len;
+
+    if (len < PACKET_HEADER_SIZE) {
+        return false;
+    }
+
+    switch (PACKET_TYPE(packet)) {
+        case PACKET_SET_SERVICE_STATE:
+            return end - p > (ptrdiff_t)sizeof(service_state_t) && control_check_string(p + sizeof(service_state_t), end) != NULL;
+        case PACKET_REQUEST_SERVICE_STATE:
+        case PACKET_SUBSCRIBE_SERVICE_STATE:
+        case PACKET_REQUEST_SERVICE_OUTPUT:
+            return control_check_string(p, end) != NULL;
+        case PACKET_SET_SERVICE_STATES:
+            return end - p > (ptrdiff_t)sizeof(service_state_t) && control_check_names(p + sizeof(service_state_t), end) != NULL;
+        case PACKET_REQUEST_SERVICE_STATES:
+        case PACKET_SUBSCRIBE_SERVICE_STATES:
+            return control_check_names(p, end) != NULL;
+        case PACKET_REQUEST_TRACE:
+            return end - p >= (ptrdiff_t)sizeof(uint64_t);
+        case PACKET_REPORT_TRACE:
+            return control_check_trace_report(p, end);
+        default:
+            return true;
+    }
+}
+
+static status_t control_write_packet(int fd, control_type_t type, control_request_id_t id, size_t len, const void *data)
+{
+    if (len > control_max_data_length - PACKET_HEADER_SIZE) {
+        log_error("Packet %d of %zu bytes is too large", type, len);
+        return S_CONTROL_PACKET_TOO_LARGE;
+    }
+
+    control_header_length_t payload_size = len + PACKET_HEADER_SIZE;
+    uint32_t packet_size = sizeof(control_header_length_t) + payload_size;
     uint8_t buff[packet_size];
     uint8_t *p = buff;
 
     p += control_memcpy(p, &payload_size, sizeof(control_header_length_t));
     p += control_memcpy(p, &type, sizeof(control_type_t));
-    p += control_memcpy(p, data, len);
+    p += control_memcpy(p, &id, sizeof(control_request_id_t));
+    if (len) {
+        p += control_memcpy(p, data, len);
+    }
     
-    log_debug("Writting %d bytes to %d", packet_size, fd);
+    log_debug("Writting %u bytes to %d", packet_size, fd);
+
+    struct control_client *client = control_client_get(fd);
+    if (client != NULL) {
+        return control_client_write(client, buff, packet_size);
+    }
 
     return control_communicate(fd, (ssize_t (*)(int,  void *, size_t,  int))send, packet_size, buff);
 }
@@ -95,17 +520,17 @@ static status_t control_write_packet(int fd, control_type_t type, control_header
  * On success returns S_OK.
  * When failed returns one of S_SOCKET_*, S_CONTROL_* constants.
  */
-status_t control_set_service_state(const char* name, service_state_t state, int fd)
+status_t control_set_service_state(const char* name, service_state_t state, control_request_id_t id, int fd)
 {
     log_debug("sending set_service_state");
     size_t len = strlen(name) + 1 + sizeof(uint8_t);
-    uint8_t buff[control_max_data_length];
+    uint8_t buff[len];
     uint8_t *p = buff;
 
     p += control_memcpy(p, &state, sizeof(service_state_t));
     memcpy(p, name, strlen(name)+1);
 
-    return control_write_packet(fd, PACKET_SET_SERVICE_STATE, len, buff);
+    return control_write_packet(fd, PACKET_SET_SERVICE_STATE, id, len, buff);
 }
 
 void control_decode_set_service_state(void *packet, char **svc_name, service_state_t *state)
@@ -115,16 +540,16 @@ void control_decode_set_service_state(void *packet, char **svc_name, service_sta
     *svc_name = (char*)p;
 }
 
-status_t control_request_service_state(const char* name, int fd)
+status_t control_request_service_state(const char* name, control_request_id_t id, int fd)
 {
     log_debug("sending request_service_state");
-    return control_write_packet(fd, PACKET_REQUEST_SERVICE_STATE, strlen(name) + 1, name);
+    return control_write_packet(fd, PACKET_REQUEST_SERVICE_STATE, id, strlen(name) + 1, name);
 }
 void control_decode_request_service_state(void *packet, char **svc_name)
 {
     *svc_name = (char*)PACKET_FIRST_DATA(packet);
 }
-status_t control_write_service_state(control_response_t response, service_state_t state, int fd)
+status_t control_write_service_state(control_response_t response, service_state_t state, control_request_id_t id, int fd)
 {
     control_header_length_t len = sizeof(control_response_t) + sizeof(service_state_t);
     uint8_t buff[len];
@@ -133,7 +558,7 @@ status_t control_write_service_state(control_response_t response, service_state_
     p += control_memcpy(p, &response, sizeof(control_response_t));
     control_memcpy(p, &state, sizeof(service_state_t));
 
-    return control_write_packet(fd, PACKET_SERVICE_STATE, len, buff);
+    return control_write_packet(fd, PACKET_SERVICE_STATE, id, len, buff);
 }
 void control_decode_service_state(void *packet, control_response_t *response, service_state_t *state)
 {
@@ -143,38 +568,459 @@ void control_decode_service_state(void *packet, control_response_t *response, se
     control_memcpy(state, p, sizeof(service_state_t));
 }
 
-status_t control_subscribe_service_state(const char* name, int fd)
+/**
+ * Name lists are encoded as uint16 count followed by NUL terminated names.
+ */
+static size_t control_names_size(const char **names, uint16_t count)
 {
-    return control_write_packet(fd, PACKET_SUBSCRIBE_SERVICE_STATE, strlen(name) + 1, name);
+    size_t len = sizeof(uint16_t);
+    uint16_t i;
+
+    for (i=0;i<count;i++) {
+        len += strlen(names[i]) + 1;
+    }
+
+    return len;
+}
+
+static uint8_t *control_names_write(uint8_t *p, const char **names, uint16_t count)
+{
+    uint16_t i;
+
+    p += control_memcpy(p, &count, sizeof(uint16_t));
+    for (i=0;i<count;i++) {
+        p += control_memcpy(p, names[i], strlen(names[i]) + 1);
+    }
+
+    return p;
+}
+
+static void control_names_decode(uint8_t *p, uint16_t *count, char **names)
+{
+    p += control_memcpy(count, p, sizeof(uint16_t));
+    *names = (char*)p;
+}
+
+/**
+ * Sets state of every listed service, answered with PACKET_SERVICE_STATES.
+ */
+status_t control_set_service_states(const char **names, uint16_t count, service_state_t state, control_request_id_t id, int fd)
+{
+    size_t len = sizeof(service_state_t) + control_names_size(names, count);
+    if (len > control_max_data_length) {
+        return S_CONTROL_PACKET_TOO_LARGE;
+    }
+
+    uint8_t buff[len];
+    uint8_t *p = buff;
+
+    p += control_memcpy(p, &state, sizeof(service_state_t));
+    control_names_write(p, names, count);
+
+    return control_write_packet(fd, PACKET_SET_SERVICE_STATES, id, len, buff);
+}
+void control_decode_set_service_states(void *packet, service_state_t *state, uint16_t *count, char **names)
+{
+    uint8_t *p = PACKET_FIRST_DATA(packet);
+
+    p += control_memcpy(state, p, sizeof(service_state_t));
+    control_names_decode(p, count, names);
+}
+
+/**
+ * Requests state of listed services, zero count requests all services.
+ */
+status_t control_request_service_states(const char **names, uint16_t count, control_request_id_t id, int fd)
+{
+    size_t len = control_names_size(names, count);
+    if (len > control_max_data_length) {
+        return S_CONTROL_PACKET_TOO_LARGE;
+    }
+
+    uint8_t buff[len];
+    control_names_write(buff, names, count);
+
+    return control_write_packet(fd, PACKET_REQUEST_SERVICE_STATES, id, len, buff);
+}
+void control_decode_request_service_states(void *packet, uint16_t *count, char **names)
+{
+    control_names_decode(PACKET_FIRST_DATA(packet), count, names);
+}
+
+/**
+ * Entries are encoded as state followed by NUL terminated name,
+ * unknown services are reported with state 0.
+ */
+status_t control_write_service_states(control_response_t response, const struct control_service_state *states, uint16_t count, control_request_id_t id, int fd)
+{
+    size_t len = sizeof(control_response_t) + sizeof(uint16_t);
+    uint16_t i;
+
+    for (i=0;i<count;i++) {
+        len += sizeof(service_state_t) + strlen(states[i].name) + 1;
+    }
+    if (len > control_max_data_length) {
+        return S_CONTROL_PACKET_TOO_LARGE;
+    }
+
+    uint8_t buff[len];
+    uint8_t *p = buff;
+
+    p += control_memcpy(p, &response, sizeof(control_response_t));
+    p += control_memcpy(p, &count, sizeof(uint16_t));
+    for (i=0;i<count;i++) {
+        p += control_memcpy(p, &states[i].state, sizeof(service_state_t));
+        p += control_memcpy(p, states[i].name, strlen(states[i].name) + 1);
+    }
+
+    return control_write_packet(fd, PACKET_SERVICE_STATES, id, len, buff);
+}
+void control_decode_service_states(void *packet, control_response_t *response, uint16_t *count, uint8_t **entries)
+{
+    uint8_t *p = PACKET_FIRST_DATA(packet);
+
+    p += control_memcpy(response, p, sizeof(control_response_t));
+    p += control_memcpy(count, p, sizeof(uint16_t));
+    *entries = p;
+}
+void control_next_service_state(uint8_t **entries, service_state_t *state, char **name)
+{
+    uint8_t *p = *entries;
+
+    p += control_memcpy(state, p, sizeof(service_state_t));
+    *name = (char*)p;
+    *entries = p + strlen(*name) + 1;
+}
+
+status_t control_request_metrics(control_request_id_t id, int fd)
+{
+    return control_write_packet(fd, PACKET_REQUEST_METRICS, id, 0, NULL);
+}
+
+// fixed part of each metrics entry, followed by NUL terminated name
+#define CONTROL_METRICS_ENTRY_SIZE (sizeof(uint8_t) + sizeof(uint32_t) * 4 + sizeof(int16_t) + sizeof(uint64_t) * 4)
+
+/**
+ * Entries are encoded as fixed size counters followed by NUL terminated name.
+ */
+status_t control_write_metrics(control_response_t response, const struct service_metrics *metrics, uint16_t count, uint64_t log_dropped, control_request_id_t id, int fd)
+{
+    size_t len = sizeof(control_response_t) + sizeof(uint64_t) + sizeof(uint16_t);
+    const struct service_metrics *m;
+    status_t status;
+    uint8_t *buff, *p;
+    uint16_t i;
+
+    for (i=0;i<count;i++) {
+        len += CONTROL_METRICS_ENTRY_SIZE + strlen(metrics[i].name) + 1;
+    }
+    if (len > control_max_data_length) {
+        return S_CONTROL_PACKET_TOO_LARGE;
+    }
+
+    p = buff = malloc(len);
+    p += control_memcpy(p, &response, sizeof(control_response_t));
+    p += control_memcpy(p, &log_dropped, sizeof(uint64_t));
+    p += control_memcpy(p, &count, sizeof(uint16_t));
+    for (i=0;i<count;i++) {
+        m = &metrics[i];
+        p += control_memcpy(p, &m->state, sizeof(uint8_t));
+        p += control_memcpy(p, &m->starts, sizeof(uint32_t));
+        p += control_memcpy(p, &m->restarts, sizeof(uint32_t));
+        p += control_memcpy(p, &m->last_exit, sizeof(int16_t));
+        p += control_memcpy(p, &m->uptime, sizeof(uint32_t));
+        p += control_memcpy(p, &m->ready_time, sizeof(uint32_t));
+        p += control_memcpy(p, &m->cpu_ms, sizeof(uint64_t));
+        p += control_memcpy(p, &m->rss, sizeof(uint64_t));
+        p += control_memcpy(p, &m->output_bytes, sizeof(uint64_t));
+        p += control_memcpy(p, &m->output_dropped, sizeof(uint64_t));
+        p += control_memcpy(p, m->name, strlen(m->name) + 1);
+    }
+
+    status = control_write_packet(fd, PACKET_METRICS, id, len, buff);
+    free(buff);
+    return status;
+}
+void control_decode_metrics(void *packet, control_response_t *response, uint16_t *count, uint64_t *log_dropped, uint8_t **entries)
+{
+    uint8_t *p = PACKET_FIRST_DATA(packet);
+
+    p += control_memcpy(response, p, sizeof(control_response_t));
+    p += control_memcpy(log_dropped, p, sizeof(uint64_t));
+    p += control_memcpy(count, p, sizeof(uint16_t));
+    *entries = p;
+}
+void control_next_metrics(uint8_t **entries, struct service_metrics *m)
+{
+    uint8_t *p = *entries;
+
+    p += control_memcpy(&m->state, p, sizeof(uint8_t));
+    p += control_memcpy(&m->starts, p, sizeof(uint32_t));
+    p += control_memcpy(&m->restarts, p, sizeof(uint32_t));
+    p += control_memcpy(&m->last_exit, p, sizeof(int16_t));
+    p += control_memcpy(&m->uptime, p, sizeof(uint32_t));
+    p += control_memcpy(&m->ready_time, p, sizeof(uint32_t));
+    p += control_memcpy(&m->cpu_ms, p, sizeof(uint64_t));
+    p += control_memcpy(&m->rss, p, sizeof(uint64_t));
+    p += control_memcpy(&m->output_bytes, p, sizeof(uint64_t));
+    p += control_memcpy(&m->output_dropped, p, sizeof(uint64_t));
+    m->name = (char*)p;
+    *entries = p + strlen(m->name) + 1;
+}
+
+status_t control_request_trace(uint64_t since, control_request_id_t id, int fd)
+{
+    return control_write_packet(fd, PACKET_REQUEST_TRACE, id, sizeof(uint64_t), &since);
+}
+void control_decode_request_trace(void *packet, uint64_t *since)
+{
+    control_memcpy(since, PACKET_FIRST_DATA(packet), sizeof(uint64_t));
+}
+
+// fixed part of each trace entry, followed by NUL terminated name
+#define CONTROL_TRACE_ENTRY_SIZE (sizeof(uint64_t) * 2 + sizeof(uint32_t) + sizeof(char))
+
+/**
+ * Next is sequence number to request following events with.
+ */
+status_t control_write_trace(control_response_t response, const struct trace_event *events, uint16_t count, uint64_t next, control_request_id_t id, int fd)
+{
+    size_t len = sizeof(control_response_t) + sizeof(uint64_t) + sizeof(uint16_t);
+    const struct trace_event *ev;
+    status_t status;
+    uint8_t *buff, *p;
+    uint16_t i;
+
+    for (i=0;i<count;i++) {
+        len += CONTROL_TRACE_ENTRY_SIZE + strlen(events[i].name) + 1;
+    }
+    if (len > control_max_data_length) {
+        return S_CONTROL_PACKET_TOO_LARGE;
+    }
+
+    p = buff = malloc(len);
+    p += control_memcpy(p, &response, sizeof(control_response_t));
+    p += control_memcpy(p, &next, sizeof(uint64_t));
+    p += control_memcpy(p, &count, sizeof(uint16_t));
+    for (i=0;i<count;i++) {
+        ev = &events[i];
+        p += control_memcpy(p, &ev->ts, sizeof(uint64_t));
+        p += control_memcpy(p, &ev->dur, sizeof(uint64_t));
+        p += control_memcpy(p, &ev->track, sizeof(uint32_t));
+        p += control_memcpy(p, &ev->phase, sizeof(char));
+        p += control_memcpy(p, ev->name, strlen(ev->name) + 1);
+    }
+
+    status = control_write_packet(fd, PACKET_TRACE, id, len, buff);
+    free(buff);
+    return status;
+}
+void control_decode_trace(void *packet, control_response_t *response, uint16_t *count, uint64_t *next, uint8_t **entries)
+{
+    uint8_t *p = PACKET_FIRST_DATA(packet);
+
+    p += control_memcpy(response, p, sizeof(control_response_t));
+    p += control_memcpy(next, p, sizeof(uint64_t));
+    p += control_memcpy(count, p, sizeof(uint16_t));
+    *entries = p;
+}
+void control_next_trace(uint8_t **entries, struct trace_event *ev)
+{
+    uint8_t *p = *entries;
+
+    p += control_memcpy(&ev->ts, p, sizeof(uint64_t));
+    p += control_memcpy(&ev->dur, p, sizeof(uint64_t));
+    p += control_memcpy(&ev->track, p, sizeof(uint32_t));
+    p += control_memcpy(&ev->phase, p, sizeof(char));
+    snprintf(ev->name, TRACE_NAME_SIZE, "%s", (char*)p);
+    *entries = p + strlen((char*)p) + 1;
+}
+
+/**
+ * Durations in us of consecutive phases which just ended, in order.
+ */
+status_t control_report_trace(const char **names, const uint32_t *durations, uint16_t count, control_request_id_t id, int fd)
+{
+    size_t len = sizeof(uint16_t);
+    status_t status;
+    uint8_t *buff, *p;
+    uint16_t i;
+
+    for (i=0;i<count;i++) {
+        len += sizeof(uint32_t) + strlen(names[i]) + 1;
+    }
+    if (len > control_max_data_length) {
+        return S_CONTROL_PACKET_TOO_LARGE;
+    }
+
+    p = buff = malloc(len);
+    p += control_memcpy(p, &count, sizeof(uint16_t));
+    for (i=0;i<count;i++) {
+        p += control_memcpy(p, &durations[i], sizeof(uint32_t));
+        p += control_memcpy(p, names[i], strlen(names[i]) + 1);
+    }
+
+    status = control_write_packet(fd, PACKET_REPORT_TRACE, id, len, buff);
+    free(buff);
+    return status;
+}
+void control_decode_report_trace(void *packet, uint16_t *count, uint8_t **entries)
+{
+    uint8_t *p = PACKET_FIRST_DATA(packet);
+
+    p += control_memcpy(count, p, sizeof(uint16_t));
+    *entries = p;
+}
+void control_next_report_trace(uint8_t **entries, char **name, uint32_t *duration)
+{
+    uint8_t *p = *entries;
+
+    p += control_memcpy(duration, p, sizeof(uint32_t));
+    *name = (char*)p;
+    *entries = p + strlen(*name) + 1;
+}
+
+status_t control_subscribe_service_state(const char* name, control_request_id_t id, int fd)
+{
+    return control_write_packet(fd, PACKET_SUBSCRIBE_SERVICE_STATE, id, strlen(name) + 1, name);
 }
 void control_decode_subscribe_service_state(void *packet, char **svc_name)
 {
     control_decode_request_service_state(packet, svc_name);
 }
 
-status_t control_write_response(control_response_t response, int fd)
+/**
+ * Updates are sent as PACKET_SERVICE_STATES with changed services only.
+ */
+status_t control_subscribe_all_services(control_request_id_t id, int fd)
 {
-    return control_write_packet(fd, PACKET_COMMAND_RESPONSE, sizeof(control_response_t), &response);
+    return control_write_packet(fd, PACKET_SUBSCRIBE_ALL_SERVICES, id, 0, NULL);
+}
+
+/**
+ * Subscribes to multiple services with single request id, current states
+ * are sent as PACKET_SERVICE_STATES and updates carry service name.
+ */
+status_t control_subscribe_service_states(const char **names, uint16_t count, control_request_id_t id, int fd)
+{
+    size_t len = control_names_size(names, count);
+    if (len > control_max_data_length) {
+        return S_CONTROL_PACKET_TOO_LARGE;
+    }
+
+    uint8_t buff[len];
+    control_names_write(buff, names, count);
+
+    return control_write_packet(fd, PACKET_SUBSCRIBE_SERVICE_STATES, id, len, buff);
+}
+void control_decode_subscribe_service_states(void *packet, uint16_t *count, char **names)
+{
+    control_names_decode(PACKET_FIRST_DATA(packet), count, names);
+}
+
+status_t control_subscribe_init_state(control_request_id_t id, int fd)
+{
+    return control_write_packet(fd, PACKET_SUBSCRIBE_INIT_STATE, id, 0, NULL);
+}
+
+/**
+ * Cancels subscription made with given request id.
+ */
+status_t control_unsubscribe(control_request_id_t id, int fd)
+{
+    return control_write_packet(fd, PACKET_UNSUBSCRIBE, id, 0, NULL);
+}
+
+status_t control_request_service_output(const char* name, control_request_id_t id, int fd)
+{
+    return control_write_packet(fd, PACKET_REQUEST_SERVICE_OUTPUT, id, strlen(name) + 1, name);
+}
+void control_decode_request_service_output(void *packet, char **svc_name)
+{
+    control_decode_request_service_state(packet, svc_name);
+}
+
+/**
+ * Sends last captured output of service, len is limited by packet size.
+ */
+status_t control_write_service_output(control_response_t response, const void *data, uint16_t len, control_request_id_t id, int fd)
+{
+    const uint16_t max = control_max_data_length - sizeof(control_response_t) - sizeof(uint16_t);
+    uint16_t data_len = len > max ? max : len;
+    uint8_t *buff = malloc(sizeof(control_response_t) + sizeof(uint16_t) + data_len);
+    uint8_t *p = buff;
+    status_t status;
+
+    p += control_memcpy(p, &response, sizeof(control_response_t));
+    p += control_memcpy(p, &data_len, sizeof(uint16_t));
+    p += control_memcpy(p, (const uint8_t*)data + (len - data_len), data_len);
+
+    status = control_write_packet(fd, PACKET_SERVICE_OUTPUT, id, p - buff, buff);
+    free(buff);
+    return status;
+}
+void control_decode_service_output(void *packet, control_response_t *response, uint16_t *len, uint8_t **data)
+{
+    uint8_t *p = PACKET_FIRST_DATA(packet);
+
+    p += control_memcpy(response, p, sizeof(control_response_t));
+    p += control_memcpy(len, p, sizeof(uint16_t));
+    *data = p;
+}
+
+status_t control_write_response(control_response_t response, control_request_id_t id, int fd)
+{
+    return control_write_packet(fd, PACKET_COMMAND_RESPONSE, id, sizeof(control_response_t), &response);
 }
 void control_decode_response(void *packet, control_response_t *response)
 {
     control_memcpy(response, PACKET_FIRST_DATA(packet), sizeof(control_response_t));
 }
-status_t control_request_init_state(int fd)
+status_t control_request_init_state(control_request_id_t id, int fd)
 {
-    return control_write_packet(fd, PACKET_REQUEST_INIT_STATE, 0, NULL);
+    return control_write_packet(fd, PACKET_REQUEST_INIT_STATE, id, 0, NULL);
 }
 
-status_t control_write_init_state(uint8_t state, int fd)
+status_t control_write_init_state(uint8_t state, control_request_id_t id, int fd)
 {
-    return control_write_packet(fd, PACKET_INIT_STATE, sizeof(uint8_t), &state);
+    return control_write_packet(fd, PACKET_INIT_STATE, id, sizeof(uint8_t), &state);
 }
 void control_decode_init_state(void *packet, uint8_t *state)
 {
     control_memcpy(state, PACKET_FIRST_DATA(packet), sizeof(uint8_t));
 }
 
+status_t control_request_health(control_request_id_t id, int fd)
+{
+    return control_write_packet(fd, PACKET_REQUEST_HEALTH, id, 0, NULL);
+}
 
+/**
+ * Sends cached health state, age of oldest result in seconds
+ * and name of first failed check (or empty string).
+ */
+status_t control_write_health(uint8_t state, uint32_t age, const char *failed, control_request_id_t id, int fd)
+{
+    size_t name_len = strnlen(failed, 255);
+    control_header_length_t len = sizeof(uint8_t) + sizeof(uint32_t) + name_len + 1;
+    uint8_t buff[len];
+    uint8_t *p = buff;
+
+    p += control_memcpy(p, &state, sizeof(uint8_t));
+    p += control_memcpy(p, &age, sizeof(uint32_t));
+    p += control_memcpy(p, failed, name_len);
+    *p = 0;
+
+    return control_write_packet(fd, PACKET_HEALTH, id, len, buff);
+}
+void control_decode_health(void *packet, uint8_t *state, uint32_t *age, char **failed)
+{
+    uint8_t *p = PACKET_FIRST_DATA(packet);
+
+    p += control_memcpy(state, p, sizeof(uint8_t));
+    p += control_memcpy(age, p, sizeof(uint32_t));
+    *failed = (char*)p;
+}
 status_t control_connect(int* fd)
 {
     struct sockaddr_un saddr;
@@ -195,7 +1041,7 @@ status_t MOCKABLE(control_listen)(int* fd, uint8_t backlog)
 {
     struct sockaddr_un saddr_server;
 
-    int fd_control = socket(AF_UNIX, SOCK_STREAM, 0);
+    int fd_control = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (fd_control == -1) {
         return S_SOCKET_ERROR;
         // fatal_errno("Failed to create control socket", ERROR_SOCKET_FAILED);
@@ -218,43 +1064,373 @@ status_t MOCKABLE(control_listen)(int* fd, uint8_t backlog)
     return S_OK;
 }
 
-bool control_subscribe_client(int fd, struct service *svc)
+static struct control_watch *control_watch_get(uint16_t svc_id)
 {
-    log_debug("Subscribing client %d to %s", fd, svc->name);
-    uint8_t i;
-    for (i=0;i<MAX_SUBSCRIBED_CLIENTS;i++) {
-        if (subscribed_clients[i].svc == NULL) {
-            subscribed_clients[i].svc = svc;
-            subscribed_clients[i].client_fd = fd;
-            return control_write_service_state(CMD_RESPONSE_OK, svc->state, subscribed_clients[i].client_fd) == S_OK;
+    struct control_watch *resized;
+    uint16_t size = watches_size ? watches_size : 16;
+
+    if (svc_id >= watches_size) {
+        while (size <= svc_id) size *= 2;
+        resized = realloc(watches, size * sizeof(struct control_watch));
+        if (resized == NULL) {
+            return NULL;
         }
+        memset(resized + watches_size, 0, (size - watches_size) * sizeof(struct control_watch));
+        watches = resized;
+        watches_size = size;
     }
-    return false;
+
+    return &watches[svc_id];
 }
 
-void control_unsubscribe_client(int fd)
+static bool control_subscribers_add(struct control_subscribers *list, int fd, control_request_id_t id)
 {
-    uint8_t i;
-    bool found = false;
+    struct control_subscriber *resized;
 
-    for (i=0;i<MAX_SUBSCRIBED_CLIENTS;i++) {
-        if (subscribed_clients[i].client_fd == fd) {
-            subscribed_clients[i].svc = NULL;
-            subscribed_clients[i].client_fd = 0;
-            found = true;
+    if (list->count == list->size) {
+        resized = realloc(list->items, (list->size ? list->size * 2 : 4) * sizeof(struct control_subscriber));
+        if (resized == NULL) {
+            return false;
         }
+        list->items = resized;
+        list->size = list->size ? list->size * 2 : 4;
     }
-    if (found) {
+
+    list->items[list->count].fd = fd;
+    list->items[list->count].id = id;
+    list->items[list->count].named = false;
+    list->count++;
+    return true;
+}
+
+/**
+ * Removes subscriptions of fd, only the one made with given request id
+ * when one_id is set. Returns number of removed subscriptions.
+ */
+static uint32_t control_subscribers_remove(struct control_subscribers *list, int fd, bool one_id, control_request_id_t id)
+{
+    uint32_t i = 0, removed = 0;
+
+    while (i < list->count) {
+        if (list->items[i].fd == fd && (!one_id || list->items[i].id == id)) {
+            list->items[i] = list->items[--list->count];
+            removed++;
+        } else {
+            i++;
+        }
+    }
+
+    return removed;
+}
+
+static uint32_t control_unsubscribe_all_lists(int fd, bool one_id, control_request_id_t id)
+{
+    uint32_t removed;
+    uint16_t i;
+
+    removed = control_subscribers_remove(&all_subscribers, fd, one_id, id);
+    removed += control_subscribers_remove(&init_subscribers, fd, one_id, id);
+    for (i=0;i<watches_size;i++) {
+        removed += control_subscribers_remove(&watches[i].subscribers, fd, one_id, id);
+    }
+
+    return removed;
+}
+
+bool control_subscribe_client(int fd, struct service *svc, control_request_id_t id)
+{
+    struct control_watch *watch = control_watch_get(svc->id);
+
+    log_debug("Subscribing client %d to %s", fd, svc->name);
+
+    if (watch == NULL || !control_subscribers_add(&watch->subscribers, fd, id)) {
+        return false;
+    }
+    return control_write_service_state(CMD_RESPONSE_OK, svc->state, id, fd) == S_OK;
+}
+
+/**
+ * Adds service to subscription shared by multiple services, caller sends
+ * current states. Updates are sent as PACKET_SERVICE_STATES with single entry.
+ */
+bool control_subscribe_client_named(int fd, struct service *svc, control_request_id_t id)
+{
+    struct control_watch *watch = control_watch_get(svc->id);
+
+    if (watch == NULL || !control_subscribers_add(&watch->subscribers, fd, id)) {
+        return false;
+    }
+    watch->subscribers.items[watch->subscribers.count - 1].named = true;
+    return true;
+}
+
+/**
+ * Subscribes to changes of all services, current states are sent right away.
+ */
+bool control_subscribe_client_all(int fd, control_request_id_t id)
+{
+    struct control_service_state *states;
+    struct service *svc;
+    uint16_t count = 0;
+    status_t status;
+
+    log_debug("Subscribing client %d to all services", fd);
+
+    while (service_get(count) != NULL) count++;
+    states = calloc(count ? count : 1, sizeof(struct control_service_state));
+    if (states == NULL) {
+        return false;
+    }
+    for (count=0;(svc = service_get(count)) != NULL;count++) {
+        states[count].name = svc->name;
+        states[count].state = svc->state;
+    }
+
+    status = control_write_service_states(CMD_RESPONSE_OK, states, count, id, fd);
+    free(states);
+
+    return status == S_OK && control_subscribers_add(&all_subscribers, fd, id);
+}
+
+bool control_subscribe_client_init(int fd, control_request_id_t id, uint8_t state)
+{
+    log_debug("Subscribing client %d to init state", fd);
+
+    if (!control_subscribers_add(&init_subscribers, fd, id)) {
+        return false;
+    }
+    return control_write_init_state(state, id, fd) == S_OK;
+}
+
+void control_unsubscribe_client(int fd)
+{
+    if (control_unsubscribe_all_lists(fd, false, 0) > 0) {
         log_debug("Unsubscribed client %d", fd);
     }
 }
 
+bool control_unsubscribe_client_request(int fd, control_request_id_t id)
+{
+    if (control_unsubscribe_all_lists(fd, true, id) > 0) {
+        log_debug("Unsubscribed client %d from request %d", fd, id);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Marks service as changed, subscribers are notified on control_dispatch_flush
+ * so multiple transitions in one loop iteration are sent as single update.
+ */
 void control_dispatch_service_state_change(struct service *svc)
 {
-    uint8_t i;
-    for (i=0;i<MAX_SUBSCRIBED_CLIENTS;i++) {
-        if (subscribed_clients[i].svc == svc) {
-            control_write_service_state(CMD_RESPONSE_OK, svc->state, subscribed_clients[i].client_fd);
+    struct control_watch *watch = control_watch_get(svc->id);
+    uint16_t *resized;
+
+    facts_changed();
+    if (watch == NULL || watch->dirty) return;
+    if (watch->subscribers.count == 0 && all_subscribers.count == 0) return;
+
+    if (dirty_count == dirty_size) {
+        resized = realloc(dirty_ids, (dirty_size ? dirty_size * 2 : 16) * sizeof(uint16_t));
+        if (resized == NULL) {
+            log_error("Could not queue state change of %s", svc->name);
+            return;
+        }
+        dirty_ids = resized;
+        dirty_size = dirty_size ? dirty_size * 2 : 16;
+    }
+
+    dirty_ids[dirty_count++] = svc->id;
+    watch->dirty = true;
+}
+
+void control_dispatch_init_state_change(uint8_t state)
+{
+    init_state = state;
+    init_dirty = init_subscribers.count > 0;
+    facts_changed();
+}
+
+/**
+ * Sends queued state changes, called once per event loop iteration.
+ */
+void control_dispatch_flush()
+{
+    struct control_service_state *states = NULL;
+    struct control_subscribers *list;
+    struct service *svc;
+    uint16_t i, count = 0;
+    uint32_t j;
+
+    if (dirty_count && all_subscribers.count) {
+        states = calloc(dirty_count, sizeof(struct control_service_state));
+    }
+
+    for (i=0;i<dirty_count;i++) {
+        watches[dirty_ids[i]].dirty = false;
+        svc = service_get(dirty_ids[i]);
+        if (svc == NULL) continue;
+
+        list = &watches[dirty_ids[i]].subscribers;
+        for (j=0;j<list->count;j++) {
+            if (list->items[j].named) {
+                struct control_service_state entry = { svc->name, svc->state };
+                control_write_service_states(CMD_RESPONSE_OK, &entry, 1, list->items[j].id, list->items[j].fd);
+            } else {
+                control_write_service_state(CMD_RESPONSE_OK, svc->state, list->items[j].id, list->items[j].fd);
+            }
+        }
+
+        if (states != NULL) {
+            states[count].name = svc->name;
+            states[count].state = svc->state;
+            count++;
+        }
+    }
+    dirty_count = 0;
+
+    if (states != NULL) {
+        for (j=0;j<all_subscribers.count;j++) {
+            control_write_service_states(CMD_RESPONSE_OK, states, count, all_subscribers.items[j].id, all_subscribers.items[j].fd);
+        }
+        free(states);
+    }
+
+    if (init_dirty) {
+        init_dirty = false;
+        for (j=0;j<init_subscribers.count;j++) {
+            control_write_init_state(init_state, init_subscribers.items[j].id, init_subscribers.items[j].fd);
+        }
+    }
+}
+
+static void control_snapshot_save_subscribers(struct snapshot *s, const struct control_subscribers *list)
+{
+    uint32_t i;
+
+    SNAPSHOT_PUT(s, list->count);
+    for (i=0; i<list->count; i++) {
+        SNAPSHOT_PUT(s, list->items[i].fd);
+        SNAPSHOT_PUT(s, list->items[i].id);
+        SNAPSHOT_PUT(s, list->items[i].named);
+    }
+}
+
+static bool control_snapshot_restore_subscribers(struct snapshot *s, struct control_subscribers *list)
+{
+    struct control_subscriber sub;
+    uint32_t i, count;
+
+    SNAPSHOT_GET(s, count);
+    for (i=0; i<count && !s->failed; i++) {
+        SNAPSHOT_GET(s, sub.fd);
+        SNAPSHOT_GET(s, sub.id);
+        SNAPSHOT_GET(s, sub.named);
+        if (!s->failed && control_subscribers_add(list, sub.fd, sub.id)) {
+            list->items[list->count - 1].named = sub.named;
+        }
+    }
+    return !s->failed;
+}
+
+/**
+ * Saves connected clients with their buffered data and subscriptions,
+ * so clients waiting for state changes do not notice re-exec.
+ * Pending updates are expected to be flushed already.
+ */
+void control_snapshot_save(struct snapshot *s)
+{
+    struct control_client *client;
+    struct service *svc;
+    uint32_t first;
+    uint16_t i, count = 0;
+    int fd;
+
+    for (fd = 0; fd < clients_size; fd++) {
+        if (clients[fd] != NULL && !clients[fd]->dead) count++;
+    }
+    SNAPSHOT_PUT(s, count);
+    for (fd = 0; fd < clients_size; fd++) {
+        client = clients[fd];
+        if (client == NULL || client->dead) continue;
+
+        snapshot_put_fd(s, fd);
+        SNAPSHOT_PUT(s, client->rlen);
+        snapshot_put(s, client->rbuf, client->rlen);
+        // ring is written unwrapped
+        first = client->wcap - client->whead;
+        if (first > client->wlen) first = client->wlen;
+        SNAPSHOT_PUT(s, client->wlen);
+        snapshot_put(s, client->wbuf + client->whead, first);
+        snapshot_put(s, client->wbuf, client->wlen - first);
+    }
+
+    control_snapshot_save_subscribers(s, &all_subscribers);
+    control_snapshot_save_subscribers(s, &init_subscribers);
+
+    count = 0;
+    for (i=0; i<watches_size; i++) {
+        if (watches[i].subscribers.count > 0 && service_get(i) != NULL) count++;
+    }
+    SNAPSHOT_PUT(s, count);
+    for (i=0; i<watches_size; i++) {
+        if (watches[i].subscribers.count == 0 || (svc = service_get(i)) == NULL) continue;
+        snapshot_put_string(s, svc->name);
+        control_snapshot_save_subscribers(s, &watches[i].subscribers);
+    }
+}
+
+/**
+ * Restores clients after services, as watches are matched by service name.
+ */
+status_t control_snapshot_restore(struct snapshot *s)
+{
+    struct control_client *client;
+    struct control_subscribers ignored = { 0 };
+    struct control_watch *watch;
+    struct service *svc;
+    const void *data;
+    const char *name;
+    uint16_t i, count;
+    uint32_t len;
+    int fd;
+
+    SNAPSHOT_GET(s, count);
+    for (i=0; i<count && !s->failed; i++) {
+        fd = snapshot_get_fd(s);
+        if (fd == -1 || control_client_add(fd) != S_OK) {
+            return S_SNAPSHOT_ERROR;
         }
+        client = clients[fd];
+
+        SNAPSHOT_GET(s, len);
+        data = snapshot_get_data(s, len);
+        if (data != NULL && len > 0 && (client->rbuf = malloc(len)) != NULL) {
+            memcpy(client->rbuf, data, len);
+            client->rlen = client->rcap = len;
+        }
+        SNAPSHOT_GET(s, len);
+        data = snapshot_get_data(s, len);
+        if (data != NULL && len > 0 && control_client_write(client, data, len) != S_OK) {
+            log_warning("Could not restore output of client %d", fd);
+        }
+    }
+
+    if (!control_snapshot_restore_subscribers(s, &all_subscribers)
+            || !control_snapshot_restore_subscribers(s, &init_subscribers)) {
+        return S_SNAPSHOT_ERROR;
     }
+
+    SNAPSHOT_GET(s, count);
+    for (i=0; i<count && !s->failed; i++) {
+        name = snapshot_get_string(s);
+        svc = name != NULL ? service_find_by_name(name) : NULL;
+        watch = svc != NULL ? control_watch_get(svc->id) : NULL;
+        // service is gone, subscription is dropped
+        control_snapshot_restore_subscribers(s, watch != NULL ? &watch->subscribers : &ignored);
+    }
+    free(ignored.items);
+
+    return s->failed ? S_SNAPSHOT_ERROR : S_OK;
 }
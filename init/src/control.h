@@ -3,6 +3,9 @@
 
 #include "status.h"
 #include "service.h"
+#include "metrics.h"
+#include "snapshot.h"
+#include "trace.h"
 
 #define PACKET_SET_SERVICE_STATE 1
 #define PACKET_COMMAND_RESPONSE 2
@@ -11,12 +14,35 @@
 #define PACKET_SERVICE_STATE 5
 #define PACKET_REQUEST_INIT_STATE 6
 #define PACKET_INIT_STATE 7
+#define PACKET_REQUEST_HEALTH 8
+#define PACKET_HEALTH 9
+#define PACKET_REQUEST_SERVICE_STATES 10
+#define PACKET_SERVICE_STATES 11
+#define PACKET_SET_SERVICE_STATES 12
+#define PACKET_UNSUBSCRIBE 13
+#define PACKET_SUBSCRIBE_ALL_SERVICES 14
+#define PACKET_SUBSCRIBE_INIT_STATE 15
+#define PACKET_REQUEST_SERVICE_OUTPUT 16
+#define PACKET_SERVICE_OUTPUT 17
+#define PACKET_SUBSCRIBE_SERVICE_STATES 18
+#define PACKET_REQUEST_METRICS 19
+#define PACKET_METRICS 20
+#define PACKET_REQUEST_TRACE 21
+#define PACKET_TRACE 22
+#define PACKET_REPORT_TRACE 23
 
 #define CMD_RESPONSE_ERROR 0
 #define CMD_RESPONSE_OK 1
 #define CMD_RESPONSE_FAILED 2
 
-extern const uint8_t control_max_data_length;
+/*
+ * Packet layout (host byte order):
+ *   uint16 length of following bytes
+ *   uint8  type
+ *   uint16 request id, echoed in responses and subscription updates
+ *   data
+ */
+extern const uint16_t control_max_data_length;
 
 // typedef uint8_t control_command_type_t;
 // typedef struct control_command_t {
@@ -26,6 +52,12 @@ extern const uint8_t control_max_data_length;
 
 typedef uint8_t control_response_t;
 typedef uint8_t control_type_t;
+typedef uint16_t control_request_id_t;
+
+struct control_service_state {
+    const char *name;
+    service_state_t state;
+};
 
 // status_t control_read_command(int fd, control_command_t *msg);
 status_t control_connect(int* fd);
@@ -34,32 +66,91 @@ status_t control_listen(int *fd, uint8_t backlog);
 // status_t control_write_command(const char* name, control_command_type_t type, int fd);
 // status_t control_write_response(control_reponse_t response, uint8_t payload, int fd);
 
-bool control_subscribe_client(int fd, struct service *svc);
+// len covers type, request id and data of packet
+typedef status_t (*control_packet_handler_t)(void *packet, uint16_t len, int fd);
+
+status_t control_client_add(int fd);
+status_t control_client_read(int fd, control_packet_handler_t handler);
+status_t control_client_flush(int fd);
+void control_client_close(int fd);
+void control_client_reap();
+
+bool control_subscribe_client(int fd, struct service *svc, control_request_id_t id);
+bool control_subscribe_client_all(int fd, control_request_id_t id);
+bool control_subscribe_client_named(int fd, struct service *svc, control_request_id_t id);
+bool control_subscribe_client_init(int fd, control_request_id_t id, uint8_t state);
 void control_unsubscribe_client(int fd);
+bool control_unsubscribe_client_request(int fd, control_request_id_t id);
 void control_dispatch_service_state_change(struct service *svc);
+void control_dispatch_init_state_change(uint8_t state);
+void control_dispatch_flush();
+
+void control_snapshot_save(struct snapshot *s);
+status_t control_snapshot_restore(struct snapshot *s);
 
 status_t control_read_packet(int fd, void *data);
+control_request_id_t control_decode_request_id(void *packet);
+bool control_packet_valid(void *packet, uint16_t len);
 
-status_t control_set_service_state(const char* name, service_state_t type, int fd);
+status_t control_set_service_state(const char* name, service_state_t type, control_request_id_t id, int fd);
 void control_decode_set_service_state(void *packet, char **svc_name, service_state_t *state);
 
-status_t control_request_service_state(const char* name, int fd);
+status_t control_request_service_state(const char* name, control_request_id_t id, int fd);
 void control_decode_request_service_state(void *packet, char **svc_name);
 
-status_t control_write_response(control_response_t response, int fd);
+status_t control_write_response(control_response_t response, control_request_id_t id, int fd);
 void control_decode_response(void *packet, control_response_t *response);
 
-status_t control_write_service_state(control_response_t response, service_state_t state, int fd);
+status_t control_write_service_state(control_response_t response, service_state_t state, control_request_id_t id, int fd);
 void control_decode_service_state(void *packet, control_response_t *response, service_state_t *state);
 
-status_t control_subscribe_service_state(const char* name, int fd);
-void control_decode_subscribe_service_state(void *packet, char **svc_name);
+status_t control_set_service_states(const char **names, uint16_t count, service_state_t state, control_request_id_t id, int fd);
+void control_decode_set_service_states(void *packet, service_state_t *state, uint16_t *count, char **names);
+
+status_t control_request_service_states(const char **names, uint16_t count, control_request_id_t id, int fd);
+void control_decode_request_service_states(void *packet, uint16_t *count, char **names);
 
-status_t control_request_init_state(int fd);
-status_t control_write_init_state(uint8_t state, int fd);
+status_t control_write_service_states(control_response_t response, const struct control_service_state *states, uint16_t count, control_request_id_t id, int fd);
+void control_decode_service_states(void *packet, control_response_t *response, uint16_t *count, uint8_t **entries);
+void control_next_service_state(uint8_t **entries, service_state_t *state, char **name);
+
+status_t control_subscribe_service_state(const char* name, control_request_id_t id, int fd);
+void control_decode_subscribe_service_state(void *packet, char **svc_name);
+status_t control_subscribe_all_services(control_request_id_t id, int fd);
+status_t control_subscribe_service_states(const char **names, uint16_t count, control_request_id_t id, int fd);
+void control_decode_subscribe_service_states(void *packet, uint16_t *count, char **names);
+status_t control_subscribe_init_state(control_request_id_t id, int fd);
+status_t control_unsubscribe(control_request_id_t id, int fd);
+
+status_t control_request_service_output(const char* name, control_request_id_t id, int fd);
+void control_decode_request_service_output(void *packet, char **svc_name);
+status_t control_write_service_output(control_response_t response, const void *data, uint16_t len, control_request_id_t id, int fd);
+void control_decode_service_output(void *packet, control_response_t *response, uint16_t *len, uint8_t **data);
+
+status_t control_request_init_state(control_request_id_t id, int fd);
+status_t control_write_init_state(uint8_t state, control_request_id_t id, int fd);
 void control_decode_init_state(void *packet, uint8_t *state);
 
+status_t control_request_metrics(control_request_id_t id, int fd);
+status_t control_write_metrics(control_response_t response, const struct service_metrics *metrics, uint16_t count, uint64_t log_dropped, control_request_id_t id, int fd);
+void control_decode_metrics(void *packet, control_response_t *response, uint16_t *count, uint64_t *log_dropped, uint8_t **entries);
+void control_next_metrics(uint8_t **entries, struct service_metrics *metrics);
+
+status_t control_request_trace(uint64_t since, control_request_id_t id, int fd);
+void control_decode_request_trace(void *packet, uint64_t *since);
+status_t control_write_trace(control_response_t response, const struct trace_event *events, uint16_t count, uint64_t next, control_request_id_t id, int fd);
+void control_decode_trace(void *packet, control_response_t *response, uint16_t *count, uint64_t *next, uint8_t **entries);
+void control_next_trace(uint8_t **entries, struct trace_event *event);
+status_t control_report_trace(const char **names, const uint32_t *durations, uint16_t count, control_request_id_t id, int fd);
+void control_decode_report_trace(void *packet, uint16_t *count, uint8_t **entries);
+void control_next_report_trace(uint8_t **entries, char **name, uint32_t *duration);
+
+status_t control_request_health(control_request_id_t id, int fd);
+status_t control_write_health(uint8_t state, uint32_t age, const char *failed, control_request_id_t id, int fd);
+void control_decode_health(void *packet, uint8_t *state, uint32_t *age, char **failed);
+
 
 #define PACKET_TYPE(X) ((control_type_t*)X)[0]
+#define PACKET_REQUEST_ID(X) control_decode_request_id(X)
 
 #endif
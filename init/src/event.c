@@ -0,0 +1,271 @@
+#include "common.h"
+
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event.h"
+#include "log.h"
+
+#define LOG_MODULE "event"
+
+static int fd_epoll = -1;
+static int fd_timer = -1;
+
+// min-heap of pending timers ordered by deadline
+static struct event_timer **heap = NULL;
+static uint32_t heap_count = 0;
+static uint32_t heap_size = 0;
+
+status_t event_setup()
+{
+    if (fd_epoll != -1) {
+        return S_OK;
+    }
+
+    fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (fd_epoll == -1) {
+        log_errno_error("Failed to setup polling");
+        return S_EVENT_ERROR;
+    }
+
+    fd_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd_timer == -1) {
+        log_errno_error("Failed to create timer");
+        return S_EVENT_ERROR;
+    }
+
+    if (event_add(fd_timer, EVENT_TIMER, 0) != S_OK) {
+        return S_EVENT_ERROR;
+    }
+
+    return S_OK;
+}
+
+/**
+ * Watches fd for input, type and id are returned with each event.
+ */
+static status_t event_add_flags(int fd, event_type_t type, uint32_t id, uint32_t flags)
+{
+    struct epoll_event ev;
+
+    ev.events = flags;
+    ev.data.u64 = EVENT_KEY(type, id);
+
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        log_errno_error("Failed to add fd %d to polling", fd);
+        return S_EVENT_ERROR;
+    }
+    return S_OK;
+}
+
+status_t event_add(int fd, event_type_t type, uint32_t id)
+{
+    return event_add_flags(fd, type, id, EPOLLIN);
+}
+
+/**
+ * Reports only new input, used for fds read by someone else.
+ */
+status_t event_add_edge(int fd, event_type_t type, uint32_t id)
+{
+    return event_add_flags(fd, type, id, EPOLLIN | EPOLLET);
+}
+
+/**
+ * Toggles waiting for fd to become writable, registration must already exist.
+ */
+status_t event_set_writable(int fd, event_type_t type, uint32_t id, bool writable)
+{
+    struct epoll_event ev;
+
+    ev.events = writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.u64 = EVENT_KEY(type, id);
+
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        log_errno_error("Failed to modify polling of fd %d", fd);
+        return S_EVENT_ERROR;
+    }
+    return S_OK;
+}
+
+status_t event_remove(int fd)
+{
+    struct epoll_event ev;
+
+    if (epoll_ctl(fd_epoll, EPOLL_CTL_DEL, fd, &ev) == -1) {
+        log_errno_error("Failed to remove fd %d from polling", fd);
+        return S_EVENT_ERROR;
+    }
+    return S_OK;
+}
+
+uint64_t event_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void event_heap_swap(uint32_t a, uint32_t b)
+{
+    struct event_timer *tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->heap_index = a;
+    heap[b]->heap_index = b;
+}
+
+static void event_heap_up(uint32_t i)
+{
+    while (i > 0 && heap[(i - 1) / 2]->deadline > heap[i]->deadline) {
+        event_heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void event_heap_down(uint32_t i)
+{
+    uint32_t child;
+
+    for (;;) {
+        child = i * 2 + 1;
+        if (child >= heap_count) break;
+        if (child + 1 < heap_count && heap[child + 1]->deadline < heap[child]->deadline) {
+            child++;
+        }
+        if (heap[i]->deadline <= heap[child]->deadline) break;
+        event_heap_swap(i, child);
+        i = child;
+    }
+}
+
+static void event_heap_remove(uint32_t i)
+{
+    heap[i]->heap_index = EVENT_TIMER_INACTIVE;
+    heap_count--;
+    if (i == heap_count) return;
+
+    heap[i] = heap[heap_count];
+    heap[i]->heap_index = i;
+    event_heap_up(i);
+    event_heap_down(heap[i]->heap_index);
+}
+
+/**
+ * Arms timerfd for earliest deadline, disarms it when there are no timers.
+ */
+static void event_timer_arm()
+{
+    struct itimerspec spec = {{0, 0}, {0, 0}};
+
+    if (fd_timer == -1) return;
+
+    if (heap_count > 0) {
+        spec.it_value.tv_sec = heap[0]->deadline / 1000;
+        spec.it_value.tv_nsec = (heap[0]->deadline % 1000) * 1000000;
+        // zero value would disarm timer
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+    if (timerfd_settime(fd_timer, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        log_errno_error("Failed to arm timer");
+    }
+}
+
+void event_timer_init(struct event_timer *timer, event_type_t type, uint32_t id)
+{
+    timer->deadline = 0;
+    timer->heap_index = EVENT_TIMER_INACTIVE;
+    timer->type = type;
+    timer->id = id;
+}
+
+bool event_timer_active(const struct event_timer *timer)
+{
+    return timer->heap_index != EVENT_TIMER_INACTIVE;
+}
+
+/**
+ * Schedules timer to expire after timeout_ms, rescheduling it if already active.
+ */
+void event_timer_set(struct event_timer *timer, uint64_t timeout_ms)
+{
+    struct event_timer *first = heap_count > 0 ? heap[0] : NULL;
+
+    if (event_timer_active(timer)) {
+        event_heap_remove(timer->heap_index);
+    }
+
+    if (heap_count == heap_size) {
+        heap_size = heap_size == 0 ? 16 : heap_size * 2;
+        heap = realloc(heap, sizeof(struct event_timer*) * heap_size);
+    }
+
+    timer->deadline = event_now() + timeout_ms;
+    timer->heap_index = heap_count;
+    heap[heap_count++] = timer;
+    event_heap_up(timer->heap_index);
+
+    if (heap[0] != first || first == timer) {
+        event_timer_arm();
+    }
+}
+
+void event_timer_cancel(struct event_timer *timer)
+{
+    bool was_first;
+
+    if (!event_timer_active(timer)) return;
+
+    was_first = timer->heap_index == 0;
+    event_heap_remove(timer->heap_index);
+
+    if (was_first) {
+        event_timer_arm();
+    }
+}
+
+/**
+ * Waits for events like epoll_wait.
+ * Expired timers are returned as events with their type and id,
+ * internal events are consumed.
+ */
+int event_wait(struct epoll_event *events, int max, int timeout)
+{
+    int changes, i;
+    uint64_t value, now;
+    bool timer_expired = false;
+
+    changes = epoll_wait(fd_epoll, events, max, timeout);
+    if (changes <= 0) {
+        return changes;
+    }
+
+    for (i = 0; i < changes; i++) {
+        switch (EVENT_TYPE(events[i])) {
+            case EVENT_TIMER:
+                timer_expired = true;
+                if (read(fd_timer, &value, sizeof(value)) < 0) {
+                    log_errno_debug("Failed to read internal event");
+                }
+                events[i--] = events[--changes];
+                break;
+        }
+    }
+
+    if (timer_expired) {
+        now = event_now();
+        while (heap_count > 0 && heap[0]->deadline <= now && changes < max) {
+            events[changes].events = EPOLLIN;
+            events[changes].data.u64 = EVENT_KEY(heap[0]->type, heap[0]->id);
+            changes++;
+            event_heap_remove(0);
+        }
+        event_timer_arm();
+    }
+
+    return changes;
+}
@@ -0,0 +1,61 @@
+#ifndef _EVENT_H
+#define _EVENT_H
+
+#include <sys/epoll.h>
+#include "status.h"
+
+#define EVENT_SIGNAL 1
+#define EVENT_CONTROL 2
+#define EVENT_CLIENT 3
+#define EVENT_SERVICE_EXIT 4
+#define EVENT_SERVICE_NOTIFY 5
+#define EVENT_SERVICE_TIMEOUT 6
+#define EVENT_HEALTH_TIMER 7
+#define EVENT_HALT_TIMEOUT 8
+#define EVENT_LOG 9
+#define EVENT_SERVICE_OUTPUT 10
+#define EVENT_OUTPUT 11
+#define EVENT_SERVICE_RESTART 12
+#define EVENT_WORKER 13
+#define EVENT_SERVICE_STOP_TIMEOUT 14
+#define EVENT_METRICS_TIMER 15
+#define EVENT_SERVICE_SOCKET 16
+#define EVENT_SERVICE_IDLE 17
+#define EVENT_SERVICE_DIR 18
+// internal event, not returned by event_wait
+#define EVENT_TIMER 254
+
+typedef uint8_t event_type_t;
+
+#define EVENT_KEY(T, I) (((uint64_t)(T) << 32) | (uint32_t)(I))
+#define EVENT_TYPE(E) ((event_type_t)((E).data.u64 >> 32))
+#define EVENT_ID(E) ((uint32_t)((E).data.u64 & 0xffffffff))
+
+#define EVENT_TIMER_INACTIVE UINT32_MAX
+
+/**
+ * Deadline kept in event min-heap, on expiry it is returned
+ * by event_wait as event with given type and id.
+ */
+struct event_timer {
+    // CLOCK_MONOTONIC time in ms
+    uint64_t deadline;
+    uint32_t heap_index;
+    event_type_t type;
+    uint32_t id;
+};
+
+status_t event_setup();
+status_t event_add(int fd, event_type_t type, uint32_t id);
+status_t event_add_edge(int fd, event_type_t type, uint32_t id);
+status_t event_set_writable(int fd, event_type_t type, uint32_t id, bool writable);
+status_t event_remove(int fd);
+int event_wait(struct epoll_event *events, int max, int timeout);
+
+uint64_t event_now();
+void event_timer_init(struct event_timer *timer, event_type_t type, uint32_t id);
+void event_timer_set(struct event_timer *timer, uint64_t timeout_ms);
+void event_timer_cancel(struct event_timer *timer);
+bool event_timer_active(const struct event_timer *timer);
+
+#endif
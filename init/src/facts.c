@@ -0,0 +1,119 @@
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "facts.h"
+#include "init.h"
+#include "service.h"
+#include "health.h"
+#include "log.h"
+
+#define LOG_MODULE "facts"
+
+const char *facts_path = PUPPETIZER_FACTS_FILE;
+static bool facts_dirty = true;
+
+/**
+ * Marks published state as outdated, file is rewritten on next facts_flush.
+ */
+void facts_changed()
+{
+    facts_dirty = true;
+}
+
+static const char *facts_init_state_name(uint8_t state)
+{
+    switch (state) {
+        case INIT_STATE_BOOTING: return "booting";
+        case INIT_STATE_RUNNING: return "running";
+        case INIT_STATE_HALTING: return "halting";
+        default:                 return "unknown";
+    }
+}
+
+static const char *facts_service_state_name(service_state_t state)
+{
+    switch (state) {
+        case STATE_PENDING_UP:   return "pending_up";
+        case STATE_UP:           return "up";
+        case STATE_DOWN:         return "down";
+        case STATE_PENDING_DOWN: return "pending_down";
+        default:                 return "unknown";
+    }
+}
+
+static const char *facts_health_state_name(uint8_t state)
+{
+    switch (state) {
+        case HEALTH_OK:     return "ok";
+        case HEALTH_FAILED: return "failed";
+        default:            return "unknown";
+    }
+}
+
+static void facts_write_string(FILE *f, const char *text)
+{
+    const char *c;
+
+    fputc('"', f);
+    for (c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', f);
+            fputc(*c, f);
+        } else if ((unsigned char)*c < 0x20) {
+            fprintf(f, "\\u%04x", (unsigned char)*c);
+        } else {
+            fputc(*c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+/**
+ * Writes state file when something changed, called once per event loop
+ * iteration. File is replaced with rename so readers never see partial data.
+ */
+status_t facts_flush(uint8_t init_state)
+{
+    char tmp_path[256];
+    struct service *svc;
+    struct health_check *check;
+    uint16_t i;
+    FILE *f;
+
+    if (!facts_dirty) {
+        return S_OK;
+    }
+    facts_dirty = false;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", facts_path);
+    f = fopen(tmp_path, "we");
+    if (f == NULL) {
+        log_errno_debug("Could not create facts file %s", tmp_path);
+        return S_UNKNOWN_ERROR;
+    }
+
+    fprintf(f, "{\"state\":\"%s\",\"services\":{", facts_init_state_name(init_state));
+    for (i = 0; (svc = service_get(i)) != NULL; i++) {
+        if (i > 0) fputc(',', f);
+        facts_write_string(f, svc->name);
+        fprintf(f, ":\"%s\"", facts_service_state_name(svc->state));
+    }
+    fputs("},\"health\":{", f);
+    for (i = 0; (check = health_get(i)) != NULL; i++) {
+        if (i > 0) fputc(',', f);
+        facts_write_string(f, check->name);
+        fprintf(f, ":\"%s\"", facts_health_state_name(check->state));
+    }
+    fputs("}}\n", f);
+
+    if (fclose(f) != 0 || rename(tmp_path, facts_path) == -1) {
+        log_errno_debug("Could not write facts file %s", facts_path);
+        unlink(tmp_path);
+        return S_UNKNOWN_ERROR;
+    }
+    return S_OK;
+}
@@ -0,0 +1,17 @@
+#ifndef _FACTS_H
+#define _FACTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "status.h"
+
+/*
+ * Init state published for puppetizer fact as JSON document:
+ * {"state":"running","services":{"name":"up"},"health":{"name":"ok"}}
+ */
+extern const char *facts_path;
+
+void facts_changed();
+status_t facts_flush(uint8_t init_state);
+
+#endif
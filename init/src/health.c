@@ -0,0 +1,220 @@
+#include "common.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "health.h"
+#include "spawn.h"
+#include "conf.h"
+#include "log.h"
+#include "facts.h"
+
+#define LOG_MODULE "health"
+
+static uint16_t checks_count = 0;
+static struct health_check *checks = NULL;
+
+static int health_files_filter(const struct dirent *f)
+{
+    int offset = strlen(f->d_name) - 5;
+
+    if (f->d_name[0] == '.') return 0;
+    // options for checks are kept next to them
+    if (offset > 0 && strcmp(f->d_name + offset, ".conf") == 0) return 0;
+
+    return 1;
+}
+
+static bool health_set_option(void *ctx, const char *key, const char *value)
+{
+    struct health_check *check = ctx;
+
+    if (strcmp(key, "interval") == 0) {
+        return conf_parse_uint(value, &check->interval) && check->interval > 0;
+    }
+    if (strcmp(key, "timeout") == 0) {
+        return conf_parse_uint(value, &check->timeout) && check->timeout > 0;
+    }
+    return false;
+}
+
+static char *health_path(const char *name, const char *suffix)
+{
+    size_t len = sizeof(PUPPETIZER_HEALTH_DIR "/") + strlen(name) + strlen(suffix);
+    char *path = malloc(len);
+
+    snprintf(path, len, PUPPETIZER_HEALTH_DIR "/%s%s", name, suffix);
+    return path;
+}
+
+/**
+ * Collects executable scripts from PUPPETIZER_HEALTH_DIR.
+ */
+status_t health_create_all()
+{
+    int l_count, i;
+    struct dirent **namelist;
+    char *path, *conf_path;
+    struct health_check *check;
+
+    l_count = scandir(PUPPETIZER_HEALTH_DIR, &namelist, health_files_filter, alphasort);
+    if (l_count == -1) {
+        log_errno_warning("Searching for health checks in %s failed", PUPPETIZER_HEALTH_DIR);
+        return S_HEALTH_COLLECT_ERROR;
+    }
+
+    checks = calloc(l_count, sizeof(struct health_check));
+
+    for (i=0; i<l_count; i++) {
+        path = health_path(namelist[i]->d_name, "");
+
+        if (access(path, X_OK) == 0) {
+            check = &checks[checks_count];
+            check->name = strdup(namelist[i]->d_name);
+            check->path = path;
+            check->pid = 0;
+            check->state = HEALTH_UNKNOWN;
+            check->checked_at = 0;
+            check->interval = HEALTH_DEFAULT_INTERVAL;
+            check->timeout = HEALTH_DEFAULT_TIMEOUT;
+            event_timer_init(&check->timer, EVENT_HEALTH_TIMER, checks_count);
+
+            conf_path = health_path(check->name, ".conf");
+            conf_parse_file(conf_path, health_set_option, check);
+            free(conf_path);
+
+            log_debug("Adding health check %s", check->name);
+            checks_count++;
+        } else {
+            free(path);
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+
+    log_debug("Found %d health checks", checks_count);
+
+    return S_OK;
+}
+
+/**
+ * Schedules all checks to run as soon as possible.
+ */
+void health_start_all()
+{
+    uint16_t i;
+    for (i=0; i<checks_count; i++) {
+        event_timer_set(&checks[i].timer, 0);
+    }
+}
+
+void health_stop_all()
+{
+    uint16_t i;
+    for (i=0; i<checks_count; i++) {
+        event_timer_cancel(&checks[i].timer);
+        if (checks[i].pid > 0) {
+            kill(checks[i].pid, SIGKILL);
+        }
+    }
+}
+
+static void health_run(struct health_check *check)
+{
+    check->pid = spawn1(check->path);
+    if (check->pid <= 0) {
+        log_warning("Could not run health check %s", check->name);
+        check->pid = 0;
+        check->state = HEALTH_FAILED;
+        check->checked_at = event_now();
+        event_timer_set(&check->timer, (uint64_t)check->interval * 1000);
+        return;
+    }
+
+    event_timer_set(&check->timer, (uint64_t)check->timeout * 1000);
+}
+
+/**
+ * Runs idle check or kills the one which exceeded its timeout.
+ */
+void health_handle_timer(uint16_t id)
+{
+    struct health_check *check;
+
+    if (id >= checks_count) return;
+    check = &checks[id];
+
+    if (check->pid > 0) {
+        log_warning("Health check %s timed out after %d seconds", check->name, check->timeout);
+        // result is recorded when it is reaped
+        kill(check->pid, SIGKILL);
+    } else {
+        health_run(check);
+    }
+}
+
+/**
+ * Records result of reaped check, returns false if pid is not a health check.
+ */
+bool health_handle_exit(pid_t pid, int status)
+{
+    uint16_t i;
+    int retval;
+    uint8_t state;
+
+    for (i=0; i<checks_count; i++) {
+        if (checks[i].pid == pid) {
+            retval = spawn_retval(status);
+            state = retval == 0 ? HEALTH_OK : HEALTH_FAILED;
+            if (state != checks[i].state) {
+                log_info("Health check %s is %s (exitcode %d)", checks[i].name, state == HEALTH_OK ? "passing" : "failing", retval);
+                facts_changed();
+            }
+
+            checks[i].pid = 0;
+            checks[i].state = state;
+            checks[i].checked_at = event_now();
+            event_timer_set(&checks[i].timer, (uint64_t)checks[i].interval * 1000);
+            return true;
+        }
+    }
+    return false;
+}
+
+struct health_check* health_get(uint16_t id)
+{
+    return id < checks_count ? &checks[id] : NULL;
+}
+
+/**
+ * Returns cached health with age of oldest result in seconds.
+ */
+uint8_t health_get_state(uint32_t *age, const char **failed)
+{
+    uint16_t i;
+    uint8_t state = HEALTH_OK;
+    uint64_t now = event_now(), oldest = now;
+
+    *failed = "";
+
+    for (i=0; i<checks_count; i++) {
+        if (checks[i].state == HEALTH_UNKNOWN) {
+            if (state == HEALTH_OK) state = HEALTH_UNKNOWN;
+            continue;
+        }
+        if (checks[i].checked_at < oldest) {
+            oldest = checks[i].checked_at;
+        }
+        if (checks[i].state == HEALTH_FAILED && state != HEALTH_FAILED) {
+            state = HEALTH_FAILED;
+            *failed = checks[i].name;
+        }
+    }
+
+    *age = (now - oldest) / 1000;
+
+    return state;
+}
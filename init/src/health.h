@@ -0,0 +1,37 @@
+#ifndef _HEALTH_H
+#define _HEALTH_H
+
+#include <sys/types.h>
+#include "status.h"
+#include "event.h"
+
+#define HEALTH_OK 0
+#define HEALTH_FAILED 1
+#define HEALTH_UNKNOWN 2
+
+#define HEALTH_DEFAULT_INTERVAL 30
+#define HEALTH_DEFAULT_TIMEOUT 10
+
+struct health_check {
+    char *name;
+    char *path;
+    pid_t pid;
+    uint8_t state;
+    // CLOCK_MONOTONIC time in ms of last finished run
+    uint64_t checked_at;
+    // seconds
+    uint32_t interval;
+    uint32_t timeout;
+    // next run when idle, timeout when running
+    struct event_timer timer;
+};
+
+status_t health_create_all();
+void health_start_all();
+void health_stop_all();
+bool health_handle_exit(pid_t pid, int status);
+void health_handle_timer(uint16_t id);
+uint8_t health_get_state(uint32_t *age, const char **failed);
+struct health_check* health_get(uint16_t id);
+
+#endif
@@ -1,6 +1,7 @@
 #include "common.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <signal.h>
 #include <sys/signalfd.h>
 #include <unistd.h>
@@ -9,8 +10,6 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include <sys/epoll.h>
-#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
@@ -19,16 +18,54 @@
 #include "service.h"
 #include "log.h"
 #include "spawn.h"
+#include "event.h"
+#include "health.h"
+#include "worker.h"
+#include "facts.h"
+#include "metrics.h"
+#include "cgroup.h"
+#include "snapshot.h"
+#include "trace.h"
 
 #define LOG_MODULE "init"
 
+#define HALT_NONE 0
+#define HALT_APPLY_STOPPING 1
+#define HALT_PUPPET 2
+#define HALT_SERVICES 3
+
+// trace events sent in one reply, client asks again for the rest
+#define INIT_TRACE_PAGE 512
+
+// ms before apply stopped by halt is killed
+#define INIT_APPLY_KILL_TIMEOUT 10000
+
 static bool is_halting = false;
 static bool is_booting = false;
 static bool is_applying = false;
+// HUP received while apply was running, coalesced into single next apply
+static bool apply_requested = false;
+__static bool use_apply_worker = false;
+// apply_pid is then child of worker, reported by it
+static bool apply_via_worker = false;
 static pid_t boot_pid, apply_pid;
-static pthread_t halt_thread = 0;
+static uint8_t halt_phase = HALT_NONE;
+static struct event_timer halt_timer;
+// whole halt has to finish in this many seconds, 0 to wait forever
+static uint32_t halt_timeout = 0;
+static struct event_timer halt_deadline;
 static status_t halt_cause = S_OK;
 static bool use_puppet_when_halting = false;
+static bool reap_pending = false;
+// USR2 received, init replaces itself after current loop iteration
+static bool reexec_pending = false;
+// kept over re-exec, so clients connecting meanwhile wait in backlog
+static int fd_control = -1;
+char **init_argv = NULL;
+
+// max children reaped in one loop iteration, so clients are not starved
+#define INIT_REAP_BATCH 32
+#define INIT_MAX_EVENTS 64
 
 static void init_detach_from_terminal()
 {
@@ -55,6 +92,15 @@ static pid_t init_apply(const char *mode)
     }
 
     is_applying = true;
+    trace_add(TRACE_TRACK_APPLY, TRACE_BEGIN, "apply %s", mode ? mode : "reload");
+    if (use_apply_worker && worker_apply(mode)) {
+        log_debug("Apply requested from worker");
+        apply_via_worker = true;
+        apply_pid = 0;
+        return 0;
+    }
+
+    apply_via_worker = false;
     apply_pid = spawn2(PUPPETIZER_APPLY, mode);
 
     if (apply_pid == -1) {
@@ -63,17 +109,6 @@ static pid_t init_apply(const char *mode)
     return apply_pid;
 }
 
-static void init_apply_kill()
-{
-    if (apply_pid > 0 && is_applying) {
-        log_warning("Stopping puppet apply");
-        kill(apply_pid, SIGTERM);
-        waitpid(apply_pid, NULL, 0);
-        // make sure that apply is marked as stopped
-        is_applying = false;
-    }
-}
-
 static uint8_t init_get_state()
 {
     if (is_booting) {
@@ -85,13 +120,184 @@ static uint8_t init_get_state()
     return INIT_STATE_RUNNING;
 }
 
-static status_t init_handle_client_command(void *packet, int fd)
+static control_response_t init_set_service_state(struct service *svc, service_state_t state, int fd)
+{
+    if (svc == NULL) {
+        return CMD_RESPONSE_ERROR;
+    }
+
+    switch (state) {
+        case STATE_UP:
+            return service_start(svc)?CMD_RESPONSE_OK:CMD_RESPONSE_FAILED;
+        case STATE_DOWN:
+            return service_stop(svc)?CMD_RESPONSE_OK:CMD_RESPONSE_FAILED;
+        default:
+            log_error("Bad service state %d from client %d", state, fd);
+            return CMD_RESPONSE_ERROR;
+    }
+}
+
+/**
+ * Handles batch requests, with set_state 0 only states are reported.
+ * Listing no names reports all services.
+ */
+static status_t init_handle_service_states(uint16_t count, char *names, service_state_t set_state, control_request_id_t id, int fd)
+{
+    struct control_service_state *states;
+    struct service *svc;
+    control_response_t response = CMD_RESPONSE_OK, svc_response;
+    status_t status;
+    uint16_t i;
+    bool all = count == 0 && set_state == 0;
+
+    if (all) {
+        while (service_get(count) != NULL) count++;
+    }
+
+    states = calloc(count ? count : 1, sizeof(struct control_service_state));
+    if (states == NULL) {
+        return control_write_response(CMD_RESPONSE_ERROR, id, fd);
+    }
+
+    for (i=0;i<count;i++) {
+        if (all) {
+            svc = service_get(i);
+        } else {
+            svc = service_find_by_name(names);
+            states[i].name = names;
+            names += strlen(names) + 1;
+        }
+
+        if (set_state) {
+            svc_response = init_set_service_state(svc, set_state, fd);
+            if (svc_response != CMD_RESPONSE_OK && response != CMD_RESPONSE_ERROR) {
+                response = svc_response;
+            }
+        } else if (svc == NULL && response == CMD_RESPONSE_OK) {
+            response = CMD_RESPONSE_FAILED;
+        }
+
+        if (svc != NULL) {
+            states[i].name = svc->name;
+            states[i].state = svc->state;
+        }
+    }
+
+    status = control_write_service_states(response, states, count, id, fd);
+    free(states);
+
+    if (status == S_CONTROL_PACKET_TOO_LARGE) {
+        return control_write_response(CMD_RESPONSE_ERROR, id, fd);
+    }
+    return status;
+}
+
+/**
+ * Subscribes to all given services under one request id, nothing is
+ * subscribed when any of them is unknown.
+ */
+static status_t init_subscribe_service_states(uint16_t count, char *names, control_request_id_t id, int fd)
+{
+    struct service *svc;
+    char *name = names;
+    bool failed = false;
+    uint16_t i;
+
+    for (i=0;i<count && !failed;i++) {
+        svc = service_find_by_name(name);
+        if (svc == NULL || !control_subscribe_client_named(fd, svc, id)) {
+            failed = true;
+        }
+        name += strlen(name) + 1;
+    }
+    if (failed || count == 0) {
+        control_unsubscribe_client_request(fd, id);
+        if (count == 0) {
+            return control_write_response(CMD_RESPONSE_ERROR, id, fd);
+        }
+    }
+
+    return init_handle_service_states(count, names, 0, id, fd);
+}
+
+static status_t init_handle_metrics(control_request_id_t id, int fd)
+{
+    struct service_metrics *metrics;
+    uint16_t count;
+    status_t status;
+
+    metrics_sample_all();
+    count = metrics_collect(&metrics);
+    status = control_write_metrics(CMD_RESPONSE_OK, metrics, count, log_dropped, id, fd);
+    free(metrics);
+
+    if (status == S_CONTROL_PACKET_TOO_LARGE) {
+        return control_write_response(CMD_RESPONSE_ERROR, id, fd);
+    }
+    return status;
+}
+
+static status_t init_handle_trace(uint64_t since, control_request_id_t id, int fd)
+{
+    struct trace_event *events;
+    uint64_t next;
+    uint16_t count;
+    status_t status;
+
+    events = malloc(sizeof(struct trace_event) * INIT_TRACE_PAGE);
+    count = trace_collect(since, events, INIT_TRACE_PAGE, &next);
+    status = control_write_trace(CMD_RESPONSE_OK, events, count, next, id, fd);
+    free(events);
+    return status;
+}
+
+/**
+ * Phases reported by apply just ended, so they are laid out back to back ending now.
+ */
+static status_t init_handle_report_trace(void *packet, control_request_id_t id, int fd)
+{
+    uint8_t *entries;
+    uint64_t start, total = 0;
+    uint32_t duration;
+    uint16_t count, i;
+    char *name;
+
+    control_decode_report_trace(packet, &count, &entries);
+    for (i=0;i<count;i++) {
+        control_next_report_trace(&entries, &name, &duration);
+        total += duration;
+    }
+    start = trace_now() - total;
+
+    control_decode_report_trace(packet, &count, &entries);
+    for (i=0;i<count;i++) {
+        control_next_report_trace(&entries, &name, &duration);
+        trace_complete(TRACE_TRACK_APPLY, name, start, duration);
+        start += duration;
+    }
+    return control_write_response(CMD_RESPONSE_OK, id, fd);
+}
+
+static status_t init_handle_client_command(void *packet, uint16_t len, int fd)
 {
     struct service *svc;
     char *svc_name;
     service_state_t svc_state;
     control_response_t response;
+    control_request_id_t id = PACKET_REQUEST_ID(packet);
     bool ret;
+    uint8_t health_state;
+    uint32_t health_age;
+    const char *health_failed;
+    uint16_t count;
+    uint64_t since;
+    char tail[OUTPUT_TAIL_SIZE];
+    ssize_t tail_len;
+
+    if (!control_packet_valid(packet, len)) {
+        log_warning("Client %d sent malformed packet %d", fd, PACKET_TYPE(packet));
+        return control_write_response(CMD_RESPONSE_ERROR, id, fd);
+    }
 
     switch (PACKET_TYPE(packet)) {
         
@@ -100,9 +306,9 @@ static status_t init_handle_client_command(void *packet, int fd)
             control_decode_request_service_state(packet, &svc_name);
             svc = service_find_by_name(svc_name);
             if (svc == NULL) {
-                return control_write_service_state(CMD_RESPONSE_FAILED, 0, fd);
+                return control_write_service_state(CMD_RESPONSE_FAILED, 0, id, fd);
             } else {
-                return control_write_service_state(CMD_RESPONSE_OK, svc->state, fd);
+                return control_write_service_state(CMD_RESPONSE_OK, svc->state, id, fd);
             }
         
         case PACKET_SET_SERVICE_STATE:
@@ -110,22 +316,21 @@ static status_t init_handle_client_command(void *packet, int fd)
             svc = service_find_by_name(svc_name);
             log_debug("Handling setting service state for %d and service %s", fd, svc_name);
 
-            if (svc == NULL) {
-                response = CMD_RESPONSE_ERROR;
-            } else {
-                switch (svc_state) {
-                    case STATE_UP:
-                        response = service_start(svc)?CMD_RESPONSE_OK:CMD_RESPONSE_FAILED;
-                        break;
-                    case STATE_DOWN:
-                        response = service_stop(svc)?CMD_RESPONSE_OK:CMD_RESPONSE_FAILED;
-                        break;
-                    default:
-                        log_error("Bad service state %d from client %d", svc_state, fd);
-                        response = CMD_RESPONSE_ERROR;
-                }
+            response = init_set_service_state(svc, svc_state, fd);
+            return control_write_response(response, id, fd);
+
+        case PACKET_REQUEST_SERVICE_STATES:
+            log_debug("Handling request for service states for %d", fd);
+            control_decode_request_service_states(packet, &count, &svc_name);
+            return init_handle_service_states(count, svc_name, 0, id, fd);
+
+        case PACKET_SET_SERVICE_STATES:
+            control_decode_set_service_states(packet, &svc_state, &count, &svc_name);
+            log_debug("Handling setting state for %d services for %d", count, fd);
+            if (svc_state == 0) {
+                return control_write_response(CMD_RESPONSE_ERROR, id, fd);
             }
-            return control_write_response(response, fd);
+            return init_handle_service_states(count, svc_name, svc_state, id, fd);
         
         case PACKET_SUBSCRIBE_SERVICE_STATE:
             log_debug("Handling service event subscribing for %d", fd);
@@ -136,7 +341,7 @@ static status_t init_handle_client_command(void *packet, int fd)
                 log_warning("Client %d tried to subscribe to nonexisting service %s", fd, svc_name);
                 response = CMD_RESPONSE_ERROR;
             } else {
-                ret = control_subscribe_client(fd, svc);
+                ret = control_subscribe_client(fd, svc, id);
                 if (!ret) {
                     response = CMD_RESPONSE_ERROR;
                 } else {
@@ -145,13 +350,55 @@ static status_t init_handle_client_command(void *packet, int fd)
             }
 
             if (response != CMD_RESPONSE_OK) {
-                return control_write_service_state(response, 0, fd);
+                return control_write_service_state(response, 0, id, fd);
             } else {
                 return S_OK;
             }
+        case PACKET_SUBSCRIBE_SERVICE_STATES:
+            control_decode_subscribe_service_states(packet, &count, &svc_name);
+            log_debug("Handling subscribing to %d services for %d", count, fd);
+            return init_subscribe_service_states(count, svc_name, id, fd);
+        case PACKET_SUBSCRIBE_ALL_SERVICES:
+            log_debug("Handling all services subscribing for %d", fd);
+            if (!control_subscribe_client_all(fd, id)) {
+                return control_write_response(CMD_RESPONSE_ERROR, id, fd);
+            }
+            return S_OK;
+        case PACKET_SUBSCRIBE_INIT_STATE:
+            log_debug("Handling init state subscribing for %d", fd);
+            if (!control_subscribe_client_init(fd, id, init_get_state())) {
+                return control_write_response(CMD_RESPONSE_ERROR, id, fd);
+            }
+            return S_OK;
+        case PACKET_UNSUBSCRIBE:
+            response = control_unsubscribe_client_request(fd, id)?CMD_RESPONSE_OK:CMD_RESPONSE_FAILED;
+            return control_write_response(response, id, fd);
         case PACKET_REQUEST_INIT_STATE:
             log_debug("Handling request for init state for %d", fd);
-            return control_write_init_state(init_get_state(), fd);
+            return control_write_init_state(init_get_state(), id, fd);
+        case PACKET_REQUEST_SERVICE_OUTPUT:
+            log_debug("Handling request for service output for %d", fd);
+            control_decode_request_service_output(packet, &svc_name);
+            svc = service_find_by_name(svc_name);
+            if (svc == NULL) {
+                return control_write_service_output(CMD_RESPONSE_FAILED, "", 0, id, fd);
+            }
+            tail_len = output_read_tail(&svc->output, tail, sizeof(tail));
+            return control_write_service_output(CMD_RESPONSE_OK, tail, tail_len, id, fd);
+        case PACKET_REQUEST_METRICS:
+            log_debug("Handling request for metrics for %d", fd);
+            return init_handle_metrics(id, fd);
+        case PACKET_REQUEST_TRACE:
+            log_debug("Handling request for trace for %d", fd);
+            control_decode_request_trace(packet, &since);
+            return init_handle_trace(since, id, fd);
+        case PACKET_REPORT_TRACE:
+            log_debug("Handling trace report for %d", fd);
+            return init_handle_report_trace(packet, id, fd);
+        case PACKET_REQUEST_HEALTH:
+            log_debug("Handling request for health for %d", fd);
+            health_state = health_get_state(&health_age, &health_failed);
+            return control_write_health(health_state, health_age, health_failed, id, fd);
         default:
             log_error("Unknown packet %d", PACKET_TYPE(packet));
             return S_UNKNOWN_ERROR;
@@ -160,7 +407,7 @@ static status_t init_handle_client_command(void *packet, int fd)
 
 /**
  * Blocks all signals.
- * SIGCHLD, SIGTERM and SIGHUP will be handled by init_loop.
+ * SIGCHLD, SIGTERM, SIGHUP and SIGUSR2 will be handled by init_loop.
  */
 __static void init_setup_signals()
 {
@@ -170,133 +417,358 @@ __static void init_setup_signals()
 }
 
 /**
- * Marks init as halting and runs shutdown process.
+ * Advances halt process, called again whenever apply exits.
  * 
- * Halt process will run apply command with halt argument
- * then it tries to stop any service which is still running.
+ * Running apply is stopped first, then apply command is run
+ * with halt argument and finally any service which is still running
+ * is stopped. Main loop exits when all services are down.
  * 
- * Will not wait for services to exit not send signal to
- * other processes.
+ * Nothing here waits, progress is driven by event loop.
  */
-static void init_halt()
+static void init_halt_step()
 {
-    uint8_t i;
-    int ret;
+    uint16_t i;
 
-    if (is_halting) return;
+    if (halt_phase == HALT_NONE) {
+        halt_phase = HALT_APPLY_STOPPING;
+        trace_add(TRACE_TRACK_INIT, TRACE_INSTANT, "halt: stopping apply");
+        if (is_applying) {
+            log_warning("Stopping puppet apply");
+            if (apply_pid > 0) kill(apply_pid, SIGTERM);
+            event_timer_set(&halt_timer, INIT_APPLY_KILL_TIMEOUT);
+        }
+    }
 
-    is_halting = true;
-    
-    log_debug("Running halt action");
+    if (halt_phase == HALT_APPLY_STOPPING) {
+        if (is_applying) return;
+        event_timer_cancel(&halt_timer);
 
-    // kill any running apply
-    init_apply_kill();
+        halt_phase = HALT_PUPPET;
+        trace_add(TRACE_TRACK_INIT, TRACE_INSTANT, "halt: puppet");
+        if (use_puppet_when_halting) {
+            // run puppet-apply with halt option to stop services
+            init_apply("halt");
+            return;
+        }
+    }
 
-    if (use_puppet_when_halting) {
-        // run puppet-apply with halt option to stop services
-        ret = spawn_wait_for_pid(init_apply("halt"));
-        if (ret != 0) {
-            log_error("Puppet halt failed with exitcode %d", ret);
+    if (halt_phase == HALT_PUPPET) {
+        if (is_applying) return;
+
+        halt_phase = HALT_SERVICES;
+        trace_add(TRACE_TRACK_INIT, TRACE_INSTANT, "halt: stopping services");
+        worker_stop();
+        // stop any services that are not stopping, rest follows as dependents exit
+        i = service_stop_all();
+        if (i>0) {
+            log_warning("Stopping %d outstanding services.", i);
         }
     }
+}
 
-    // stop any services that are not stopping
-    i = service_stop_all();
-    if (i>0) {
-        log_warning("Stopping %d outstanding services.", i);
+static void init_handle_halt_timeout(uint16_t id)
+{
+    if (id == 1) {
+        log_warning("Halt did not finish in %d seconds, killing everything", halt_timeout);
+        if (is_applying && apply_pid > 0) kill(apply_pid, SIGKILL);
+        service_kill_all();
+        return;
+    }
+    if (halt_phase == HALT_APPLY_STOPPING && is_applying) {
+        log_warning("Puppet apply did not stop in time, killing it");
+        if (apply_pid > 0) kill(apply_pid, SIGKILL);
     }
 }
 
-__static void MOCKABLE(init_halt_thread)(status_t cause)
+/**
+ * Marks init as halting and starts shutdown process.
+ */
+__static void MOCKABLE(init_halt_request)(status_t cause)
 {
-    int ret;
+    if (is_halting) return;
+
+    is_halting = true;
+    halt_cause = cause;
+    log_info("Halting init");
+    trace_add(TRACE_TRACK_INIT, TRACE_BEGIN, "halt");
+    control_dispatch_init_state_change(INIT_STATE_HALTING);
+    if (halt_timeout > 0) {
+        event_timer_set(&halt_deadline, (uint64_t)halt_timeout * 1000);
+    }
+    health_stop_all();
+    service_unlisten_all();
 
-    if (halt_thread == 0 && !is_halting) {
-        halt_cause = cause;
-        log_info("Halting init");
-        ret = pthread_create(&halt_thread, NULL, (void * (*)(void *))init_halt, NULL);
+    log_debug("Running halt action");
+    init_halt_step();
+}
 
-        if (ret != 0) {
-            fatal(ERROR_THREAD_FAILED, "Halt thread creation failed with %d", ret);
+/**
+ * Handles finished apply, pid is 0 when it was run by worker.
+ */
+static void init_handle_apply_exit(pid_t pid, int retval)
+{
+    is_applying = false;
+    apply_pid = 0;
+    apply_via_worker = false;
+    trace_add(TRACE_TRACK_APPLY, TRACE_INSTANT, "exit %d", retval);
+    trace_add(TRACE_TRACK_APPLY, TRACE_END, NULL);
+
+    if (is_booting && boot_pid == pid) {
+        is_booting = false;
+        boot_pid = 0;
+        trace_add(TRACE_TRACK_INIT, TRACE_END, NULL);
+        trace_write_file();
+        control_dispatch_init_state_change(init_get_state());
+        if (retval == 0 && use_apply_worker) {
+            worker_start();
         }
     }
+
+    if (halt_phase == HALT_PUPPET) {
+        if (retval != 0) {
+            log_error("Puppet halt failed with exitcode %d", retval);
+        }
+    } else if (retval == 0) {
+        log_info("Applying changes completed");
+    } else {
+        log_error("Applying changes failed");
+        init_halt_request(S_INIT_APPLY_FAILED);
+    }
+
+    if (is_halting) {
+        init_halt_step();
+    } else if (apply_requested) {
+        apply_requested = false;
+        log_debug("Running requested apply");
+        init_apply(NULL);
+    }
 }
 
+/**
+ * Reads replies from apply worker.
+ */
+static void init_handle_worker()
+{
+    worker_event_t event;
+    int value;
+
+    while ((event = worker_handle(&value)) != WORKER_EVENT_NONE) {
+        if (event == WORKER_EVENT_STARTED && apply_via_worker) {
+            apply_pid = value;
+            if (halt_phase == HALT_APPLY_STOPPING) {
+                kill(apply_pid, SIGTERM);
+            }
+        } else if (event == WORKER_EVENT_EXIT && apply_via_worker) {
+            init_handle_apply_exit(0, value);
+        }
+    }
+}
 
-static void init_handle_signal(const struct signalfd_siginfo *info)
+__static void init_handle_exit(pid_t pid, int status)
 {
-    int status;
     struct service* svc;
     service_state_t svc_state;
     int retval;
-    pid_t pid;
 
-    log_debug("Handling signal");
+    retval = spawn_retval(status);
 
-    // multiple signals do not stack, wait for all processes
-    for (;;) {
-        pid = waitpid(-1, &status, WNOHANG);
-        if (pid <= 0) {
-            break;
+    if (apply_pid == pid && !apply_via_worker) {
+        init_handle_apply_exit(pid, retval);
+        return;
+    }
+
+    if (worker_handle_exit(pid, status, &retval)) {
+        if (apply_via_worker) {
+            init_handle_apply_exit(0, retval);
+        }
+        if (!is_halting) {
+            worker_start();
         }
+        return;
+    }
 
-        retval = spawn_retval(status);
+    if (health_handle_exit(pid, status)) {
+        return;
+    }
 
-        if (apply_pid == pid) {
-            is_applying = false;
-            apply_pid = 0;
+    svc = service_find_by_pid(pid);
+    if (svc == NULL) {
+        log_debug("Reaped PID:%d", pid);
+    } else {
+        svc_state = svc->state;
+        svc->stats.last_exit = retval;
+        // dependents keep waiting when service is restarted
+        service_set_exited(svc);
 
-            if (is_booting && boot_pid == pid) {
-                is_booting = false;
-                boot_pid = 0;
-            }
+        log_error("Service %s exitted with code %d", svc->name, retval);
 
-            if (retval == 0) {
-                log_info("Applying changes completed");
-            } else {
-                log_error("Applying changes failed");
-                init_halt_thread(S_INIT_APPLY_FAILED);
-            }
+        // service stopped on request, exit code does not matter as stop could escalate to signals
+        if (svc_state == STATE_PENDING_DOWN) {
+            service_cancel_dependents(svc);
+            return;
+        }
+        // socket activated service can exit when idle, next connection starts it again
+        if (svc->sockets_count > 0 && !is_halting && retval == 0) {
+            service_cancel_dependents(svc);
+            return;
         }
+        // unexpected exit is retried by restart policy, halt if it is not allowed or failed too many times
+        if (is_halting || !service_schedule_restart(svc, retval)) {
+            service_cancel_dependents(svc);
+            log_debug("Service exitted with code %d when had status %d, halting", retval, svc_state);
+            init_halt_request(S_INIT_SERVICE_ERROR);
+        }
+    }
+}
 
-        svc = service_find_by_pid(pid);
-        if (svc == NULL) {
-            log_debug("Reaped PID:%d", pid);
-        } else {
-            svc_state = svc->state;
-            service_set_down(svc);
+/**
+ * Handles exit of service watched by pidfd.
+ */
+static void init_handle_service_exit(uint16_t id)
+{
+    int status;
+    struct service *svc = service_get(id);
 
-            log_error("Service %s exitted with code %d", svc->name, retval);
+    // service could be already reaped by init_reap_children
+    if (svc == NULL || svc->pidfd == -1) {
+        return;
+    }
+    if (waitpid(svc->pid, &status, WNOHANG) == svc->pid) {
+        init_handle_exit(svc->pid, status);
+    }
+}
 
-            // halt if service exitted unexpectedly or it failed wither errorcode
-            if (svc_state != STATE_PENDING_DOWN || retval != 0) {
-                log_debug("Service exitted with code %d when had status %d, halting", retval, svc_state);
-                init_halt_thread(S_INIT_SERVICE_ERROR);
-            }
+/**
+ * Reaps at most INIT_REAP_BATCH children.
+ * Returns true when there could be more children to reap.
+ */
+__static bool init_reap_children()
+{
+    int status;
+    pid_t pid;
+    uint16_t i;
+
+    for (i = 0; i < INIT_REAP_BATCH; i++) {
+        pid = waitpid(-1, &status, WNOHANG);
+        if (pid <= 0) {
+            return false;
         }
+        init_handle_exit(pid, status);
     }
 
+    return true;
+}
+
+static void init_handle_signal(const struct signalfd_siginfo *info)
+{
+    log_debug("Handling signal");
+
     switch(info->ssi_signo){
         case SIGCHLD:
+            // multiple signals do not stack, children are reaped in batches by init_loop
+            reap_pending = true;
             break;
         case SIGTERM:
         case SIGINT:
             log_debug("Received TERM/INT signal");
             // exit gracefully if halting with signal
-            init_halt_thread(S_OK);
+            init_halt_request(S_OK);
             break;
         case SIGHUP:
             log_debug("Received HUP signal");
             if (is_halting) {
                 log_warning("Ignoring apply request");
+            } else if (is_applying) {
+                if (!apply_requested) {
+                    log_info("Apply is already running, next one will follow");
+                }
+                apply_requested = true;
             } else {
                 log_debug("Running apply");
                 init_apply(NULL);
             }
             break;
+        case SIGUSR2:
+            log_debug("Received USR2 signal");
+            reexec_pending = true;
+            break;
+    }
+}
+
+/**
+ * Replaces running image with init binary from disk, services keep running.
+ * State is passed in memfd, see init_restore. Returns only on failure.
+ */
+static void init_reexec()
+{
+    struct snapshot s;
+    char value[16];
+    int fd;
+
+    if (is_booting || is_halting || is_applying) {
+        // apply and halt are driven by children of this image
+        log_warning("Ignoring re-exec request while booting, applying or halting");
+        return;
+    }
+
+    log_info("Re-executing init");
+    worker_stop();
+    control_dispatch_flush();
+
+    snapshot_init(&s);
+    snapshot_put_fd(&s, fd_control);
+    service_snapshot_save(&s);
+    control_snapshot_save(&s);
+    trace_snapshot_save(&s);
+
+    fd = snapshot_write_memfd(&s);
+    if (fd != -1) {
+        snprintf(value, sizeof(value), "%d", fd);
+        setenv(SNAPSHOT_ENV, value, 1);
+        snapshot_keep_fds(&s, true);
+        log_flush_blocking();
+
+        execvp(init_argv[0], init_argv);
+
+        log_errno_error("Could not execute %s", init_argv[0]);
+        unsetenv(SNAPSHOT_ENV);
+        snapshot_keep_fds(&s, false);
+        close(fd);
+    } else {
+        log_error("Could not save state, re-exec is aborted");
+    }
+    snapshot_free(&s);
+
+    if (use_apply_worker) {
+        worker_start();
     }
 }
 
+/**
+ * Takes over state saved by init_reexec in previous image.
+ * Services are registered before they are read from disk again.
+ */
+static status_t init_restore(int fd)
+{
+    struct snapshot s;
+    status_t status;
+
+    status = snapshot_read_fd(fd, &s);
+    if (status == S_OK) {
+        fd_control = snapshot_get_fd(&s);
+        status = service_snapshot_restore(&s);
+    }
+    if (status == S_OK) {
+        status = control_snapshot_restore(&s);
+    }
+    if (status == S_OK) {
+        status = trace_snapshot_restore(&s);
+        trace_add(TRACE_TRACK_INIT, TRACE_INSTANT, "re-exec");
+    }
+    snapshot_free(&s);
+    return status;
+}
+
 static int init_create_signal_fd()
 {
     int fd_signal;
@@ -307,9 +779,10 @@ static int init_create_signal_fd()
     sigaddset(&sigmask, SIGINT);
     sigaddset(&sigmask, SIGCHLD);
     sigaddset(&sigmask, SIGHUP);
+    sigaddset(&sigmask, SIGUSR2);
 
     // create fd for reading required signals
-    fd_signal = signalfd(-1, &sigmask, 0);
+    fd_signal = signalfd(-1, &sigmask, SFD_CLOEXEC);
     if (fd_signal == -1) {
         fatal_errno(ERROR_FD_FAILED, "Failed to create signal descriptor");
     }
@@ -319,48 +792,51 @@ static int init_create_signal_fd()
 
 __static status_t init_loop()
 {
-    struct epoll_event ev, events[10];
+    struct epoll_event events[INIT_MAX_EVENTS];
     int changes = 0;
     uint8_t buffer[sizeof(struct signalfd_siginfo)+128];
     status_t status;
-    uint8_t packet[control_max_data_length];
 
-    int fd_signal, fd_epoll, fd_control, fd_client;
+    int fd_signal, fd_client, fd;
     uint16_t i;
     struct sockaddr_un saddr_client;
     socklen_t peer_addr_size = sizeof(struct sockaddr_un);
-    bool errored;
     
     // make fd for reading required signals
     fd_signal = init_create_signal_fd();
 
-    // make fd for control socket
-    status = control_listen(&fd_control, 5);
-    if (status != S_OK) {
-        fatal_status(ERROR_SOCKET_FAILED, status, "Failed to create listening socket");
+    // make fd for control socket, unless it was kept over re-exec
+    if (fd_control == -1) {
+        status = control_listen(&fd_control, 5);
+        if (status != S_OK) {
+            fatal_status(ERROR_SOCKET_FAILED, status, "Failed to create listening socket");
+        }
     }
 
     // TODO: fatal_* should be replaced with S_INIT_* as it is return code to init
     
     // setup epoll
-    fd_epoll = epoll_create1(0);
-    if (fd_epoll == -1) {
-        fatal_errno(ERROR_EPOLL_FAILED, "Failed to setup polling");
+    if (event_setup() != S_OK) {
+        fatal(ERROR_EPOLL_FAILED, "Failed to setup polling");
     }
-
-    ev.events = EPOLLIN;
-    
-    ev.data.fd = fd_signal;
-    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_signal, &ev) == -1) {
-        fatal_errno(ERROR_EPOLL_FAILED, "Failed to setup signal polling");
+    log_setup_async();
+    if (event_add(fd_signal, EVENT_SIGNAL, 0) != S_OK) {
+        fatal(ERROR_EPOLL_FAILED, "Failed to setup signal polling");
     }
-    ev.data.fd = fd_control;
-    if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_control, &ev) == -1) {
-        fatal_errno(ERROR_EPOLL_FAILED, "Failed to setup control socket polling");
+    if (event_add(fd_control, EVENT_CONTROL, 0) != S_OK) {
+        fatal(ERROR_EPOLL_FAILED, "Failed to setup control socket polling");
     }
+
+    event_timer_init(&halt_timer, EVENT_HALT_TIMEOUT, 0);
+    event_timer_init(&halt_deadline, EVENT_HALT_TIMEOUT, 1);
+    metrics_setup();
+    health_start_all();
+    service_listen_all();
     
     for (;;) {
-        changes = epoll_wait(fd_epoll, events, 10, 500);
+        // do not wait when there are children left from previous batch,
+        // otherwise sleep until fd activity or next timer deadline
+        changes = event_wait(events, INIT_MAX_EVENTS, reap_pending ? 0 : -1);
         if (changes == -1) {
             fatal_errno(ERROR_EPOLL_WAIT, "Could not wait for events");
         }
@@ -368,58 +844,133 @@ __static status_t init_loop()
         log_debug("loop");
 
         for (i = 0; i < changes; i++) {
-            errored = false;
 
-            if (events[i].data.fd == fd_signal) {
-                // there should be sizeof(struct signalfd_siginfo) bytes available to read
-                if (read(fd_signal, buffer, sizeof(struct signalfd_siginfo)) != sizeof(struct signalfd_siginfo)) {
-                    log_error("Bad signal size info read");
-                    return ERROR_EPOLL_SIGNAL_MESSAGE;
-                }
-                init_handle_signal((struct signalfd_siginfo*)buffer);
-            }
-            // handle init client
-            else if (events[i].data.fd == fd_control) {
-                fd_client = accept(fd_control, (struct sockaddr *) &saddr_client, &peer_addr_size);
-                ev.data.fd = fd_client;
-                if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_client, &ev) == -1) {
-                    log_errno_error("Failed to setup control client socket polling");
-                    return ERROR_SOCKET_FAILED;
-                }
-            }
-            else {
-                // client connections
-                status = control_read_packet(events[i].data.fd, packet);
-                if (status == S_SOCKET_EOF) {
-                    // socket is closed
-                    log_debug("Client %d exitted", events[i].data.fd);
-                    errored = true;
-                } else {
-                    if (status == S_OK) {
-                        if (init_handle_client_command(packet, events[i].data.fd) != S_OK) {
-                            log_warning("Failed to handle client message from %d", events[i].data.fd);
-                            errored = true;
+            switch (EVENT_TYPE(events[i])) {
+                case EVENT_SIGNAL:
+                    // there should be sizeof(struct signalfd_siginfo) bytes available to read
+                    if (read(fd_signal, buffer, sizeof(struct signalfd_siginfo)) != sizeof(struct signalfd_siginfo)) {
+                        log_error("Bad signal size info read");
+                        return ERROR_EPOLL_SIGNAL_MESSAGE;
+                    }
+                    init_handle_signal((struct signalfd_siginfo*)buffer);
+                    break;
+
+                case EVENT_SERVICE_EXIT:
+                    init_handle_service_exit(EVENT_ID(events[i]));
+                    break;
+
+                case EVENT_SERVICE_NOTIFY:
+                    service_handle_notify(service_get(EVENT_ID(events[i])));
+                    break;
+
+                case EVENT_SERVICE_RESTART:
+                    service_handle_restart(service_get(EVENT_ID(events[i])));
+                    break;
+
+                case EVENT_SERVICE_TIMEOUT:
+                    service_handle_ready_timeout(service_get(EVENT_ID(events[i])));
+                    break;
+
+                case EVENT_METRICS_TIMER:
+                    metrics_handle_timer();
+                    break;
+
+                case EVENT_SERVICE_STOP_TIMEOUT:
+                    service_handle_stop_timeout(service_get(EVENT_ID(events[i])));
+                    break;
+
+                case EVENT_SERVICE_SOCKET:
+                    service_handle_socket(service_get(EVENT_ID(events[i])));
+                    break;
+
+                case EVENT_SERVICE_IDLE:
+                    service_handle_idle_timeout(service_get(EVENT_ID(events[i])));
+                    break;
+
+                case EVENT_SERVICE_DIR:
+                    service_handle_dir();
+                    break;
+
+                case EVENT_HALT_TIMEOUT:
+                    init_handle_halt_timeout(EVENT_ID(events[i]));
+                    break;
+
+                case EVENT_LOG:
+                    log_flush();
+                    break;
+
+                case EVENT_WORKER:
+                    init_handle_worker();
+                    break;
+
+                case EVENT_SERVICE_OUTPUT:
+                    service_handle_output(service_get(EVENT_ID(events[i])));
+                    break;
+
+                case EVENT_OUTPUT:
+                    output_handle_writable();
+                    break;
+
+                case EVENT_HEALTH_TIMER:
+                    health_handle_timer(EVENT_ID(events[i]));
+                    break;
+
+                // handle init client
+                case EVENT_CONTROL:
+                    fd_client = accept(fd_control, (struct sockaddr *) &saddr_client, &peer_addr_size);
+                    if (fd_client == -1) {
+                        if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                            log_errno_warning("Failed to accept control client");
+                            break;
                         }
-                    } else {
-                        log_status_warning(status, "Failed to read client message");
-                        errored = true;
+                        log_errno_error("Control socket failed");
+                        return ERROR_SOCKET_FAILED;
                     }
-                }
+                    if (control_client_add(fd_client) != S_OK) {
+                        log_errno_warning("Failed to setup control client socket polling");
+                        close(fd_client);
+                    }
+                    break;
 
-                if (errored) {
-                    ev.data.fd = events[i].data.fd;
-                    if (epoll_ctl(fd_epoll, EPOLL_CTL_DEL, events[i].data.fd, &ev) == -1) {
-                        fatal_errno(ERROR_EPOLL_FAILED, "Failed to remove client socket polling");
+                case EVENT_CLIENT:
+                    // client connections, both reading and writing never block
+                    fd = EVENT_ID(events[i]);
+                    if (events[i].events & EPOLLOUT) {
+                        control_client_flush(fd);
                     }
-                    control_unsubscribe_client(events[i].data.fd);
-                    shutdown(events[i].data.fd, SHUT_RDWR);
-                }
+                    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                        status = control_client_read(fd, init_handle_client_command);
+                        if (status == S_SOCKET_EOF) {
+                            log_debug("Client %d exitted", fd);
+                        } else if (status != S_OK) {
+                            log_status_warning(status, "Failed to handle client message from %d", fd);
+                        }
+                    }
+                    break;
             }
         }
 
-        if (is_halting) {
+        control_dispatch_flush();
+        facts_flush(init_get_state());
+        control_client_reap();
+        log_flush();
+
+        if (reap_pending) {
+            reap_pending = init_reap_children();
+        }
+
+        if (reexec_pending) {
+            reexec_pending = false;
+            init_reexec();
+        }
+
+        if (halt_phase == HALT_SERVICES) {
+            // services whose dependents exited meanwhile
+            service_stop_all();
             if (service_count_by_state(STATE_DOWN, true) == 0) {
                 log_info("No more services running, exitting");
+                trace_add(TRACE_TRACK_INIT, TRACE_END, NULL);
+                trace_write_file();
                 break;
             }
         }
@@ -428,16 +979,13 @@ __static status_t init_loop()
     shutdown(fd_control, SHUT_RDWR);
     unlink(PUPPETIZER_CONTROL_SOCKET);
 
-    if (halt_thread != 0) {
-        log_debug("Waiting for halt thread to exit");
-        pthread_join(halt_thread, NULL);
-    }
-   
-   return halt_cause;
+    return halt_cause;
 }
 
 __static int init_boot()
 {
+    is_booting = true;
+    trace_add(TRACE_TRACK_INIT, TRACE_BEGIN, "boot");
     boot_pid = init_apply("init");
     if (boot_pid == -1) {
         fatal(ERROR_BOOT_FAILED, "Could not start boot script");
@@ -446,18 +994,53 @@ __static int init_boot()
     return init_loop();
 }
 
-int init_main(bool puppet_halt)
+int init_main(bool puppet_halt, bool apply_worker, uint32_t halt_seconds)
 {
     status_t status;
+    uint64_t discover_start;
+    int snapshot_fd = snapshot_env_fd();
 
     use_puppet_when_halting = puppet_halt;
+    use_apply_worker = apply_worker;
+    halt_timeout = halt_seconds;
 
-    log_info("Running init");
+    log_info(snapshot_fd == -1 ? "Running init" : "Running init after re-exec");
     init_setup_signals();
+    if (event_setup() != S_OK) {
+        fatal(ERROR_EPOLL_FAILED, "Failed to setup polling");
+    }
+    // before scanning, so files written meanwhile by boot apply are not missed
+    service_watch_dir();
+    if (cgroup_setup() == S_OK) {
+        log_debug("Services will run in own cgroups");
+    } else {
+        log_info("Cgroup v2 is not delegated, resource limits of services are disabled");
+    }
+    if (snapshot_fd != -1) {
+        status = init_restore(snapshot_fd);
+        if (status != S_OK) {
+            // processes left by previous image are not known anymore
+            fatal_status(ERROR_BOOT_FAILED, status, "Failed to restore state after re-exec");
+        }
+    }
+    discover_start = trace_now();
     status = service_create_all(NULL);
     if (status != S_OK) {
         fatal_status(ERROR_BOOT_FAILED, status, "Failed to initialise services");
     }
+    trace_complete(TRACE_TRACK_INIT, "discover services", discover_start, trace_now() - discover_start);
+    status = health_create_all();
+    if (status != S_OK) {
+        log_status_warning(status, "Health checks are disabled");
+    }
+
+    if (snapshot_fd != -1) {
+        if (use_apply_worker) {
+            worker_start();
+        }
+        facts_changed();
+        return init_loop();
+    }
 
     init_detach_from_terminal();
     return init_boot();
@@ -3,7 +3,10 @@
 
 #include "common.h"
 
-int init_main(bool puppet_halt);
+// argv of init, executed again on re-exec
+extern char **init_argv;
+
+int init_main(bool puppet_halt, bool apply_worker, uint32_t halt_seconds);
 
 #define INIT_STATE_BOOTING 0
 #define INIT_STATE_RUNNING 1
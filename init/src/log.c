@@ -3,11 +3,49 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
 #include "log.h"
+#include "event.h"
+
+#define LOG_MODULE "log"
+
+// iovecs passed to single writev
+#define LOG_FLUSH_IOV 64
 
 log_level_t log_level = LOG_INFO;
+log_format_t log_format = LOG_FORMAT_TEXT;
 char *log_name = "?";
+uint64_t log_dropped = 0;
+
+struct log_entry {
+    uint16_t len;
+    char data[LOG_ENTRY_SIZE];
+};
+
+/*
+ * In async mode lines are formatted straight into ring and written out
+ * by event loop, so slow log reader never blocks init.
+ */
+static struct log_entry ring[LOG_RING_SIZE];
+static uint16_t ring_head = 0;
+static uint16_t ring_count = 0;
+// bytes of oldest entry already written
+static uint16_t ring_offset = 0;
+
+static int log_fd = -1;
+static bool log_is_socket = false;
+static bool log_blocking = false;
+static bool log_writable = false;
+static bool log_flushing = false;
+// after ring overflow new lines are dropped until half of it is free
+static bool log_dropping = false;
+static uint64_t log_dropped_since = 0;
 
 static const char *log_level_name(log_level_t level)
 {
@@ -20,46 +58,363 @@ static const char *log_level_name(log_level_t level)
     }
 }
 
-void vlog(log_level_t level, const char *module, const char *msg, va_list ap)
+bool log_parse_format(const char *name, log_format_t *format)
+{
+    if (strcmp(name, "text") == 0) {
+        *format = LOG_FORMAT_TEXT;
+    } else if (strcmp(name, "logfmt") == 0) {
+        *format = LOG_FORMAT_LOGFMT;
+    } else if (strcmp(name, "json") == 0) {
+        *format = LOG_FORMAT_JSON;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void log_advance(size_t *len, int written, size_t limit)
+{
+    if (written < 0) {
+        return;
+    }
+    *len += written;
+    if (*len > limit) {
+        *len = limit;
+    }
+}
+
+static size_t log_escape(char *out, size_t limit, const char *text)
+{
+    size_t len = 0;
+    const char *c;
+
+    for (c = text; *c && len < limit; c++) {
+        switch (*c) {
+            case '"':  case '\\':
+                if (len + 2 > limit) return len;
+                out[len++] = '\\';
+                out[len++] = *c;
+                break;
+            case '\n':
+                if (len + 2 > limit) return len;
+                out[len++] = '\\';
+                out[len++] = 'n';
+                break;
+            case '\t':
+                if (len + 2 > limit) return len;
+                out[len++] = '\\';
+                out[len++] = 't';
+                break;
+            default:
+                if ((unsigned char)*c < 0x20) {
+                    if (len + 6 > limit) return len;
+                    len += sprintf(out + len, "\\u%04x", (unsigned char)*c);
+                } else {
+                    out[len++] = *c;
+                }
+        }
+    }
+    return len;
+}
+
+/**
+ * Formats single line ending with newline, returns its length.
+ */
+static uint16_t log_format_line(char *out, log_level_t level, const char *module, const char *suffix, const char *msg, va_list ap)
+{
+    // room for closing characters and newline
+    const size_t limit = LOG_ENTRY_SIZE - 3;
+    char text[LOG_ENTRY_SIZE], stamp[32];
+    struct timespec ts;
+    struct tm tm;
+    size_t len = 0;
+
+    if (log_format == LOG_FORMAT_TEXT) {
+        log_advance(&len, snprintf(out, limit + 1, "[%s.%s:%s] ", log_name, module, log_level_name(level)), limit);
+        log_advance(&len, vsnprintf(out + len, limit + 1 - len, msg, ap), limit);
+        if (suffix) {
+            log_advance(&len, snprintf(out + len, limit + 1 - len, "%s", suffix), limit);
+        }
+        out[len++] = '\n';
+        return len;
+    }
+
+    len = 0;
+    log_advance(&len, vsnprintf(text, sizeof(text), msg, ap), sizeof(text) - 1);
+    if (suffix) {
+        log_advance(&len, snprintf(text + len, sizeof(text) - len, "%s", suffix), sizeof(text) - 1);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gmtime_r(&ts.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    len = 0;
+    if (log_format == LOG_FORMAT_JSON) {
+        log_advance(&len, snprintf(out, limit + 1, "{\"time\":\"%s.%03ldZ\",\"level\":\"%s\",\"name\":\"%s\",\"module\":\"%s\",\"msg\":\"",
+            stamp, ts.tv_nsec / 1000000, log_level_name(level), log_name, module), limit);
+        len += log_escape(out + len, limit - len, text);
+        out[len++] = '"';
+        out[len++] = '}';
+    } else {
+        log_advance(&len, snprintf(out, limit + 1, "time=%s.%03ldZ level=%s name=%s module=%s msg=\"",
+            stamp, ts.tv_nsec / 1000000, log_level_name(level), log_name, module), limit);
+        len += log_escape(out + len, limit - len, text);
+        out[len++] = '"';
+    }
+    out[len++] = '\n';
+    return len;
+}
+
+static ssize_t log_write(struct iovec *iov, int count)
+{
+    struct msghdr mh;
+
+    if (!log_is_socket) {
+        return writev(log_fd, iov, count);
+    }
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = count;
+    return sendmsg(log_fd, &mh, MSG_NOSIGNAL | (log_blocking ? 0 : MSG_DONTWAIT));
+}
+
+static void log_set_writable(bool writable)
 {
+    if (log_writable != writable) {
+        log_writable = writable;
+        event_set_writable(log_fd, EVENT_LOG, 0, writable);
+    }
+}
+
+static void log_disable()
+{
+    event_remove(log_fd);
+    close(log_fd);
+    log_fd = -1;
+    log_dropped += ring_count;
+    ring_count = 0;
+    ring_offset = 0;
+}
+
+/**
+ * Writes out as much of ring as possible without blocking,
+ * returns true when nothing is left.
+ */
+bool log_flush()
+{
+    struct iovec iov[LOG_FLUSH_IOV];
+    struct log_entry *entry;
+    ssize_t written;
+    uint16_t i, skip;
+
+    if (log_fd == -1 || log_flushing) {
+        return ring_count == 0;
+    }
+    log_flushing = true;
+
+    while (ring_count > 0) {
+        for (i = 0; i < LOG_FLUSH_IOV && i < ring_count; i++) {
+            entry = &ring[(ring_head + i) % LOG_RING_SIZE];
+            skip = i == 0 ? ring_offset : 0;
+            iov[i].iov_base = entry->data + skip;
+            iov[i].iov_len = entry->len - skip;
+        }
+
+        written = log_write(iov, i);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                log_set_writable(true);
+                log_flushing = false;
+                return false;
+            }
+            // reader is gone, nothing more can be written
+            log_disable();
+            break;
+        }
+
+        while (written > 0) {
+            entry = &ring[ring_head];
+            if (written < entry->len - ring_offset) {
+                ring_offset += written;
+                break;
+            }
+            written -= entry->len - ring_offset;
+            ring_offset = 0;
+            ring_head = (ring_head + 1) % LOG_RING_SIZE;
+            ring_count--;
+        }
+    }
+
+    if (log_fd != -1) {
+        log_set_writable(false);
+    }
+    log_flushing = false;
+    return true;
+}
+
+/**
+ * Writes out whole ring even when log fd would block, used before exit and exec.
+ */
+void log_flush_blocking()
+{
+    int flags;
+
+    if (log_fd == -1) {
+        return;
+    }
+    flags = fcntl(log_fd, F_GETFL);
+    if (flags != -1) {
+        fcntl(log_fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    log_blocking = true;
+    log_flush();
+    // init keeps running when exec failed
+    log_blocking = false;
+    if (flags != -1) {
+        fcntl(log_fd, F_SETFL, flags);
+    }
+}
+
+/**
+ * Switches to buffered output drained by event loop.
+ * Regular files never block so they are still written directly.
+ */
+void log_setup_async()
+{
+    struct stat st;
+    int fd;
+
+    if (log_fd != -1 || fstat(STDERR_FILENO, &st) == -1) {
+        return;
+    }
+
+    if (S_ISSOCK(st.st_mode)) {
+        // file status is shared with children, use per call flags instead
+        fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+        log_is_socket = true;
+    } else if (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)) {
+        // private open file description, so O_NONBLOCK does not leak to services
+        fd = open("/proc/self/fd/2", O_WRONLY | O_APPEND | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+        log_is_socket = false;
+    } else {
+        return;
+    }
+
+    if (fd == -1) {
+        log_errno_warning("Failed to open log output, logging synchronously");
+        return;
+    }
+    if (event_add(fd, EVENT_LOG, 0) != S_OK) {
+        close(fd);
+        return;
+    }
+
+    log_fd = fd;
+    atexit(log_flush_blocking);
+}
+
+static void log_push(log_level_t level, const char *module, const char *suffix, const char *msg, va_list ap);
+
+static void log_push_line(log_level_t level, const char *module, const char *msg, ...)
+{
+    va_list ap;
+    va_start(ap, msg);
+    log_push(level, module, NULL, msg, ap);
+    va_end(ap);
+}
+
+static void log_push(log_level_t level, const char *module, const char *suffix, const char *msg, va_list ap)
+{
+    struct log_entry *entry;
+    uint64_t dropped;
+
+    if (log_dropping && ring_count > LOG_RING_SIZE / 2) {
+        log_dropped++;
+        log_dropped_since++;
+        return;
+    }
+    if (ring_count == LOG_RING_SIZE) {
+        log_dropping = true;
+        log_dropped++;
+        log_dropped_since++;
+        return;
+    }
+    if (log_dropping) {
+        dropped = log_dropped_since;
+        log_dropping = false;
+        log_dropped_since = 0;
+        log_push_line(LOG_WARNING, LOG_MODULE, "Dropped %llu log messages", (unsigned long long)dropped);
+    }
+
+    entry = &ring[(ring_head + ring_count) % LOG_RING_SIZE];
+    entry->len = log_format_line(entry->data, level, module, suffix, msg, ap);
+    ring_count++;
+
+    if (ring_count >= LOG_RING_SIZE / 4 * 3) {
+        log_flush();
+    }
+}
+
+static void vlog(log_level_t level, const char *module, const char *suffix, const char *msg, va_list ap)
+{
+    char line[LOG_ENTRY_SIZE];
+    uint16_t len;
+    int saved_errno;
+
     if (log_level < level) {
         return;
     }
-    char tmp[strlen(msg) + strlen(log_name) + strlen(module) + 2 + 10];
-    sprintf(tmp, "[%s.%s:%s] %s\n", log_name, module, log_level_name(level), msg);
-    vfprintf(stderr, tmp, ap);
+
+    saved_errno = errno;
+    if (log_fd != -1) {
+        log_push(level, module, suffix, msg, ap);
+    } else {
+        len = log_format_line(line, level, module, suffix, msg, ap);
+        if (write(STDERR_FILENO, line, len) == -1) {
+            // nowhere to report it
+        }
+    }
+    errno = saved_errno;
 }
 
 void log_any(log_level_t level, const char *module, const char *msg, ...)
 {
-        va_list ap;
-        va_start(ap, msg);
-        vlog(level, module, msg, ap);
-        va_end(ap);
+    va_list ap;
+    va_start(ap, msg);
+    vlog(level, module, NULL, msg, ap);
+    va_end(ap);
 }
 
 void log_status(log_level_t level, const char *module, status_t status, const char *msg, ...)
 {
-    uint16_t size = strlen(msg) + 6 + 2 + 128; // msg + status + translation
-    char tmp[size];
+    char suffix[128 + 16];
 
-    snprintf(tmp, size, "%s (status=%d %s)", msg, status, status_translation(status));
+    if (log_level < level) {
+        return;
+    }
+    snprintf(suffix, sizeof(suffix), " (status=%d %s)", status, status_translation(status));
 
     va_list ap;
     va_start(ap, msg);
-    vlog(level, module, tmp, ap);
+    vlog(level, module, suffix, msg, ap);
     va_end(ap);
 }
 
 void log_errno(log_level_t level, const char *module, const char *msg, ...)
 {
-    uint16_t size = strlen(msg) + 5 + 2 + 128; // msg + status + translation
-    char tmp[size];
+    char suffix[128 + 16];
 
-    snprintf(tmp, size, "%s (errno=%d %s)", msg, errno, strerror(errno));
+    if (log_level < level) {
+        return;
+    }
+    snprintf(suffix, sizeof(suffix), " (errno=%d %s)", errno, strerror(errno));
 
     va_list ap;
     va_start(ap, msg);
-    vlog(level, module, tmp, ap);
+    vlog(level, module, suffix, msg, ap);
     va_end(ap);
 }
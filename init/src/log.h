@@ -2,6 +2,7 @@
 #define _LOG_H
 
 #include <stdarg.h>
+#include <stdbool.h>
 #include "status.h"
 
 #define LOG_NONE 0
@@ -11,8 +12,26 @@
 #define LOG_DEBUG 4
 typedef uint8_t log_level_t;
 
+#define LOG_FORMAT_TEXT 0
+#define LOG_FORMAT_LOGFMT 1
+#define LOG_FORMAT_JSON 2
+typedef uint8_t log_format_t;
+
+// single formatted line, longer messages are truncated
+#define LOG_ENTRY_SIZE 512
+// entries buffered in async mode before dropping
+#define LOG_RING_SIZE 256
+
 extern log_level_t log_level;
+extern log_format_t log_format;
 extern char *log_name;
+// messages lost because ring was full
+extern uint64_t log_dropped;
+
+bool log_parse_format(const char *name, log_format_t *format);
+void log_setup_async();
+bool log_flush();
+void log_flush_blocking();
 
 void log_any(log_level_t level, const char *module, const char *msg, ...);
 void log_status(log_level_t level, const char *module, status_t status, const char *msg, ...);
@@ -21,7 +40,8 @@ void log_errno(log_level_t level, const char *module, const char *msg, ...);
 #define log_error(...) log_any(LOG_ERROR, LOG_MODULE, __VA_ARGS__)
 #define log_info(...) log_any(LOG_INFO, LOG_MODULE, __VA_ARGS__)
 #define log_warning(...) log_any(LOG_WARNING, LOG_MODULE, __VA_ARGS__)
-#define log_debug(...) log_any(LOG_DEBUG, LOG_MODULE, __VA_ARGS__)
+// arguments are not evaluated unless debug is enabled
+#define log_debug(...) do { if (log_level >= LOG_DEBUG) log_any(LOG_DEBUG, LOG_MODULE, __VA_ARGS__); } while (0)
 
 #define log_status_error(...) log_status(LOG_ERROR, LOG_MODULE, __VA_ARGS__)
 #define log_status_info(...) log_status(LOG_INFO, LOG_MODULE, __VA_ARGS__)
@@ -1,32 +1,45 @@
 #include <argp.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include "common.h"
 #include "client.h"
 #include "init.h"
 #include "control.h"
 #include "log.h"
+#include "conf.h"
+#include "metrics.h"
+#include "trace.h"
 
 const char *argp_program_version = "init 1.0.0";
 const char *argp_program_bug_address = "<arkadiusz.dziegiel@glorpen.pl>";
 static char doc[] = "Puppetizer init system.";
-static char args_doc[] = "status|[<start|stop|status> <SERVICE>]";
+static char args_doc[] = "status|health|list|events|metrics|trace|[<start|stop|status|logs> <SERVICE>...]|trace-report <PHASE=SECONDS>...";
 static struct argp_option options[] = { 
     { "init", '0', 0, 0, "Run in system init mode, default if pid 1."},
     { "wait", 'w', 0, 0, "Wait for service start/stop when in client mode."},
     { "verbose", 'v', 0, 0, "Increase verbosity level (error, warning, info, debug)."},
     { "safe-halt", 'h', 0, 0, "When in init mode run puppet on halt to stop services."},
+    { "log-format", 'f', "FORMAT", 0, "Log output format (text, logfmt, json)."},
+    { "apply-worker", 'a', 0, 0, "When in init mode keep puppet loaded in worker process for reloads and halt."},
+    { "halt-timeout", 't', "SECONDS", 0, "When in init mode kill everything left when halt takes longer."},
+    { "metrics-file", 'm', "FILE", 0, "When in init mode write service metrics in Prometheus text format to FILE."},
+    { "trace-file", 'T', "FILE", 0, "When in init mode write Chrome trace of boot and services to FILE after boot and on exit."},
     { 0 } 
 };
 
 struct arguments {
     enum { SERVER_MODE, CLIENT_MODE } mode;
-    char *svc_name;
+    const char **svc_names;
+    uint16_t svc_count;
     uint8_t svc_action;
     bool wait;
     log_level_t log_level;
+    log_format_t log_format;
     bool safe_halt;
+    bool apply_worker;
+    uint32_t halt_timeout;
 };
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
@@ -43,6 +56,25 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 'h':
             arguments->safe_halt = true;
             break;
+        case 'a':
+            arguments->apply_worker = true;
+            break;
+        case 't':
+            if (!conf_parse_uint(arg, &arguments->halt_timeout)) {
+                argp_error(state, "bad halt timeout: %s", arg);
+            }
+            break;
+        case 'm':
+            metrics_path = arg;
+            break;
+        case 'T':
+            trace_path = arg;
+            break;
+        case 'f':
+            if (!log_parse_format(arg, &arguments->log_format)) {
+                argp_error(state, "unknown log format: %s", arg);
+            }
+            break;
         case ARGP_KEY_ARG: 
             switch (state->arg_num) {
                 case 0:
@@ -52,18 +84,35 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
                         arguments->svc_action = CMD_SERVICE_STOP;
                     } else if (strcmp(arg, "status") == 0) {
                         arguments->svc_action = CMD_SERVICE_STATUS;
+                    } else if (strcmp(arg, "health") == 0) {
+                        arguments->svc_action = CMD_HEALTH;
+                    } else if (strcmp(arg, "list") == 0) {
+                        arguments->svc_action = CMD_SERVICE_LIST;
+                    } else if (strcmp(arg, "events") == 0) {
+                        arguments->svc_action = CMD_SERVICE_EVENTS;
+                    } else if (strcmp(arg, "logs") == 0) {
+                        arguments->svc_action = CMD_SERVICE_LOGS;
+                    } else if (strcmp(arg, "metrics") == 0) {
+                        arguments->svc_action = CMD_METRICS;
+                    } else if (strcmp(arg, "trace") == 0) {
+                        arguments->svc_action = CMD_TRACE;
+                    } else if (strcmp(arg, "trace-report") == 0) {
+                        arguments->svc_action = CMD_TRACE_REPORT;
                     } else {
                         return ARGP_ERR_UNKNOWN;
                     }
                     break;
-                case 1:
-                    arguments->svc_name = arg;
-                    break;
                 default:
-                    return ARGP_ERR_UNKNOWN;
+                    arguments->svc_names[arguments->svc_count++] = arg;
+                    break;
             }
             return 0;
             break;
+        case ARGP_KEY_END:
+            if ((arguments->svc_action == CMD_SERVICE_START || arguments->svc_action == CMD_SERVICE_STOP || arguments->svc_action == CMD_SERVICE_LOGS || arguments->svc_action == CMD_TRACE_REPORT) && arguments->svc_count == 0) {
+                argp_usage(state);
+            }
+            break;
         default:
             return ARGP_ERR_UNKNOWN;
     }   
@@ -78,25 +127,31 @@ int main(int argc, char** argv)
 
     arguments.mode = getpid() == 1?SERVER_MODE:CLIENT_MODE;
     arguments.svc_action = CMD_SERVICE_STATUS;
-    arguments.svc_name = NULL;
+    arguments.svc_names = calloc(argc, sizeof(char*));
+    arguments.svc_count = 0;
     arguments.wait = false;
     arguments.log_level = LOG_ERROR;
+    arguments.log_format = LOG_FORMAT_TEXT;
     arguments.safe_halt = false;
+    arguments.apply_worker = false;
+    arguments.halt_timeout = 0;
 
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
     log_level = arguments.log_level;
+    log_format = arguments.log_format;
 
-    if (arguments.svc_action == CMD_SERVICE_STATUS && arguments.svc_name == NULL) {
+    if (arguments.svc_action == CMD_SERVICE_STATUS && arguments.svc_count == 0) {
         arguments.svc_action = CMD_INIT_STATUS;
     }
 
     switch(arguments.mode) {
         case SERVER_MODE:
             log_name = "init";
-            return init_main(arguments.safe_halt);
+            init_argv = argv;
+            return init_main(arguments.safe_halt, arguments.apply_worker, arguments.halt_timeout);
         case CLIENT_MODE:
             log_name = "client";
-            return client_main(arguments.svc_name, arguments.svc_action, arguments.wait);
+            return client_main(arguments.svc_names, arguments.svc_count, arguments.svc_action, arguments.wait);
     }
 }
@@ -0,0 +1,185 @@
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "service.h"
+#include "cgroup.h"
+#include "event.h"
+#include "log.h"
+
+#define LOG_MODULE "metrics"
+
+const char *metrics_path = NULL;
+static struct event_timer sample_timer;
+
+/**
+ * Samples periodically only for metrics file, control requests sample on demand
+ * so idle init is not woken up.
+ */
+void metrics_setup()
+{
+    event_timer_init(&sample_timer, EVENT_METRICS_TIMER, 0);
+    if (metrics_path != NULL) {
+        event_timer_set(&sample_timer, METRICS_SAMPLE_INTERVAL);
+    }
+}
+
+/**
+ * Reads cpu time and rss of main process of service from /proc/<pid>/stat.
+ */
+static bool metrics_sample(struct service *svc)
+{
+    static long ticks = 0, page_size = 0;
+    unsigned long long utime, stime;
+    long long rss;
+    char path[32], buff[1024], *p;
+    ssize_t len;
+    int fd;
+
+    if (ticks == 0) {
+        ticks = sysconf(_SC_CLK_TCK);
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", svc->pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    len = read(fd, buff, sizeof(buff) - 1);
+    close(fd);
+    if (len <= 0) {
+        return false;
+    }
+    buff[len] = 0;
+
+    // process name can contain spaces and parens, fields follow last one
+    p = strrchr(buff, ')');
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %*d %*d %*u %*u %lld",
+            &utime, &stime, &rss) != 3) {
+        return false;
+    }
+
+    svc->stats.cpu_ms = (utime + stime) * 1000 / ticks;
+    svc->stats.rss = rss > 0 ? (uint64_t)rss * page_size : 0;
+    return true;
+}
+
+static void metrics_write_file()
+{
+    struct service_metrics *metrics;
+    char tmp_path[256];
+    uint16_t count;
+    FILE *f;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", metrics_path);
+    f = fopen(tmp_path, "we");
+    if (f == NULL) {
+        log_errno_warning("Could not create metrics file %s", tmp_path);
+        return;
+    }
+
+    count = metrics_collect(&metrics);
+    metrics_write_prometheus(f, metrics, count, log_dropped);
+    free(metrics);
+
+    if (fclose(f) != 0 || rename(tmp_path, metrics_path) == -1) {
+        log_errno_warning("Could not write metrics file %s", metrics_path);
+        unlink(tmp_path);
+    }
+}
+
+/**
+ * Refreshes resource usage of running services, cgroup totals
+ * cover whole process tree and are preferred when available.
+ */
+void metrics_sample_all()
+{
+    struct service *svc;
+    uint16_t i;
+
+    for (i = 0; (svc = service_get(i)) != NULL; i++) {
+        if (svc->pid <= 0) continue;
+        metrics_sample(svc);
+        if (svc->cgroup_fd != -1) {
+            cgroup_cpu_usage(svc->cgroup_fd, &svc->stats.cpu_ms);
+            cgroup_memory_usage(svc->cgroup_fd, &svc->stats.rss);
+        }
+    }
+}
+
+void metrics_handle_timer()
+{
+    if (metrics_path == NULL) {
+        return;
+    }
+    metrics_sample_all();
+    metrics_write_file();
+    event_timer_set(&sample_timer, METRICS_SAMPLE_INTERVAL);
+}
+
+/**
+ * Returns number of services, array has to be freed by caller.
+ * Names point to service names.
+ */
+uint16_t metrics_collect(struct service_metrics **metrics)
+{
+    struct service_metrics *m;
+    struct service *svc;
+    uint64_t now = event_now();
+    uint16_t i, count = 0;
+
+    while (service_get(count) != NULL) count++;
+    *metrics = calloc(count ? count : 1, sizeof(struct service_metrics));
+
+    for (i = 0; i < count; i++) {
+        svc = service_get(i);
+        m = &(*metrics)[i];
+        m->name = svc->name;
+        m->state = svc->state;
+        m->starts = svc->stats.starts;
+        m->restarts = svc->stats.restarts;
+        m->last_exit = svc->stats.last_exit;
+        m->uptime = svc->pid > 0 ? (now - svc->started_at) / 1000 : 0;
+        m->ready_time = svc->stats.ready_at > 0 ? svc->stats.ready_at - svc->started_at : 0;
+        m->cpu_ms = svc->stats.cpu_ms;
+        m->rss = svc->stats.rss;
+        m->output_bytes = svc->output.bytes;
+        m->output_dropped = svc->output.dropped;
+    }
+    return count;
+}
+
+#define METRICS_SERIES(F, M, COUNT, NAME, TYPE, HELP, FMT, VALUE) do { \
+        uint16_t _i; \
+        fprintf(F, "# HELP puppetizer_" NAME " " HELP "\n# TYPE puppetizer_" NAME " " TYPE "\n"); \
+        for (_i = 0; _i < COUNT; _i++) { \
+            const struct service_metrics *m = &M[_i]; \
+            fprintf(F, "puppetizer_" NAME "{service=\"%s\"} " FMT "\n", m->name, VALUE); \
+        } \
+    } while (0)
+
+/**
+ * Writes metrics in Prometheus text exposition format.
+ */
+void metrics_write_prometheus(FILE *f, const struct service_metrics *metrics, uint16_t count, uint64_t dropped)
+{
+    METRICS_SERIES(f, metrics, count, "service_up", "gauge", "Whether service is up.", "%d", m->state == STATE_UP);
+    METRICS_SERIES(f, metrics, count, "service_starts_total", "counter", "Times service was spawned.", "%u", m->starts);
+    METRICS_SERIES(f, metrics, count, "service_restarts_total", "counter", "Times service was restarted after crash.", "%u", m->restarts);
+    METRICS_SERIES(f, metrics, count, "service_last_exit_code", "gauge", "Exit code of last run, negative for signals.", "%d", m->last_exit);
+    METRICS_SERIES(f, metrics, count, "service_uptime_seconds", "gauge", "Seconds since service was spawned.", "%u", m->uptime);
+    METRICS_SERIES(f, metrics, count, "service_ready_seconds", "gauge", "Time from spawn to ready of last start.", "%.3f", m->ready_time / 1000.0);
+    METRICS_SERIES(f, metrics, count, "service_cpu_seconds_total", "counter", "CPU time of service, whole cgroup when available.", "%.3f", m->cpu_ms / 1000.0);
+    METRICS_SERIES(f, metrics, count, "service_memory_rss_bytes", "gauge", "Resident memory of service, whole cgroup when available.", "%llu", (unsigned long long)m->rss);
+    METRICS_SERIES(f, metrics, count, "service_output_bytes_total", "counter", "Captured output forwarded to stdout.", "%llu", (unsigned long long)m->output_bytes);
+    METRICS_SERIES(f, metrics, count, "service_output_dropped_bytes_total", "counter", "Captured output dropped when stdout was full.", "%llu", (unsigned long long)m->output_dropped);
+
+    fprintf(f, "# HELP puppetizer_log_dropped_total Init log messages dropped when log output was full.\n"
+        "# TYPE puppetizer_log_dropped_total counter\npuppetizer_log_dropped_total %llu\n", (unsigned long long)dropped);
+}
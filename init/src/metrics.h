@@ -0,0 +1,39 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "status.h"
+
+// ms between samples of service resource usage
+#define METRICS_SAMPLE_INTERVAL 10000
+
+/**
+ * Snapshot of single service sent over control socket.
+ */
+struct service_metrics {
+    const char *name;
+    uint8_t state;
+    uint32_t starts;
+    uint32_t restarts;
+    int16_t last_exit;
+    // seconds, 0 when not running
+    uint32_t uptime;
+    // ms from spawn to UP of last start, 0 when it did not get UP
+    uint32_t ready_time;
+    uint64_t cpu_ms;
+    uint64_t rss;
+    uint64_t output_bytes;
+    uint64_t output_dropped;
+};
+
+// Prometheus text file rewritten after each sample, NULL to disable
+extern const char *metrics_path;
+
+void metrics_setup();
+void metrics_sample_all();
+void metrics_handle_timer();
+uint16_t metrics_collect(struct service_metrics **metrics);
+void metrics_write_prometheus(FILE *f, const struct service_metrics *metrics, uint16_t count, uint64_t log_dropped);
+
+#endif
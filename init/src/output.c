@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "output.h"
+#include "event.h"
+#include "log.h"
+
+#define LOG_MODULE "output"
+
+// moved per splice call
+#define OUTPUT_CHUNK 65536
+// chunks handled per event, so one noisy service does not starve others
+#define OUTPUT_BATCH 16
+
+/*
+ * Output is moved from service pipe to init stdout with splice(), so it is
+ * never copied to userspace. Tail is taken with tee() to scratch pipe and
+ * only last OUTPUT_TAIL_SIZE bytes of each chunk are read from it.
+ */
+static bool dest_ready = false;
+static int dest_fd = STDOUT_FILENO;
+static bool dest_polled = false;
+// ttys and other devices can not be spliced to
+static bool dest_splice = false;
+// sockets would block in splice, they are written with per call flags
+static bool dest_socket = false;
+static bool dest_writable = false;
+static int null_fd = -1;
+static int scratch[2] = { -1, -1 };
+
+// outputs waiting for stdout to become writable
+static struct output **blocked = NULL;
+static uint16_t blocked_count = 0;
+static uint16_t blocked_size = 0;
+
+static void output_dest_setup()
+{
+    struct stat st;
+    int fd;
+
+    if (dest_ready) {
+        return;
+    }
+    dest_ready = true;
+
+    if (fstat(STDOUT_FILENO, &st) == -1) {
+        memset(&st, 0, sizeof(st));
+    }
+    dest_splice = S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode);
+    dest_socket = S_ISSOCK(st.st_mode);
+    // private open file description, so O_NONBLOCK does not leak to services
+    if (S_ISFIFO(st.st_mode) || isatty(STDOUT_FILENO)) {
+        fd = open("/proc/self/fd/1", O_WRONLY | O_APPEND | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+        if (fd != -1 && event_add(fd, EVENT_OUTPUT, 0) == S_OK) {
+            dest_fd = fd;
+            dest_polled = true;
+        } else if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (pipe2(scratch, O_CLOEXEC | O_NONBLOCK) == -1) {
+        log_errno_error("Could not create output scratch pipe");
+        scratch[0] = -1;
+    } else {
+        fcntl(scratch[1], F_SETPIPE_SZ, OUTPUT_CHUNK);
+    }
+}
+
+void output_init(struct output *out, uint16_t id, const char *prefix)
+{
+    memset(out, 0, sizeof(struct output));
+    out->id = id;
+    out->prefix = prefix;
+    out->fd = -1;
+}
+
+static void output_set_writable(bool writable)
+{
+    if (dest_polled && dest_writable != writable) {
+        dest_writable = writable;
+        event_set_writable(dest_fd, EVENT_OUTPUT, 0, writable);
+    }
+}
+
+static void output_unblock(struct output *out)
+{
+    uint16_t i;
+
+    if (!out->blocked) {
+        return;
+    }
+    out->blocked = false;
+    for (i = 0; i < blocked_count; i++) {
+        if (blocked[i] == out) {
+            blocked[i] = blocked[--blocked_count];
+            break;
+        }
+    }
+}
+
+/**
+ * Stops polling service pipe until stdout is writable again,
+ * data is left in pipe so service is slowed down instead of init.
+ */
+static void output_block(struct output *out)
+{
+    if (out->blocked) {
+        return;
+    }
+    if (blocked_count == blocked_size) {
+        blocked_size = blocked_size == 0 ? 8 : blocked_size * 2;
+        blocked = realloc(blocked, sizeof(struct output*) * blocked_size);
+    }
+    event_remove(out->fd);
+    blocked[blocked_count++] = out;
+    out->blocked = true;
+    output_set_writable(true);
+}
+
+/**
+ * Creates pipe for service stdout and stderr.
+ * Returns write end for child or -1 on failure.
+ */
+int output_setup(struct output *out)
+{
+    int fds[2];
+
+    output_dest_setup();
+    if (scratch[0] == -1 || null_fd == -1) {
+        return -1;
+    }
+    // output left by previous run, eg. from detached grandchildren
+    output_close(out);
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        log_errno_error("Could not create output pipe for service %s", out->prefix);
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    out->fd = fds[0];
+    out->line_start = true;
+    out->pending = 0;
+    if (event_add(out->fd, EVENT_SERVICE_OUTPUT, out->id) != S_OK) {
+        close(fds[0]);
+        close(fds[1]);
+        out->fd = -1;
+        return -1;
+    }
+    return fds[1];
+}
+
+void output_close(struct output *out)
+{
+    if (out->fd == -1) {
+        return;
+    }
+    if (out->blocked) {
+        output_unblock(out);
+    } else {
+        event_remove(out->fd);
+    }
+    close(out->fd);
+    out->fd = -1;
+}
+
+static void output_tail_append(struct output *out, const char *data, size_t len)
+{
+    size_t pos, part;
+
+    if (out->tail == NULL) {
+        out->tail = malloc(OUTPUT_TAIL_SIZE);
+    }
+    if (len > OUTPUT_TAIL_SIZE) {
+        data += len - OUTPUT_TAIL_SIZE;
+        len = OUTPUT_TAIL_SIZE;
+    }
+
+    while (len > 0) {
+        pos = (out->tail_start + out->tail_len) % OUTPUT_TAIL_SIZE;
+        part = OUTPUT_TAIL_SIZE - pos < len ? OUTPUT_TAIL_SIZE - pos : len;
+        memcpy(out->tail + pos, data, part);
+        data += part;
+        len -= part;
+        out->tail_len += part;
+        if (out->tail_len > OUTPUT_TAIL_SIZE) {
+            out->tail_start = (out->tail_start + out->tail_len - OUTPUT_TAIL_SIZE) % OUTPUT_TAIL_SIZE;
+            out->tail_len = OUTPUT_TAIL_SIZE;
+            out->tail_wrapped = true;
+        }
+    }
+}
+
+/**
+ * Duplicates at most len bytes from service pipe into tail, returns
+ * number of bytes duplicated, 0 on EOF or -1 with EAGAIN when pipe is empty.
+ */
+static ssize_t output_tee_tail(struct output *out, size_t len)
+{
+    char buff[OUTPUT_TAIL_SIZE];
+    ssize_t n, skip, got;
+
+    n = tee(out->fd, scratch[1], len, SPLICE_F_NONBLOCK);
+    if (n <= 0) {
+        return n;
+    }
+
+    skip = n > OUTPUT_TAIL_SIZE ? n - OUTPUT_TAIL_SIZE : 0;
+    while (skip > 0) {
+        got = splice(scratch[0], NULL, null_fd, NULL, skip, SPLICE_F_NONBLOCK);
+        if (got <= 0) break;
+        skip -= got;
+    }
+    while ((got = read(scratch[0], buff, sizeof(buff))) > 0) {
+        output_tail_append(out, buff, got);
+    }
+    return n;
+}
+
+/**
+ * Forwards pending bytes to stdout, returns false when stdout is full.
+ */
+static bool output_forward(struct output *out)
+{
+    ssize_t n;
+
+    while (out->pending > 0) {
+        n = splice(out->fd, NULL, dest_fd, NULL, out->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && errno == EAGAIN) {
+            return false;
+        }
+        if (n <= 0) {
+            if (n == -1) {
+                log_errno_debug("Failed to forward output of service %s", out->prefix);
+            }
+            // stdout is unusable, discard data still in pipe
+            out->dropped += out->pending;
+            out->pending = 0;
+            while (splice(out->fd, NULL, null_fd, NULL, OUTPUT_CHUNK, SPLICE_F_NONBLOCK) > 0);
+            return true;
+        }
+        out->pending -= n;
+        out->bytes += n;
+    }
+    return true;
+}
+
+static void output_write(struct output *out, struct iovec *iov, int count, size_t total)
+{
+    struct msghdr mh;
+    ssize_t written;
+
+    if (dest_socket) {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = count;
+        written = sendmsg(dest_fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } else {
+        written = writev(dest_fd, iov, count);
+    }
+
+    if (written < 0) {
+        written = 0;
+    }
+    out->bytes += written;
+    out->dropped += total - written;
+}
+
+/**
+ * Copies output through userspace buffer, used for line prefixes and
+ * for stdout that does not support splice. Output that does not fit
+ * into stdout is dropped instead of blocking.
+ */
+static ssize_t output_copy(struct output *out)
+{
+    char buff[4096], prefix[64];
+    struct iovec iov[64];
+    size_t total = 0, prefix_len;
+    char *p, *end, *nl;
+    int count = 0;
+    ssize_t n;
+
+    n = read(out->fd, buff, sizeof(buff));
+    if (n <= 0) {
+        return n;
+    }
+    output_tail_append(out, buff, n);
+
+    if (out->mode != OUTPUT_PREFIX) {
+        iov[0].iov_base = buff;
+        iov[0].iov_len = n;
+        output_write(out, iov, 1, n);
+        return n;
+    }
+
+    prefix_len = snprintf(prefix, sizeof(prefix), "[%s] ", out->prefix);
+    if (prefix_len >= sizeof(prefix)) {
+        prefix_len = sizeof(prefix) - 1;
+    }
+
+    for (p = buff, end = buff + n; p < end; p = nl) {
+        if (count + 2 > 64) {
+            output_write(out, iov, count, total);
+            count = 0;
+            total = 0;
+        }
+        if (out->line_start) {
+            iov[count].iov_base = prefix;
+            iov[count++].iov_len = prefix_len;
+            total += prefix_len;
+        }
+        nl = memchr(p, '\n', end - p);
+        nl = nl == NULL ? end : nl + 1;
+        out->line_start = nl[-1] == '\n';
+        iov[count].iov_base = p;
+        iov[count++].iov_len = nl - p;
+        total += nl - p;
+    }
+    if (count > 0) {
+        output_write(out, iov, count, total);
+    }
+    return n;
+}
+
+void output_handle(struct output *out)
+{
+    ssize_t n;
+    uint8_t i;
+
+    if (out == NULL || out->fd == -1 || out->blocked) {
+        return;
+    }
+
+    for (i = 0; i < OUTPUT_BATCH; i++) {
+        if (out->mode == OUTPUT_PREFIX || !dest_splice) {
+            n = output_copy(out);
+        } else {
+            if (!output_forward(out)) {
+                output_block(out);
+                return;
+            }
+            n = output_tee_tail(out, OUTPUT_CHUNK);
+            if (n > 0) {
+                out->pending = n;
+            }
+        }
+
+        if (n == 0) {
+            // all writers are gone
+            if (out->pending == 0 || output_forward(out)) {
+                output_close(out);
+            }
+            return;
+        }
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                log_errno_warning("Failed to read output of service %s", out->prefix);
+                output_close(out);
+            }
+            break;
+        }
+    }
+
+    if (out->mode != OUTPUT_PREFIX && dest_splice && !output_forward(out)) {
+        output_block(out);
+    }
+}
+
+/**
+ * Resumes outputs which were waiting for stdout.
+ */
+void output_handle_writable()
+{
+    struct output *out;
+
+    output_set_writable(false);
+    while (blocked_count > 0) {
+        out = blocked[--blocked_count];
+        out->blocked = false;
+        if (event_add(out->fd, EVENT_SERVICE_OUTPUT, out->id) != S_OK) {
+            output_close(out);
+            continue;
+        }
+        output_handle(out);
+        if (dest_writable) {
+            // stdout filled up again, rest waits for next event
+            break;
+        }
+    }
+}
+
+/**
+ * Copies tail to buff, when older output was already discarded
+ * it starts after first full line.
+ */
+ssize_t output_read_tail(struct output *out, void *buff, size_t size)
+{
+    size_t start, len, skip = 0, part;
+    char *dst = buff;
+
+    if (out->tail == NULL) {
+        return 0;
+    }
+
+    len = out->tail_len < size ? out->tail_len : size;
+    start = (out->tail_start + out->tail_len - len) % OUTPUT_TAIL_SIZE;
+    part = OUTPUT_TAIL_SIZE - start < len ? OUTPUT_TAIL_SIZE - start : len;
+    memcpy(dst, out->tail + start, part);
+    memcpy(dst + part, out->tail, len - part);
+
+    if (out->tail_wrapped || len < out->tail_len) {
+        while (skip < len && dst[skip] != '\n') skip++;
+        if (skip < len) {
+            skip++;
+            memmove(dst, dst + skip, len - skip);
+            len -= skip;
+        }
+    }
+    return len;
+}
+
+/**
+ * Pipe and tail are handed over to new init image, data left
+ * in pipe is forwarded by it.
+ */
+void output_snapshot_save(struct snapshot *s, struct output *out)
+{
+    char tail[OUTPUT_TAIL_SIZE];
+    uint32_t len;
+
+    SNAPSHOT_PUT(s, out->mode);
+    snapshot_put_fd(s, out->fd);
+    SNAPSHOT_PUT(s, out->line_start);
+    SNAPSHOT_PUT(s, out->pending);
+    SNAPSHOT_PUT(s, out->bytes);
+    SNAPSHOT_PUT(s, out->dropped);
+
+    len = output_read_tail(out, tail, sizeof(tail));
+    SNAPSHOT_PUT(s, len);
+    snapshot_put(s, tail, len);
+}
+
+void output_snapshot_restore(struct snapshot *s, struct output *out)
+{
+    const char *tail;
+    uint32_t len;
+
+    SNAPSHOT_GET(s, out->mode);
+    out->fd = snapshot_get_fd(s);
+    SNAPSHOT_GET(s, out->line_start);
+    SNAPSHOT_GET(s, out->pending);
+    SNAPSHOT_GET(s, out->bytes);
+    SNAPSHOT_GET(s, out->dropped);
+
+    SNAPSHOT_GET(s, len);
+    tail = snapshot_get_data(s, len);
+    if (tail != NULL && len > 0) {
+        output_tail_append(out, tail, len);
+    }
+
+    if (out->fd != -1) {
+        output_dest_setup();
+        if (event_add(out->fd, EVENT_SERVICE_OUTPUT, out->id) != S_OK) {
+            close(out->fd);
+            out->fd = -1;
+        }
+    }
+}
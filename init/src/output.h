@@ -0,0 +1,48 @@
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <sys/types.h>
+#include "status.h"
+#include "snapshot.h"
+
+#define OUTPUT_INHERIT 0
+#define OUTPUT_CAPTURE 1
+#define OUTPUT_PREFIX 2
+typedef uint8_t output_mode_t;
+
+// last bytes of output kept for each service
+#define OUTPUT_TAIL_SIZE 16384
+
+/**
+ * Captured stdout and stderr of service, forwarded to init stdout.
+ */
+struct output {
+    output_mode_t mode;
+    uint16_t id;
+    const char *prefix;
+    // read end of pipe given to child, -1 when not capturing
+    int fd;
+    bool blocked;
+    bool line_start;
+    // bytes already copied to tail but not forwarded yet
+    size_t pending;
+    // ring with last bytes, allocated on first use
+    char *tail;
+    size_t tail_start;
+    size_t tail_len;
+    bool tail_wrapped;
+    // bytes forwarded and dropped when stdout was full
+    uint64_t bytes;
+    uint64_t dropped;
+};
+
+void output_init(struct output *out, uint16_t id, const char *prefix);
+int output_setup(struct output *out);
+void output_handle(struct output *out);
+void output_handle_writable();
+void output_close(struct output *out);
+ssize_t output_read_tail(struct output *out, void *buff, size_t size);
+void output_snapshot_save(struct snapshot *s, struct output *out);
+void output_snapshot_restore(struct snapshot *s, struct output *out);
+
+#endif
@@ -1,22 +1,48 @@
 #include "common.h"
 
 #include <dirent.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <string.h>
 #include <malloc.h>
-#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
 
 #include "service.h"
+#include "event.h"
 #include "spawn.h"
 #include "log.h"
 #include "control.h"
+#include "conf.h"
+#include "cgroup.h"
+#include "activation.h"
+#include "trace.h"
 
 #define LOG_MODULE "service"
 
-static uint8_t services_count = 0;
+static uint16_t services_count = 0;
+static uint16_t services_size = 0;
 static struct service **services;
+// sockets of DOWN services are watched, off during halt
+static bool listening = false;
+// inotify watch of PUPPETIZER_SERVICE_DIR, -1 when not watched
+static int dir_fd = -1;
+
+/*
+ * Open addressing (linear probing) indexes of services,
+ * index_size is power of two and kept at least twice the services count.
+ */
+static uint32_t index_size = 0;
+static struct service **index_by_name = NULL;
+static struct service **index_by_pid = NULL;
+
+#define INDEX_SLOT(H) ((H) & (index_size - 1))
+#define INDEX_NEXT(I) (((I) + 1) & (index_size - 1))
 
 static int service_files_filter(const struct dirent * f)
 {
@@ -24,140 +50,1220 @@ static int service_files_filter(const struct dirent * f)
     if (offset > 0) {
         return strcmp(f->d_name + offset, ".start") == 0;
     } else {
-        return 0;
+        return 0;
+    }
+}
+
+static uint32_t service_hash_name(const char *name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t service_hash_pid(pid_t pid)
+{
+    // Knuth multiplicative hash, sequential pids are spread over the table
+    return ((uint32_t)pid * 2654435761u) >> 7;
+}
+
+static void service_index_insert(struct service **index, uint32_t hash, struct service *svc)
+{
+    uint32_t i = INDEX_SLOT(hash);
+    while (index[i] != NULL) {
+        i = INDEX_NEXT(i);
+    }
+    index[i] = svc;
+}
+
+static void service_index_pid(struct service *svc)
+{
+    service_index_insert(index_by_pid, service_hash_pid(svc->pid), svc);
+}
+
+/**
+ * Removes service from pid index with backward shift deletion,
+ * so lookups do not need tombstones.
+ */
+static void service_unindex_pid(struct service *svc)
+{
+    uint32_t i, j, home;
+
+    for (i = INDEX_SLOT(service_hash_pid(svc->pid)); index_by_pid[i] != svc; i = INDEX_NEXT(i)) {
+        if (index_by_pid[i] == NULL) return;
+    }
+
+    for (;;) {
+        index_by_pid[i] = NULL;
+        for (j = INDEX_NEXT(i);; j = INDEX_NEXT(j)) {
+            if (index_by_pid[j] == NULL) return;
+            home = INDEX_SLOT(service_hash_pid(index_by_pid[j]->pid));
+            // entry can stay when its home slot is cyclically in (i, j]
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+            break;
+        }
+        index_by_pid[i] = index_by_pid[j];
+        i = j;
+    }
+}
+
+static void service_index_rebuild(uint32_t size)
+{
+    uint16_t i;
+
+    free(index_by_name);
+    free(index_by_pid);
+    index_size = size;
+    index_by_name = calloc(size, sizeof(struct service*));
+    index_by_pid = calloc(size, sizeof(struct service*));
+
+    for (i=0; i<services_count; i++) {
+        service_index_insert(index_by_name, service_hash_name(services[i]->name), services[i]);
+        if (services[i]->pid > 0) {
+            service_index_pid(services[i]);
+        }
+    }
+}
+
+static char *service_script_path(const char *name, const char *suffix)
+{
+    size_t len = sizeof(PUPPETIZER_SERVICE_DIR "/") + strlen(name) + strlen(suffix);
+    char *path = malloc(len);
+
+    snprintf(path, len, PUPPETIZER_SERVICE_DIR "/%s%s", name, suffix);
+    return path;
+}
+
+static void service_default_options(struct service_options *opts)
+{
+    opts->ready = SERVICE_READY_NONE;
+    opts->ready_timeout = SERVICE_DEFAULT_READY_TIMEOUT;
+    opts->restart = SERVICE_RESTART_NEVER;
+    opts->restart_delay = SERVICE_DEFAULT_RESTART_DELAY;
+    opts->restart_delay_max = SERVICE_DEFAULT_RESTART_DELAY_MAX;
+    opts->restart_limit = SERVICE_DEFAULT_RESTART_LIMIT;
+    opts->stop_timeout = SERVICE_DEFAULT_STOP_TIMEOUT;
+}
+
+static struct service* service_new(uint16_t id, const char *name)
+{
+    struct service* svc = calloc(1, sizeof(struct service));
+    svc->id = id;
+    svc->name = strdup(name);
+    svc->start_path = service_script_path(name, ".start");
+    svc->stop_path = service_script_path(name, ".stop");
+    svc->pid = 0;
+    svc->pidfd = -1;
+    svc->state = STATE_DOWN;
+    svc->deps = NULL;
+    svc->deps_count = 0;
+    svc->notify_fd = -1;
+    svc->cgroup_fd = -1;
+    event_timer_init(&svc->ready_timer, EVENT_SERVICE_TIMEOUT, id);
+    output_init(&svc->output, id, svc->name);
+    event_timer_init(&svc->restart_timer, EVENT_SERVICE_RESTART, id);
+    event_timer_init(&svc->stop_timer, EVENT_SERVICE_STOP_TIMEOUT, id);
+    event_timer_init(&svc->idle_timer, EVENT_SERVICE_IDLE, id);
+    service_default_options(&svc->opts);
+
+    return svc;
+}
+
+/**
+ * Registers new service and indexes it by name.
+ */
+__static struct service* service_add(const char *name)
+{
+    struct service *svc;
+    uint32_t size;
+
+    if (services_count == UINT16_MAX) {
+        log_error("Too many services, ignoring %s", name);
+        return NULL;
+    }
+
+    if (services_count == services_size) {
+        services_size = services_size == 0 ? 16 : services_size * 2;
+        services = realloc(services, sizeof(struct service*) * services_size);
+    }
+
+    svc = service_new(services_count, name);
+    services[services_count++] = svc;
+
+    if (services_count * 2 > index_size) {
+        for (size = index_size == 0 ? 32 : index_size; size < services_count * 2; size *= 2);
+        service_index_rebuild(size);
+    } else {
+        service_index_insert(index_by_name, service_hash_name(svc->name), svc);
+    }
+
+    return svc;
+}
+
+static bool service_depends_on(struct service *svc, struct service *dep)
+{
+    uint8_t i;
+    for (i=0; i<svc->deps_count; i++) {
+        if (svc->deps[i] == dep) return true;
+    }
+    return false;
+}
+
+/**
+ * Reads <name>.deps file with whitespace separated service names.
+ * Lines starting with # are ignored.
+ */
+static status_t service_load_deps(struct service *svc)
+{
+    char *path = service_script_path(svc->name, ".deps");
+    char name[256];
+    FILE *f;
+    struct service *dep;
+
+    f = fopen(path, "r");
+    free(path);
+    if (f == NULL) {
+        if (errno != ENOENT) {
+            log_errno_warning("Could not read dependencies of service %s", svc->name);
+        }
+        return S_OK;
+    }
+
+    while (fscanf(f, "%255s", name) == 1) {
+        if (name[0] == '#') {
+            fscanf(f, "%*[^\n]");
+            continue;
+        }
+
+        dep = service_find_by_name(name);
+        if (dep == NULL || dep == svc) {
+            log_error("Service %s has invalid dependency %s", svc->name, name);
+            fclose(f);
+            return S_SERVICE_DEPS_ERROR;
+        }
+        if (service_depends_on(svc, dep)) {
+            log_warning("Service %s lists dependency %s more than once", svc->name, name);
+            continue;
+        }
+        if (svc->deps_count == UINT8_MAX) {
+            log_error("Service %s has more than %d dependencies", svc->name, UINT8_MAX);
+            fclose(f);
+            return S_SERVICE_DEPS_ERROR;
+        }
+
+        svc->deps = realloc(svc->deps, sizeof(struct service*) * (svc->deps_count + 1));
+        svc->deps[svc->deps_count++] = dep;
+        log_debug("Service %s depends on %s", svc->name, dep->name);
+    }
+    fclose(f);
+
+    return S_OK;
+}
+
+static const struct {
+    const char *name;
+    int resource;
+} service_limits[] = {
+    { "as", RLIMIT_AS },
+    { "core", RLIMIT_CORE },
+    { "cpu", RLIMIT_CPU },
+    { "fsize", RLIMIT_FSIZE },
+    { "memlock", RLIMIT_MEMLOCK },
+    { "nofile", RLIMIT_NOFILE },
+    { "nproc", RLIMIT_NPROC },
+    { "stack", RLIMIT_STACK },
+    { NULL, 0 }
+};
+
+static bool service_parse_rlim(const char *value, size_t len, rlim_t *out)
+{
+    char buff[32];
+    uint32_t parsed;
+
+    if (len == 0 || len >= sizeof(buff)) return false;
+    memcpy(buff, value, len);
+    buff[len] = 0;
+
+    if (strcmp(buff, "unlimited") == 0) {
+        *out = RLIM_INFINITY;
+        return true;
+    }
+    if (!conf_parse_uint(buff, &parsed)) return false;
+    *out = parsed;
+    return true;
+}
+
+/**
+ * Parses byte count with optional K, M or G suffix.
+ */
+static bool service_parse_size(const char *value, uint64_t *out)
+{
+    unsigned long long parsed;
+    char *end;
+
+    if (value[0] < '0' || value[0] > '9') return false;
+    errno = 0;
+    parsed = strtoull(value, &end, 10);
+    if (errno != 0) return false;
+
+    switch (*end) {
+        case 'G': parsed *= 1024;
+        // fall through
+        case 'M': parsed *= 1024;
+        // fall through
+        case 'K': parsed *= 1024; end++;
+        // fall through
+        case 0: break;
+        default: return false;
+    }
+    if (*end != 0) return false;
+
+    *out = parsed;
+    return true;
+}
+
+static bool service_parse_weight(const char *value, uint32_t *out)
+{
+    uint32_t parsed;
+
+    if (!conf_parse_uint(value, &parsed) || parsed < 1 || parsed > 10000) return false;
+    *out = parsed;
+    return true;
+}
+
+/**
+ * Parses limit.NAME=SOFT[:HARD], both can be "unlimited".
+ */
+static bool service_add_limit(struct service_options *opts, const char *name, const char *value)
+{
+    struct spawn_rlimit limit;
+    const char *sep = strchr(value, ':');
+    uint8_t i;
+
+    for (i=0; service_limits[i].name != NULL; i++) {
+        if (strcmp(service_limits[i].name, name) == 0) break;
+    }
+    if (service_limits[i].name == NULL) return false;
+
+    limit.resource = service_limits[i].resource;
+    if (!service_parse_rlim(value, sep ? (size_t)(sep - value) : strlen(value), &limit.limit.rlim_cur)) return false;
+    if (sep == NULL) {
+        limit.limit.rlim_max = limit.limit.rlim_cur;
+    } else if (!service_parse_rlim(sep + 1, strlen(sep + 1), &limit.limit.rlim_max)) {
+        return false;
+    }
+
+    if (opts->rlimits_count == UINT8_MAX) return false;
+    opts->rlimits = realloc(opts->rlimits, sizeof(struct spawn_rlimit) * (opts->rlimits_count + 1));
+    opts->rlimits[opts->rlimits_count++] = limit;
+    return true;
+}
+
+static bool service_add_env(struct service_options *opts, const char *name, const char *value)
+{
+    size_t len = strlen(name) + strlen(value) + 2;
+    char *entry;
+
+    // last slot is left for notify fd entry
+    if (name[0] == 0 || strchr(name, '=') != NULL || opts->env_count == UINT8_MAX - 1) return false;
+
+    entry = malloc(len);
+    snprintf(entry, len, "%s=%s", name, value);
+    opts->env = realloc(opts->env, sizeof(char*) * (opts->env_count + 1));
+    opts->env[opts->env_count++] = entry;
+    return true;
+}
+
+static bool service_set_option(void *ctx, const char *key, const char *value)
+{
+    struct service_options *opts = ctx;
+
+    if (strncmp(key, "env.", 4) == 0) {
+        return service_add_env(opts, key + 4, value);
+    }
+    if (strncmp(key, "limit.", 6) == 0) {
+        return service_add_limit(opts, key + 6, value);
+    }
+    if (strcmp(key, "cwd") == 0) {
+        free(opts->cwd);
+        opts->cwd = strdup(value);
+        return true;
+    }
+
+    if (strcmp(key, "ready") == 0) {
+        if (strcmp(value, "none") == 0) {
+            opts->ready = SERVICE_READY_NONE;
+        } else if (strcmp(value, "notify") == 0) {
+            opts->ready = SERVICE_READY_NOTIFY;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    if (strcmp(key, "ready_timeout") == 0) {
+        return conf_parse_uint(value, &opts->ready_timeout);
+    }
+    if (strcmp(key, "restart") == 0) {
+        if (strcmp(value, "never") == 0) {
+            opts->restart = SERVICE_RESTART_NEVER;
+        } else if (strcmp(value, "on-failure") == 0) {
+            opts->restart = SERVICE_RESTART_ON_FAILURE;
+        } else if (strcmp(value, "always") == 0) {
+            opts->restart = SERVICE_RESTART_ALWAYS;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    if (strcmp(key, "restart_delay") == 0) {
+        return conf_parse_uint(value, &opts->restart_delay);
+    }
+    if (strcmp(key, "restart_delay_max") == 0) {
+        return conf_parse_uint(value, &opts->restart_delay_max);
+    }
+    if (strcmp(key, "restart_limit") == 0) {
+        return conf_parse_uint(value, &opts->restart_limit);
+    }
+    if (strcmp(key, "stop_timeout") == 0) {
+        return conf_parse_uint(value, &opts->stop_timeout);
+    }
+    if (strcmp(key, "idle_timeout") == 0) {
+        return conf_parse_uint(value, &opts->idle_timeout);
+    }
+    if (strcmp(key, "memory_max") == 0) {
+        return service_parse_size(value, &opts->cgroup.memory_max);
+    }
+    if (strcmp(key, "cpu_weight") == 0) {
+        return service_parse_weight(value, &opts->cgroup.cpu_weight);
+    }
+    if (strcmp(key, "io_weight") == 0) {
+        return service_parse_weight(value, &opts->cgroup.io_weight);
+    }
+    if (strcmp(key, "output") == 0) {
+        if (strcmp(value, "inherit") == 0) {
+            opts->output = OUTPUT_INHERIT;
+        } else if (strcmp(value, "capture") == 0) {
+            opts->output = OUTPUT_CAPTURE;
+        } else if (strcmp(value, "prefix") == 0) {
+            opts->output = OUTPUT_PREFIX;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+static void service_load_options(struct service *svc)
+{
+    char *path = service_script_path(svc->name, ".conf");
+
+    conf_parse_file(path, service_set_option, &svc->opts);
+    free(path);
+}
+
+static status_t service_load_sockets(struct service *svc)
+{
+    char *path = service_script_path(svc->name, ".socket");
+    status_t status;
+
+    status = activation_load(path, &svc->sockets, &svc->sockets_count);
+    if (status != S_OK) {
+        log_error("Could not open sockets of service %s", svc->name);
+    } else if (svc->sockets_count > 0) {
+        log_debug("Service %s is activated by %d sockets", svc->name, svc->sockets_count);
+    }
+    free(path);
+    return status;
+}
+
+#define DEPS_MARK_NONE 0
+#define DEPS_MARK_VISITING 1
+#define DEPS_MARK_DONE 2
+
+/**
+ * Walks dependency graph depth-first, returns false when a cycle was found.
+ */
+static bool service_deps_acyclic(struct service *svc, uint8_t *marks)
+{
+    uint8_t i;
+
+    if (marks[svc->id] == DEPS_MARK_DONE) return true;
+    if (marks[svc->id] == DEPS_MARK_VISITING) {
+        log_error("Dependency cycle found at service %s", svc->name);
+        return false;
+    }
+
+    marks[svc->id] = DEPS_MARK_VISITING;
+    for (i=0; i<svc->deps_count; i++) {
+        if (!service_deps_acyclic(svc->deps[i], marks)) {
+            return false;
+        }
+    }
+    marks[svc->id] = DEPS_MARK_DONE;
+
+    return true;
+}
+
+/**
+ * Service was requested to start but not yet spawned
+ * as some of its dependencies are not UP.
+ */
+static bool service_is_waiting(struct service *svc)
+{
+    return svc->state == STATE_PENDING_UP && svc->pid == 0;
+}
+
+/**
+ * Waiting for dependencies, not for restart backoff.
+ */
+static bool service_is_waiting_for_deps(struct service *svc)
+{
+    return service_is_waiting(svc) && !event_timer_active(&svc->restart_timer);
+}
+
+status_t service_create_all(uint16_t* count)
+{
+    int l_count, i;
+    struct dirent **namelist;
+
+    l_count = scandir(PUPPETIZER_SERVICE_DIR, &namelist, service_files_filter, NULL);
+
+    if (l_count == -1) {
+        log_errno_error("Searching for services in %s failed", PUPPETIZER_SERVICE_DIR);
+        return S_SERVICE_COLLECT_ERROR;
+    }
+
+    for (i=0;i<l_count; i++) {
+        namelist[i]->d_name[strlen(namelist[i]->d_name)-6] = 0;
+        // restored from snapshot already
+        if (service_find_by_name(namelist[i]->d_name) != NULL) {
+            free(namelist[i]);
+            continue;
+        }
+        if (service_add(namelist[i]->d_name) != NULL) {
+            log_debug("Adding service %s", namelist[i]->d_name);
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+    l_count = services_count;
+
+    log_debug("Found %d services", services_count);
+
+    // dependencies can be resolved only when all services are known
+    for (i=0; i<l_count; i++) {
+        service_load_options(services[i]);
+        if (service_load_deps(services[i]) != S_OK) {
+            return S_SERVICE_DEPS_ERROR;
+        }
+        if (!services[i]->restored && service_load_sockets(services[i]) != S_OK) {
+            return S_ACTIVATION_ERROR;
+        }
+        // kept running over re-exec after its start script was removed
+        if (services[i]->restored && access(services[i]->start_path, F_OK) == -1) {
+            services[i]->unavailable = true;
+        }
+    }
+
+    // zeroed marks are DEPS_MARK_NONE, VLA would be empty without services
+    uint8_t *marks = calloc(l_count, sizeof(uint8_t));
+    for (i=0; i<l_count; i++) {
+        if (!service_deps_acyclic(services[i], marks)) {
+            free(marks);
+            return S_SERVICE_DEPS_ERROR;
+        }
+    }
+    free(marks);
+
+    if (count != NULL) {
+        *count = l_count;
+    }
+
+    return S_OK;
+}
+
+/**
+ * Sets up cwd, environment and limits from service options,
+ * env must have room for one more entry.
+ */
+static void service_spawn_options(struct service *svc, struct spawn_options *opts, const char **env)
+{
+    memset(opts, 0, sizeof(struct spawn_options));
+    opts->cgroup_fd = -1;
+    if (svc->opts.env_count) {
+        memcpy(env, svc->opts.env, sizeof(char*) * svc->opts.env_count);
+    }
+
+    opts->cwd = svc->opts.cwd;
+    opts->env = env;
+    opts->env_count = svc->opts.env_count;
+    opts->rlimits = svc->opts.rlimits;
+    opts->rlimits_count = svc->opts.rlimits_count;
+}
+
+static void service_close_fd(int *fd)
+{
+    if (*fd != -1) {
+        event_remove(*fd);
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static void service_watch_sockets(struct service *svc, uint8_t mode)
+{
+    uint8_t i;
+
+    if (svc->sockets_count == 0 || svc->sockets_watch == mode) {
+        return;
+    }
+    for (i=0; i<svc->sockets_count; i++) {
+        if (svc->sockets_watch != SERVICE_SOCKETS_UNWATCHED) {
+            event_remove(svc->sockets[i]);
+        }
+        if (mode == SERVICE_SOCKETS_LISTEN) {
+            event_add(svc->sockets[i], EVENT_SERVICE_SOCKET, svc->id);
+        } else if (mode == SERVICE_SOCKETS_ACTIVITY) {
+            event_add_edge(svc->sockets[i], EVENT_SERVICE_SOCKET, svc->id);
+        }
+    }
+    svc->sockets_watch = mode;
+}
+
+/**
+ * Replaces sockets of stopped service with ones from current .socket file.
+ */
+static void service_reload_sockets(struct service *svc)
+{
+    service_watch_sockets(svc, SERVICE_SOCKETS_UNWATCHED);
+    while (svc->sockets_count > 0) {
+        close(svc->sockets[--svc->sockets_count]);
+    }
+    free(svc->sockets);
+    svc->sockets = NULL;
+    svc->sockets_stale = false;
+
+    if (!svc->unavailable && service_load_sockets(svc) != S_OK) {
+        svc->unavailable = true;
+    }
+}
+
+static void service_ready_cleanup(struct service *svc)
+{
+    service_close_fd(&svc->notify_fd);
+    event_timer_cancel(&svc->ready_timer);
+}
+
+/**
+ * Services waiting for dependency which went down would wait forever,
+ * their start is cancelled, which cancels start of their dependents too.
+ */
+void service_cancel_dependents(struct service *svc)
+{
+    uint16_t i;
+    for (i=0; i<services_count; i++) {
+        if (service_is_waiting_for_deps(services[i]) && service_depends_on(services[i], svc)) {
+            log_warning("Cancelling start of service %s, dependency %s is down", services[i]->name, svc->name);
+            service_set_down(services[i]);
+        }
+    }
+}
+
+/**
+ * Same as service_set_down, but services waiting for it are left waiting,
+ * eg. while it could be restarted.
+ */
+void service_set_exited(struct service *svc)
+{
+    if (svc->pid > 0) {
+        trace_add(TRACE_TRACK_SERVICE(svc->id), TRACE_INSTANT, "exit %d", svc->stats.last_exit);
+        trace_add(TRACE_TRACK_SERVICE(svc->id), TRACE_END, NULL);
+        service_unindex_pid(svc);
+        // daemonized leftovers would otherwise outlive service
+        if (svc->cgroup_fd != -1) {
+            cgroup_signal(svc->cgroup_fd, SIGKILL);
+        }
+    }
+    service_close_fd(&svc->pidfd);
+    service_ready_cleanup(svc);
+    event_timer_cancel(&svc->restart_timer);
+    event_timer_cancel(&svc->stop_timer);
+    event_timer_cancel(&svc->idle_timer);
+    svc->stop_signals = 0;
+    svc->pid = 0;
+    svc->state = STATE_DOWN;
+    if (svc->sockets_stale) {
+        service_reload_sockets(svc);
+    }
+    service_watch_sockets(svc, listening ? SERVICE_SOCKETS_LISTEN : SERVICE_SOCKETS_UNWATCHED);
+    control_dispatch_service_state_change(svc);
+}
+
+void service_set_down(struct service *svc)
+{
+    service_set_exited(svc);
+    service_cancel_dependents(svc);
+}
+
+static void service_signal(struct service *svc, int sig);
+
+/**
+ * Runs stop script asynchronusly.
+ */
+bool service_stop(struct service *svc)
+{
+    struct spawn_options opts;
+    const char *env[svc->opts.env_count + 1];
+    char pid[16];
+
+    if (service_is_waiting(svc)) {
+        log_info("Cancelling start of service %s", svc->name);
+        service_set_down(svc);
+        return true;
+    }
+
+    if (svc->state == STATE_UP || (svc->state == STATE_PENDING_UP && svc->pid > 0)) {
+        log_info("Stopping service %s", svc->name);
+        service_ready_cleanup(svc);
+        svc->state = STATE_PENDING_DOWN;
+        control_dispatch_service_state_change(svc);
+        trace_add(TRACE_TRACK_SERVICE(svc->id), TRACE_END, NULL);
+        trace_add(TRACE_TRACK_SERVICE(svc->id), TRACE_BEGIN, "stopping");
+
+        sprintf(pid, "%d", svc->pid);
+        service_spawn_options(svc, &opts, env);
+        // .stop powinno zrobić co się da by zatrzymać serwis "wkrótce"
+        if (spawn(svc->stop_path, pid, &opts) <= 0) {
+            // readiness is already abandoned, service is stopped by signals instead
+            log_warning("Failed to run stop script for service %s, terminating it", svc->name);
+            service_signal(svc, SIGTERM);
+            svc->stop_signals++;
+            event_timer_set(&svc->stop_timer, SERVICE_KILL_DELAY);
+        } else if (svc->opts.stop_timeout > 0) {
+            event_timer_set(&svc->stop_timer, (uint64_t)svc->opts.stop_timeout * 1000);
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+static bool service_deps_up(struct service *svc)
+{
+    uint8_t i;
+    for (i=0; i<svc->deps_count; i++) {
+        if (svc->deps[i]->state != STATE_UP) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool service_spawn(struct service *svc);
+
+/**
+ * Spawns waiting services which have all dependencies satisfied.
+ */
+static void service_start_waiting()
+{
+    uint16_t i;
+    for (i=0; i<services_count; i++) {
+        if (service_is_waiting_for_deps(services[i]) && service_deps_up(services[i])) {
+            service_spawn(services[i]);
+        }
+    }
+}
+
+static void service_set_up(struct service *svc)
+{
+    svc->state = STATE_UP;
+    svc->stats.ready_at = event_now();
+    control_dispatch_service_state_change(svc);
+    trace_add(TRACE_TRACK_SERVICE(svc->id), TRACE_END, NULL);
+    trace_add(TRACE_TRACK_SERVICE(svc->id), TRACE_BEGIN, "up");
+
+    service_start_waiting();
+}
+
+/**
+ * Creates notify pipe and schedules timeout for service waiting for readiness.
+ * Returns write end of notify pipe for child or -1 on failure.
+ */
+static int service_ready_setup(struct service *svc)
+{
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        log_errno_error("Could not create notify pipe for service %s", svc->name);
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    svc->notify_fd = fds[0];
+    if (event_add(svc->notify_fd, EVENT_SERVICE_NOTIFY, svc->id) != S_OK) {
+        close(fds[0]);
+        close(fds[1]);
+        svc->notify_fd = -1;
+        return -1;
+    }
+
+    if (svc->opts.ready_timeout > 0) {
+        event_timer_set(&svc->ready_timer, (uint64_t)svc->opts.ready_timeout * 1000);
+    }
+
+    return fds[1];
+}
+
+/**
+ * Prepares service cgroup when cgroups are delegated to init.
+ * Returns cgroup.procs fd for child or -1 when service stays in init cgroup.
+ */
+static int service_cgroup_setup(struct service *svc)
+{
+    if (!cgroup_enabled()) {
+        return -1;
+    }
+    if (svc->cgroup_fd == -1) {
+        svc->cgroup_fd = cgroup_create(svc->name);
+        if (svc->cgroup_fd == -1) {
+            return -1;
+        }
+    }
+    cgroup_set_limits(svc->cgroup_fd, svc->name, &svc->opts.cgroup);
+    return cgroup_open_procs(svc->cgroup_fd);
+}
+
+static bool service_spawn(struct service *svc)
+{
+    struct spawn_options opts;
+    struct spawn_fd fds[3 + ACTIVATION_MAX_SOCKETS];
+    const char *env[svc->opts.env_count + 1];
+    char notify_env[sizeof(SPAWN_NOTIFY_ENV "=") + 4];
+    int notify_fd = -1, output_fd = -1, cgroup_fd;
+    uint64_t spawn_start;
+    uint8_t i;
+
+    if (svc->opts.ready == SERVICE_READY_NOTIFY) {
+        notify_fd = service_ready_setup(svc);
+        if (notify_fd == -1) {
+            service_set_down(svc);
+            return false;
+        }
+    }
+
+    if (svc->opts.output != OUTPUT_INHERIT) {
+        svc->output.mode = svc->opts.output;
+        output_fd = output_setup(&svc->output);
+        if (output_fd == -1) {
+            log_warning("Output of service %s will not be captured", svc->name);
+        }
+    }
+
+    cgroup_fd = service_cgroup_setup(svc);
+
+    service_spawn_options(svc, &opts, env);
+    opts.new_group = true;
+    opts.cgroup_fd = cgroup_fd;
+    opts.fds = fds;
+    for (i=0; i<svc->sockets_count; i++) {
+        fds[opts.fds_count].fd = svc->sockets[i];
+        fds[opts.fds_count++].target = SPAWN_LISTEN_FDS_START + i;
+    }
+    opts.listen_fds = svc->sockets_count;
+    if (notify_fd != -1 && svc->sockets_count == 0) {
+        fds[opts.fds_count].fd = notify_fd;
+        fds[opts.fds_count++].target = SPAWN_NOTIFY_FD;
+        env[opts.env_count++] = SPAWN_NOTIFY_ENV_ENTRY;
+    } else if (notify_fd != -1) {
+        fds[opts.fds_count].fd = notify_fd;
+        fds[opts.fds_count++].target = SPAWN_LISTEN_FDS_START + svc->sockets_count;
+        snprintf(notify_env, sizeof(notify_env), SPAWN_NOTIFY_ENV "=%d", SPAWN_LISTEN_FDS_START + svc->sockets_count);
+        env[opts.env_count++] = notify_env;
+    }
+    if (output_fd != -1) {
+        fds[opts.fds_count].fd = output_fd;
+        fds[opts.fds_count++].target = STDOUT_FILENO;
+        fds[opts.fds_count].fd = output_fd;
+        fds[opts.fds_count++].target = STDERR_FILENO;
+    }
+
+    spawn_start = trace_now();
+    pid_t pid = spawn(svc->start_path, NULL, &opts);
+
+    if (notify_fd != -1) {
+        close(notify_fd);
+    }
+    if (output_fd != -1) {
+        close(output_fd);
+    }
+    if (cgroup_fd != -1) {
+        close(cgroup_fd);
+    }
+
+    if (pid > 0) {
+        trace_complete(TRACE_TRACK_SERVICE(svc->id), "exec", spawn_start, trace_now() - spawn_start);
+        trace_add(TRACE_TRACK_SERVICE(svc->id), TRACE_BEGIN, "starting");
+        svc->pid = pid;
+        svc->started_at = event_now();
+        svc->stats.starts++;
+        svc->stats.ready_at = 0;
+        svc->stats.cpu_ms = 0;
+        svc->stats.rss = 0;
+        service_index_pid(svc);
+
+        // service accepts connections itself from now on
+        if (svc->opts.idle_timeout > 0) {
+            service_watch_sockets(svc, SERVICE_SOCKETS_ACTIVITY);
+            event_timer_set(&svc->idle_timer, (uint64_t)svc->opts.idle_timeout * 1000);
+        } else {
+            service_watch_sockets(svc, SERVICE_SOCKETS_UNWATCHED);
+        }
+
+        // exits of tracked services are delivered as separate events
+        svc->pidfd = spawn_pidfd(pid);
+        if (svc->pidfd != -1 && event_add(svc->pidfd, EVENT_SERVICE_EXIT, svc->id) != S_OK) {
+            close(svc->pidfd);
+            svc->pidfd = -1;
+        }
+
+        // early exits are handled by reaper
+        if (svc->opts.ready == SERVICE_READY_NONE) {
+            service_set_up(svc);
+        } else {
+            log_debug("Waiting for service %s to be ready", svc->name);
+        }
+        return true;
+    } else {
+        log_warning("Service %s failed to start", svc->name);
+        // activation sockets are watched again
+        service_set_down(svc);
     }
+
+    return false;
 }
 
-static struct service* service_new(const char *name)
+/**
+ * Reads readiness notification from service.
+ */
+void service_handle_notify(struct service *svc)
 {
-    struct service* svc = malloc(sizeof(struct service));
-    svc->name = strdup(name);
-    svc->pid = 0;
-    svc->state = STATE_DOWN;
+    char buff[128];
+    ssize_t len;
 
-    return svc;
+    if (svc == NULL || svc->notify_fd == -1) {
+        return;
+    }
+
+    len = read(svc->notify_fd, buff, sizeof(buff) - 1);
+    if (len > 0) {
+        buff[len] = 0;
+        if (strstr(buff, SERVICE_NOTIFY_READY) != NULL && svc->state == STATE_PENDING_UP) {
+            log_info("Service %s is ready", svc->name);
+            service_ready_cleanup(svc);
+            service_set_up(svc);
+        }
+    } else if (len == 0) {
+        // child closed notify fd without notifying, timeout or exit will follow
+        service_close_fd(&svc->notify_fd);
+    } else if (errno != EAGAIN) {
+        log_errno_warning("Could not read notification from service %s", svc->name);
+        service_close_fd(&svc->notify_fd);
+    }
 }
 
-status_t service_create_all(uint8_t* count)
+/**
+ * Forwards captured output, pipe is drained until all writers close it,
+ * so it can outlive service process.
+ */
+void service_handle_output(struct service *svc)
 {
-    int l_count, i;
-    struct dirent **namelist;
+    if (svc != NULL) {
+        output_handle(&svc->output);
+    }
+}
 
-    l_count = scandir(PUPPETIZER_SERVICE_DIR, &namelist, service_files_filter, NULL);
+/**
+ * Decides if service which exitted on its own should be started again,
+ * when so it is left in STATE_PENDING_UP until backoff expires.
+ * Returns false when init should halt instead.
+ */
+bool service_schedule_restart(struct service *svc, int retval)
+{
+    uint64_t delay, max;
+    uint32_t i;
 
-    if (l_count == -1) {
-        log_errno_error("Searching for services in %s failed", PUPPETIZER_SERVICE_DIR);
-        return S_SERVICE_COLLECT_ERROR;
+    if (svc->opts.restart == SERVICE_RESTART_NEVER || (svc->opts.restart == SERVICE_RESTART_ON_FAILURE && retval == 0)) {
+        return false;
     }
 
-    services = malloc(sizeof(struct service*) * l_count);
-    services_count = l_count;
+    max = (uint64_t)svc->opts.restart_delay_max * 1000;
+    if (event_now() - svc->started_at >= max) {
+        svc->restarts = 0;
+    }
+    if (svc->restarts >= svc->opts.restart_limit) {
+        log_error("Service %s was restarted %d times in a row, giving up", svc->name, svc->restarts);
+        return false;
+    }
 
-    for (i=0;i<l_count; i++) {
-        namelist[i]->d_name[strlen(namelist[i]->d_name)-6] = 0;
-        services[i] = service_new(namelist[i]->d_name);
-        log_debug("Adding service %s", services[i]->name);
-        free(namelist[i]);
+    delay = (uint64_t)svc->opts.restart_delay * 1000;
+    for (i = 0; i < svc->restarts && delay < max; i++) {
+        delay *= 2;
     }
-    free(namelist);
+    if (delay > max) {
+        delay = max;
+    }
+    svc->restarts++;
+    svc->stats.restarts++;
 
-    log_debug("Found %d services", services_count);
+    log_warning("Restarting service %s in %llu ms (attempt %d of %d)", svc->name, (unsigned long long)delay, svc->restarts, svc->opts.restart_limit);
+    svc->state = STATE_PENDING_UP;
+    control_dispatch_service_state_change(svc);
+    event_timer_set(&svc->restart_timer, delay);
 
-    if (count != NULL) {
-        *count = l_count;
+    return true;
+}
+
+void service_handle_restart(struct service *svc)
+{
+    if (svc == NULL || !service_is_waiting(svc)) {
+        return;
     }
 
-    return S_OK;
+    log_info("Restarting service %s", svc->name);
+    // otherwise left waiting, spawned once dependencies are UP
+    if (service_deps_up(svc)) {
+        service_spawn(svc);
+    }
 }
 
-void service_set_down(struct service *svc)
+void service_handle_ready_timeout(struct service *svc)
 {
-    svc->pid = 0;
-    svc->state = STATE_DOWN;
-    control_dispatch_service_state_change(svc);
+    if (svc == NULL) {
+        return;
+    }
+
+    if (svc->state == STATE_PENDING_UP && svc->pid > 0) {
+        log_error("Service %s was not ready in %d seconds", svc->name, svc->opts.ready_timeout);
+        service_stop(svc);
+    }
+    service_ready_cleanup(svc);
 }
 
 /**
- * Runs stop script asynchronusly.
+ * Starts service asynchronusly.
+ * 
+ * When some dependencies are not UP service is left in STATE_PENDING_UP
+ * and dependencies are started, so independent services are spawned
+ * in parallel and dependent ones as soon as its last dependency is UP.
  */
-bool service_stop(struct service *svc)
+bool service_start(struct service *svc)
 {
-    char cmd[256];
-    char pid[16];
+    uint8_t i;
 
-    if (svc->state == STATE_UP) {
-        log_info("Stopping service %s", svc->name);
-        svc->state = STATE_PENDING_DOWN;
+    if (svc->state == STATE_DOWN && svc->unavailable) {
+        log_warning("Service %s is not available", svc->name);
+        return false;
+    }
+    if (svc->state == STATE_DOWN) {
+        log_info("Starting service %s", svc->name);
+        service_watch_sockets(svc, SERVICE_SOCKETS_UNWATCHED);
+        svc->state = STATE_PENDING_UP;
+        svc->restarts = 0;
         control_dispatch_service_state_change(svc);
 
-        cmd[snprintf(cmd, 255, PUPPETIZER_SERVICE_DIR "/%s.stop", svc->name)] = 0;
-        sprintf(pid, "%d", svc->pid);
-        // .stop powinno zrobić co się da by zatrzymać serwis "wkrótce"
-        if (spawn2(cmd, pid) <= 0) {
-            log_warning("Failed to run stop script for service %s", svc->name);
-            svc->state = STATE_UP;
+        if (service_deps_up(svc)) {
+            return service_spawn(svc);
         }
 
-        control_dispatch_service_state_change(svc);
-
+        log_debug("Service %s is waiting for dependencies", svc->name);
+        for (i=0; i<svc->deps_count; i++) {
+            service_start(svc->deps[i]);
+            // cancelled by dependency which failed to spawn
+            if (svc->state == STATE_DOWN) {
+                return false;
+            }
+            // nothing would ever set it down and cancel this one
+            if (svc->deps[i]->state == STATE_DOWN) {
+                log_warning("Cancelling start of service %s, dependency %s could not be started", svc->name, svc->deps[i]->name);
+                service_set_down(svc);
+                return false;
+            }
+        }
         return true;
     }
 
     return false;
 }
 
-bool service_start(struct service *svc)
+static bool service_has_running_dependents(struct service *svc)
 {
-    char cmd[256];
-    int status;
-
-    if (svc->state == STATE_DOWN) {
-        log_info("Starting service %s", svc->name);
-        svc->state = STATE_PENDING_UP;
-        control_dispatch_service_state_change(svc);
+    uint16_t i;
+    uint8_t j;
 
-        cmd[snprintf(cmd, 255, PUPPETIZER_SERVICE_DIR "/%s.start", svc->name)] = 0;
-        pid_t pid = spawn2(cmd, NULL);
-        if (pid > 0) {
-            svc->pid = pid;
-
-            // FIXME: will mark as failed when child somehow is SIGSTOP
-            if (waitpid(pid, &status, WNOHANG) == 0) {
-                svc->state = STATE_UP;
-                control_dispatch_service_state_change(svc);
-                return true;
-            } else {
-                service_set_down(svc);
-                return false;
-            }
-        } else {
-            log_warning("Service %s failed to start", svc->name);
-            svc->state = STATE_DOWN;
-            control_dispatch_service_state_change(svc);
+    for (i=0; i<services_count; i++) {
+        if (services[i]->state == STATE_DOWN) continue;
+        for (j=0; j<services[i]->deps_count; j++) {
+            if (services[i]->deps[j] == svc) return true;
         }
     }
-
     return false;
 }
 
-uint8_t service_stop_all()
+/**
+ * Stops services in reverse dependency order, service is stopped only
+ * when nothing that depends on it is running. Independent services are
+ * stopped in parallel, call again after each service exit.
+ * Returns number of services which were stopped.
+ */
+uint16_t service_stop_all()
 {
-    uint8_t i, stopping = 0;
+    uint16_t i, stopping = 0;
+
+    // not spawned yet, nothing to wait for
     for (i=0; i<services_count; i++) {
-        if (services[i]->state != STATE_DOWN && services[i]->state != STATE_PENDING_DOWN) {
+        if (service_is_waiting(services[i])) {
             service_stop(services[i]);
             stopping++;
         }
     }
+    for (i=0; i<services_count; i++) {
+        if (services[i]->state == STATE_DOWN || services[i]->state == STATE_PENDING_DOWN) continue;
+        if (service_has_running_dependents(services[i])) continue;
+        if (service_stop(services[i])) {
+            stopping++;
+        }
+    }
     return stopping;
 }
 
-struct service* service_find_by_name(const char* name)
+static void service_signal(struct service *svc, int sig)
 {
-    uint8_t i;
+    if (svc->cgroup_fd != -1 && cgroup_signal(svc->cgroup_fd, sig)) {
+        return;
+    }
+    // group is missing when service did not get its own one
+    if (kill(-svc->pid, sig) == -1) {
+        kill(svc->pid, sig);
+    }
+}
+
+/**
+ * Escalates stop of service which did not exit in time.
+ */
+void service_handle_stop_timeout(struct service *svc)
+{
+    if (svc == NULL || svc->pid <= 0 || svc->state != STATE_PENDING_DOWN) {
+        return;
+    }
+
+    if (svc->stop_signals == 0) {
+        log_warning("Service %s did not stop in %d seconds, terminating it", svc->name, svc->opts.stop_timeout);
+        service_signal(svc, SIGTERM);
+        event_timer_set(&svc->stop_timer, SERVICE_KILL_DELAY);
+    } else {
+        log_warning("Service %s did not terminate, killing it", svc->name);
+        service_signal(svc, SIGKILL);
+    }
+    svc->stop_signals++;
+}
+
+/**
+ * Kills processes of all running services, returns their count.
+ */
+uint16_t service_kill_all()
+{
+    uint16_t i, killed = 0;
+
+    for (i=0; i<services_count; i++) {
+        if (services[i]->pid > 0) {
+            service_signal(services[i], SIGKILL);
+            services[i]->stop_signals++;
+            killed++;
+        }
+    }
+    return killed;
+}
+
+/**
+ * Watches sockets of services which are DOWN, they are started on first connection.
+ */
+void service_listen_all()
+{
+    uint16_t i;
+
+    listening = true;
+    for (i=0; i<services_count; i++) {
+        if (services[i]->state == STATE_DOWN) {
+            service_watch_sockets(services[i], SERVICE_SOCKETS_LISTEN);
+        } else if (services[i]->pid > 0 && services[i]->opts.idle_timeout > 0) {
+            // restored running service
+            service_watch_sockets(services[i], SERVICE_SOCKETS_ACTIVITY);
+        }
+    }
+}
+
+/**
+ * Stops activation and idle stops, used when halting.
+ */
+void service_unlisten_all()
+{
+    uint16_t i;
+
+    listening = false;
     for (i=0; i<services_count; i++) {
-        if (strcmp(name, services[i]->name) == 0) {
-            return services[i];
+        service_watch_sockets(services[i], SERVICE_SOCKETS_UNWATCHED);
+        event_timer_cancel(&services[i]->idle_timer);
+    }
+}
+
+/**
+ * Starts service on first connection, while it runs new connections postpone idle stop.
+ */
+void service_handle_socket(struct service *svc)
+{
+    if (svc == NULL) {
+        return;
+    }
+
+    if (svc->state == STATE_DOWN) {
+        log_info("Activating service %s by connection", svc->name);
+        service_start(svc);
+    } else if (svc->pid > 0 && svc->opts.idle_timeout > 0) {
+        event_timer_set(&svc->idle_timer, (uint64_t)svc->opts.idle_timeout * 1000);
+    } else {
+        // waiting for restart or dependencies, spawn takes sockets over
+        service_watch_sockets(svc, SERVICE_SOCKETS_UNWATCHED);
+    }
+}
+
+void service_handle_idle_timeout(struct service *svc)
+{
+    if (svc == NULL || svc->state != STATE_UP) {
+        return;
+    }
+
+    log_info("Service %s had no new connections in %d seconds, stopping it", svc->name, svc->opts.idle_timeout);
+    service_stop(svc);
+}
+
+struct service* service_find_by_name(const char* name)
+{
+    uint32_t i;
+
+    if (index_size == 0) return NULL;
+
+    for (i = INDEX_SLOT(service_hash_name(name)); index_by_name[i] != NULL; i = INDEX_NEXT(i)) {
+        if (strcmp(name, index_by_name[i]->name) == 0) {
+            return index_by_name[i];
         }
     }
     return NULL;
@@ -165,18 +1271,26 @@ struct service* service_find_by_name(const char* name)
 
 struct service* service_find_by_pid(pid_t pid)
 {
-    uint8_t i;
-    for (i=0; i<services_count; i++) {
-        if (services[i]->pid > 0 && services[i]->pid == pid) {
-            return services[i];
+    uint32_t i;
+
+    if (index_size == 0 || pid <= 0) return NULL;
+
+    for (i = INDEX_SLOT(service_hash_pid(pid)); index_by_pid[i] != NULL; i = INDEX_NEXT(i)) {
+        if (index_by_pid[i]->pid == pid) {
+            return index_by_pid[i];
         }
     }
     return NULL;
 }
 
-uint8_t service_count_by_state(uint8_t state, bool invert)
+struct service* service_get(uint16_t id)
+{
+    return id < services_count ? services[id] : NULL;
+}
+
+uint16_t service_count_by_state(uint8_t state, bool invert)
 {
-    uint8_t i, count=0;
+    uint16_t i, count=0;
     for (i=0; i<services_count; i++) {
         if (services[i]->state == state) {
             if(!invert) count++;
@@ -186,3 +1300,307 @@ uint8_t service_count_by_state(uint8_t state, bool invert)
     }
     return count;
 }
+
+static void service_reload_options(struct service *svc)
+{
+    uint8_t i;
+
+    for (i=0; i<svc->opts.env_count; i++) {
+        free((char*)svc->opts.env[i]);
+    }
+    free(svc->opts.env);
+    free(svc->opts.rlimits);
+    free(svc->opts.cwd);
+    memset(&svc->opts, 0, sizeof(struct service_options));
+    service_default_options(&svc->opts);
+    service_load_options(svc);
+}
+
+/**
+ * Previous dependencies are kept when new ones are invalid.
+ * Only edges of this service changed, so any new cycle goes through it.
+ */
+static status_t service_reload_deps(struct service *svc)
+{
+    struct service **deps = svc->deps;
+    uint8_t deps_count = svc->deps_count;
+    uint8_t *marks;
+    status_t status;
+
+    svc->deps = NULL;
+    svc->deps_count = 0;
+    status = service_load_deps(svc);
+    marks = calloc(services_count, sizeof(uint8_t));
+    if (status == S_OK && !service_deps_acyclic(svc, marks)) {
+        status = S_SERVICE_DEPS_ERROR;
+    }
+    free(marks);
+
+    if (status != S_OK) {
+        free(svc->deps);
+        svc->deps = deps;
+        svc->deps_count = deps_count;
+        return status;
+    }
+    free(deps);
+    return S_OK;
+}
+
+/**
+ * Reads all files of service again, running process is not touched.
+ * Sockets are opened again only when asked or availability changed.
+ */
+static void service_reload(struct service *svc, bool sockets)
+{
+    bool was_unavailable = svc->unavailable;
+
+    svc->unavailable = access(svc->start_path, F_OK) == -1;
+    service_reload_options(svc);
+    if (!svc->unavailable && service_reload_deps(svc) != S_OK) {
+        log_error("Service %s is not available until its dependencies are fixed", svc->name);
+        svc->unavailable = true;
+    }
+
+    if (!sockets && was_unavailable == svc->unavailable) {
+        // sockets are unchanged
+    } else if (svc->state == STATE_DOWN) {
+        service_reload_sockets(svc);
+        service_watch_sockets(svc, listening ? SERVICE_SOCKETS_LISTEN : SERVICE_SOCKETS_UNWATCHED);
+    } else {
+        svc->sockets_stale = true;
+    }
+    if (svc->unavailable && service_is_waiting(svc)) {
+        service_set_down(svc);
+    }
+
+    if (was_unavailable && !svc->unavailable) {
+        log_info("Service %s is available", svc->name);
+    } else if (!was_unavailable && svc->unavailable) {
+        log_info("Service %s is not available anymore", svc->name);
+    }
+}
+
+/**
+ * Handles change of single file in service directory.
+ */
+__static void service_handle_dir_file(const char *file)
+{
+    static const char *suffixes[] = { ".start", ".conf", ".deps", ".socket", NULL };
+    struct service *svc;
+    const char *suffix = strrchr(file, '.');
+    char name[256];
+    uint16_t i;
+    uint8_t j;
+
+    if (suffix == NULL || suffix == file || (size_t)(suffix - file) >= sizeof(name)) {
+        return;
+    }
+    for (j=0; suffixes[j] != NULL && strcmp(suffixes[j], suffix) != 0; j++);
+    if (suffixes[j] == NULL) {
+        return;
+    }
+    memcpy(name, file, suffix - file);
+    name[suffix - file] = 0;
+
+    svc = service_find_by_name(name);
+    if (svc == NULL) {
+        if (j != 0 || (svc = service_add(name)) == NULL) {
+            return;
+        }
+        log_info("Found new service %s", name);
+        service_reload(svc, true);
+        control_dispatch_service_state_change(svc);
+        // services waiting for new dependency
+        for (i=0; i<services_count; i++) {
+            if (services[i] != svc && services[i]->unavailable && access(services[i]->start_path, F_OK) == 0) {
+                service_reload(services[i], false);
+            }
+        }
+        return;
+    }
+
+    log_debug("Reloading service %s after change of %s", name, file);
+    // start script and .socket decide which sockets are open
+    service_reload(svc, j == 0 || j == 3);
+}
+
+/**
+ * Events were dropped, every file is checked again.
+ */
+static void service_rescan_dir()
+{
+    struct dirent **namelist;
+    char *name;
+    int count, i;
+    uint16_t j, known = services_count;
+
+    log_warning("Service directory changed too quickly, scanning it again");
+    for (j=0; j<known; j++) {
+        service_reload(services[j], true);
+    }
+    count = scandir(PUPPETIZER_SERVICE_DIR, &namelist, service_files_filter, NULL);
+    for (i=0; i<count; i++) {
+        name = namelist[i]->d_name;
+        name[strlen(name) - 6] = 0;
+        if (service_find_by_name(name) == NULL) {
+            name[strlen(name)] = '.';
+            service_handle_dir_file(name);
+        }
+        free(namelist[i]);
+    }
+    if (count >= 0) {
+        free(namelist);
+    }
+}
+
+/**
+ * Watches service directory, so services added or changed by apply
+ * are picked up without restarting init.
+ */
+status_t service_watch_dir()
+{
+    if (dir_fd != -1) {
+        return S_OK;
+    }
+    dir_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (dir_fd == -1) {
+        log_errno_warning("Could not watch service directory");
+        return S_EVENT_ERROR;
+    }
+    // files are picked up once written, moved in or removed
+    if (inotify_add_watch(dir_fd, PUPPETIZER_SERVICE_DIR, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB | IN_ONLYDIR) == -1
+            || event_add(dir_fd, EVENT_SERVICE_DIR, 0) != S_OK) {
+        log_errno_warning("Could not watch service directory %s", PUPPETIZER_SERVICE_DIR);
+        close(dir_fd);
+        dir_fd = -1;
+        return S_EVENT_ERROR;
+    }
+    return S_OK;
+}
+
+void service_handle_dir()
+{
+    char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    bool overflow = false;
+    ssize_t len;
+    char *p;
+
+    while ((len = read(dir_fd, buff, sizeof(buff))) > 0) {
+        for (p = buff; p < buff + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+            } else if (ev->mask & IN_IGNORED) {
+                log_warning("Service directory %s is gone, not watching it anymore", PUPPETIZER_SERVICE_DIR);
+                event_remove(dir_fd);
+                close(dir_fd);
+                dir_fd = -1;
+                return;
+            } else if (!overflow && ev->len > 0) {
+                service_handle_dir_file(ev->name);
+            }
+        }
+    }
+
+    if (overflow) {
+        service_rescan_dir();
+    }
+}
+
+/**
+ * Saves runtime state of services, all fds are kept open over exec.
+ * Options and dependencies are not saved, new image reads them again.
+ */
+void service_snapshot_save(struct snapshot *s)
+{
+    struct service *svc;
+    uint16_t i;
+    uint8_t j;
+
+    SNAPSHOT_PUT(s, services_count);
+    for (i=0; i<services_count; i++) {
+        svc = services[i];
+        snapshot_put_string(s, svc->name);
+        SNAPSHOT_PUT(s, svc->state);
+        SNAPSHOT_PUT(s, svc->pid);
+        SNAPSHOT_PUT(s, svc->started_at);
+        SNAPSHOT_PUT(s, svc->restarts);
+        SNAPSHOT_PUT(s, svc->stop_signals);
+        SNAPSHOT_PUT(s, svc->stats.starts);
+        SNAPSHOT_PUT(s, svc->stats.restarts);
+        SNAPSHOT_PUT(s, svc->stats.last_exit);
+        SNAPSHOT_PUT(s, svc->stats.ready_at);
+        snapshot_put_fd(s, svc->notify_fd);
+        snapshot_put_timer(s, &svc->ready_timer);
+        snapshot_put_timer(s, &svc->restart_timer);
+        snapshot_put_timer(s, &svc->stop_timer);
+        snapshot_put_timer(s, &svc->idle_timer);
+        output_snapshot_save(s, &svc->output);
+        snapshot_put_fd(s, svc->cgroup_fd);
+        SNAPSHOT_PUT(s, svc->sockets_count);
+        for (j=0; j<svc->sockets_count; j++) {
+            snapshot_put_fd(s, svc->sockets[j]);
+        }
+    }
+}
+
+/**
+ * Registers services from snapshot before service_create_all, so ids
+ * can change but running processes and their fds are kept.
+ */
+status_t service_snapshot_restore(struct snapshot *s)
+{
+    struct service *svc;
+    const char *name;
+    uint16_t i, count;
+    uint8_t j;
+
+    SNAPSHOT_GET(s, count);
+    for (i=0; i<count && !s->failed; i++) {
+        name = snapshot_get_string(s);
+        if (name == NULL || (svc = service_add(name)) == NULL) {
+            return S_SNAPSHOT_ERROR;
+        }
+        svc->restored = true;
+        SNAPSHOT_GET(s, svc->state);
+        SNAPSHOT_GET(s, svc->pid);
+        SNAPSHOT_GET(s, svc->started_at);
+        SNAPSHOT_GET(s, svc->restarts);
+        SNAPSHOT_GET(s, svc->stop_signals);
+        SNAPSHOT_GET(s, svc->stats.starts);
+        SNAPSHOT_GET(s, svc->stats.restarts);
+        SNAPSHOT_GET(s, svc->stats.last_exit);
+        SNAPSHOT_GET(s, svc->stats.ready_at);
+        svc->notify_fd = snapshot_get_fd(s);
+        snapshot_get_timer(s, &svc->ready_timer);
+        snapshot_get_timer(s, &svc->restart_timer);
+        snapshot_get_timer(s, &svc->stop_timer);
+        snapshot_get_timer(s, &svc->idle_timer);
+        output_snapshot_restore(s, &svc->output);
+        svc->cgroup_fd = snapshot_get_fd(s);
+        SNAPSHOT_GET(s, svc->sockets_count);
+        if (svc->sockets_count > 0) {
+            svc->sockets = malloc(sizeof(int) * svc->sockets_count);
+        }
+        for (j=0; j<svc->sockets_count; j++) {
+            svc->sockets[j] = snapshot_get_fd(s);
+        }
+
+        if (svc->notify_fd != -1 && event_add(svc->notify_fd, EVENT_SERVICE_NOTIFY, svc->id) != S_OK) {
+            service_close_fd(&svc->notify_fd);
+        }
+        if (svc->pid > 0) {
+            service_index_pid(svc);
+            // exit meanwhile left zombie, so pidfd is still valid
+            svc->pidfd = spawn_pidfd(svc->pid);
+            if (svc->pidfd != -1 && event_add(svc->pidfd, EVENT_SERVICE_EXIT, svc->id) != S_OK) {
+                close(svc->pidfd);
+                svc->pidfd = -1;
+            }
+        }
+        log_debug("Restored service %s with pid %d", svc->name, svc->pid);
+    }
+
+    return s->failed ? S_SNAPSHOT_ERROR : S_OK;
+}
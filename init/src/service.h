@@ -3,13 +3,123 @@
 
 #include <sys/types.h>
 #include "status.h"
+#include "event.h"
+#include "spawn.h"
+#include "output.h"
+#include "cgroup.h"
+#include "snapshot.h"
 
 typedef uint8_t service_state_t;
 
+#define SERVICE_READY_NONE 0
+#define SERVICE_READY_NOTIFY 1
+
+#define SERVICE_RESTART_NEVER 0
+#define SERVICE_RESTART_ON_FAILURE 1
+#define SERVICE_RESTART_ALWAYS 2
+
+#define SERVICE_DEFAULT_RESTART_DELAY 1
+#define SERVICE_DEFAULT_RESTART_DELAY_MAX 60
+#define SERVICE_DEFAULT_RESTART_LIMIT 5
+
+// line written to notify fd by service when it is ready
+#define SERVICE_NOTIFY_READY "READY=1"
+#define SERVICE_DEFAULT_READY_TIMEOUT 60
+
+// how sockets of socket activated service are watched by init
+#define SERVICE_SOCKETS_UNWATCHED 0
+// service is DOWN, first connection starts it
+#define SERVICE_SOCKETS_LISTEN 1
+// service is running, new connections postpone idle stop
+#define SERVICE_SOCKETS_ACTIVITY 2
+
+#define SERVICE_DEFAULT_STOP_TIMEOUT 10
+// ms between SIGTERM and SIGKILL of processes of service that did not stop
+#define SERVICE_KILL_DELAY 5000
+
+/**
+ * Options read from <name>.conf
+ */
+struct service_options {
+    uint8_t ready;
+    // seconds to wait for readiness notification, 0 to wait forever
+    uint32_t ready_timeout;
+    // working directory of start and stop scripts
+    char *cwd;
+    // NAME=value entries from env.NAME keys
+    const char **env;
+    uint8_t env_count;
+    // limits from limit.NAME keys
+    struct spawn_rlimit *rlimits;
+    uint8_t rlimits_count;
+    // inherit, capture or prefix stdout and stderr of start script
+    output_mode_t output;
+    // what to do when service exits without being stopped
+    uint8_t restart;
+    // seconds before first restart, doubled for each next one up to restart_delay_max
+    uint32_t restart_delay;
+    uint32_t restart_delay_max;
+    // restarts in a row before init halts, run longer than restart_delay_max resets it
+    uint32_t restart_limit;
+    // seconds after stop script before process group is terminated, 0 to wait forever
+    uint32_t stop_timeout;
+    // seconds without new connections before socket activated service is stopped, 0 to keep it running
+    uint32_t idle_timeout;
+    // memory_max, cpu_weight and io_weight of service cgroup
+    struct cgroup_limits cgroup;
+};
+
+/**
+ * Counters kept for metrics, resource usage is sampled by metrics timer.
+ */
+struct service_stats {
+    uint32_t starts;
+    uint32_t restarts;
+    int16_t last_exit;
+    // CLOCK_MONOTONIC time in ms when service became UP, 0 when it did not
+    uint64_t ready_at;
+    uint64_t cpu_ms;
+    uint64_t rss;
+};
+
 struct service {
+    uint16_t id;
     char* name;
+    char *start_path;
+    char *stop_path;
     service_state_t state;
     pid_t pid;
+    // pidfd watched for exit, -1 when not available
+    int pidfd;
+    // services that have to be UP before this one is spawned
+    struct service **deps;
+    uint8_t deps_count;
+    struct service_options opts;
+    // readiness notifications, -1 when not waiting
+    int notify_fd;
+    struct event_timer ready_timer;
+    struct output output;
+    // backoff before restart, service is PENDING_UP meanwhile
+    struct event_timer restart_timer;
+    uint32_t restarts;
+    uint64_t started_at;
+    // escalation of stop, SIGTERM and then SIGKILL sent to cgroup or process group
+    struct event_timer stop_timer;
+    uint8_t stop_signals;
+    struct service_stats stats;
+    // own cgroup directory, -1 when service shares cgroup with init
+    int cgroup_fd;
+    // listening sockets from <name>.socket, passed to service as LISTEN_FDS
+    int *sockets;
+    uint8_t sockets_count;
+    uint8_t sockets_watch;
+    struct event_timer idle_timer;
+    // runtime state came from snapshot, sockets are not opened again
+    bool restored;
+    // start script is gone or dependencies are invalid, service can not be started
+    bool unavailable;
+    // .socket changed while service was running, sockets are opened again when it is DOWN
+    bool sockets_stale;
 };
 
 #define STATE_PENDING_UP 1
@@ -17,13 +127,31 @@ struct service {
 #define STATE_DOWN 3
 #define STATE_PENDING_DOWN 4
 
-status_t service_create_all();
-uint8_t service_stop_all();
+status_t service_create_all(uint16_t* count);
+uint16_t service_stop_all();
 bool service_start(struct service *svc);
 bool service_stop(struct service *svc);
 struct service* service_find_by_name(const char* name);
 struct service* service_find_by_pid(pid_t pid);
-uint8_t service_count_by_state(uint8_t state, bool invert);
+struct service* service_get(uint16_t id);
+uint16_t service_count_by_state(uint8_t state, bool invert);
 void service_set_down(struct service *svc);
+void service_set_exited(struct service *svc);
+void service_cancel_dependents(struct service *svc);
+void service_handle_notify(struct service *svc);
+void service_handle_ready_timeout(struct service *svc);
+void service_handle_output(struct service *svc);
+bool service_schedule_restart(struct service *svc, int retval);
+void service_handle_restart(struct service *svc);
+void service_handle_stop_timeout(struct service *svc);
+uint16_t service_kill_all();
+void service_listen_all();
+void service_unlisten_all();
+void service_handle_socket(struct service *svc);
+void service_handle_idle_timeout(struct service *svc);
+status_t service_watch_dir();
+void service_handle_dir();
+void service_snapshot_save(struct snapshot *s);
+status_t service_snapshot_restore(struct snapshot *s);
 
 #endif
@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "snapshot.h"
+#include "conf.h"
+#include "log.h"
+
+#define LOG_MODULE "snapshot"
+
+#ifndef SYS_memfd_create
+#define SYS_memfd_create 319
+#endif
+
+struct snapshot_header {
+    uint32_t magic;
+    uint16_t version;
+    uint64_t len;
+};
+
+void snapshot_init(struct snapshot *s)
+{
+    memset(s, 0, sizeof(struct snapshot));
+}
+
+void snapshot_free(struct snapshot *s)
+{
+    free(s->data);
+    free(s->fds);
+    snapshot_init(s);
+}
+
+void snapshot_put(struct snapshot *s, const void *data, size_t len)
+{
+    uint8_t *resized;
+    size_t size;
+
+    if (s->failed) {
+        return;
+    }
+    if (s->len + len > s->size) {
+        for (size = s->size ? s->size : 4096; size < s->len + len; size *= 2);
+        resized = realloc(s->data, size);
+        if (resized == NULL) {
+            s->failed = true;
+            return;
+        }
+        s->data = resized;
+        s->size = size;
+    }
+    memcpy(s->data + s->len, data, len);
+    s->len += len;
+}
+
+/**
+ * Length prefixed and NUL terminated, so it can be used in place when read.
+ */
+void snapshot_put_string(struct snapshot *s, const char *str)
+{
+    uint16_t len = str ? strlen(str) + 1 : 0;
+
+    SNAPSHOT_PUT(s, len);
+    snapshot_put(s, str, len);
+}
+
+/**
+ * Records fd, it is kept open over exec by snapshot_keep_fds.
+ */
+void snapshot_put_fd(struct snapshot *s, int fd)
+{
+    int32_t value = fd;
+    int *resized;
+
+    if (fd >= 0) {
+        resized = realloc(s->fds, sizeof(int) * (s->fds_count + 1));
+        if (resized == NULL) {
+            s->failed = true;
+            return;
+        }
+        s->fds = resized;
+        s->fds[s->fds_count++] = fd;
+    }
+    SNAPSHOT_PUT(s, value);
+}
+
+/**
+ * Monotonic clock keeps running over exec, so absolute deadline is stored.
+ */
+void snapshot_put_timer(struct snapshot *s, const struct event_timer *timer)
+{
+    uint64_t deadline = event_timer_active(timer) ? timer->deadline : 0;
+
+    SNAPSHOT_PUT(s, deadline);
+}
+
+bool snapshot_get(struct snapshot *s, void *data, size_t len)
+{
+    if (s->failed || s->len - s->pos < len) {
+        s->failed = true;
+        memset(data, 0, len);
+        return false;
+    }
+    memcpy(data, s->data + s->pos, len);
+    s->pos += len;
+    return true;
+}
+
+/**
+ * Returns pointer into snapshot data, valid until snapshot is freed.
+ */
+const void *snapshot_get_data(struct snapshot *s, size_t len)
+{
+    const void *data;
+
+    if (s->failed || s->len - s->pos < len) {
+        s->failed = true;
+        return NULL;
+    }
+    data = s->data + s->pos;
+    s->pos += len;
+    return data;
+}
+
+const char *snapshot_get_string(struct snapshot *s)
+{
+    const char *str;
+    uint16_t len;
+
+    if (!SNAPSHOT_GET(s, len) || len == 0) {
+        return NULL;
+    }
+    str = snapshot_get_data(s, len);
+    if (str != NULL && str[len - 1] != 0) {
+        s->failed = true;
+        return NULL;
+    }
+    return str;
+}
+
+int snapshot_get_fd(struct snapshot *s)
+{
+    int32_t fd;
+
+    if (!SNAPSHOT_GET(s, fd) || fd < 0) {
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+void snapshot_get_timer(struct snapshot *s, struct event_timer *timer)
+{
+    uint64_t deadline, now;
+
+    if (!SNAPSHOT_GET(s, deadline) || deadline == 0) {
+        return;
+    }
+    now = event_now();
+    event_timer_set(timer, deadline > now ? deadline - now : 0);
+}
+
+/**
+ * Clears close-on-exec flag of recorded fds, or sets it back when exec failed.
+ */
+void snapshot_keep_fds(struct snapshot *s, bool keep)
+{
+    uint16_t i;
+
+    for (i=0; i<s->fds_count; i++) {
+        if (fcntl(s->fds[i], F_SETFD, keep ? 0 : FD_CLOEXEC) == -1 && keep) {
+            log_errno_warning("Could not keep fd %d over exec", s->fds[i]);
+        }
+    }
+}
+
+/**
+ * Writes snapshot with header to memfd which is left open over exec.
+ * Returns fd or -1 on failure.
+ */
+int snapshot_write_memfd(struct snapshot *s)
+{
+    struct snapshot_header header = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION, s->len };
+    int fd;
+
+    if (s->failed) {
+        return -1;
+    }
+    fd = syscall(SYS_memfd_create, "puppetizer-snapshot", 0);
+    if (fd == -1) {
+        log_errno_error("Could not create snapshot memfd");
+        return -1;
+    }
+    if (write(fd, &header, sizeof(header)) != sizeof(header) || write(fd, s->data, s->len) != (ssize_t)s->len) {
+        log_errno_error("Could not write snapshot");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Reads snapshot left by previous image, fd is closed.
+ */
+status_t snapshot_read_fd(int fd, struct snapshot *s)
+{
+    struct snapshot_header header;
+    ssize_t n;
+    size_t read_len = 0;
+
+    snapshot_init(s);
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != SNAPSHOT_MAGIC) {
+        log_error("Invalid snapshot");
+        close(fd);
+        return S_SNAPSHOT_ERROR;
+    }
+    if (header.version != SNAPSHOT_VERSION) {
+        log_error("Snapshot version %d is not supported", header.version);
+        close(fd);
+        return S_SNAPSHOT_ERROR;
+    }
+
+    s->data = malloc(header.len ? header.len : 1);
+    s->size = s->len = header.len;
+    while (s->data != NULL && read_len < header.len) {
+        n = pread(fd, s->data + read_len, header.len - read_len, sizeof(header) + read_len);
+        if (n <= 0) break;
+        read_len += n;
+    }
+    close(fd);
+
+    if (s->data == NULL || read_len != header.len) {
+        log_error("Snapshot is truncated");
+        snapshot_free(s);
+        return S_SNAPSHOT_ERROR;
+    }
+    return S_OK;
+}
+
+/**
+ * Returns snapshot fd passed by previous image or -1, variable is
+ * removed so services do not inherit it.
+ */
+int snapshot_env_fd()
+{
+    const char *value = getenv(SNAPSHOT_ENV);
+    uint32_t fd;
+    bool valid;
+
+    if (value == NULL) {
+        return -1;
+    }
+    valid = conf_parse_uint(value, &fd) && fd <= INT32_MAX;
+    unsetenv(SNAPSHOT_ENV);
+    return valid ? (int)fd : -1;
+}
@@ -0,0 +1,52 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <sys/types.h>
+#include "status.h"
+#include "event.h"
+
+// memfd with state of previous init image
+#define SNAPSHOT_ENV "PUPPETIZER_SNAPSHOT_FD"
+#define SNAPSHOT_MAGIC 0x70757a31
+// bumped whenever layout changes, other versions are not restored
+#define SNAPSHOT_VERSION 2
+
+/**
+ * Runtime state handed to new init image over execve.
+ * Values are written in host order, both images run on same machine.
+ */
+struct snapshot {
+    uint8_t *data;
+    size_t len, size;
+    // read position
+    size_t pos;
+    // set when reading past end or on allocation failure
+    bool failed;
+    // fds to keep open over exec
+    int *fds;
+    uint16_t fds_count;
+};
+
+#define SNAPSHOT_PUT(S, V) snapshot_put(S, &(V), sizeof(V))
+#define SNAPSHOT_GET(S, V) snapshot_get(S, &(V), sizeof(V))
+
+void snapshot_init(struct snapshot *s);
+void snapshot_free(struct snapshot *s);
+
+void snapshot_put(struct snapshot *s, const void *data, size_t len);
+void snapshot_put_string(struct snapshot *s, const char *str);
+void snapshot_put_fd(struct snapshot *s, int fd);
+void snapshot_put_timer(struct snapshot *s, const struct event_timer *timer);
+
+bool snapshot_get(struct snapshot *s, void *data, size_t len);
+const char *snapshot_get_string(struct snapshot *s);
+const void *snapshot_get_data(struct snapshot *s, size_t len);
+int snapshot_get_fd(struct snapshot *s);
+void snapshot_get_timer(struct snapshot *s, struct event_timer *timer);
+
+void snapshot_keep_fds(struct snapshot *s, bool keep);
+int snapshot_write_memfd(struct snapshot *s);
+status_t snapshot_read_fd(int fd, struct snapshot *s);
+int snapshot_env_fd();
+
+#endif
@@ -1,41 +1,251 @@
+#define _GNU_SOURCE
 #include "common.h"
 
-#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 
 #include "spawn.h"
 #include "log.h"
 
 #define LOG_MODULE "spawn"
 
-pid_t MOCKABLE(spawn2)(const char *script, const char *arg)
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+extern char **environ;
+
+struct spawn_child {
+    char *const *argv;
+    char *const *envp;
+    const struct spawn_options *opts;
+    int err_fd;
+    // digits of LISTEN_PID entry, pid is known only in child
+    char *listen_pid;
+};
+
+#define SPAWN_LISTEN_PID_PREFIX "LISTEN_PID="
+#define SPAWN_PID_DIGITS 10
+
+/*
+ * Child shares memory with init until exec (CLONE_VM | CLONE_VFORK)
+ * and init is suspended meanwhile, so single static stack is enough.
+ */
+static uint8_t spawn_stack[SPAWN_STACK_SIZE] __attribute__((aligned(16)));
+
+/**
+ * Writes decimal pid without libc, field has room for SPAWN_PID_DIGITS and NUL.
+ */
+static void spawn_format_pid(char *field, pid_t pid)
 {
+    char digits[SPAWN_PID_DIGITS];
+    int len = 0, i;
+
+    do {
+        digits[len++] = '0' + pid % 10;
+        pid /= 10;
+    } while (pid > 0 && len < SPAWN_PID_DIGITS);
+    for (i = 0; i < len; i++) {
+        field[i] = digits[len - 1 - i];
+    }
+    field[len] = 0;
+}
+
+/**
+ * Runs in child, only raw syscalls are allowed here as memory is shared with init.
+ * On failure errno is sent to init over CLOEXEC pipe.
+ */
+static int spawn_child_main(void *data)
+{
+    struct spawn_child *child = data;
+    const struct spawn_options *opts = child->opts;
     sigset_t no_signals;
+    int tmp_fds[opts->fds_count ? opts->fds_count : 1];
+    int max_target = STDERR_FILENO;
+    int err;
+    uint8_t i;
+
+    // unblock all signals for child
+    sigemptyset(&no_signals);
+    sigprocmask(SIG_SETMASK, &no_signals, NULL);
+
+    if (child->listen_pid != NULL) {
+        spawn_format_pid(child->listen_pid, getpid());
+    }
+
+    // before exec so nothing of service is ever accounted to init
+    if (opts->cgroup_fd >= 0 && write(opts->cgroup_fd, "0", 1) != 1) goto failed;
+
+    // move fds out of the way first so sources and targets can overlap
+    for (i=0;i<opts->fds_count;i++) {
+        if (opts->fds[i].target > max_target) max_target = opts->fds[i].target;
+    }
+    for (i=0;i<opts->fds_count;i++) {
+        tmp_fds[i] = fcntl(opts->fds[i].fd, F_DUPFD_CLOEXEC, max_target + 1);
+        if (tmp_fds[i] == -1) goto failed;
+    }
+    for (i=0;i<opts->fds_count;i++) {
+        if (dup2(tmp_fds[i], opts->fds[i].target) == -1) goto failed;
+    }
+
+    for (i=0;i<opts->rlimits_count;i++) {
+        if (setrlimit(opts->rlimits[i].resource, &opts->rlimits[i].limit) == -1) goto failed;
+    }
+
+    if (opts->cwd != NULL && chdir(opts->cwd) == -1) goto failed;
+    if (opts->new_group && setpgid(0, 0) == -1) goto failed;
+
+    execve(child->argv[0], child->argv, child->envp);
+
+failed:
+    err = errno;
+    if (write(child->err_fd, &err, sizeof(err)) != sizeof(err)) {
+        // nothing more can be done
+    }
+    _exit(ERROR_EXEC_FAILED);
+}
+
+static bool spawn_env_overridden(const char *entry, const struct spawn_options *opts)
+{
+    const char *eq = strchr(entry, '=');
+    size_t len = eq ? (size_t)(eq - entry) + 1 : strlen(entry);
+    uint8_t i;
+
+    for (i=0;i<opts->env_count;i++) {
+        if (strncmp(opts->env[i], entry, len) == 0) return true;
+    }
+    return false;
+}
+
+/**
+ * Returns environment for child, init environment when nothing is overridden.
+ * Extra entries are added after ones from options.
+ */
+static char **spawn_build_env(const struct spawn_options *opts, char **extra, uint8_t extra_count)
+{
+    char **envp;
+    size_t count = 0, i, k = 0;
+
+    if (opts->env_count == 0 && extra_count == 0) {
+        return environ;
+    }
+
+    while (environ[count]) count++;
+    envp = malloc((count + opts->env_count + extra_count + 1) * sizeof(char*));
+    if (envp == NULL) {
+        return NULL;
+    }
+
+    for (i=0;i<count;i++) {
+        if (!spawn_env_overridden(environ[i], opts)) {
+            envp[k++] = environ[i];
+        }
+    }
+    for (i=0;i<opts->env_count;i++) {
+        envp[k++] = (char*)opts->env[i];
+    }
+    for (i=0;i<extra_count;i++) {
+        envp[k++] = extra[i];
+    }
+    envp[k] = NULL;
+
+    return envp;
+}
+
+/**
+ * Spawns script with optional argument and process setup.
+ * Uses vfork-like clone so init page tables are not copied,
+ * falls back to fork when clone is not permitted.
+ *
+ * Returns -1 when child could not be created or exec failed.
+ */
+pid_t MOCKABLE(spawn)(const char *script, const char *arg, const struct spawn_options *opts)
+{
+    static const struct spawn_options no_options = { .cgroup_fd = -1 };
+    struct spawn_child child;
     pid_t pid;
+    int err_pipe[2], err = 0;
+    char **envp;
+    char listen_fds[sizeof("LISTEN_FDS=") + 3];
+    char listen_pid[sizeof(SPAWN_LISTEN_PID_PREFIX) + SPAWN_PID_DIGITS];
+    char *extra[] = { listen_fds, listen_pid };
 
-    const char *argv[] = {
-        script,
-        arg,
+    char *const argv[] = {
+        (char*)script,
+        (char*)arg,
         0
     };
-    
-    pid = fork();
-    if (pid < 0) {
+
+    if (opts == NULL) {
+        opts = &no_options;
+    }
+
+    child.listen_pid = NULL;
+    if (opts->listen_fds > 0) {
+        snprintf(listen_fds, sizeof(listen_fds), "LISTEN_FDS=%d", opts->listen_fds);
+        strcpy(listen_pid, SPAWN_LISTEN_PID_PREFIX);
+        child.listen_pid = listen_pid + sizeof(SPAWN_LISTEN_PID_PREFIX) - 1;
+    }
+
+    envp = spawn_build_env(opts, extra, opts->listen_fds > 0 ? 2 : 0);
+    if (envp == NULL) {
+        log_error("Could not build environment for %s", script);
+        return -1;
+    }
+
+    if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+        log_errno_error("Could not create pipe for %s", script);
+        if (envp != environ) free(envp);
+        return -1;
+    }
+
+    child.argv = argv;
+    child.envp = envp;
+    child.opts = opts;
+    child.err_fd = err_pipe[1];
+
+    pid = clone(spawn_child_main, spawn_stack + SPAWN_STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD, &child);
+    if (pid == -1 && (errno == ENOSYS || errno == EPERM || errno == EINVAL)) {
+        pid = fork();
+        if (pid == 0) {
+            spawn_child_main(&child);
+        }
+    }
+    close(err_pipe[1]);
+
+    if (pid == -1) {
         fatal_errno(6, "Forking failed");
-    } else if (pid == 0) {
-        // unblock all signals for child
-        sigemptyset(&no_signals);
-        sigprocmask(SIG_SETMASK, &no_signals, NULL);
+    }
 
-        // run app
-        execv(script, (char * const*)argv);
-        //TODO: lepsze raportowanie do parenta?
-        fatal_errno(ERROR_EXEC_FAILED, "Could not run exec for %s", script);
+    // returns 0 once exec succeeded and pipe was closed
+    if (read(err_pipe[0], &err, sizeof(err)) == sizeof(err)) {
+        errno = err;
+        log_errno_error("Could not run %s", script);
+        waitpid(pid, NULL, 0);
+        pid = -1;
     }
+    close(err_pipe[0]);
+
+    if (envp != environ) free(envp);
 
     return pid;
 }
+
+pid_t spawn2(const char *script, const char *arg)
+{
+    return spawn(script, arg, NULL);
+}
+
 pid_t spawn1(const char *script)
 {
     return spawn2(script, NULL);
@@ -70,3 +280,17 @@ int16_t spawn_retval(int stat)
         return SPAWN_RETVAL_RUNNING;
     }
 }
+
+/**
+ * Returns pidfd for given child or -1 when kernel does not support it.
+ */
+int spawn_pidfd(pid_t pid)
+{
+    int fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd == -1) {
+        log_errno_debug("Could not open pidfd for %d", pid);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
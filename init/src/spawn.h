@@ -1,14 +1,60 @@
 #ifndef _SPAWN_H
 #define _SPAWN_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 
 #define SPAWN_RETVAL_RUNNING -256
 
+// readiness notifications are read from this fd in child
+#define SPAWN_NOTIFY_FD 3
+#define SPAWN_NOTIFY_FD_STR "3"
+#define SPAWN_NOTIFY_ENV "PUPPETIZER_NOTIFY_FD"
+#define SPAWN_NOTIFY_ENV_ENTRY SPAWN_NOTIFY_ENV "=" SPAWN_NOTIFY_FD_STR
+
+// activated sockets are passed from this fd, notify fd follows them
+#define SPAWN_LISTEN_FDS_START 3
+
+// fd from init passed to child as target fd
+struct spawn_fd {
+    int fd;
+    int target;
+};
+
+struct spawn_rlimit {
+    int resource;
+    struct rlimit limit;
+};
+
+/**
+ * Child process setup applied between clone and exec.
+ */
+struct spawn_options {
+    // working directory, NULL to inherit
+    const char *cwd;
+    // NAME=value entries overriding init environment
+    const char **env;
+    uint8_t env_count;
+    const struct spawn_fd *fds;
+    uint8_t fds_count;
+    const struct spawn_rlimit *rlimits;
+    uint8_t rlimits_count;
+    // run in own process group so whole tree can be signalled
+    bool new_group;
+    // cgroup.procs of cgroup joined before exec, -1 to stay in init cgroup
+    int cgroup_fd;
+    // fds from SPAWN_LISTEN_FDS_START announced with LISTEN_FDS and LISTEN_PID
+    uint8_t listen_fds;
+};
+
+pid_t spawn(const char *script, const char *arg, const struct spawn_options *opts);
 pid_t spawn1(const char *script);
 pid_t spawn2(const char *script, const char *arg);
 int spawn2_wait(const char *script, const char *arg);
 int16_t spawn_retval(int stat);
 int spawn_wait_for_pid(pid_t pid);
+int spawn_pidfd(pid_t pid);
 
 #endif
@@ -10,8 +10,10 @@
 
 #define S_CONTROL_SERVICE_NAME_MAXLEN 3
 #define S_CONTROL_NO_SERVER 4
+#define S_CONTROL_PACKET_TOO_LARGE 14
 
 #define S_SERVICE_COLLECT_ERROR 5
+#define S_SERVICE_DEPS_ERROR 10
 
 #define S_INIT_APPLY_FAILED 6
 #define S_INIT_SERVICE_ERROR 7
@@ -19,6 +21,13 @@
 
 #define S_UNKNOWN_ERROR 9
 
+#define S_EVENT_ERROR 11
+#define S_CONF_ERROR 12
+#define S_HEALTH_COLLECT_ERROR 13
+#define S_CGROUP_UNAVAILABLE 15
+#define S_ACTIVATION_ERROR 16
+#define S_SNAPSHOT_ERROR 17
+
 typedef uint8_t status_t;
 const char* status_translation(status_t status);
 
@@ -0,0 +1,206 @@
+#include "common.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "log.h"
+#include "service.h"
+
+#define LOG_MODULE "trace"
+
+const char *trace_path = NULL;
+
+static struct trace_event ring[TRACE_RING_SIZE];
+// sequence number of next event, ring holds last TRACE_RING_SIZE of them
+static uint64_t ring_next = 0;
+
+uint64_t trace_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct trace_event *trace_push(uint32_t track, char phase, uint64_t ts)
+{
+    struct trace_event *ev = &ring[ring_next++ % TRACE_RING_SIZE];
+
+    ev->ts = ts;
+    ev->dur = 0;
+    ev->track = track;
+    ev->phase = phase;
+    ev->name[0] = 0;
+    return ev;
+}
+
+/**
+ * Records event with printf formatted name, end events do not need one.
+ */
+void trace_add(uint32_t track, char phase, const char *name, ...)
+{
+    struct trace_event *ev = trace_push(track, phase, trace_now());
+    va_list ap;
+
+    if (name != NULL) {
+        va_start(ap, name);
+        vsnprintf(ev->name, TRACE_NAME_SIZE, name, ap);
+        va_end(ap);
+    }
+}
+
+/**
+ * Records event which happened in the past, e.g. reported by apply.
+ */
+void trace_complete(uint32_t track, const char *name, uint64_t start, uint64_t dur)
+{
+    struct trace_event *ev = trace_push(track, TRACE_COMPLETE, start);
+
+    ev->dur = dur;
+    snprintf(ev->name, TRACE_NAME_SIZE, "%s", name);
+}
+
+/**
+ * Copies events starting at sequence number since, events already
+ * overwritten are skipped. Next is set to sequence to continue from.
+ */
+uint32_t trace_collect(uint64_t since, struct trace_event *events, uint32_t max, uint64_t *next)
+{
+    uint32_t count = 0;
+
+    if (ring_next > TRACE_RING_SIZE && since < ring_next - TRACE_RING_SIZE) {
+        since = ring_next - TRACE_RING_SIZE;
+    }
+    for (; since < ring_next && count < max; since++) {
+        events[count++] = ring[since % TRACE_RING_SIZE];
+    }
+    *next = since;
+    return count;
+}
+
+static void trace_write_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(f, "\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            fprintf(f, "\\u%04x", *str);
+        } else {
+            fputc(*str, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void trace_write_track_name(FILE *f, uint32_t track, const char *name)
+{
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", track);
+    trace_write_string(f, name);
+    fprintf(f, "}},\n");
+}
+
+/**
+ * Writes events in Chrome trace format, services are names of service tracks by id.
+ * Timestamps stay monotonic, only differences between them are meaningful.
+ */
+void trace_write_chrome(FILE *f, const struct trace_event *events, uint32_t count, const char **services, uint16_t services_count)
+{
+    const struct trace_event *ev;
+    uint32_t i;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    trace_write_track_name(f, TRACE_TRACK_INIT, "init");
+    trace_write_track_name(f, TRACE_TRACK_APPLY, "apply");
+    for (i=0; i<services_count; i++) {
+        trace_write_track_name(f, TRACE_TRACK_SERVICE(i), services[i]);
+    }
+
+    for (i=0; i<count; i++) {
+        ev = &events[i];
+        fprintf(f, "{\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%u", ev->phase, (unsigned long long)ev->ts, ev->track);
+        if (ev->phase == TRACE_COMPLETE) {
+            fprintf(f, ",\"dur\":%llu", (unsigned long long)ev->dur);
+        } else if (ev->phase == TRACE_INSTANT) {
+            fprintf(f, ",\"s\":\"t\"");
+        }
+        if (ev->name[0] != 0) {
+            fprintf(f, ",\"name\":");
+            trace_write_string(f, ev->name);
+        }
+        fprintf(f, "}%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(f, "]}\n");
+}
+
+void trace_write_file()
+{
+    struct trace_event *events;
+    const char **names;
+    struct service *svc;
+    char tmp_path[256];
+    uint64_t next;
+    uint32_t count;
+    uint16_t services_count = 0;
+    FILE *f;
+
+    if (trace_path == NULL) {
+        return;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", trace_path);
+    f = fopen(tmp_path, "we");
+    if (f == NULL) {
+        log_errno_warning("Could not create trace file %s", tmp_path);
+        return;
+    }
+
+    while (service_get(services_count) != NULL) services_count++;
+    names = calloc(services_count ? services_count : 1, sizeof(char*));
+    for (services_count = 0; (svc = service_get(services_count)) != NULL; services_count++) {
+        names[services_count] = svc->name;
+    }
+    events = malloc(sizeof(struct trace_event) * TRACE_RING_SIZE);
+    count = trace_collect(0, events, TRACE_RING_SIZE, &next);
+    trace_write_chrome(f, events, count, names, services_count);
+    free(events);
+    free(names);
+
+    if (fclose(f) != 0 || rename(tmp_path, trace_path) == -1) {
+        log_errno_warning("Could not write trace file %s", trace_path);
+        unlink(tmp_path);
+    }
+}
+
+/**
+ * Events are kept over re-exec, so trace of boot is not lost.
+ */
+void trace_snapshot_save(struct snapshot *s)
+{
+    uint64_t first = ring_next > TRACE_RING_SIZE ? ring_next - TRACE_RING_SIZE : 0, i;
+
+    SNAPSHOT_PUT(s, first);
+    SNAPSHOT_PUT(s, ring_next);
+    for (i=first; i<ring_next; i++) {
+        SNAPSHOT_PUT(s, ring[i % TRACE_RING_SIZE]);
+    }
+}
+
+status_t trace_snapshot_restore(struct snapshot *s)
+{
+    uint64_t first, i;
+
+    if (!SNAPSHOT_GET(s, first) || !SNAPSHOT_GET(s, ring_next) || ring_next < first || ring_next - first > TRACE_RING_SIZE) {
+        ring_next = 0;
+        return S_SNAPSHOT_ERROR;
+    }
+    for (i=first; i<ring_next; i++) {
+        if (!SNAPSHOT_GET(s, ring[i % TRACE_RING_SIZE])) {
+            ring_next = 0;
+            return S_SNAPSHOT_ERROR;
+        }
+    }
+    return S_OK;
+}
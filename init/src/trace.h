@@ -0,0 +1,47 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "status.h"
+#include "snapshot.h"
+
+// events kept in memory, oldest ones are overwritten
+#define TRACE_RING_SIZE 2048
+#define TRACE_NAME_SIZE 48
+
+// phases of Chrome trace events
+#define TRACE_BEGIN 'B'
+#define TRACE_END 'E'
+#define TRACE_INSTANT 'i'
+#define TRACE_COMPLETE 'X'
+
+// tracks are shown as threads by trace viewers, services follow by id
+#define TRACE_TRACK_INIT 0
+#define TRACE_TRACK_APPLY 1
+#define TRACE_TRACK_SERVICE(ID) ((uint32_t)(ID) + 2)
+
+struct trace_event {
+    // CLOCK_MONOTONIC in us
+    uint64_t ts;
+    // us, only for TRACE_COMPLETE
+    uint64_t dur;
+    uint32_t track;
+    char phase;
+    char name[TRACE_NAME_SIZE];
+};
+
+// Chrome trace written after boot and on exit, NULL to disable
+extern const char *trace_path;
+
+uint64_t trace_now();
+void trace_add(uint32_t track, char phase, const char *name, ...);
+void trace_complete(uint32_t track, const char *name, uint64_t start, uint64_t dur);
+uint32_t trace_collect(uint64_t since, struct trace_event *events, uint32_t max, uint64_t *next);
+void trace_write_chrome(FILE *f, const struct trace_event *events, uint32_t count, const char **services, uint16_t services_count);
+void trace_write_file();
+
+void trace_snapshot_save(struct snapshot *s);
+status_t trace_snapshot_restore(struct snapshot *s);
+
+#endif
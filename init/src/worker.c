@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "worker.h"
+#include "event.h"
+#include "log.h"
+
+#define LOG_MODULE "worker"
+
+/*
+ * Long running apply worker keeps puppet loaded between applies,
+ * it is started after boot and used for reloads and halt.
+ */
+pid_t worker_pid = 0;
+static int worker_request_fd = -1;
+static int worker_reply_fd = -1;
+static bool worker_is_ready = false;
+static bool worker_is_busy = false;
+static uint8_t worker_crashes = 0;
+
+static char reply_buff[128];
+static size_t reply_len = 0;
+
+static void worker_close()
+{
+    if (worker_request_fd != -1) {
+        close(worker_request_fd);
+        worker_request_fd = -1;
+    }
+    if (worker_reply_fd != -1) {
+        event_remove(worker_reply_fd);
+        close(worker_reply_fd);
+        worker_reply_fd = -1;
+    }
+    worker_is_ready = false;
+    reply_len = 0;
+}
+
+status_t worker_start()
+{
+    struct spawn_options opts;
+    struct spawn_fd fds[2];
+    const char *env[] = { SPAWN_NOTIFY_ENV_ENTRY };
+    int request[2], reply[2];
+
+    if (worker_pid > 0) {
+        return S_OK;
+    }
+    if (worker_crashes >= WORKER_MAX_CRASHES) {
+        return S_UNKNOWN_ERROR;
+    }
+
+    if (pipe2(request, O_CLOEXEC) == -1 || pipe2(reply, O_CLOEXEC) == -1) {
+        log_errno_error("Could not create apply worker pipes");
+        return S_UNKNOWN_ERROR;
+    }
+    fcntl(reply[0], F_SETFL, O_NONBLOCK);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.cgroup_fd = -1;
+    fds[0].fd = request[0];
+    fds[0].target = STDIN_FILENO;
+    fds[1].fd = reply[1];
+    fds[1].target = WORKER_REPLY_FD;
+    opts.fds = fds;
+    opts.fds_count = 2;
+    opts.env = env;
+    opts.env_count = 1;
+
+    worker_pid = spawn(PUPPETIZER_APPLY_WORKER, NULL, &opts);
+    close(request[0]);
+    close(reply[1]);
+    worker_request_fd = request[1];
+    worker_reply_fd = reply[0];
+
+    if (worker_pid <= 0 || event_add(worker_reply_fd, EVENT_WORKER, 0) != S_OK) {
+        log_warning("Could not start apply worker");
+        // started worker exits on closed stdin and is reaped as usual
+        if (worker_pid < 0) worker_pid = 0;
+        worker_close();
+        return S_UNKNOWN_ERROR;
+    }
+
+    log_debug("Started apply worker %d", worker_pid);
+    return S_OK;
+}
+
+/**
+ * Worker exits when its stdin is closed.
+ */
+void worker_stop()
+{
+    if (worker_pid > 0) {
+        log_debug("Stopping apply worker");
+        worker_close();
+    }
+}
+
+bool worker_ready()
+{
+    return worker_is_ready && !worker_is_busy;
+}
+
+bool worker_busy()
+{
+    return worker_is_busy;
+}
+
+bool worker_apply(const char *mode)
+{
+    char line[64];
+    int len;
+
+    if (!worker_ready()) {
+        return false;
+    }
+
+    len = snprintf(line, sizeof(line), "apply %s\n", mode ? mode : "");
+    if (len >= (int)sizeof(line) || write(worker_request_fd, line, len) != len) {
+        log_errno_warning("Could not send apply request to worker");
+        return false;
+    }
+    worker_is_busy = true;
+    return true;
+}
+
+/**
+ * Reads one reply from worker, value is set to pid or exit code.
+ * Call again while it returns other than WORKER_EVENT_NONE.
+ */
+worker_event_t worker_handle(int *value)
+{
+    ssize_t len;
+    char *nl;
+    worker_event_t event = WORKER_EVENT_NONE;
+
+    if (worker_reply_fd == -1) {
+        return WORKER_EVENT_NONE;
+    }
+
+    nl = memchr(reply_buff, '\n', reply_len);
+    if (nl == NULL) {
+        len = read(worker_reply_fd, reply_buff + reply_len, sizeof(reply_buff) - reply_len);
+        if (len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR)) {
+            // worker is exiting, its exit is handled by reaper
+            event_remove(worker_reply_fd);
+            close(worker_reply_fd);
+            worker_reply_fd = -1;
+            return WORKER_EVENT_NONE;
+        }
+        if (len > 0) {
+            reply_len += len;
+        }
+        nl = memchr(reply_buff, '\n', reply_len);
+        if (nl == NULL) {
+            if (reply_len == sizeof(reply_buff)) {
+                log_warning("Discarding too long reply from apply worker");
+                reply_len = 0;
+            }
+            return WORKER_EVENT_NONE;
+        }
+    }
+    *nl = 0;
+
+    if (strcmp(reply_buff, "ready") == 0) {
+        log_info("Apply worker is ready");
+        worker_is_ready = true;
+        event = WORKER_EVENT_READY;
+    } else if (sscanf(reply_buff, "started %d", value) == 1) {
+        event = WORKER_EVENT_STARTED;
+    } else if (sscanf(reply_buff, "exit %d", value) == 1) {
+        worker_is_busy = false;
+        event = WORKER_EVENT_EXIT;
+    } else {
+        log_warning("Unknown reply from apply worker: %s", reply_buff);
+    }
+
+    reply_len -= nl + 1 - reply_buff;
+    memmove(reply_buff, nl + 1, reply_len);
+    return event;
+}
+
+/**
+ * Returns true when pid was the worker, when it died during apply
+ * retval is set to exit code of that apply.
+ */
+bool worker_handle_exit(pid_t pid, int status, int *retval)
+{
+    bool was_busy = worker_is_busy;
+
+    if (worker_pid <= 0 || pid != worker_pid) {
+        return false;
+    }
+
+    *retval = spawn_retval(status);
+    worker_pid = 0;
+    worker_is_busy = false;
+    worker_close();
+
+    if (*retval != 0) {
+        worker_crashes++;
+        log_warning("Apply worker exitted with code %d", *retval);
+    }
+    if (!was_busy) {
+        *retval = 0;
+        return true;
+    }
+    if (*retval == 0) {
+        *retval = 1;
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#include <sys/types.h>
+#include "status.h"
+#include "spawn.h"
+
+// replies are written to notify fd, same as service readiness
+#define WORKER_REPLY_FD SPAWN_NOTIFY_FD
+// worker crashes after which applies are spawned directly again
+#define WORKER_MAX_CRASHES 3
+
+#define WORKER_EVENT_NONE 0
+#define WORKER_EVENT_READY 1
+#define WORKER_EVENT_STARTED 2
+#define WORKER_EVENT_EXIT 3
+typedef uint8_t worker_event_t;
+
+/*
+ * Protocol, one line per message:
+ *   init -> worker (stdin):  apply <mode>
+ *   worker -> init (notify fd): ready | started <pid> | exit <code>
+ */
+
+extern pid_t worker_pid;
+
+status_t worker_start();
+void worker_stop();
+bool worker_ready();
+bool worker_busy();
+bool worker_apply(const char *mode);
+worker_event_t worker_handle(int *value);
+bool worker_handle_exit(pid_t pid, int status, int *retval);
+
+#endif
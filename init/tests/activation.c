@@ -0,0 +1,75 @@
+#include "../src/common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "activation.h"
+
+#include "../src/activation.h"
+
+static int socket_type(int fd, int option)
+{
+  int value = -1;
+  socklen_t len = sizeof(value);
+
+  ck_assert_int_eq(getsockopt(fd, SOL_SOCKET, option, &value, &len), 0);
+  return value;
+}
+
+START_TEST (test_activation_load)
+{
+  char path[] = "/tmp/activation-test-XXXXXX", unix_path[64];
+  int fd, *fds;
+  uint8_t count;
+  FILE *f;
+
+  fd = mkstemp(path);
+  snprintf(unix_path, sizeof(unix_path), "%s.sock", path);
+  f = fdopen(fd, "w");
+  fprintf(f, "# comment\n  tcp:127.0.0.1:0  \n\nudp:[::1]:0\nunix:%s\n", unix_path);
+  fclose(f);
+
+  ck_assert_int_eq(activation_load(path, &fds, &count), S_OK);
+  ck_assert_int_eq(count, 3);
+  ck_assert_int_eq(socket_type(fds[0], SO_TYPE), SOCK_STREAM);
+  ck_assert_int_eq(socket_type(fds[0], SO_ACCEPTCONN), 1);
+  ck_assert_int_eq(socket_type(fds[1], SO_TYPE), SOCK_DGRAM);
+  ck_assert_int_eq(socket_type(fds[2], SO_ACCEPTCONN), 1);
+  ck_assert_int_eq(access(unix_path, F_OK), 0);
+  while (count > 0) close(fds[--count]);
+  free(fds);
+
+  // invalid entry fails whole file
+  f = fopen(path, "w");
+  fprintf(f, "tcp:127.0.0.1:0\nsctp:80\n");
+  fclose(f);
+  ck_assert_int_eq(activation_load(path, &fds, &count), S_ACTIVATION_ERROR);
+  ck_assert_int_eq(count, 0);
+  ck_assert_ptr_null(fds);
+
+  // only numeric addresses are accepted
+  ck_assert_int_eq(activation_open("tcp:localhost:0"), -1);
+  ck_assert_int_eq(activation_open("tcp:127.0.0.1:http"), -1);
+  ck_assert_int_eq(activation_open("udp:127.0.0.1:65536"), -1);
+  fd = activation_open("tcp:0");
+  ck_assert_int_ne(fd, -1);
+  close(fd);
+
+  unlink(path);
+  unlink(unix_path);
+  ck_assert_int_eq(activation_load(path, &fds, &count), S_OK);
+  ck_assert_int_eq(count, 0);
+}
+END_TEST
+
+TCase * tactivation_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Activation");
+    tcase_add_test(tc, test_activation_load);
+
+    return tc;
+}
@@ -0,0 +1,8 @@
+#ifndef _TESTS_ACTIVATION_H
+#define _TESTS_ACTIVATION_H
+
+#include <check.h>
+
+TCase * tactivation_create_test_case(void);
+
+#endif
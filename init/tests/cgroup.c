@@ -0,0 +1,111 @@
+#include "../src/common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "cgroup.h"
+
+#include "../src/cgroup.h"
+
+extern int base_fd;
+
+static void write_file(int dir, const char *name, const char *value)
+{
+  int fd = openat(dir, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ck_assert_int_ne(fd, -1);
+  ck_assert_int_eq(write(fd, value, strlen(value)), strlen(value));
+  close(fd);
+}
+
+static void read_file(int dir, const char *name, char *buff, size_t size)
+{
+  int fd = openat(dir, name, O_RDONLY);
+  ssize_t n;
+
+  ck_assert_int_ne(fd, -1);
+  n = read(fd, buff, size - 1);
+  close(fd);
+  ck_assert_int_ge(n, 0);
+  buff[n] = 0;
+}
+
+START_TEST (test_cgroup_files)
+{
+  struct cgroup_limits limits = { 512 * 1024 * 1024ull, 200, 0 };
+  char path[] = "/tmp/cgroup-test-XXXXXX", buff[64];
+  uint64_t value;
+  pid_t pid;
+  int fd, status;
+
+  // plain directory stands in for cgroup, interface files have to exist
+  ck_assert_ptr_ne(mkdtemp(path), NULL);
+  base_fd = open(path, O_RDONLY | O_DIRECTORY);
+  ck_assert(cgroup_enabled());
+
+  fd = cgroup_create("web");
+  ck_assert_int_ne(fd, -1);
+  ck_assert_int_eq(faccessat(base_fd, "web" CGROUP_SERVICE_SUFFIX, F_OK, 0), 0);
+  // existing cgroup is reused
+  close(fd);
+  fd = cgroup_create("web");
+  ck_assert_int_ne(fd, -1);
+
+  write_file(fd, "memory.max", "max");
+  write_file(fd, "cpu.weight", "100");
+  write_file(fd, "io.weight", "default 100");
+  cgroup_set_limits(fd, "web", &limits);
+  read_file(fd, "memory.max", buff, sizeof(buff));
+  ck_assert_str_eq(buff, "536870912");
+  read_file(fd, "cpu.weight", buff, sizeof(buff));
+  ck_assert_str_eq(buff, "200");
+  read_file(fd, "io.weight", buff, sizeof(buff));
+  ck_assert_str_eq(buff, "default 100");
+
+  write_file(fd, "cpu.stat", "usage_usec 2500000\nuser_usec 2000000\n");
+  write_file(fd, "memory.current", "4096\n");
+  ck_assert(cgroup_cpu_usage(fd, &value));
+  ck_assert(value == 2500);
+  ck_assert(cgroup_memory_usage(fd, &value));
+  ck_assert(value == 4096);
+  unlinkat(fd, "memory.current", 0);
+  ck_assert(!cgroup_memory_usage(fd, &value));
+
+  // without cgroup.kill processes are signalled one by one
+  pid = fork();
+  if (pid == 0) {
+    pause();
+    _exit(0);
+  }
+  snprintf(buff, sizeof(buff), "%d\n", pid);
+  write_file(fd, "cgroup.procs", buff);
+  ck_assert(cgroup_signal(fd, SIGKILL));
+  ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+  ck_assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+  unlinkat(fd, "memory.max", 0);
+  unlinkat(fd, "cpu.weight", 0);
+  unlinkat(fd, "io.weight", 0);
+  unlinkat(fd, "cpu.stat", 0);
+  unlinkat(fd, "cgroup.procs", 0);
+  close(fd);
+  unlinkat(base_fd, "web" CGROUP_SERVICE_SUFFIX, AT_REMOVEDIR);
+  close(base_fd);
+  base_fd = -1;
+  rmdir(path);
+}
+END_TEST
+
+TCase * tcgroup_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Cgroup");
+    tcase_add_test(tc, test_cgroup_files);
+
+    return tc;
+}
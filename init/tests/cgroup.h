@@ -0,0 +1,8 @@
+#ifndef _TESTS_CGROUP_H
+#define _TESTS_CGROUP_H
+
+#include <check.h>
+
+TCase * tcgroup_create_test_case(void);
+
+#endif
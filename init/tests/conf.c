@@ -0,0 +1,63 @@
+#include "../src/common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conf.h"
+
+#include "../src/status.h"
+#include "../src/conf.h"
+
+struct test_options {
+  uint32_t timeout;
+  bool enabled;
+  uint8_t count;
+};
+
+static bool test_handler(void *ctx, const char *key, const char *value)
+{
+  struct test_options *opts = ctx;
+  opts->count++;
+
+  if (strcmp(key, "timeout") == 0) {
+    return conf_parse_uint(value, &opts->timeout);
+  }
+  if (strcmp(key, "enabled") == 0) {
+    return conf_parse_bool(value, &opts->enabled);
+  }
+  return false;
+}
+
+START_TEST (test_parse_file)
+{
+  char path[] = "/tmp/puppetizer-test-conf-XXXXXX";
+  struct test_options opts = {0, false, 0};
+  FILE *f = fdopen(mkstemp(path), "w");
+
+  fputs("# comment\n\n  timeout = 15 \nmalformed\nenabled=yes\nunknown=1\ntimeout=x\n", f);
+  fclose(f);
+
+  ck_assert_int_eq(conf_parse_file(path, test_handler, &opts), S_OK);
+  unlink(path);
+
+  ck_assert_int_eq(opts.count, 4);
+  ck_assert_int_eq(opts.timeout, 15);
+  ck_assert(opts.enabled);
+
+  // missing files are not an error
+  ck_assert_int_eq(conf_parse_file(path, test_handler, &opts), S_OK);
+  ck_assert_int_eq(opts.count, 4);
+}
+END_TEST
+
+TCase * tconf_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Conf");
+
+    tcase_add_test(tc, test_parse_file);
+
+    return tc;
+}
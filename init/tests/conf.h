@@ -0,0 +1,8 @@
+#ifndef _TESTS_CONF_H
+#define _TESTS_CONF_H
+
+#include <check.h>
+
+TCase * tconf_create_test_case(void);
+
+#endif
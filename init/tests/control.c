@@ -1,12 +1,16 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <pthread.h>
+#include <string.h>
 
 #include "control.h"
 
 #include "../src/common.h"
 #include "../src/status.h"
 #include "../src/control.h"
+#include "../src/event.h"
+#include "../src/service.h"
+#include "mock.h"
 
 struct generic_read_argument {
   int fd;
@@ -34,12 +38,371 @@ START_TEST (test_communication)
   th_arg.fd = fd[0];
   th_arg.data = data;
   pthread_create(&thread, NULL, generic_read, &th_arg);
-  ck_assert_int_eq(control_write_response(response_in, fd[1]), S_OK);
+  ck_assert_int_eq(control_write_response(response_in, 1234, fd[1]), S_OK);
   pthread_join(thread, NULL);
   ck_assert_int_eq(S_OK, th_arg.status);
   control_decode_response(data, &response_out);
   
   ck_assert_int_eq(response_in, response_out);
+  ck_assert_int_eq(PACKET_REQUEST_ID(data), 1234);
+}
+END_TEST
+
+START_TEST (test_service_states)
+{
+  const char *names[] = { "first", "second" };
+  struct control_service_state states[] = { { "first", STATE_UP }, { "second", 0 } };
+  control_response_t response;
+  service_state_t state;
+  uint8_t data[control_max_data_length];
+  uint8_t *entries;
+  uint16_t count;
+  char *name;
+  int fd[2];
+
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+
+  // requests are pipelined, replies are matched by id
+  ck_assert_int_eq(control_request_service_states(names, 2, 1, fd[1]), S_OK);
+  ck_assert_int_eq(control_request_service_states(NULL, 0, 2, fd[1]), S_OK);
+
+  ck_assert_int_eq(control_read_packet(fd[0], data), S_OK);
+  ck_assert_int_eq(PACKET_TYPE(data), PACKET_REQUEST_SERVICE_STATES);
+  ck_assert_int_eq(PACKET_REQUEST_ID(data), 1);
+  control_decode_request_service_states(data, &count, &name);
+  ck_assert_int_eq(count, 2);
+  ck_assert_str_eq(name, "first");
+  ck_assert_str_eq(name + strlen(name) + 1, "second");
+
+  ck_assert_int_eq(control_read_packet(fd[0], data), S_OK);
+  ck_assert_int_eq(PACKET_REQUEST_ID(data), 2);
+  control_decode_request_service_states(data, &count, &name);
+  ck_assert_int_eq(count, 0);
+
+  ck_assert_int_eq(control_write_service_states(CMD_RESPONSE_FAILED, states, 2, 1, fd[1]), S_OK);
+  ck_assert_int_eq(control_read_packet(fd[0], data), S_OK);
+  ck_assert_int_eq(PACKET_TYPE(data), PACKET_SERVICE_STATES);
+  control_decode_service_states(data, &response, &count, &entries);
+  ck_assert_int_eq(response, CMD_RESPONSE_FAILED);
+  ck_assert_int_eq(count, 2);
+  control_next_service_state(&entries, &state, &name);
+  ck_assert_str_eq(name, "first");
+  ck_assert_int_eq(state, STATE_UP);
+  control_next_service_state(&entries, &state, &name);
+  ck_assert_str_eq(name, "second");
+  ck_assert_int_eq(state, 0);
+
+  close(fd[0]);
+  close(fd[1]);
+}
+END_TEST
+
+static int handled_packets = 0;
+static status_t count_packet(void *packet, uint16_t len, int fd)
+{
+  ck_assert_int_eq(PACKET_TYPE(packet), PACKET_REQUEST_INIT_STATE);
+  ck_assert_int_eq(PACKET_REQUEST_ID(packet), 7);
+  ck_assert_int_eq(len, 3);
+  handled_packets++;
+  return S_OK;
+}
+
+START_TEST (test_client_buffers)
+{
+  uint16_t len = sizeof(control_type_t) + sizeof(control_request_id_t);
+  uint8_t rest[3] = { PACKET_REQUEST_INIT_STATE };
+  uint8_t buff[4096];
+  int fd[2], i;
+  status_t status = S_OK;
+  control_request_id_t id = 7;
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+  ck_assert_int_eq(control_client_add(fd[0]), S_OK);
+
+  // partial packet is kept until rest arrives
+  memcpy(rest + 1, &id, sizeof(id));
+  send(fd[1], &len, sizeof(len), 0);
+  ck_assert_int_eq(control_client_read(fd[0], count_packet), S_OK);
+  ck_assert_int_eq(handled_packets, 0);
+  send(fd[1], rest, sizeof(rest), 0);
+  ck_assert_int_eq(control_client_read(fd[0], count_packet), S_OK);
+  ck_assert_int_eq(handled_packets, 1);
+
+  // client not reading replies gets disconnected instead of blocking
+  for (i=0;i<1000000 && status == S_OK;i++) {
+    status = control_write_init_state(1, 1, fd[0]);
+  }
+  ck_assert_int_ne(status, S_OK);
+  control_client_reap();
+
+  while ((i = recv(fd[1], buff, sizeof(buff), 0)) > 0);
+  ck_assert_int_eq(i, 0);
+
+  close(fd[1]);
+}
+END_TEST
+
+START_TEST (test_subscriptions)
+{
+  struct service *svc = service_add("subscribed");
+  uint8_t data[control_max_data_length];
+  control_response_t response;
+  service_state_t state;
+  uint8_t *entries;
+  uint16_t count;
+  char *name;
+  int fd[2], i;
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+  ck_assert_int_eq(control_client_add(fd[0]), S_OK);
+
+  svc->state = STATE_UP;
+  for (i=1;i<=20;i++) {
+    ck_assert(control_subscribe_client(fd[0], svc, i));
+  }
+  ck_assert(control_subscribe_client_all(fd[0], 100));
+  for (i=0;i<21;i++) {
+    ck_assert_int_eq(control_read_packet(fd[1], data), S_OK);
+  }
+
+  // transitions in one loop iteration are sent once
+  svc->state = STATE_PENDING_DOWN;
+  control_dispatch_service_state_change(svc);
+  svc->state = STATE_DOWN;
+  control_dispatch_service_state_change(svc);
+  control_dispatch_flush();
+
+  for (i=0;i<20;i++) {
+    ck_assert_int_eq(control_read_packet(fd[1], data), S_OK);
+    ck_assert_int_eq(PACKET_TYPE(data), PACKET_SERVICE_STATE);
+    control_decode_service_state(data, &response, &state);
+    ck_assert_int_eq(state, STATE_DOWN);
+  }
+  ck_assert_int_eq(control_read_packet(fd[1], data), S_OK);
+  ck_assert_int_eq(PACKET_REQUEST_ID(data), 100);
+  control_decode_service_states(data, &response, &count, &entries);
+  ck_assert_int_eq(count, 1);
+  control_next_service_state(&entries, &state, &name);
+  ck_assert_str_eq(name, "subscribed");
+  ck_assert_int_eq(state, STATE_DOWN);
+  ck_assert_int_eq(recv(fd[1], data, 1, MSG_DONTWAIT), -1);
+
+  ck_assert(control_unsubscribe_client_request(fd[0], 5));
+  ck_assert(!control_unsubscribe_client_request(fd[0], 5));
+
+  close(fd[0]);
+  close(fd[1]);
+}
+END_TEST
+
+START_TEST (test_named_subscriptions)
+{
+  struct service *first = service_add("first"), *second = service_add("second");
+  const char *names[] = { "first", "second" };
+  uint8_t data[control_max_data_length];
+  control_response_t response;
+  service_state_t state;
+  uint8_t *entries;
+  uint16_t count;
+  char *name;
+  int fd[2];
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+  ck_assert_int_eq(control_client_add(fd[0]), S_OK);
+
+  ck_assert_int_eq(control_subscribe_service_states(names, 2, 7, fd[1]), S_OK);
+  ck_assert_int_eq(control_read_packet(fd[0], data), S_OK);
+  ck_assert_int_eq(PACKET_TYPE(data), PACKET_SUBSCRIBE_SERVICE_STATES);
+  control_decode_subscribe_service_states(data, &count, &name);
+  ck_assert_int_eq(count, 2);
+  ck_assert_str_eq(name, "first");
+
+  ck_assert(control_subscribe_client_named(fd[0], first, 7));
+  ck_assert(control_subscribe_client_named(fd[0], second, 7));
+
+  // updates of both services carry their names
+  first->state = STATE_UP;
+  control_dispatch_service_state_change(first);
+  second->state = STATE_PENDING_UP;
+  control_dispatch_service_state_change(second);
+  control_dispatch_flush();
+
+  ck_assert_int_eq(control_read_packet(fd[1], data), S_OK);
+  ck_assert_int_eq(PACKET_TYPE(data), PACKET_SERVICE_STATES);
+  ck_assert_int_eq(PACKET_REQUEST_ID(data), 7);
+  control_decode_service_states(data, &response, &count, &entries);
+  ck_assert_int_eq(count, 1);
+  control_next_service_state(&entries, &state, &name);
+  ck_assert_str_eq(name, "first");
+  ck_assert_int_eq(state, STATE_UP);
+
+  ck_assert_int_eq(control_read_packet(fd[1], data), S_OK);
+  control_decode_service_states(data, &response, &count, &entries);
+  control_next_service_state(&entries, &state, &name);
+  ck_assert_str_eq(name, "second");
+  ck_assert_int_eq(state, STATE_PENDING_UP);
+
+  // single unsubscribe removes whole subscription
+  ck_assert(control_unsubscribe_client_request(fd[0], 7));
+  ck_assert(!control_unsubscribe_client_request(fd[0], 7));
+
+  close(fd[0]);
+  close(fd[1]);
+}
+END_TEST
+
+START_TEST (test_metrics)
+{
+  struct service_metrics in[2], out;
+  control_response_t response;
+  uint64_t log_dropped;
+  uint8_t *entries;
+  uint16_t count;
+  int fd[2];
+  pthread_t thread;
+  struct generic_read_argument th_arg;
+  uint8_t data[control_max_data_length];
+
+  memset(in, 0, sizeof(in));
+  in[0].name = "first";
+  in[0].starts = 3;
+  in[0].restarts = 2;
+  in[0].last_exit = -1;
+  in[0].cpu_ms = 1500;
+  in[1].name = "second";
+  in[1].rss = 4096;
+  in[1].output_dropped = 10;
+
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+
+  th_arg.fd = fd[0];
+  th_arg.data = data;
+  pthread_create(&thread, NULL, generic_read, &th_arg);
+  ck_assert_int_eq(control_write_metrics(CMD_RESPONSE_OK, in, 2, 7, 55, fd[1]), S_OK);
+  pthread_join(thread, NULL);
+  ck_assert_int_eq(S_OK, th_arg.status);
+  ck_assert_int_eq(PACKET_TYPE(data), PACKET_METRICS);
+
+  control_decode_metrics(data, &response, &count, &log_dropped, &entries);
+  ck_assert_int_eq(response, CMD_RESPONSE_OK);
+  ck_assert_int_eq(count, 2);
+  ck_assert(log_dropped == 7);
+
+  control_next_metrics(&entries, &out);
+  ck_assert_str_eq(out.name, "first");
+  ck_assert_int_eq(out.starts, 3);
+  ck_assert_int_eq(out.restarts, 2);
+  ck_assert_int_eq(out.last_exit, -1);
+  ck_assert(out.cpu_ms == 1500);
+
+  control_next_metrics(&entries, &out);
+  ck_assert_str_eq(out.name, "second");
+  ck_assert(out.rss == 4096);
+  ck_assert(out.output_dropped == 10);
+
+  close(fd[0]);
+  close(fd[1]);
+}
+END_TEST
+
+START_TEST (test_trace)
+{
+  struct trace_event in[2], out;
+  const char *names[] = { "fact_generation", "catalog" };
+  uint32_t durations[] = { 1500000, 20 }, duration;
+  control_response_t response;
+  uint64_t next;
+  uint8_t *entries;
+  uint16_t count;
+  char *name;
+  int fd[2];
+  pthread_t thread;
+  struct generic_read_argument th_arg;
+  uint8_t data[control_max_data_length];
+
+  memset(in, 0, sizeof(in));
+  in[0].ts = 100;
+  in[0].track = TRACE_TRACK_SERVICE(4);
+  in[0].phase = TRACE_BEGIN;
+  strcpy(in[0].name, "starting");
+  in[1].ts = 200;
+  in[1].dur = 50;
+  in[1].phase = TRACE_COMPLETE;
+  strcpy(in[1].name, "discover services");
+
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+
+  th_arg.fd = fd[0];
+  th_arg.data = data;
+  pthread_create(&thread, NULL, generic_read, &th_arg);
+  ck_assert_int_eq(control_write_trace(CMD_RESPONSE_OK, in, 2, 9, 55, fd[1]), S_OK);
+  pthread_join(thread, NULL);
+  ck_assert_int_eq(S_OK, th_arg.status);
+  ck_assert_int_eq(PACKET_TYPE(data), PACKET_TRACE);
+
+  control_decode_trace(data, &response, &count, &next, &entries);
+  ck_assert_int_eq(response, CMD_RESPONSE_OK);
+  ck_assert_int_eq(count, 2);
+  ck_assert(next == 9);
+  control_next_trace(&entries, &out);
+  ck_assert(out.ts == 100);
+  ck_assert_int_eq(out.track, 6);
+  ck_assert_int_eq(out.phase, TRACE_BEGIN);
+  ck_assert_str_eq(out.name, "starting");
+  control_next_trace(&entries, &out);
+  ck_assert(out.dur == 50);
+  ck_assert_str_eq(out.name, "discover services");
+
+  pthread_create(&thread, NULL, generic_read, &th_arg);
+  ck_assert_int_eq(control_report_trace(names, durations, 2, 56, fd[1]), S_OK);
+  pthread_join(thread, NULL);
+  ck_assert_int_eq(S_OK, th_arg.status);
+  ck_assert_int_eq(PACKET_TYPE(data), PACKET_REPORT_TRACE);
+
+  control_decode_report_trace(data, &count, &entries);
+  ck_assert_int_eq(count, 2);
+  control_next_report_trace(&entries, &name, &duration);
+  ck_assert_str_eq(name, "fact_generation");
+  ck_assert_int_eq(duration, 1500000);
+  control_next_report_trace(&entries, &name, &duration);
+  ck_assert_str_eq(name, "catalog");
+  ck_assert_int_eq(duration, 20);
+
+  close(fd[0]);
+  close(fd[1]);
+}
+END_TEST
+
+/**
+ * Counts and names sent by client have to fit in packet.
+ */
+START_TEST (test_packet_validation)
+{
+  // type, request id, count, names
+  uint8_t names[] = { PACKET_REQUEST_SERVICE_STATES, 1, 0, 2, 0, 'a', 0, 'b', 0 };
+  uint8_t state[] = { PACKET_SET_SERVICE_STATE, 1, 0, STATE_UP, 'a', 'b' };
+  uint8_t report[] = { PACKET_REPORT_TRACE, 1, 0, 1, 0, 5, 0, 0, 0, 'a', 0 };
+  uint8_t since[] = { PACKET_REQUEST_TRACE, 1, 0, 1, 2, 3 };
+
+  ck_assert(control_packet_valid(names, sizeof(names)));
+  ck_assert(!control_packet_valid(names, sizeof(names) - 1));
+  ck_assert(!control_packet_valid(names, 4));
+  names[3] = 3;
+  ck_assert(!control_packet_valid(names, sizeof(names)));
+
+  // name without terminating NUL
+  ck_assert(!control_packet_valid(state, sizeof(state)));
+  ck_assert(!control_packet_valid(state, 4));
+  state[5] = 0;
+  ck_assert(control_packet_valid(state, sizeof(state)));
+
+  ck_assert(control_packet_valid(report, sizeof(report)));
+  ck_assert(!control_packet_valid(report, 8));
+  ck_assert(!control_packet_valid(since, sizeof(since)));
+  ck_assert(!control_packet_valid(since, 2));
 }
 END_TEST
 
@@ -50,6 +413,13 @@ TCase * tcontrol_create_test_case(void)
     tc = tcase_create("Control");
 
     tcase_add_test(tc, test_communication);
+    tcase_add_test(tc, test_service_states);
+    tcase_add_test(tc, test_client_buffers);
+    tcase_add_test(tc, test_subscriptions);
+    tcase_add_test(tc, test_named_subscriptions);
+    tcase_add_test(tc, test_metrics);
+    tcase_add_test(tc, test_trace);
+    tcase_add_test(tc, test_packet_validation);
 
     return tc;
 }
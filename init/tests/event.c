@@ -0,0 +1,57 @@
+#include "../src/common.h"
+
+#include "event.h"
+
+#include "../src/status.h"
+#include "../src/event.h"
+
+#define TEST_EVENT 100
+
+/**
+ * Timers should be delivered as events in deadline order, cancelled ones never.
+ */
+START_TEST (test_timers)
+{
+  struct event_timer timers[4];
+  struct epoll_event events[4];
+  uint32_t expected[] = {1, 3, 0};
+  int i, received = 0, changes;
+
+  ck_assert_int_eq(event_setup(), S_OK);
+
+  for (i=0;i<4;i++) {
+    event_timer_init(&timers[i], TEST_EVENT, i);
+  }
+  event_timer_set(&timers[0], 60);
+  event_timer_set(&timers[1], 10);
+  event_timer_set(&timers[2], 20);
+  event_timer_set(&timers[3], 100);
+  // reschedule to be second
+  event_timer_set(&timers[3], 30);
+  event_timer_cancel(&timers[2]);
+  ck_assert(!event_timer_active(&timers[2]));
+
+  while (received < 3) {
+    changes = event_wait(events, 4, 1000);
+    ck_assert_int_gt(changes, 0);
+    for (i=0;i<changes;i++) {
+      ck_assert_int_eq(EVENT_TYPE(events[i]), TEST_EVENT);
+      ck_assert_int_eq(EVENT_ID(events[i]), expected[received++]);
+    }
+  }
+
+  // there is nothing left which could wake us
+  ck_assert_int_eq(event_wait(events, 4, 100), 0);
+}
+END_TEST
+
+TCase * tevent_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Event");
+
+    tcase_add_test(tc, test_timers);
+
+    return tc;
+}
@@ -0,0 +1,8 @@
+#ifndef _TESTS_EVENT_H
+#define _TESTS_EVENT_H
+
+#include <check.h>
+
+TCase * tevent_create_test_case(void);
+
+#endif
@@ -0,0 +1,54 @@
+#include "../src/common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "facts.h"
+
+#include "../src/facts.h"
+#include "../src/init.h"
+
+START_TEST (test_facts_file)
+{
+  char path[] = "/tmp/facts-test-XXXXXX", buff[256] = {0};
+  int fd;
+
+  fd = mkstemp(path);
+  close(fd);
+  facts_path = path;
+
+  ck_assert_int_eq(facts_flush(INIT_STATE_BOOTING), S_OK);
+  fd = open(path, O_RDONLY);
+  ck_assert_int_gt(read(fd, buff, sizeof(buff) - 1), 0);
+  close(fd);
+  ck_assert_str_eq(buff, "{\"state\":\"booting\",\"services\":{},\"health\":{}}\n");
+
+  // nothing changed, file is left alone
+  unlink(path);
+  ck_assert_int_eq(facts_flush(INIT_STATE_RUNNING), S_OK);
+  ck_assert_int_eq(access(path, F_OK), -1);
+
+  facts_changed();
+  ck_assert_int_eq(facts_flush(INIT_STATE_HALTING), S_OK);
+  fd = open(path, O_RDONLY);
+  memset(buff, 0, sizeof(buff));
+  ck_assert_int_gt(read(fd, buff, sizeof(buff) - 1), 0);
+  close(fd);
+  ck_assert_ptr_ne(strstr(buff, "\"state\":\"halting\""), NULL);
+
+  unlink(path);
+}
+END_TEST
+
+TCase * tfacts_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Facts");
+
+    tcase_add_test(tc, test_facts_file);
+
+    return tc;
+}
@@ -0,0 +1,8 @@
+#ifndef _TESTS_FACTS_H
+#define _TESTS_FACTS_H
+
+#include <check.h>
+
+TCase * tfacts_create_test_case(void);
+
+#endif
@@ -5,10 +5,16 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
 #include "init.h"
 
 #include "../src/status.h"
+#include "../src/service.h"
+#include "../src/event.h"
 
 static void* run_loop_signals(void *data)
 {
@@ -28,7 +34,7 @@ START_TEST (test_signals_in_loop)
 
   socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
 
-  mock_init_halt_thread_use = true;
+  mock_init_halt_request_use = true;
   mock_control_listen_use = true;
   mock_control_listen_fd = fd[1];
 
@@ -54,6 +60,217 @@ START_TEST (test_signals_in_loop)
 }
 END_TEST
 
+/**
+ * Halt should stop running apply without blocking the loop.
+ */
+START_TEST (test_halt_stops_apply)
+{
+  int fd[2];
+  sigset_t all_signals;
+  pid_t parent = getpid();
+  struct timespec delay = { 0, 200000000 };
+
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+
+  mock_control_listen_use = true;
+  mock_control_listen_fd = fd[1];
+  // boot apply never finishes by itself
+  mock_spawn_use = true;
+  mock_spawn_script = "/bin/sleep";
+  mock_spawn_arg = "100";
+
+  sigfillset(&all_signals);
+  sigprocmask(SIG_BLOCK, &all_signals, NULL);
+
+  if (fork() == 0) {
+    nanosleep(&delay, NULL);
+    kill(parent, SIGTERM);
+    exit(0);
+  }
+
+  ck_assert_int_eq(init_boot(), S_OK);
+  ck_assert_msg(waitpid(-1, NULL, WNOHANG) <= 0, "Apply should be reaped by loop");
+}
+END_TEST
+
+/**
+ * HUPs received during apply should result in single following apply.
+ */
+START_TEST (test_hup_coalescing)
+{
+  int fd[2], i;
+  char script[] = "/tmp/apply-test-XXXXXX", buff[16];
+  char counter[] = "/tmp/apply-count-XXXXXX";
+  int script_fd, counter_fd;
+  sigset_t all_signals;
+  pid_t parent = getpid();
+  struct timespec delay = { 0, 100000000 };
+
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+  counter_fd = mkstemp(counter);
+  script_fd = mkstemp(script);
+  dprintf(script_fd, "#!/bin/sh\nprintf x >> $1\nsleep 0.5\n");
+  fchmod(script_fd, 0700);
+  close(script_fd);
+
+  mock_control_listen_use = true;
+  mock_control_listen_fd = fd[1];
+  mock_spawn_use = true;
+  mock_spawn_script = script;
+  mock_spawn_arg = counter;
+
+  sigfillset(&all_signals);
+  sigprocmask(SIG_BLOCK, &all_signals, NULL);
+
+  if (fork() == 0) {
+    for (i=0;i<3;i++) {
+      nanosleep(&delay, NULL);
+      kill(parent, SIGHUP);
+    }
+    sleep(1);
+    kill(parent, SIGTERM);
+    exit(0);
+  }
+
+  ck_assert_int_eq(init_boot(), S_OK);
+  ck_assert_int_eq(read(counter_fd, buff, sizeof(buff)), 2);
+
+  unlink(script);
+  unlink(counter);
+}
+END_TEST
+
+/**
+ * Test case for reloads sent to apply worker started after boot.
+ */
+START_TEST (test_apply_worker)
+{
+  int fd[2];
+  char script[] = "/tmp/apply-test-XXXXXX", buff[16];
+  char counter[] = "/tmp/apply-count-XXXXXX";
+  int script_fd, counter_fd;
+  sigset_t all_signals;
+  pid_t parent = getpid();
+  struct timespec delay = { 0, 500000000 };
+
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+  counter_fd = mkstemp(counter);
+  script_fd = mkstemp(script);
+  // worker is told apart from apply by notify fd
+  dprintf(script_fd, "#!/bin/sh\n"
+    "if [ -z \"$PUPPETIZER_NOTIFY_FD\" ]; then printf x >> $1; exit 0; fi\n"
+    "echo ready >&3\n"
+    "while read cmd mode; do printf w >> $1; echo \"started $$\" >&3; echo \"exit 0\" >&3; done\n");
+  fchmod(script_fd, 0700);
+  close(script_fd);
+
+  mock_control_listen_use = true;
+  mock_control_listen_fd = fd[1];
+  mock_spawn_use = true;
+  mock_spawn_script = script;
+  mock_spawn_arg = counter;
+  use_apply_worker = true;
+
+  sigfillset(&all_signals);
+  sigprocmask(SIG_BLOCK, &all_signals, NULL);
+
+  if (fork() == 0) {
+    nanosleep(&delay, NULL);
+    kill(parent, SIGHUP);
+    nanosleep(&delay, NULL);
+    kill(parent, SIGTERM);
+    exit(0);
+  }
+
+  ck_assert_int_eq(init_boot(), S_OK);
+  ck_assert_int_eq(read(counter_fd, buff, sizeof(buff)), 2);
+  ck_assert(buff[0] == 'x' && buff[1] == 'w');
+
+  unlink(script);
+  unlink(counter);
+}
+END_TEST
+
+/**
+ * Service killed while being stopped was stopped on request,
+ * only unexpected exits halt init.
+ */
+START_TEST (test_stopped_service_exit)
+{
+  struct service *svc = service_add("slow-stop");
+  int status;
+  pid_t pid;
+
+  mock_init_halt_request_use = true;
+  mock_init_halt_request_executed = false;
+  mock_spawn_use = true;
+  mock_spawn_script = "/bin/sleep";
+  mock_spawn_arg = "100";
+
+  // stop escalated to SIGKILL after timeout
+  ck_assert(service_start(svc));
+  svc->state = STATE_PENDING_DOWN;
+  pid = svc->pid;
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  init_handle_exit(pid, status);
+  ck_assert_int_eq(svc->state, STATE_DOWN);
+  ck_assert(!mock_init_halt_request_executed);
+
+  ck_assert(service_start(svc));
+  pid = svc->pid;
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  init_handle_exit(pid, status);
+  ck_assert(mock_init_halt_request_executed);
+}
+END_TEST
+
+/**
+ * Dependents keep waiting while crashed dependency is restarted.
+ */
+START_TEST (test_restarted_dependency_exit)
+{
+  struct service *db = service_add("flaky-db"), *app = service_add("flaky-app");
+  struct service *deps[] = { db };
+  int status;
+  pid_t pid;
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  mock_init_halt_request_use = true;
+  mock_init_halt_request_executed = false;
+  mock_spawn_use = true;
+  mock_spawn_script = "/bin/sleep";
+  mock_spawn_arg = "100";
+  db->opts.ready = SERVICE_READY_NOTIFY;
+  db->opts.restart = SERVICE_RESTART_ON_FAILURE;
+  db->opts.restart_delay = 1;
+  db->opts.restart_delay_max = 3;
+  db->opts.restart_limit = 1;
+  app->deps = deps;
+  app->deps_count = 1;
+
+  ck_assert(service_start(app));
+  pid = db->pid;
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  init_handle_exit(pid, status);
+  ck_assert_int_eq(db->state, STATE_PENDING_UP);
+  ck_assert_int_eq(app->state, STATE_PENDING_UP);
+  ck_assert(!mock_init_halt_request_executed);
+
+  // no restarts are left, waiting dependent is cancelled
+  service_handle_restart(db);
+  pid = db->pid;
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  init_handle_exit(pid, status);
+  ck_assert_int_eq(db->state, STATE_DOWN);
+  ck_assert_int_eq(app->state, STATE_DOWN);
+  ck_assert(mock_init_halt_request_executed);
+}
+END_TEST
+
 TCase * tinit_create_test_case(void)
 {
     TCase *tc;
@@ -61,6 +278,11 @@ TCase * tinit_create_test_case(void)
     tc = tcase_create("Init");
 
     tcase_add_test(tc, test_signals_in_loop);
+    tcase_add_test(tc, test_halt_stops_apply);
+    tcase_add_test(tc, test_stopped_service_exit);
+    tcase_add_test(tc, test_restarted_dependency_exit);
+    tcase_add_test(tc, test_hup_coalescing);
+    tcase_add_test(tc, test_apply_worker);
 
     return tc;
 }
@@ -0,0 +1,94 @@
+#include "../src/common.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "log.h"
+
+#include "../src/log.h"
+#include "../src/event.h"
+
+#define LOG_MODULE "test"
+
+static int log_capture(int fd[2])
+{
+  ck_assert_int_eq(pipe(fd), 0);
+  ck_assert_int_eq(dup2(fd[1], STDERR_FILENO), STDERR_FILENO);
+  close(fd[1]);
+  fcntl(fd[0], F_SETFL, O_NONBLOCK);
+  return fd[0];
+}
+
+START_TEST (test_log_formats)
+{
+  char buff[LOG_ENTRY_SIZE * 2] = {0};
+  int fd[2];
+
+  log_capture(fd);
+  log_level = LOG_INFO;
+
+  log_format = LOG_FORMAT_JSON;
+  log_info("say \"%s\"\n", "hi");
+  ck_assert_int_gt(read(fd[0], buff, sizeof(buff) - 1), 0);
+  ck_assert_ptr_ne(strstr(buff, "\"level\":\"info\",\"name\":\"test\",\"module\":\"test\",\"msg\":\"say \\\"hi\\\"\\n\"}\n"), NULL);
+
+  memset(buff, 0, sizeof(buff));
+  log_format = LOG_FORMAT_LOGFMT;
+  log_status_warning(S_OK, "done");
+  ck_assert_int_gt(read(fd[0], buff, sizeof(buff) - 1), 0);
+  ck_assert_ptr_ne(strstr(buff, " level=warn name=test module=test msg=\"done (status=0 Success)\"\n"), NULL);
+
+  // long messages are truncated but stay single line
+  memset(buff, 0, sizeof(buff));
+  log_format = LOG_FORMAT_TEXT;
+  log_info("%0*d", LOG_ENTRY_SIZE * 2, 0);
+  ck_assert_int_eq(read(fd[0], buff, sizeof(buff) - 1), LOG_ENTRY_SIZE - 2);
+  ck_assert_int_eq(buff[LOG_ENTRY_SIZE - 3], '\n');
+}
+END_TEST
+
+START_TEST (test_log_ring)
+{
+  char buff[4096];
+  bool found = false;
+  ssize_t len;
+  int fd[2], i;
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  log_capture(fd);
+  log_level = LOG_INFO;
+  log_setup_async();
+
+  // nothing reads the pipe, so ring fills up instead of blocking
+  for (i = 0; i < 10000; i++) {
+    log_info("message %d", i);
+  }
+  ck_assert_int_gt(log_dropped, 0);
+  ck_assert(!log_flush());
+
+  do {
+    while ((len = read(fd[0], buff, sizeof(buff))) > 0);
+  } while (!log_flush());
+
+  log_info("after");
+  ck_assert(log_flush());
+  while ((len = read(fd[0], buff, sizeof(buff) - 1)) > 0) {
+    buff[len] = 0;
+    found = found || strstr(buff, "[test.log:warn] Dropped ") != NULL;
+  }
+  ck_assert(found);
+}
+END_TEST
+
+TCase * tlog_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Log");
+
+    tcase_add_test(tc, test_log_formats);
+    tcase_add_test(tc, test_log_ring);
+
+    return tc;
+}
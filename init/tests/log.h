@@ -0,0 +1,8 @@
+#ifndef _TESTS_LOG_H
+#define _TESTS_LOG_H
+
+#include <check.h>
+
+TCase * tlog_create_test_case(void);
+
+#endif
@@ -2,6 +2,18 @@
 
 #include "control.h"
 #include "init.h"
+#include "service.h"
+#include "conf.h"
+#include "event.h"
+#include "spawn.h"
+#include "log.h"
+#include "output.h"
+#include "facts.h"
+#include "cgroup.h"
+#include "activation.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "puppetizer.h"
 
 #include "../src/log.h"
 
@@ -14,6 +26,18 @@ Suite * init_suite(void)
 
     suite_add_tcase(s, tcontrol_create_test_case());
     suite_add_tcase(s, tinit_create_test_case());
+    suite_add_tcase(s, tservice_create_test_case());
+    suite_add_tcase(s, tconf_create_test_case());
+    suite_add_tcase(s, tevent_create_test_case());
+    suite_add_tcase(s, tspawn_create_test_case());
+    suite_add_tcase(s, tlog_create_test_case());
+    suite_add_tcase(s, toutput_create_test_case());
+    suite_add_tcase(s, tfacts_create_test_case());
+    suite_add_tcase(s, tcgroup_create_test_case());
+    suite_add_tcase(s, tactivation_create_test_case());
+    suite_add_tcase(s, tsnapshot_create_test_case());
+    suite_add_tcase(s, ttrace_create_test_case());
+    suite_add_tcase(s, tpuppetizer_create_test_case());
 
     return s;
 }
@@ -1,14 +1,14 @@
 #include "mock.h"
 
-bool mock_init_halt_thread_executed = false;
-bool mock_init_halt_thread_use = false;
+bool mock_init_halt_request_executed = false;
+bool mock_init_halt_request_use = false;
 
-void init_halt_thread(status_t cause)
+void init_halt_request(status_t cause)
 {
-    mock_init_halt_thread_executed = true;
+    mock_init_halt_request_executed = true;
 
-    if (!mock_control_listen_use) {
-        init_halt_thread__real(cause);
+    if (!mock_init_halt_request_use) {
+        init_halt_request__real(cause);
     }
 }
 
@@ -28,11 +28,14 @@ status_t control_listen(int* fd, uint8_t backlog)
     }
 }
 
-bool mock_spawn2_use = false;
+bool mock_spawn_use = false;
+const char *mock_spawn_script = NULL;
+const char *mock_spawn_arg = NULL;
 
-pid_t spawn2(const char *script, const char *arg)
+pid_t spawn(const char *script, const char *arg, const struct spawn_options *opts)
 {
-    if (!mock_spawn2_use) {
-        return spawn2__real(script, arg);
+    if (mock_spawn_use) {
+        return spawn__real(mock_spawn_script, mock_spawn_arg, opts);
     }
-}
\ No newline at end of file
+    return spawn__real(script, arg, opts);
+}
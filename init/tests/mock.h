@@ -6,22 +6,32 @@
 #include "../src/common.h"
 #include "../src/status.h"
 
-extern bool mock_init_halt_thread_executed;
-extern bool mock_init_halt_thread_use;
+extern bool mock_init_halt_request_executed;
+extern bool mock_init_halt_request_use;
 
 extern bool mock_control_listen_executed;
 extern bool mock_control_listen_use;
 extern int mock_control_listen_fd;
 
-void init_halt_thread(status_t cause);
-void init_halt_thread__real(status_t cause);
+void init_halt_request(status_t cause);
+void init_halt_request__real(status_t cause);
 int init_boot();
 
 status_t control_listen__real(int* fd, uint8_t backlog);
 
 status_t init_loop();
+void init_handle_exit(pid_t pid, int status);
+extern bool use_apply_worker;
 
-pid_t spawn2(const char *script, const char *arg);
-pid_t spawn2__real(const char *script, const char *arg);
+struct service* service_add(const char *name);
+void service_handle_dir_file(const char *file);
+
+extern bool mock_spawn_use;
+extern const char *mock_spawn_script;
+extern const char *mock_spawn_arg;
+
+struct spawn_options;
+pid_t spawn(const char *script, const char *arg, const struct spawn_options *opts);
+pid_t spawn__real(const char *script, const char *arg, const struct spawn_options *opts);
 
 #endif
@@ -0,0 +1,120 @@
+#include "../src/common.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "output.h"
+
+#include "../src/output.h"
+#include "../src/event.h"
+
+static int output_capture_stdout()
+{
+  int fd[2];
+
+  ck_assert_int_eq(pipe(fd), 0);
+  ck_assert_int_eq(dup2(fd[1], STDOUT_FILENO), STDOUT_FILENO);
+  close(fd[1]);
+  fcntl(fd[0], F_SETFL, O_NONBLOCK);
+  return fd[0];
+}
+
+START_TEST (test_output_capture)
+{
+  char buff[OUTPUT_TAIL_SIZE * 2] = {0}, line[100];
+  struct output out, prefixed;
+  int stdout_fd, fd, i;
+  ssize_t len;
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  stdout_fd = output_capture_stdout();
+
+  output_init(&out, 1, "svc");
+  out.mode = OUTPUT_CAPTURE;
+  fd = output_setup(&out);
+  ck_assert_int_ne(fd, -1);
+
+  write(fd, "one\ntwo\n", 8);
+  output_handle(&out);
+  ck_assert_int_eq(read(stdout_fd, buff, sizeof(buff)), 8);
+  ck_assert_int_eq(memcmp(buff, "one\ntwo\n", 8), 0);
+  ck_assert_int_eq(out.bytes, 8);
+  ck_assert_int_eq(output_read_tail(&out, buff, sizeof(buff)), 8);
+
+  // older output is discarded, tail starts with full line
+  memset(line, 'x', sizeof(line));
+  line[sizeof(line) - 1] = '\n';
+  for (i = 0; i < OUTPUT_TAIL_SIZE / sizeof(line) + 10; i++) {
+    write(fd, line, sizeof(line));
+    output_handle(&out);
+    while (read(stdout_fd, buff, sizeof(buff)) > 0);
+  }
+  len = output_read_tail(&out, buff, sizeof(buff));
+  ck_assert_int_le(len, OUTPUT_TAIL_SIZE);
+  ck_assert_int_eq(len % sizeof(line), 0);
+  ck_assert_int_eq(buff[0], 'x');
+
+  // pipe is closed once all writers are gone
+  close(fd);
+  output_handle(&out);
+  ck_assert_int_eq(out.fd, -1);
+
+  output_init(&prefixed, 2, "svc");
+  prefixed.mode = OUTPUT_PREFIX;
+  fd = output_setup(&prefixed);
+  write(fd, "a\nb", 3);
+  output_handle(&prefixed);
+  write(fd, "c\n", 2);
+  output_handle(&prefixed);
+  memset(buff, 0, sizeof(buff));
+  ck_assert_int_gt(read(stdout_fd, buff, sizeof(buff)), 0);
+  ck_assert_str_eq(buff, "[svc] a\n[svc] bc\n");
+  close(fd);
+}
+END_TEST
+
+/**
+ * Full socket stdout drops output instead of blocking init.
+ */
+START_TEST (test_output_socket)
+{
+  char buff[4096];
+  struct output out;
+  int sock[2], fd, size = 4096, i;
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sock), 0);
+  setsockopt(sock[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  ck_assert_int_eq(dup2(sock[1], STDOUT_FILENO), STDOUT_FILENO);
+  close(sock[1]);
+
+  output_init(&out, 1, "svc");
+  out.mode = OUTPUT_CAPTURE;
+  fd = output_setup(&out);
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  memset(buff, 'x', sizeof(buff));
+  for (i = 0; i < 256; i++) {
+    if (write(fd, buff, sizeof(buff)) > 0) {
+      output_handle(&out);
+    }
+  }
+  ck_assert_int_gt(out.bytes, 0);
+  ck_assert_int_gt(out.dropped, 0);
+  close(fd);
+  close(sock[0]);
+}
+END_TEST
+
+TCase * toutput_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Output");
+
+    tcase_add_test(tc, test_output_capture);
+    tcase_add_test(tc, test_output_socket);
+
+    return tc;
+}
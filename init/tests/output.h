@@ -0,0 +1,8 @@
+#ifndef _TESTS_OUTPUT_H
+#define _TESTS_OUTPUT_H
+
+#include <check.h>
+
+TCase * toutput_create_test_case(void);
+
+#endif
@@ -0,0 +1,138 @@
+#include "../src/common.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "puppetizer.h"
+
+#include "../src/control.h"
+#include "../src/health.h"
+#include "../src/service.h"
+#include "../lib/puppetizer.h"
+
+// replies are queued up front, socket buffer holds both directions
+START_TEST (test_client_service_states)
+{
+  const char *names[] = { "first", "second" }, *name;
+  struct control_service_state states[] = { { "first", STATE_UP }, { "second", 0 } };
+  uint8_t data[control_max_data_length], state;
+  struct puppetizer *p;
+  uint16_t count;
+  char *request_name;
+  int fd[2];
+
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+  p = puppetizer_open_fd(fd[0]);
+
+  ck_assert_int_eq(control_write_service_states(CMD_RESPONSE_OK, states, 2, 1, fd[1]), S_OK);
+  ck_assert_int_eq(puppetizer_service_states(p, names, 2), 0);
+  ck_assert_int_eq(puppetizer_next_service_state(p, &name, &state), 0);
+  ck_assert_str_eq(name, "first");
+  ck_assert_int_eq(state, STATE_UP);
+  ck_assert_int_eq(puppetizer_next_service_state(p, &name, &state), 0);
+  ck_assert_str_eq(name, "second");
+  ck_assert_int_eq(state, 0);
+  ck_assert_int_eq(puppetizer_next_service_state(p, &name, &state), 1);
+
+  ck_assert_int_eq(control_read_packet(fd[1], data), S_OK);
+  ck_assert_int_eq(PACKET_TYPE(data), PACKET_REQUEST_SERVICE_STATES);
+  ck_assert_int_eq(PACKET_REQUEST_ID(data), 1);
+  control_decode_request_service_states(data, &count, &request_name);
+  ck_assert_int_eq(count, 2);
+  ck_assert_str_eq(request_name, "first");
+  ck_assert_str_eq(request_name + strlen(request_name) + 1, "second");
+
+  puppetizer_close(p);
+  close(fd[1]);
+}
+END_TEST
+
+START_TEST (test_client_wait)
+{
+  const char *names[] = { "first" };
+  struct control_service_state pending[] = { { "first", STATE_PENDING_UP } };
+  struct control_service_state up[] = { { "first", STATE_UP } };
+  struct control_service_state down[] = { { "first", STATE_DOWN } };
+  uint8_t data[control_max_data_length];
+  struct puppetizer *p;
+  int fd[2];
+
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+  p = puppetizer_open_fd(fd[0]);
+
+  // command is 1, subscription 2, stray update is dropped
+  ck_assert_int_eq(control_write_service_states(CMD_RESPONSE_OK, up, 1, 9, fd[1]), S_OK);
+  ck_assert_int_eq(control_write_service_states(CMD_RESPONSE_OK, pending, 1, 1, fd[1]), S_OK);
+  ck_assert_int_eq(control_write_service_states(CMD_RESPONSE_OK, pending, 1, 2, fd[1]), S_OK);
+  ck_assert_int_eq(control_write_service_states(CMD_RESPONSE_OK, up, 1, 2, fd[1]), S_OK);
+  ck_assert_int_eq(control_write_response(CMD_RESPONSE_OK, 2, fd[1]), S_OK);
+  ck_assert_int_eq(puppetizer_set_service_states(p, names, 1, STATE_UP, 1), 0);
+
+  ck_assert_int_eq(control_read_packet(fd[1], data), S_OK);
+  ck_assert_int_eq(PACKET_TYPE(data), PACKET_SET_SERVICE_STATES);
+  ck_assert_int_eq(control_read_packet(fd[1], data), S_OK);
+  ck_assert_int_eq(PACKET_TYPE(data), PACKET_SUBSCRIBE_SERVICE_STATES);
+  ck_assert_int_eq(PACKET_REQUEST_ID(data), 2);
+  ck_assert_int_eq(control_read_packet(fd[1], data), S_OK);
+  ck_assert_int_eq(PACKET_TYPE(data), PACKET_UNSUBSCRIBE);
+  ck_assert_int_eq(PACKET_REQUEST_ID(data), 2);
+
+  // service went down before it was ready
+  ck_assert_int_eq(control_write_service_states(CMD_RESPONSE_OK, pending, 1, 3, fd[1]), S_OK);
+  ck_assert_int_eq(control_write_service_states(CMD_RESPONSE_OK, down, 1, 4, fd[1]), S_OK);
+  ck_assert_int_eq(control_write_response(CMD_RESPONSE_OK, 4, fd[1]), S_OK);
+  ck_assert_int_eq(puppetizer_set_service_states(p, names, 1, STATE_UP, 1), 1);
+  ck_assert_str_eq(puppetizer_failed(p), "first");
+
+  puppetizer_close(p);
+  close(fd[1]);
+}
+END_TEST
+
+START_TEST (test_client_pending)
+{
+  const char *first[] = { "first" }, *second[] = { "second" }, *failed;
+  struct control_service_state up[] = { { "first", STATE_PENDING_UP } };
+  struct control_service_state down[] = { { "second", STATE_DOWN } };
+  struct puppetizer *p;
+  uint8_t state;
+  uint32_t age;
+  int fd[2];
+
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, fd);
+  p = puppetizer_open_fd(fd[0]);
+
+  // replies to changes sent without waiting are checked while reading others
+  ck_assert_int_eq(control_write_service_states(CMD_RESPONSE_FAILED, down, 1, 2, fd[1]), S_OK);
+  ck_assert_int_eq(control_write_health(HEALTH_FAILED, 5, "disk", 3, fd[1]), S_OK);
+  ck_assert_int_eq(control_write_service_states(CMD_RESPONSE_OK, up, 1, 1, fd[1]), S_OK);
+  ck_assert_int_eq(puppetizer_set_service_states(p, first, 1, STATE_UP, 0), 0);
+  ck_assert_int_eq(puppetizer_set_service_states(p, second, 1, STATE_UP, 0), 0);
+
+  ck_assert_int_eq(puppetizer_health(p, &state, &age, &failed), 0);
+  ck_assert_int_eq(state, HEALTH_FAILED);
+  ck_assert_int_eq(age, 5);
+  ck_assert_str_eq(failed, "disk");
+
+  ck_assert_int_eq(puppetizer_check_pending(p), 1);
+  ck_assert_str_eq(puppetizer_failed(p), "second");
+  ck_assert_int_eq(puppetizer_check_pending(p), 0);
+
+  puppetizer_close(p);
+  close(fd[1]);
+}
+END_TEST
+
+TCase * tpuppetizer_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Puppetizer");
+
+    tcase_add_test(tc, test_client_service_states);
+    tcase_add_test(tc, test_client_wait);
+    tcase_add_test(tc, test_client_pending);
+
+    return tc;
+}
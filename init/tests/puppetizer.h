@@ -0,0 +1,8 @@
+#ifndef _TESTS_PUPPETIZER_H
+#define _TESTS_PUPPETIZER_H
+
+#include <check.h>
+
+TCase * tpuppetizer_create_test_case(void);
+
+#endif
@@ -0,0 +1,285 @@
+#include "../src/common.h"
+
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "service.h"
+
+#include "../src/status.h"
+#include "../src/service.h"
+#include "../src/event.h"
+
+#define TEST_SERVICES 300
+#define TEST_RUNNING 40
+
+/**
+ * Lookups should work past previous limit of 255 services.
+ */
+START_TEST (test_find_by_name)
+{
+  char name[16];
+  int i;
+  struct service *svc;
+
+  for (i=0;i<TEST_SERVICES;i++) {
+    sprintf(name, "svc%d", i);
+    ck_assert_ptr_ne(service_add(name), NULL);
+  }
+
+  for (i=0;i<TEST_SERVICES;i++) {
+    sprintf(name, "svc%d", i);
+    svc = service_find_by_name(name);
+    ck_assert_ptr_ne(svc, NULL);
+    ck_assert_str_eq(svc->name, name);
+  }
+
+  ck_assert_ptr_eq(service_find_by_name("svc"), NULL);
+  ck_assert_int_eq(service_count_by_state(STATE_DOWN, false), TEST_SERVICES);
+}
+END_TEST
+
+/**
+ * Pid index has to stay consistent when entries are removed from the middle of probe chains.
+ */
+START_TEST (test_find_by_pid)
+{
+  char name[16];
+  int i;
+  struct service *svcs[TEST_RUNNING];
+
+  mock_spawn_use = true;
+  mock_spawn_script = "/bin/sleep";
+  mock_spawn_arg = "10";
+
+  for (i=0;i<TEST_RUNNING;i++) {
+    sprintf(name, "svc%d", i);
+    svcs[i] = service_add(name);
+    ck_assert(service_start(svcs[i]));
+    ck_assert_int_eq(svcs[i]->state, STATE_UP);
+  }
+
+  for (i=0;i<TEST_RUNNING;i++) {
+    ck_assert_ptr_eq(service_find_by_pid(svcs[i]->pid), svcs[i]);
+  }
+
+  for (i=0;i<TEST_RUNNING;i+=2) {
+    kill(svcs[i]->pid, SIGKILL);
+    waitpid(svcs[i]->pid, NULL, 0);
+    service_set_down(svcs[i]);
+  }
+
+  for (i=0;i<TEST_RUNNING;i++) {
+    if (i % 2 == 0) {
+      ck_assert_int_eq(svcs[i]->pid, 0);
+    } else {
+      ck_assert_ptr_eq(service_find_by_pid(svcs[i]->pid), svcs[i]);
+      kill(svcs[i]->pid, SIGKILL);
+    }
+  }
+
+  ck_assert_ptr_eq(service_find_by_pid(0), NULL);
+}
+END_TEST
+
+/**
+ * Delay doubles up to maximum, init halts after too many restarts in a row.
+ */
+START_TEST (test_restart_backoff)
+{
+  struct service *svc = service_add("crashing");
+  uint64_t now;
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  svc->opts.restart = SERVICE_RESTART_ON_FAILURE;
+  svc->opts.restart_delay = 1;
+  svc->opts.restart_delay_max = 3;
+  svc->opts.restart_limit = 3;
+  svc->started_at = event_now();
+
+  ck_assert(!service_schedule_restart(svc, 0));
+
+  now = event_now();
+  ck_assert(service_schedule_restart(svc, 1));
+  ck_assert_int_eq(svc->state, STATE_PENDING_UP);
+  ck_assert(svc->restart_timer.deadline >= now + 1000);
+  ck_assert(svc->restart_timer.deadline < now + 2000);
+
+  ck_assert(service_schedule_restart(svc, -9));
+  ck_assert(svc->restart_timer.deadline >= now + 2000);
+  ck_assert(service_schedule_restart(svc, 1));
+  ck_assert(svc->restart_timer.deadline >= now + 3000);
+  ck_assert(svc->restart_timer.deadline < now + 4000);
+  ck_assert(!service_schedule_restart(svc, 1));
+
+  // stopping cancels pending restart
+  ck_assert(service_stop(svc));
+  ck_assert_int_eq(svc->state, STATE_DOWN);
+  ck_assert(!event_timer_active(&svc->restart_timer));
+}
+END_TEST
+
+START_TEST (test_stop_order)
+{
+  struct service *db = service_add("db"), *app = service_add("app");
+  struct service *deps[] = { db };
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  mock_spawn_use = true;
+  mock_spawn_script = "/bin/true";
+  mock_spawn_arg = NULL;
+  app->deps = deps;
+  app->deps_count = 1;
+
+  ck_assert(service_start(db));
+  ck_assert(service_start(app));
+  ck_assert_int_eq(app->state, STATE_UP);
+
+  // dependents are stopped first
+  ck_assert_int_eq(service_stop_all(), 1);
+  ck_assert_int_eq(app->state, STATE_PENDING_DOWN);
+  ck_assert_int_eq(db->state, STATE_UP);
+  ck_assert(event_timer_active(&app->stop_timer));
+
+  service_set_down(app);
+  ck_assert(!event_timer_active(&app->stop_timer));
+  ck_assert_int_eq(service_stop_all(), 1);
+  ck_assert_int_eq(db->state, STATE_PENDING_DOWN);
+}
+END_TEST
+
+/**
+ * Changes in service directory add services, but only from start scripts.
+ */
+START_TEST (test_dir_change)
+{
+  struct service *svc;
+
+  service_handle_dir_file("late.conf");
+  service_handle_dir_file("late.stop");
+  ck_assert_ptr_null(service_find_by_name("late"));
+
+  service_handle_dir_file("late.start");
+  svc = service_find_by_name("late");
+  ck_assert_ptr_ne(svc, NULL);
+  ck_assert_int_eq(svc->state, STATE_DOWN);
+
+  // start script is not there
+  ck_assert(svc->unavailable);
+  ck_assert(!service_start(svc));
+  ck_assert_int_eq(svc->state, STATE_DOWN);
+}
+END_TEST
+
+/**
+ * Dependents waiting for dependency which went down do not wait forever.
+ */
+START_TEST (test_dependency_down)
+{
+  struct service *db = service_add("slowdb"), *app = service_add("slowapp"), *web = service_add("slowweb");
+  struct service *app_deps[] = { db }, *web_deps[] = { app };
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  mock_spawn_use = true;
+  mock_spawn_script = "/bin/sleep";
+  mock_spawn_arg = "10";
+  db->opts.ready = SERVICE_READY_NOTIFY;
+  app->deps = app_deps;
+  app->deps_count = 1;
+  web->deps = web_deps;
+  web->deps_count = 1;
+
+  ck_assert(service_start(web));
+  ck_assert_int_eq(db->state, STATE_PENDING_UP);
+  ck_assert(db->pid > 0);
+  ck_assert_int_eq(app->state, STATE_PENDING_UP);
+  ck_assert_int_eq(web->state, STATE_PENDING_UP);
+
+  kill(db->pid, SIGKILL);
+  waitpid(db->pid, NULL, 0);
+  service_set_down(db);
+  ck_assert_int_eq(app->state, STATE_DOWN);
+  ck_assert_int_eq(web->state, STATE_DOWN);
+
+  // unavailable dependency is never started
+  db->unavailable = true;
+  ck_assert(!service_start(web));
+  ck_assert_int_eq(app->state, STATE_DOWN);
+  ck_assert_int_eq(web->state, STATE_DOWN);
+}
+END_TEST
+
+/**
+ * Service is stopped by signals when its stop script cannot be run.
+ */
+START_TEST (test_stop_script_failure)
+{
+  struct service *svc = service_add("nostop");
+  int status;
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  mock_spawn_use = true;
+  mock_spawn_script = "/bin/sleep";
+  mock_spawn_arg = "10";
+  svc->opts.ready = SERVICE_READY_NOTIFY;
+
+  ck_assert(service_start(svc));
+  ck_assert(svc->pid > 0);
+
+  mock_spawn_script = "/nonexistent";
+  ck_assert(service_stop(svc));
+  ck_assert_int_eq(svc->state, STATE_PENDING_DOWN);
+  ck_assert_int_eq(svc->stop_signals, 1);
+  ck_assert(event_timer_active(&svc->stop_timer));
+  ck_assert(!event_timer_active(&svc->ready_timer));
+
+  ck_assert_int_eq(waitpid(svc->pid, &status, 0), svc->pid);
+  ck_assert(WIFSIGNALED(status));
+  ck_assert_int_eq(WTERMSIG(status), SIGTERM);
+  service_set_down(svc);
+}
+END_TEST
+
+/**
+ * Socket activated service which failed to spawn listens again.
+ */
+START_TEST (test_activation_spawn_failure)
+{
+  struct service *svc = service_add("brokensock");
+
+  ck_assert_int_eq(event_setup(), S_OK);
+  svc->sockets = malloc(sizeof(int));
+  svc->sockets[0] = socket(AF_UNIX, SOCK_STREAM, 0);
+  svc->sockets_count = 1;
+  service_listen_all();
+  ck_assert_int_eq(svc->sockets_watch, SERVICE_SOCKETS_LISTEN);
+
+  mock_spawn_use = true;
+  mock_spawn_script = "/nonexistent";
+  mock_spawn_arg = NULL;
+  ck_assert(!service_start(svc));
+  ck_assert_int_eq(svc->state, STATE_DOWN);
+  ck_assert_int_eq(svc->sockets_watch, SERVICE_SOCKETS_LISTEN);
+  service_unlisten_all();
+}
+END_TEST
+
+TCase * tservice_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Service");
+
+    tcase_add_test(tc, test_find_by_name);
+    tcase_add_test(tc, test_find_by_pid);
+    tcase_add_test(tc, test_restart_backoff);
+    tcase_add_test(tc, test_stop_order);
+    tcase_add_test(tc, test_dependency_down);
+    tcase_add_test(tc, test_stop_script_failure);
+    tcase_add_test(tc, test_activation_spawn_failure);
+    tcase_add_test(tc, test_dir_change);
+
+    return tc;
+}
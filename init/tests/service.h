@@ -0,0 +1,8 @@
+#ifndef _TESTS_SERVICE_H
+#define _TESTS_SERVICE_H
+
+#include <check.h>
+
+TCase * tservice_create_test_case(void);
+
+#endif
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include "../src/common.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+#include "../src/snapshot.h"
+
+START_TEST (test_snapshot_round_trip)
+{
+  struct snapshot s;
+  struct event_timer timer, restored;
+  uint32_t value = 0xdeadbeef, read_value;
+  int pipe_fds[2], fd;
+
+  ck_assert_int_eq(pipe2(pipe_fds, O_CLOEXEC), 0);
+  event_timer_init(&timer, EVENT_SERVICE_TIMEOUT, 1);
+  event_timer_init(&restored, EVENT_SERVICE_TIMEOUT, 2);
+  event_timer_set(&timer, 60000);
+
+  snapshot_init(&s);
+  SNAPSHOT_PUT(&s, value);
+  snapshot_put_string(&s, "nginx");
+  snapshot_put_string(&s, NULL);
+  snapshot_put_fd(&s, pipe_fds[0]);
+  snapshot_put_fd(&s, -1);
+  snapshot_put_timer(&s, &timer);
+
+  // fds are inheritable only while exec is attempted
+  snapshot_keep_fds(&s, true);
+  ck_assert_int_eq(fcntl(pipe_fds[0], F_GETFD) & FD_CLOEXEC, 0);
+  snapshot_keep_fds(&s, false);
+  ck_assert_int_eq(fcntl(pipe_fds[0], F_GETFD) & FD_CLOEXEC, FD_CLOEXEC);
+
+  fd = snapshot_write_memfd(&s);
+  ck_assert_int_ge(fd, 0);
+  snapshot_free(&s);
+
+  ck_assert_int_eq(snapshot_read_fd(fd, &s), S_OK);
+  ck_assert_int_eq(SNAPSHOT_GET(&s, read_value), true);
+  ck_assert(read_value == value);
+  ck_assert_str_eq(snapshot_get_string(&s), "nginx");
+  ck_assert_ptr_null(snapshot_get_string(&s));
+  ck_assert_int_eq(snapshot_get_fd(&s), pipe_fds[0]);
+  ck_assert_int_eq(snapshot_get_fd(&s), -1);
+  snapshot_get_timer(&s, &restored);
+  ck_assert_int_eq(event_timer_active(&restored), true);
+  // remaining time is measured again on restore
+  ck_assert(restored.deadline >= timer.deadline && restored.deadline <= timer.deadline + 5);
+  ck_assert_int_eq(s.failed, false);
+
+  // reading past end fails
+  ck_assert_int_eq(SNAPSHOT_GET(&s, read_value), false);
+  ck_assert(read_value == 0);
+  ck_assert_int_eq(s.failed, true);
+  snapshot_free(&s);
+
+  event_timer_cancel(&timer);
+  event_timer_cancel(&restored);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+}
+END_TEST
+
+START_TEST (test_snapshot_invalid)
+{
+  struct snapshot s;
+  int fd;
+
+  fd = memfd_create("snapshot-test", 0);
+  ck_assert_int_eq(write(fd, "garbage", 7), 7);
+  ck_assert_int_eq(snapshot_read_fd(fd, &s), S_SNAPSHOT_ERROR);
+  ck_assert_ptr_null(s.data);
+
+  setenv(SNAPSHOT_ENV, "x", 1);
+  ck_assert_int_eq(snapshot_env_fd(), -1);
+  setenv(SNAPSHOT_ENV, "7", 1);
+  ck_assert_int_eq(snapshot_env_fd(), 7);
+  ck_assert_ptr_null(getenv(SNAPSHOT_ENV));
+  ck_assert_int_eq(snapshot_env_fd(), -1);
+}
+END_TEST
+
+TCase * tsnapshot_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Snapshot");
+    tcase_add_test(tc, test_snapshot_round_trip);
+    tcase_add_test(tc, test_snapshot_invalid);
+
+    return tc;
+}
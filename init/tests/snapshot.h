@@ -0,0 +1,8 @@
+#ifndef _TESTS_SNAPSHOT_H
+#define _TESTS_SNAPSHOT_H
+
+#include <check.h>
+
+TCase * tsnapshot_create_test_case(void);
+
+#endif
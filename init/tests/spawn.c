@@ -0,0 +1,123 @@
+#include "../src/common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "spawn.h"
+
+#include "../src/spawn.h"
+
+/**
+ * Options should be applied to child without shell wrappers.
+ */
+START_TEST (test_spawn_options)
+{
+  char script[] = "/tmp/spawn-test-XXXXXX";
+  const char *env[] = { "SPAWN_TEST=value" };
+  struct spawn_rlimit limit = { RLIMIT_NOFILE, { 64, 64 } };
+  struct spawn_options opts;
+  struct spawn_fd fd;
+  char buff[128] = {0};
+  int fds[2], script_fd, status;
+  pid_t pid;
+  ssize_t len;
+
+  script_fd = mkstemp(script);
+  dprintf(script_fd, "#!/bin/sh\necho \"$SPAWN_TEST $(pwd) $(ulimit -n) $1\" >&5\n");
+  close(script_fd);
+  chmod(script, 0700);
+
+  ck_assert_int_eq(pipe(fds), 0);
+  fd.fd = fds[1];
+  fd.target = 5;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.cgroup_fd = -1;
+  opts.cwd = "/";
+  opts.env = env;
+  opts.env_count = 1;
+  opts.fds = &fd;
+  opts.fds_count = 1;
+  opts.rlimits = &limit;
+  opts.rlimits_count = 1;
+
+  pid = spawn(script, "arg", &opts);
+  ck_assert_int_gt(pid, 0);
+  close(fds[1]);
+
+  len = read(fds[0], buff, sizeof(buff) - 1);
+  ck_assert_int_gt(len, 0);
+  ck_assert_str_eq(buff, "value / 64 arg\n");
+
+  waitpid(pid, &status, 0);
+  ck_assert_int_eq(spawn_retval(status), 0);
+  unlink(script);
+}
+END_TEST
+
+/**
+ * Script runs as process which got LISTEN_PID, without wrappers.
+ */
+START_TEST (test_spawn_listen_fds)
+{
+  char script[] = "/tmp/spawn-test-XXXXXX";
+  struct spawn_options opts;
+  struct spawn_fd fd;
+  char buff[128] = {0}, expected[128];
+  int fds[2], script_fd, status;
+  pid_t pid;
+  ssize_t len;
+
+  script_fd = mkstemp(script);
+  dprintf(script_fd, "#!/bin/sh\necho \"$LISTEN_FDS $LISTEN_PID\" >&3\n");
+  close(script_fd);
+  chmod(script, 0700);
+
+  ck_assert_int_eq(pipe(fds), 0);
+  fd.fd = fds[1];
+  fd.target = SPAWN_LISTEN_FDS_START;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.cgroup_fd = -1;
+  opts.fds = &fd;
+  opts.fds_count = 1;
+  opts.listen_fds = 1;
+
+  pid = spawn(script, NULL, &opts);
+  ck_assert_int_gt(pid, 0);
+  close(fds[1]);
+
+  len = read(fds[0], buff, sizeof(buff) - 1);
+  ck_assert_int_gt(len, 0);
+  snprintf(expected, sizeof(expected), "1 %d\n", pid);
+  ck_assert_str_eq(buff, expected);
+
+  waitpid(pid, &status, 0);
+  close(fds[0]);
+  unlink(script);
+}
+END_TEST
+
+START_TEST (test_spawn_exec_failure)
+{
+  ck_assert_int_eq(spawn1("/nonexistent/script"), -1);
+  ck_assert_msg(waitpid(-1, NULL, WNOHANG) == -1, "Failed child should be reaped");
+}
+END_TEST
+
+TCase * tspawn_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Spawn");
+
+    tcase_add_test(tc, test_spawn_options);
+    tcase_add_test(tc, test_spawn_listen_fds);
+    tcase_add_test(tc, test_spawn_exec_failure);
+
+    return tc;
+}
@@ -0,0 +1,8 @@
+#ifndef _TESTS_SPAWN_H
+#define _TESTS_SPAWN_H
+
+#include <check.h>
+
+TCase * tspawn_create_test_case(void);
+
+#endif
@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include "../src/common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#include "../src/trace.h"
+
+START_TEST (test_trace_ring)
+{
+  struct trace_event *events = malloc(sizeof(struct trace_event) * TRACE_RING_SIZE);
+  uint64_t next, last;
+  uint32_t i, count;
+
+  // overwrites anything recorded before
+  for (i=0; i<TRACE_RING_SIZE + 10; i++) {
+    trace_add(TRACE_TRACK_SERVICE(1), TRACE_INSTANT, "event %u", i);
+  }
+
+  count = trace_collect(0, events, TRACE_RING_SIZE, &next);
+  ck_assert_int_eq(count, TRACE_RING_SIZE);
+  ck_assert_str_eq(events[0].name, "event 10");
+  ck_assert_str_eq(events[count - 1].name, "event 2057");
+  ck_assert_int_eq(events[0].track, 3);
+  ck_assert_int_eq(events[0].phase, TRACE_INSTANT);
+  ck_assert(events[0].ts <= events[count - 1].ts);
+
+  // nothing new since last collect
+  last = next;
+  ck_assert_int_eq(trace_collect(last, events, TRACE_RING_SIZE, &next), 0);
+  ck_assert(next == last);
+
+  trace_complete(TRACE_TRACK_APPLY, "config_retrieval", 100, 250);
+  ck_assert_int_eq(trace_collect(last, events, 2, &next), 1);
+  ck_assert(next == last + 1);
+  ck_assert_str_eq(events[0].name, "config_retrieval");
+  ck_assert(events[0].ts == 100);
+  ck_assert(events[0].dur == 250);
+
+  // paging stops at max
+  ck_assert_int_eq(trace_collect(last - 5, events, 2, &next), 2);
+  ck_assert(next == last - 3);
+
+  free(events);
+}
+END_TEST
+
+START_TEST (test_trace_chrome)
+{
+  struct trace_event events[3];
+  const char *services[] = { "web\"server" };
+  char *out;
+  size_t len;
+  FILE *f = open_memstream(&out, &len);
+
+  memset(events, 0, sizeof(events));
+  events[0].ts = 10;
+  events[0].track = TRACE_TRACK_SERVICE(0);
+  events[0].phase = TRACE_BEGIN;
+  strcpy(events[0].name, "starting");
+  events[1].ts = 20;
+  events[1].dur = 5;
+  events[1].track = TRACE_TRACK_APPLY;
+  events[1].phase = TRACE_COMPLETE;
+  strcpy(events[1].name, "plugin_sync");
+  events[2].ts = 30;
+  events[2].track = TRACE_TRACK_SERVICE(0);
+  events[2].phase = TRACE_END;
+
+  trace_write_chrome(f, events, 3, services, 1);
+  fclose(f);
+
+  ck_assert_ptr_ne(strstr(out, "\"tid\":2,\"args\":{\"name\":\"web\\\"server\"}"), NULL);
+  ck_assert_ptr_ne(strstr(out, "{\"ph\":\"B\",\"ts\":10,\"pid\":1,\"tid\":2,\"name\":\"starting\"},\n"), NULL);
+  ck_assert_ptr_ne(strstr(out, "{\"ph\":\"X\",\"ts\":20,\"pid\":1,\"tid\":1,\"dur\":5,\"name\":\"plugin_sync\"},\n"), NULL);
+  ck_assert_ptr_ne(strstr(out, "{\"ph\":\"E\",\"ts\":30,\"pid\":1,\"tid\":2}\n]}\n"), NULL);
+  free(out);
+}
+END_TEST
+
+START_TEST (test_trace_snapshot)
+{
+  struct trace_event *events = malloc(sizeof(struct trace_event) * TRACE_RING_SIZE);
+  struct snapshot s;
+  uint64_t next, first;
+
+  trace_add(TRACE_TRACK_INIT, TRACE_BEGIN, "boot");
+  trace_collect(0, events, TRACE_RING_SIZE, &first);
+  trace_add(TRACE_TRACK_INIT, TRACE_END, NULL);
+
+  snapshot_init(&s);
+  trace_snapshot_save(&s);
+  trace_add(TRACE_TRACK_INIT, TRACE_INSTANT, "lost");
+  ck_assert_int_eq(trace_snapshot_restore(&s), S_OK);
+
+  ck_assert_int_eq(trace_collect(first, events, 2, &next), 1);
+  ck_assert_int_eq(events[0].phase, TRACE_END);
+
+  // truncated snapshot
+  s.pos = 0;
+  s.len = sizeof(uint64_t);
+  ck_assert_int_eq(trace_snapshot_restore(&s), S_SNAPSHOT_ERROR);
+  snapshot_free(&s);
+  free(events);
+}
+END_TEST
+
+TCase * ttrace_create_test_case(void)
+{
+    TCase *tc;
+
+    tc = tcase_create("Trace");
+    tcase_add_test(tc, test_trace_ring);
+    tcase_add_test(tc, test_trace_chrome);
+    tcase_add_test(tc, test_trace_snapshot);
+
+    return tc;
+}
@@ -0,0 +1,8 @@
+#ifndef _TESTS_TRACE_H
+#define _TESTS_TRACE_H
+
+#include <check.h>
+
+TCase * ttrace_create_test_case(void);
+
+#endif
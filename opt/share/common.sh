@@ -17,6 +17,11 @@ puppetizer_modules_dir="${puppetizer_var_dir}/modules-internal"
 puppetizer_puppetfile="${puppet_conf_dir}/puppetfile"
 
 puppetizer_health_dir="${puppetizer_root_dir}/health" #
+puppetizer_run_dir="${puppetizer_root_dir}/run"
+puppetizer_control_socket="${puppetizer_run_dir}/control.socket"
+puppet_lastrunfile="${puppetizer_run_dir}/last_run_summary.yaml"
+puppetizer_hiera_dir="${puppetizer_root_dir}/hiera"
+puppetizer_catalog_dir="${puppetizer_root_dir}/catalogs"
 
 puppet_apply()
 {
@@ -33,16 +38,28 @@ puppet_apply()
 		debug_opts="--log_level warning"
 	fi
 
+	# catalog compiled during image build is applied as is while its inputs are unchanged
+	manifest_opts="${puppetizer_init}"
+	catalog="$(precompiled_catalog "${env}")"
+	if [ "x${catalog}" != "x" ];
+	then
+		echo "Applying catalog compiled during build"
+		manifest_opts="--catalog ${catalog}"
+	fi
+
 	saved_traps=$(trap)
 	trap '{ kill -INT %1; }' TERM INT
 	
 	# apply puppet manifests and check for exit code
+	mkdir -p "${puppetizer_run_dir}"
+	rm -f "${puppet_lastrunfile}"
 	set +e
-	"${puppetizer_bin}/puppet" apply --detailed-exitcodes $debug_opts --environment=${env} "${puppetizer_init}" &
+	"${puppetizer_bin}/puppet" apply --detailed-exitcodes $debug_opts --environment=${env} --lastrunfile="${puppet_lastrunfile}" ${manifest_opts} &
 	wait
 	puppet_ret=$?
 	eval "$saved_traps"
 	set -e
+	apply_trace_report
 	
 	if [ $puppet_ret -eq 2 ] || [ $puppet_ret -eq 0 ];
 	then
@@ -52,6 +69,108 @@ puppet_apply()
 	fi
 }
 
+# Reports phase timings of last puppet run to init trace, in order they run.
+# Nothing is reported when init is not running, e.g. during image build.
+apply_trace_report()
+{
+	[ -f "${puppet_lastrunfile}" ] || return 0
+	phases=$(awk '
+		/^[^ ]/ { in_time = ($0 == "time:"); next }
+		in_time { key = $1; sub(/:$/, "", key); value[key] = $2 }
+		END {
+			n = split("fact_generation node_retrieval plugin_sync config_retrieval convert_catalog transaction_evaluation", order, " ")
+			for (i = 1; i <= n; i++) if (order[i] in value) printf "%s=%s ", order[i], value[order[i]]
+		}' "${puppet_lastrunfile}")
+	[ -n "${phases}" ] && "${puppetizer_bin}/init" trace-report ${phases} >/dev/null 2>&1 || true
+}
+
+# Prints hash of everything puppet apply depends on: hiera data, manifests,
+# modules, puppet config, facts and environment variables which end up in them.
+# Files are compared by metadata so nothing has to be read, optional stat
+# format selects which. Puppet cache is skipped as every apply changes it,
+# directories are too as creating or removing cache changes their mtime.
+# Fails when facts cannot be resolved.
+apply_fingerprint()
+{
+	env="${1}"
+	stat_format="${2:-%n %s %Y %Z %i}"
+	facts="$("${puppetizer_bin}/facts-fingerprint" "${env}")" || return 1
+	{
+		echo "environment=${env}"
+		echo "facts=${facts}"
+		env | grep -Ev '^(HOME|PATH|PWD|TERM|OLDPWD|LS_COLORS|LESSOPEN|_|RUBYOPT|SHLVL|HOSTNAME)=' | sort
+		find "${puppetizer_hiera_dir}" "${puppetizer_var_dir}" "${puppet_conf_dir}" "${puppet_code_dir}" \
+			-path "${puppetizer_var_dir}/cache" -prune -o \( -type f -o -type l \) -exec stat -c "${stat_format}" {} + 2>/dev/null | sort
+	} | sha256sum | cut -d' ' -f1
+}
+
+# Same as apply_fingerprint but comparable between image build and container,
+# inode and ctime change when image layers are unpacked while size and mtime stay.
+# Facts are included as catalog is compiled from them, e.g. hostname and network
+# of build host.
+catalog_fingerprint()
+{
+	apply_fingerprint "${1}" '%n %s %Y'
+}
+
+# Compiles catalog of environment during image build. Manifests which cannot
+# be compiled without runtime state are left to be compiled on each apply.
+puppet_compile_catalog()
+{
+	env="${1}"
+	catalog="${puppetizer_catalog_dir}/${env}.json"
+
+	mkdir -p "${puppetizer_catalog_dir}"
+	if fingerprint="$(catalog_fingerprint "${env}")" \
+		&& "${puppetizer_bin}/compile-catalog" "${env}" "${puppetizer_init}" "${catalog}.tmp";
+	then
+		mv "${catalog}.tmp" "${catalog}"
+		echo "${fingerprint}" > "${puppetizer_catalog_dir}/${env}.fingerprint"
+	else
+		echo "Catalog of ${env} environment will be compiled on each apply"
+		rm -f "${catalog}.tmp"
+	fi
+}
+
+# Prints path of catalog compiled during build when nothing it was compiled from
+# changed since, e.g. environment variables, hiera data mounted into container
+# or facts of container host.
+# Nothing is printed when catalog has to be compiled, PUPPETIZER_CATALOG_COMPILE=y always compiles.
+precompiled_catalog()
+{
+	env="${1}"
+	catalog="${puppetizer_catalog_dir}/${env}.json"
+
+	if [ "x${PUPPETIZER_CATALOG_COMPILE}" != "xy" ] && [ -f "${catalog}" ] \
+		&& [ "x$(cat "${puppetizer_catalog_dir}/${env}.fingerprint" 2>/dev/null)" = "x$(catalog_fingerprint "${env}")" ];
+	then
+		echo "${catalog}"
+	fi
+}
+
+# Runs puppet apply unless inputs are same as in last successful apply
+# of the same environment, PUPPETIZER_APPLY_FORCE=y always applies.
+# Without fingerprint, e.g. when facts failed, apply always runs.
+puppet_apply_cached()
+{
+	env="${1:-production}"
+	fingerprint_file="${puppetizer_run_dir}/apply-${env}.fingerprint"
+	fingerprint="$(apply_fingerprint "${env}")" || fingerprint=""
+
+	if [ "x${PUPPETIZER_APPLY_FORCE}" != "xy" ] && [ -n "${fingerprint}" ] && [ -f "${fingerprint_file}" ] && [ "x$(cat "${fingerprint_file}")" = "x${fingerprint}" ];
+	then
+		echo "Nothing changed since last apply, skipping"
+		return 0
+	fi
+
+	puppet_apply "${env}" || return 1
+	[ -n "${fingerprint}" ] || return 0
+
+	mkdir -p "${puppetizer_run_dir}"
+	echo "${fingerprint}" > "${fingerprint_file}.tmp"
+	mv "${fingerprint_file}.tmp" "${fingerprint_file}"
+}
+
 find_scripts()
 {
 	path="${1}"; shift
@@ -1,15 +1,21 @@
 require 'puppet'
+require 'json'
 
 Facter.add(:puppetizer) do
   is_building = Puppet[:environment] == 'build'
   is_halting = Puppet[:environment] == 'halt'
   is_booting = Puppet[:environment] == 'init'
 
-  # is_halting = false
-  # if !is_building
-  #   output = %x[/opt/puppetizer/bin/init status].chomp!
-  #   is_halting = output == "halting"
-  # end
+  # state published by running init, read without asking it over socket
+  state = {}
+  unless is_building
+    begin
+      state = JSON.parse(File.read('/opt/puppetizer/run/state.json'))
+    rescue StandardError
+      state = {}
+    end
+  end
+  is_halting ||= state['state'] == 'halting'
 
   setcode do
     {
@@ -17,6 +23,8 @@ Facter.add(:puppetizer) do
       "running"         => !is_building && !is_halting,
       "halting"         => is_halting,
       "initializing"    => is_booting,
+      "services"        => state.fetch('services', {}),
+      "health"          => state.fetch('health', {}),
     }
   end
 end
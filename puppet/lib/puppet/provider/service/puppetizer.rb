@@ -2,6 +2,8 @@
 #
 # author Arkadiusz Dzięgiel <arkadiusz.dziegiel@glorpen.pl>
 
+require File.expand_path('../../../../puppet_x/puppetizer/control', __FILE__)
+
 Puppet::Type.type(:service).provide :puppetizer, :parent => :base do
   desc <<-'EOT'
     Service management for puppetizer.
@@ -16,6 +18,14 @@ Puppet::Type.type(:service).provide :puppetizer, :parent => :base do
     * start/stop
     * status
 
+    When container is booting services are started without waiting,
+    so Puppetizer Init can spawn them in parallel in dependency order.
+
+    Init is controlled over single connection kept for whole puppet run.
+    States of all managed services are prefetched with one query, starts
+    during boot are sent without waiting for reply and checked at the end.
+    Packets go through libpuppetizer shipped with init when it is installed.
+
   EOT
 
   commands :init => '/opt/puppetizer/bin/init'
@@ -36,12 +46,51 @@ Puppet::Type.type(:service).provide :puppetizer, :parent => :base do
     end
   end
 
+  def self.control
+    PuppetX::Puppetizer::Control.instance
+  rescue SystemCallError => e
+    raise Puppet::Error, "Failed to connect to Puppetizer Init: #{e.message}"
+  end
+
+  def control
+    self.class.control
+  end
+
+  # Single round trip for states of all services in catalog.
+  def self.prefetch(resources)
+    return unless Facter.value('puppetizer')['running']
+
+    states = control.service_states(resources.keys.map(&:to_s))
+    resources.each do |name, resource|
+      next unless resource.provider.is_a?(self)
+      resource.provider.cached_state = states[name.to_s]
+    end
+  rescue PuppetX::Puppetizer::Control::Error => e
+    Puppet.debug("Prefetching service states failed: #{e.message}")
+  end
+
+  def self.post_resource_eval
+    current = PuppetX::Puppetizer::Control.current
+    current.check_pending if current
+  rescue PuppetX::Puppetizer::Control::Error => e
+    raise Puppet::Error, e.message
+  end
+
+  attr_writer :cached_state
+
+  def set_state(state, wait)
+    @cached_state = nil
+    control.set_service_states([@resource[:name]], state, wait)
+  rescue PuppetX::Puppetizer::Control::Error => e
+    raise Puppet::Error, e.message
+  end
+
   def start
-    init(:start, @resource[:name], '--wait')
+    set_state(:up, !Facter.value('puppetizer')['initializing'])
   end
 
   def stop
-    init(:stop, @resource[:name], '--wait')
+    set_state(:down, true)
   end
 
   def status
@@ -49,8 +98,8 @@ Puppet::Type.type(:service).provide :puppetizer, :parent => :base do
       return :stopped
     end
 
-    output = %x[/opt/puppetizer/bin/init #{:status} #{@resource[:name]}].chomp!
-    if ["UP", "PENDING UP"].include? output
+    state = @cached_state || control.service_state(@resource[:name])
+    if [:up, :pending_up].include? state
       :running
     else
       :stopped
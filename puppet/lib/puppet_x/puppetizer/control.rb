@@ -0,0 +1,260 @@
+# Puppetizer init control socket client
+#
+# author Arkadiusz Dzięgiel <arkadiusz.dziegiel@glorpen.pl>
+
+require 'socket'
+require File.expand_path('../native_control', __FILE__)
+
+module PuppetX
+  module Puppetizer
+    # Speaks init control protocol v2 over single connection.
+    #
+    # Packets are `[length u16][type u8][request id u16][data]` in host
+    # byte order, replies and subscription updates carry request id
+    # so requests can be pipelined.
+    class Control
+      SOCKET = '/opt/puppetizer/run/control.socket'
+
+      PACKET_SET_SERVICE_STATE = 1
+      PACKET_COMMAND_RESPONSE = 2
+      PACKET_SUBSCRIBE_SERVICE_STATE = 4
+      PACKET_SERVICE_STATE = 5
+      PACKET_REQUEST_INIT_STATE = 6
+      PACKET_INIT_STATE = 7
+      PACKET_REQUEST_HEALTH = 8
+      PACKET_HEALTH = 9
+      PACKET_REQUEST_SERVICE_STATES = 10
+      PACKET_SERVICE_STATES = 11
+      PACKET_SET_SERVICE_STATES = 12
+      PACKET_UNSUBSCRIBE = 13
+      PACKET_SUBSCRIBE_SERVICE_STATES = 18
+      PACKET_REPORT_TRACE = 23
+
+      CMD_RESPONSE_OK = 1
+
+      STATES = { 1 => :pending_up, 2 => :up, 3 => :down, 4 => :pending_down }.freeze
+      STATE_IDS = STATES.invert.freeze
+      INIT_STATES = { 0 => :booting, 1 => :running, 2 => :halting }.freeze
+      HEALTH_STATES = { 0 => :ok, 1 => :failed, 2 => :unknown }.freeze
+
+      class Error < StandardError; end
+
+      # Uses libpuppetizer when it is installed, socket is spoken directly otherwise.
+      def self.connect(path = SOCKET)
+        NativeControl.available? ? NativeControl.new(path) : new(path)
+      end
+
+      # Connection shared by all resources in current puppet run.
+      def self.instance
+        @instance = nil if @instance && @instance.closed?
+        @instance ||= connect
+      end
+
+      # Already opened connection, nil when there is none.
+      def self.current
+        @instance unless @instance.nil? || @instance.closed?
+      end
+
+      def initialize(path = SOCKET)
+        @socket = UNIXSocket.new(path)
+        @last_id = 0
+        @replies = {}
+        @unchecked = {}
+      end
+
+      def closed?
+        @socket.closed?
+      end
+
+      def close
+        @socket.close unless @socket.closed?
+      end
+
+      # Returns hash of service name to state symbol, nil for unknown services.
+      # Queries all services when no names are given.
+      def service_states(names = [])
+        id = request(PACKET_REQUEST_SERVICE_STATES, encode_names(names))
+        _response, states = decode_states(*reply(id))
+        states
+      end
+
+      def service_state(name)
+        service_states([name])[name]
+      end
+
+      # Sets state of given services, optionally waiting until they reach it.
+      # Without waiting reply is checked later by check_pending,
+      # so request costs no round trip.
+      def set_service_states(names, state, wait = false)
+        return if names.empty?
+
+        target = STATE_IDS.fetch(state)
+        command = request(PACKET_SET_SERVICE_STATES, [target].pack('C') + encode_names(names))
+        unless wait
+          @unchecked[command] = state
+          return
+        end
+        subscription = subscribe(names)
+
+        response, states = decode_states(*reply(command))
+        if response != CMD_RESPONSE_OK
+          unsubscribe([subscription])
+          raise_failed(states, state)
+        end
+
+        wait_for(subscription, names, state)
+      end
+
+      # Raises when any request sent without waiting was rejected.
+      def check_pending
+        until @unchecked.empty?
+          command, state = @unchecked.shift
+          response, states = decode_states(*reply(command))
+          raise_failed(states, state) if response != CMD_RESPONSE_OK
+        end
+      end
+
+      def init_state
+        type, data = reply(request(PACKET_REQUEST_INIT_STATE))
+        raise Error, 'Request rejected by init' unless type == PACKET_INIT_STATE
+        INIT_STATES[data.getbyte(0)]
+      end
+
+      # Cached result of health checks, age of oldest one is in seconds.
+      def health
+        type, data = reply(request(PACKET_REQUEST_HEALTH))
+        raise Error, 'Request rejected by init' unless type == PACKET_HEALTH
+        state, age, failed = data.unpack('CLZ*')
+        { state: HEALTH_STATES[state], age: age, failed: failed.empty? ? nil : failed }
+      end
+
+      # Adds phases which just finished to apply track of init trace,
+      # takes ordered hash of phase name to duration in seconds.
+      def report_trace(phases)
+        data = [phases.length].pack('S')
+        durations = Control.encode_durations(phases.values).unpack('L*')
+        phases.keys.zip(durations) { |name, duration| data << [duration].pack('L') << name.b << "\0" }
+        type, reply_data = reply(request(PACKET_REPORT_TRACE, data))
+        raise Error, 'Trace report rejected by init' unless type == PACKET_COMMAND_RESPONSE && reply_data.getbyte(0) == CMD_RESPONSE_OK
+      end
+
+      # Durations are sent as microseconds.
+      def self.encode_durations(seconds)
+        seconds.map { |s| [[(s.to_f * 1_000_000).round, 0].max, 0xffffffff].min }.pack('L*')
+      end
+
+      private
+
+      def next_id
+        @last_id = (@last_id % 0xffff) + 1
+      end
+
+      def request(type, data = '')
+        id = next_id
+        payload = [type, id].pack('CS') + data.b
+        raise Error, 'Packet too large' if payload.bytesize > 0xffff
+        @socket.write([payload.bytesize].pack('S') + payload)
+        id
+      end
+
+      def read_packet
+        header = @socket.read(2)
+        raise Error, 'Connection closed by init' if header.nil? || header.bytesize < 2
+        payload = @socket.read(header.unpack('S').first)
+        type, id = payload.unpack('CS')
+        [id, type, payload.byteslice(3..-1)]
+      end
+
+      # Waits for reply to given request, buffering replies to other requests.
+      # Subscriptions can have many packets queued under one id.
+      def reply(id)
+        if (queued = @replies[id])
+          packet = queued.shift
+          @replies.delete(id) if queued.empty?
+          return packet
+        end
+
+        loop do
+          packet_id, type, data = read_packet
+          return [type, data] if packet_id == id
+          buffer(packet_id, type, data)
+        end
+      end
+
+      def buffer(id, type, data)
+        (@replies[id] ||= []) << [type, data]
+      end
+
+      def raise_failed(states, state)
+        failed = states.reject { |_n, s| s == state }.keys
+        raise Error, "Failed to change state of #{failed.join(', ')} to #{state}"
+      end
+
+      # Single subscription for all services, updates carry service names.
+      def subscribe(names)
+        request(PACKET_SUBSCRIBE_SERVICE_STATES, encode_names(names))
+      end
+
+      def unsubscribe(ids)
+        ids.each do |id|
+          @replies.delete(id)
+          @socket.write([3, PACKET_UNSUBSCRIBE, id].pack('SCS'))
+        end
+        # updates sent before init handled unsubscribe are dropped
+        ids.each do |id|
+          loop do
+            packet_id, type, data = read_packet
+            break if packet_id == id && type == PACKET_COMMAND_RESPONSE
+            buffer(packet_id, type, data) unless ids.include?(packet_id)
+          end
+        end
+      end
+
+      def wait_for(subscription, names, state)
+        pending = names.dup
+        until pending.empty?
+          type, data = reply(subscription)
+          response, states = decode_states(type, data)
+          if response != CMD_RESPONSE_OK
+            unsubscribe([subscription])
+            raise Error, "Failed to watch #{names.join(', ')}"
+          end
+
+          states.each do |name, current|
+            next unless pending.include?(name)
+            if moved_away?(state, current)
+              unsubscribe([subscription])
+              raise Error, "Service #{name} did not reach state #{state}"
+            end
+            pending.delete(name) if current == state
+          end
+        end
+        unsubscribe([subscription])
+      end
+
+      # Service went the other way, eg. was not ready in time.
+      def moved_away?(target, current)
+        (target == :up) != [:up, :pending_up].include?(current)
+      end
+
+      def encode_names(names)
+        [names.length].pack('S') + names.map { |n| n + "\0" }.join
+      end
+
+      def decode_states(type, data)
+        raise Error, 'Request rejected by init' unless type == PACKET_SERVICE_STATES
+
+        response, count = data.unpack('CS')
+        offset = 3
+        states = {}
+        count.times do
+          state = data.getbyte(offset)
+          name_end = data.index("\0", offset + 1)
+          states[data.byteslice(offset + 1...name_end)] = STATES[state]
+          offset = name_end + 1
+        end
+        [response, states]
+      end
+    end
+  end
+end
@@ -0,0 +1,133 @@
+# Puppetizer init control over libpuppetizer
+#
+# author Arkadiusz Dzięgiel <arkadiusz.dziegiel@glorpen.pl>
+
+module PuppetX
+  module Puppetizer
+    # Same interface as Control, packets are encoded and matched by
+    # libpuppetizer shipped with init so both always speak same protocol.
+    class NativeControl
+      LIBRARY = '/opt/puppetizer/lib/libpuppetizer.so'
+
+      # Bound library module, nil when library or fiddle is missing.
+      def self.library
+        return @library if defined?(@library)
+
+        @library = begin
+          require 'fiddle/import'
+          Module.new do
+            extend Fiddle::Importer
+            dlload LIBRARY
+            extern 'void* puppetizer_open(char*)'
+            extern 'void puppetizer_close(void*)'
+            extern 'int puppetizer_service_states(void*, void*, unsigned short)'
+            extern 'int puppetizer_next_service_state(void*, void*, void*)'
+            extern 'int puppetizer_set_service_states(void*, void*, unsigned short, unsigned char, int)'
+            extern 'int puppetizer_check_pending(void*)'
+            extern 'char* puppetizer_failed(void*)'
+            extern 'int puppetizer_init_state(void*, void*)'
+            extern 'int puppetizer_health(void*, void*, void*, void*)'
+            extern 'int puppetizer_report_trace(void*, void*, void*, unsigned short)'
+          end
+        rescue LoadError, StandardError
+          nil
+        end
+      end
+
+      def self.available?
+        !library.nil?
+      end
+
+      def initialize(path = Control::SOCKET)
+        @lib = self.class.library
+        @client = @lib.puppetizer_open(path)
+        raise SystemCallError.new(path, Fiddle.last_error.to_i) if @client.null?
+      end
+
+      def closed?
+        @client.nil?
+      end
+
+      def close
+        @lib.puppetizer_close(@client) unless @client.nil?
+        @client = nil
+      end
+
+      def service_states(names = [])
+        with_strings(names) do |ptr|
+          check(@lib.puppetizer_service_states(@client, ptr, names.length), 'Request rejected by init')
+        end
+
+        name = Fiddle::Pointer.malloc(Fiddle::SIZEOF_VOIDP)
+        state = Fiddle::Pointer.malloc(1)
+        states = {}
+        while check(@lib.puppetizer_next_service_state(@client, name, state)) == 0
+          states[name.ptr.to_s] = Control::STATES[state[0]]
+        end
+        states
+      end
+
+      def service_state(name)
+        service_states([name])[name]
+      end
+
+      def set_service_states(names, state, wait = false)
+        return if names.empty?
+
+        target = Control::STATE_IDS.fetch(state)
+        with_strings(names) do |ptr|
+          check(@lib.puppetizer_set_service_states(@client, ptr, names.length, target, wait ? 1 : 0)) do
+            "Failed to change state of #{@lib.puppetizer_failed(@client)} to #{state}"
+          end
+        end
+      end
+
+      def check_pending
+        check(@lib.puppetizer_check_pending(@client)) do
+          "Failed to change state of #{@lib.puppetizer_failed(@client)}"
+        end
+      end
+
+      def init_state
+        state = Fiddle::Pointer.malloc(1)
+        check(@lib.puppetizer_init_state(@client, state))
+        Control::INIT_STATES[state[0]]
+      end
+
+      def health
+        state = Fiddle::Pointer.malloc(1)
+        age = Fiddle::Pointer.malloc(4)
+        failed = Fiddle::Pointer.malloc(Fiddle::SIZEOF_VOIDP)
+        check(@lib.puppetizer_health(@client, state, age, failed))
+        failed = failed.ptr.to_s
+        { state: Control::HEALTH_STATES[state[0]], age: age[0, 4].unpack('L').first, failed: failed.empty? ? nil : failed }
+      end
+
+      def report_trace(phases)
+        durations = Fiddle::Pointer[Control.encode_durations(phases.values)]
+        with_strings(phases.keys) do |ptr|
+          check(@lib.puppetizer_report_trace(@client, ptr, durations, phases.length), 'Trace report rejected by init')
+        end
+      end
+
+      private
+
+      # NUL terminated copies are kept referenced until call returns.
+      def with_strings(strings)
+        copies = strings.map { |s| s + "\0" }
+        yield Fiddle::Pointer[copies.map { |s| Fiddle::Pointer[s].to_i }.pack('J*')]
+      end
+
+      # Connection is unusable after socket errors, so it is closed.
+      def check(ret, message = nil)
+        if ret == -1
+          error = SystemCallError.new(nil, Fiddle.last_error.to_i)
+          close
+          raise Control::Error, "Init connection failed: #{error.message}"
+        end
+        raise Control::Error, (block_given? ? yield : message) if ret == 1 && (message || block_given?)
+        ret
+      end
+    end
+  end
+end
@@ -1,6 +1,8 @@
 define puppetizer::health(
   Optional[String] $interpreter = undef,
-  String $command
+  String $command,
+  Optional[Integer[1]] $interval = undef,
+  Optional[Integer[1]] $timeout = undef
 ){
   include ::puppetizer
 
@@ -14,4 +16,12 @@ define puppetizer::health(
     content => $_content,
     mode => 'a=,u=rx'
   }
+
+  # options for init health runner, not executable so scripts lookup skips it
+  $_options = { 'interval' => $interval, 'timeout' => $timeout }.filter |$k, $v| { $v != undef }
+  file { "${::puppetizer::health_scripts_path}/${name}.conf":
+    ensure  => empty($_options) ? { true => absent, default => file },
+    content => $_options.map |$k, $v| { "${k}=${v}\n" }.join(''),
+    mode    => 'a=,u=r'
+  }
 }
@@ -3,11 +3,19 @@ define puppetizer::service (
   Optional[String] $start_source = undef,
   Optional[String] $stop_content = undef,
   Optional[String] $stop_source = undef,
+  Array[String] $dependencies = [],
+  Hash[String, Variant[String, Integer, Boolean]] $options = {},
+  # eg. ['tcp:8080', 'unix:/run/app.sock'], service is started on first connection,
+  # sockets are opened when init starts so they should be set at build
+  Array[String] $sockets = [],
   Boolean $enabled = true
 ){
   $_dir = "/opt/puppetizer/etc/services"
   $_start_script = "${_dir}/${name}.start"
   $_stop_script = "${_dir}/${name}.stop"
+  $_deps_file = "${_dir}/${name}.deps"
+  $_conf_file = "${_dir}/${name}.conf"
+  $_socket_file = "${_dir}/${name}.socket"
 
   $file_opts = {
     mode    => 'a=rx,u+w',
@@ -26,10 +34,38 @@ define puppetizer::service (
     before  => Service[$title],
     *       => $file_opts
   }
+  file { $_deps_file:
+    ensure  => empty($dependencies) ? { true => absent, default => file },
+    content => join($dependencies, "\n"),
+    mode    => 'a=r,u+w',
+    backup  => false,
+    before  => Service[$title],
+  }
+  file { $_socket_file:
+    ensure  => empty($sockets) ? { true => absent, default => file },
+    content => "${join($sockets, "\n")}\n",
+    mode    => 'a=r,u+w',
+    backup  => false,
+    before  => Service[$title],
+  }
+  # eg. { 'ready' => 'notify', 'ready_timeout' => 30, 'cwd' => '/srv',
+  #       'env.LANG' => 'C', 'limit.nofile' => '1024:4096', 'output' => 'capture',
+  #       'restart' => 'on-failure', 'restart_delay' => 1, 'restart_limit' => 5,
+  #       'stop_timeout' => 10, 'memory_max' => '512M', 'cpu_weight' => 100,
+  #       'io_weight' => 100, 'idle_timeout' => 300 }
+  file { $_conf_file:
+    ensure  => empty($options) ? { true => absent, default => file },
+    content => $options.map |$k, $v| { "${k}=${v}\n" }.join(''),
+    mode    => 'a=r,u+w',
+    backup  => false,
+    before  => Service[$title],
+  }
 
+  $_running = $enabled and ( $facts['puppetizer']['running'] and ! $facts['puppetizer']['halting'] )
   $svc_opts = {
     provider   => 'puppetizer',
-    ensure     => $enabled and ( $facts['puppetizer']['running'] and ! $facts['puppetizer']['halting'] ),
+    # socket activated services are started by init on demand
+    ensure     => (empty($sockets) or ! $_running) ? { true => $_running, default => undef },
     hasstatus  => true,
     hasrestart => false
   }